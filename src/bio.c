@@ -24,6 +24,10 @@
  * recently inserted to the most recently inserted (older jobs processed
  * first).
  *
+ * The only exception are lazy free jobs: freeing memory does not need any
+ * ordering, so 'lazyfree-threads' threads can be configured to wait on the
+ * BIO_LAZY_FREE queue, processing jobs in parallel.
+ *
  * Currently there is no way for the creator of the job to be notified about
  * the completion of the operation, this will only be added when/if needed.
  *
@@ -61,7 +65,8 @@
 #include "server.h"
 #include "bio.h"
 
-static pthread_t bio_threads[BIO_NUM_OPS];
+static pthread_t bio_threads[BIO_NUM_OPS][BIO_MAX_THREADS_PER_OP];
+static int bio_threads_num[BIO_NUM_OPS];
 static pthread_mutex_t bio_mutex[BIO_NUM_OPS];
 static pthread_cond_t bio_newjob_cond[BIO_NUM_OPS];
 static pthread_cond_t bio_step_cond[BIO_NUM_OPS];
@@ -84,9 +89,12 @@ struct bio_job {
 };
 
 void *bioProcessBackgroundJobs(void *arg);
-void lazyfreeFreeObjectFromBioThread(robj *o);
+struct lazyfreeBatch;
+void lazyfreeFreeBatchFromBioThread(struct lazyfreeBatch *batch);
 void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2);
-void lazyfreeFreeSlotsMapFromBioThread(zskiplist *sl);
+void lazyfreeFreeDictFromBioThread(dict *d);
+void lazyfreeFreeSlotsMapFromBioThread(rax *rt);
+void clusterSaveConfigFromBioThread(sds ci, int do_fsync);
 
 /* Make sure we have enough stack to perform all the things we do in the
  * main thread. */
@@ -106,6 +114,7 @@ void bioInit(void) {
         pthread_cond_init(&bio_step_cond[j],NULL);
         bio_jobs[j] = listCreate();
         bio_pending[j] = 0;
+        bio_threads_num[j] = (j == BIO_LAZY_FREE) ? server.lazyfree_threads : 1;
     }
 
     /* Set the stack size as by default it may be small in some system */
@@ -117,14 +126,18 @@ void bioInit(void) {
 
     /* Ready to spawn our threads. We use the single argument the thread
      * function accepts in order to pass the job ID the thread is
-     * responsible of. */
+     * responsible of. Threads of the same job type share the same queue. */
     for (j = 0; j < BIO_NUM_OPS; j++) {
         void *arg = (void*)(unsigned long) j;
-        if (pthread_create(&thread,&attr,bioProcessBackgroundJobs,arg) != 0) {
-            serverLog(LL_WARNING,"Fatal: Can't initialize Background Jobs.");
-            exit(1);
+        int t;
+
+        for (t = 0; t < bio_threads_num[j]; t++) {
+            if (pthread_create(&thread,&attr,bioProcessBackgroundJobs,arg) != 0) {
+                serverLog(LL_WARNING,"Fatal: Can't initialize Background Jobs.");
+                exit(1);
+            }
+            bio_threads[j][t] = thread;
         }
-        bio_threads[j] = thread;
     }
 }
 
@@ -176,9 +189,12 @@ void *bioProcessBackgroundJobs(void *arg) {
             pthread_cond_wait(&bio_newjob_cond[type],&bio_mutex[type]);
             continue;
         }
-        /* Pop the job from the queue. */
+        /* Pop the job from the queue, so that other threads serving the
+         * same queue will not pick it. The job is still counted as pending
+         * until it is processed. */
         ln = listFirst(bio_jobs[type]);
         job = ln->value;
+        listDelNode(bio_jobs[type],ln);
         /* It is now possible to unlock the background system as we know have
          * a stand alone job structure to process.*/
         pthread_mutex_unlock(&bio_mutex[type]);
@@ -190,15 +206,20 @@ void *bioProcessBackgroundJobs(void *arg) {
             redis_fsync((long)job->arg1);
         } else if (type == BIO_LAZY_FREE) {
             /* What we free changes depending on what arguments are set:
-             * arg1 -> free the object at pointer.
+             * arg1 -> free the batch of objects at pointer.
              * arg2 & arg3 -> free two dictionaries (a Redis DB).
+             * only arg2 -> free a dictionary.
              * only arg3 -> free the skiplist. */
             if (job->arg1)
-                lazyfreeFreeObjectFromBioThread(job->arg1);
+                lazyfreeFreeBatchFromBioThread(job->arg1);
             else if (job->arg2 && job->arg3)
                 lazyfreeFreeDatabaseFromBioThread(job->arg2,job->arg3);
+            else if (job->arg2)
+                lazyfreeFreeDictFromBioThread(job->arg2);
             else if (job->arg3)
                 lazyfreeFreeSlotsMapFromBioThread(job->arg3);
+        } else if (type == BIO_CLUSTER_CONFIG) {
+            clusterSaveConfigFromBioThread(job->arg1,(long)job->arg2);
         } else {
             serverPanic("Wrong job type in bioProcessBackgroundJobs().");
         }
@@ -207,7 +228,6 @@ void *bioProcessBackgroundJobs(void *arg) {
         /* Lock again before reiterating the loop, if there are no longer
          * jobs to process we'll block again in pthread_cond_wait(). */
         pthread_mutex_lock(&bio_mutex[type]);
-        listDelNode(bio_jobs[type],ln);
         bio_pending[type]--;
 
         /* Unblock threads blocked on bioWaitStepOfType() if any. */
@@ -251,17 +271,19 @@ unsigned long long bioWaitStepOfType(int type) {
  * Currently Redis does this only on crash (for instance on SIGSEGV) in order
  * to perform a fast memory check without other threads messing with memory. */
 void bioKillThreads(void) {
-    int err, j;
+    int err, j, t;
 
     for (j = 0; j < BIO_NUM_OPS; j++) {
-        if (pthread_cancel(bio_threads[j]) == 0) {
-            if ((err = pthread_join(bio_threads[j],NULL)) != 0) {
-                serverLog(LL_WARNING,
-                    "Bio thread for job type #%d can be joined: %s",
-                        j, strerror(err));
-            } else {
-                serverLog(LL_WARNING,
-                    "Bio thread for job type #%d terminated",j);
+        for (t = 0; t < bio_threads_num[j]; t++) {
+            if (pthread_cancel(bio_threads[j][t]) == 0) {
+                if ((err = pthread_join(bio_threads[j][t],NULL)) != 0) {
+                    serverLog(LL_WARNING,
+                        "Bio thread for job type #%d can be joined: %s",
+                            j, strerror(err));
+                } else {
+                    serverLog(LL_WARNING,
+                        "Bio thread for job type #%d terminated",j);
+                }
             }
         }
     }
@@ -39,4 +39,8 @@ void bioKillThreads(void);
 #define BIO_CLOSE_FILE    0 /* Deferred close(2) syscall. */
 #define BIO_AOF_FSYNC     1 /* Deferred AOF fsync. */
 #define BIO_LAZY_FREE     2 /* Deferred objects freeing. */
-#define BIO_NUM_OPS       3
+#define BIO_CLUSTER_CONFIG 3 /* Deferred cluster config write and fsync. */
+#define BIO_NUM_OPS       4
+
+/* Max number of threads serving the same job type (see lazyfree-threads). */
+#define BIO_MAX_THREADS_PER_OP 16
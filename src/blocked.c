@@ -168,6 +168,8 @@ void unblockClient(client *c) {
         unblockClientWaitingReplicas(c);
     } else if (c->btype == BLOCKED_MODULE) {
         unblockClientFromModule(c);
+    } else if (c->btype == BLOCKED_MIGRATE) {
+        unblockClientFromMigrate(c);
     } else {
         serverPanic("Unknown btype in unblockClient().");
     }
@@ -192,6 +194,8 @@ void replyToBlockedClientTimedOut(client *c) {
         addReplyLongLong(c,replicationCountAcksByOffset(c->bpop.reploffset));
     } else if (c->btype == BLOCKED_MODULE) {
         moduleBlockedClientTimedOut(c);
+    } else if (c->btype == BLOCKED_MIGRATE) {
+        addReplySds(c,sdsnew("-IOERR MIGRATE ASYNC transfer interrupted\r\n"));
     } else {
         serverPanic("Unknown btype in replyToBlockedClientTimedOut().");
     }
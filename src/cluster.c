@@ -31,6 +31,8 @@
 #include "server.h"
 #include "cluster.h"
 #include "endianconv.h"
+#include "bio.h"
+#include "atomicvar.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -66,6 +68,7 @@ void clusterSetMaster(clusterNode *n);
 void clusterHandleSlaveFailover(void);
 void clusterHandleSlaveMigration(int max_slaves);
 int bitmapTestBit(unsigned char *bitmap, int pos);
+void bitmapSetBit(unsigned char *bitmap, int pos);
 void clusterDoBeforeSleep(int flags);
 void clusterSendUpdate(clusterLink *link, clusterNode *node);
 void resetManualFailover(void);
@@ -73,6 +76,8 @@ void clusterCloseAllSlots(void);
 void clusterSetNodeAsMaster(clusterNode *n);
 void clusterDelNode(clusterNode *delnode);
 sds representClusterNodeFlags(sds ci, uint16_t flags);
+void clusterInvalidateSlotsReply(void);
+void clusterHoldLink(clusterLink *link);
 uint64_t clusterGetMaxEpoch(void);
 int clusterBumpConfigEpochWithoutConsensus(void);
 void moduleCallClusterReceivers(const char *sender_id, uint64_t module_id, uint8_t type, const unsigned char *payload, uint32_t len);
@@ -298,10 +303,30 @@ fmterr:
     exit(1);
 }
 
+/* Number of config saves completed by the bio thread, see
+ * clusterSaveConfigAsync(). Written by the bio thread, read by the main
+ * thread, so it is only accessed with the atomicvar.h macros. */
+static unsigned long long cluster_config_saved = 0;
+/* Only referenced by the atomicvar.h macros when they fall back to a mutex. */
+static pthread_mutex_t cluster_config_saved_mutex __attribute__((unused)) =
+    PTHREAD_MUTEX_INITIALIZER;
+
 /* Cluster node configuration is exactly the same as CLUSTER NODES output.
- *
- * This function writes the node config and returns 0, on error -1
- * is returned.
+ * Return the content of the config file for the current state, with our
+ * "vars" directive at the end to save currentEpoch and lastVoteEpoch. */
+sds clusterGenConfig(void) {
+    sds ci = clusterGenNodesDescription(CLUSTER_NODE_HANDSHAKE);
+    ci = sdscatprintf(ci,"vars currentEpoch %llu lastVoteEpoch %llu\n",
+        (unsigned long long) server.cluster->currentEpoch,
+        (unsigned long long) server.cluster->lastVoteEpoch);
+    return ci;
+}
+
+/* Write the config 'ci' generated by clusterGenConfig() to the cluster
+ * config file, and returns 0, on error -1 is returned. The string is freed
+ * by this function in both cases. The function
+ * only uses its arguments and server.cluster_configfile, that never
+ * changes at runtime, so it is safe to call it from the bio thread.
  *
  * Note: we need to write the file in an atomic way from the point of view
  * of the POSIX filesystem semantics, so that if the server is stopped
@@ -310,22 +335,11 @@ fmterr:
  * a single write to write the whole file. If the pre-existing file was
  * bigger we pad our payload with newlines that are anyway ignored and truncate
  * the file afterward. */
-int clusterSaveConfig(int do_fsync) {
-    sds ci;
-    size_t content_size;
+int clusterWriteConfig(sds ci, int do_fsync) {
+    size_t content_size = sdslen(ci);
     struct stat sb;
     int fd;
 
-    server.cluster->todo_before_sleep &= ~CLUSTER_TODO_SAVE_CONFIG;
-
-    /* Get the nodes description and concatenate our "vars" directive to
-     * save currentEpoch and lastVoteEpoch. */
-    ci = clusterGenNodesDescription(CLUSTER_NODE_HANDSHAKE);
-    ci = sdscatprintf(ci,"vars currentEpoch %llu lastVoteEpoch %llu\n",
-        (unsigned long long) server.cluster->currentEpoch,
-        (unsigned long long) server.cluster->lastVoteEpoch);
-    content_size = sdslen(ci);
-
     if ((fd = open(server.cluster_configfile,O_WRONLY|O_CREAT,0644))
         == -1) goto err;
 
@@ -337,10 +351,7 @@ int clusterSaveConfig(int do_fsync) {
         }
     }
     if (write(fd,ci,sdslen(ci)) != (ssize_t)sdslen(ci)) goto err;
-    if (do_fsync) {
-        server.cluster->todo_before_sleep &= ~CLUSTER_TODO_FSYNC_CONFIG;
-        fsync(fd);
-    }
+    if (do_fsync) fsync(fd);
 
     /* Truncate the file if needed to remove the final \n padding that
      * is just garbage. */
@@ -357,6 +368,19 @@ err:
     return -1;
 }
 
+/* Save the node config synchronously, and returns 0, on error -1 is
+ * returned. Saves still queued in the bio thread are older than the
+ * current state, so we wait for them in order to never be overwritten
+ * by an old config. */
+int clusterSaveConfig(int do_fsync) {
+    server.cluster->todo_before_sleep &= ~CLUSTER_TODO_SAVE_CONFIG;
+    if (do_fsync)
+        server.cluster->todo_before_sleep &= ~CLUSTER_TODO_FSYNC_CONFIG;
+    clusterInvalidateSlotsReply();
+    clusterWaitConfigSaves();
+    return clusterWriteConfig(clusterGenConfig(),do_fsync);
+}
+
 void clusterSaveConfigOrDie(int do_fsync) {
     if (clusterSaveConfig(do_fsync) == -1) {
         serverLog(LL_WARNING,"Fatal: can't update cluster config file.");
@@ -364,6 +388,54 @@ void clusterSaveConfigOrDie(int do_fsync) {
     }
 }
 
+/* Save the node config from the bio thread: the config is serialized here
+ * so that it reflects the current state, while writing and fsyncing the
+ * file happen in background, in the same order the saves are requested.
+ *
+ * When fsync is requested, it is because we are going to tell other nodes
+ * something they rely on us not forgetting after a restart, like a vote
+ * in a given epoch. In this case the cluster bus output is held until the
+ * file is on disk, see clusterConfigIsDurable(). */
+void clusterSaveConfigAsync(int do_fsync) {
+    server.cluster->todo_before_sleep &= ~(CLUSTER_TODO_SAVE_CONFIG|
+                                           CLUSTER_TODO_FSYNC_CONFIG);
+    server.cluster->config_save_jobs++;
+    if (do_fsync)
+        server.cluster->config_fsync_job = server.cluster->config_save_jobs;
+    bioCreateBackgroundJob(BIO_CLUSTER_CONFIG,clusterGenConfig(),
+                           (void*)(long)do_fsync,NULL);
+}
+
+/* Called by the bio thread to process a job created by
+ * clusterSaveConfigAsync(). A failure is fatal exactly like in
+ * clusterSaveConfigOrDie(). */
+void clusterSaveConfigFromBioThread(sds ci, int do_fsync) {
+    if (clusterWriteConfig(ci,do_fsync) == -1) {
+        serverLog(LL_WARNING,"Fatal: can't update cluster config file.");
+        exit(1);
+    }
+    atomicIncr(cluster_config_saved,1);
+}
+
+/* Return true if all the saves requiring fsync were completed. */
+int clusterConfigIsDurable(void) {
+    unsigned long long saved;
+
+    atomicGet(cluster_config_saved,saved);
+    return saved >= server.cluster->config_fsync_job;
+}
+
+/* Block until all the config saves queued in the bio thread are done. */
+void clusterWaitConfigSaves(void) {
+    unsigned long long saved;
+
+    while(1) {
+        atomicGet(cluster_config_saved,saved);
+        if (saved == server.cluster->config_save_jobs) break;
+        bioWaitStepOfType(BIO_CLUSTER_CONFIG);
+    }
+}
+
 /* Lock the cluster config using flock(), and leaks the file descritor used to
  * acquire the lock so that the file will be locked forever.
  *
@@ -450,6 +522,12 @@ void clusterInit(void) {
         server.cluster->stats_bus_messages_received[i] = 0;
     }
     server.cluster->stats_pfail_nodes = 0;
+    server.cluster->stats_bus_compact_sent = 0;
+    server.cluster->stats_bus_compact_received = 0;
+    server.cluster->slots_reply = NULL;
+    server.cluster->held_links = listCreate();
+    server.cluster->config_save_jobs = 0;
+    server.cluster->config_fsync_job = 0;
     memset(server.cluster->slots,0, sizeof(server.cluster->slots));
     clusterCloseAllSlots();
 
@@ -594,6 +672,9 @@ clusterLink *createClusterLink(clusterNode *node) {
     link->rcvbuf = sdsempty();
     link->node = node;
     link->fd = -1;
+    link->compact = 0;
+    link->newcomer_time = 0;
+    link->held = 0;
     return link;
 }
 
@@ -604,6 +685,10 @@ void freeClusterLink(clusterLink *link) {
     if (link->fd != -1) {
         aeDeleteFileEvent(server.el, link->fd, AE_READABLE|AE_WRITABLE);
     }
+    if (link->held) {
+        listNode *ln = listSearchKey(server.cluster->held_links,link);
+        listDelNode(server.cluster->held_links,ln);
+    }
     sdsfree(link->sndbuf);
     sdsfree(link->rcvbuf);
     if (link->node)
@@ -714,6 +799,7 @@ clusterNode *createClusterNode(char *nodename, int flags) {
     node->port = 0;
     node->cport = 0;
     node->fail_reports = listCreate();
+    node->slots_info = NULL;
     node->voted_time = 0;
     node->orphaned_time = 0;
     node->repl_offset_time = 0;
@@ -830,6 +916,7 @@ int clusterNodeRemoveSlave(clusterNode *master, clusterNode *slave) {
             master->numslaves--;
             if (master->numslaves == 0)
                 master->flags &= ~CLUSTER_NODE_MIGRATE_TO;
+            clusterInvalidateSlotsReply();
             return C_OK;
         }
     }
@@ -847,6 +934,7 @@ int clusterNodeAddSlave(clusterNode *master, clusterNode *slave) {
     master->slaves[master->numslaves] = slave;
     master->numslaves++;
     master->flags |= CLUSTER_NODE_MIGRATE_TO;
+    clusterInvalidateSlotsReply();
     return C_OK;
 }
 
@@ -879,8 +967,10 @@ void freeClusterNode(clusterNode *n) {
     /* Release link and associated data structures. */
     if (n->link) freeClusterLink(n->link);
     listRelease(n->fail_reports);
+    sdsfree(n->slots_info);
     zfree(n->slaves);
     zfree(n);
+    clusterInvalidateSlotsReply();
 }
 
 /* Add a node to the nodes hash table */
@@ -958,6 +1048,7 @@ void clusterRenameNode(clusterNode *node, char *newname) {
     serverAssert(retval == DICT_OK);
     memcpy(node->name, newname, CLUSTER_NAMELEN);
     clusterAddNode(node);
+    clusterInvalidateSlotsReply();
 }
 
 /* -----------------------------------------------------------------------------
@@ -1418,6 +1509,7 @@ void clusterProcessGossipSection(clusterMsg *hdr, clusterLink *link) {
                 node->port = ntohs(g->port);
                 node->cport = ntohs(g->cport);
                 node->flags &= ~CLUSTER_NODE_NOADDR;
+                clusterInvalidateSlotsReply();
             }
         } else {
             /* If it's not in NOADDR state and we don't have it, we
@@ -1488,6 +1580,7 @@ int nodeUpdateAddressIfNeeded(clusterNode *node, clusterLink *link,
     node->cport = cport;
     if (node->link) freeClusterLink(node->link);
     node->flags &= ~CLUSTER_NODE_NOADDR;
+    clusterInvalidateSlotsReply();
     serverLog(LL_WARNING,"Address updated for node %.40s, now %s:%d",
         node->name, node->ip, node->port);
 
@@ -1698,8 +1791,22 @@ int clusterProcessPacket(clusterLink *link) {
         if (totlen != explen) return 1;
     }
 
+    /* Remember if the other side is able to receive compact messages, so
+     * that our next PING or PONG in this link can use that format. */
+    link->compact = server.cluster_compact_bus &&
+                    (hdr->mflags[0] & CLUSTERMSG_FLAG0_COMPACT);
+
     /* Check if the sender is a known node. */
     sender = clusterLookupNode(hdr->sender);
+
+    /* A MEET, or a message from a node we don't know yet, means that the
+     * other side just joined the cluster (or was reset), and still has to
+     * learn the addresses of the other nodes. Remember it so that compact
+     * messages we send to it carry every address for a while. */
+    if (type == CLUSTERMSG_TYPE_MEET || !sender || nodeInHandshake(sender)) {
+        link->newcomer_time = mstime();
+        if (sender && sender->link) sender->link->newcomer_time = mstime();
+    }
     if (sender && !nodeInHandshake(sender)) {
         /* Update our curretEpoch if we see a newer epoch in the cluster. */
         senderCurrentEpoch = ntohu64(hdr->currentEpoch);
@@ -1715,6 +1822,13 @@ int clusterProcessPacket(clusterLink *link) {
         /* Update the replication offset info for this node. */
         sender->repl_offset = ntohu64(hdr->offset);
         sender->repl_offset_time = mstime();
+        /* If this is our master and we already have all its data, our
+         * data is as fresh as the message, see clusterGetReplicaLag(). */
+        if (myself->slaveof == sender && server.master &&
+            server.master->reploff >= sender->repl_offset)
+        {
+            server.repl_synced_time = sender->repl_offset_time;
+        }
         /* If we are a slave performing a manual failover and our master
          * sent its offset while already paused, populate the MF state. */
         if (server.cluster->mf_end &&
@@ -1757,6 +1871,7 @@ int clusterProcessPacket(clusterLink *link) {
                 memcpy(myself->ip,ip,NET_IP_STR_LEN);
                 serverLog(LL_WARNING,"IP address for this node updated to %s",
                     myself->ip);
+                clusterInvalidateSlotsReply();
                 clusterDoBeforeSleep(CLUSTER_TODO_SAVE_CONFIG);
             }
         }
@@ -2124,6 +2239,12 @@ void clusterWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
     UNUSED(el);
     UNUSED(mask);
 
+    if (!clusterConfigIsDurable()) {
+        aeDeleteFileEvent(server.el, link->fd, AE_WRITABLE);
+        clusterHoldLink(link);
+        return;
+    }
+
     nwritten = write(fd, link->sndbuf, sdslen(link->sndbuf));
     if (nwritten <= 0) {
         serverLog(LL_DEBUG,"I/O error writing to node link: %s",
@@ -2136,6 +2257,234 @@ void clusterWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
         aeDeleteFileEvent(server.el, link->fd, AE_WRITABLE);
 }
 
+/* -----------------------------------------------------------------------------
+ * Compact PING / PONG / MEET messages
+ * -------------------------------------------------------------------------- */
+
+/* Return true if the address of the node described by the gossip entry 'g'
+ * should be sent in a compact message. The receiver only needs the address
+ * of nodes it does not know yet, or of nodes that may have changed address
+ * (the ones that are failing from our point of view). Nodes created
+ * recently are always sent with their address, so that the cluster learns
+ * about a new node as fast as with the full format, and the others every
+ * CLUSTER_COMPACT_ADDR_PERIOD entries on average. When 'alladdr' is true
+ * the receiver is itself a new node, that does not know most of the
+ * cluster yet, so every address is sent. */
+static int clusterCompactGossipNeedsAddr(clusterMsgDataGossip *g, int alladdr) {
+    uint16_t flags = ntohs(g->flags);
+    clusterNode *n;
+
+    if (alladdr) return 1;
+    if (flags & (CLUSTER_NODE_PFAIL|CLUSTER_NODE_FAIL|
+                 CLUSTER_NODE_HANDSHAKE|CLUSTER_NODE_NOADDR)) return 1;
+    if ((random() % CLUSTER_COMPACT_ADDR_PERIOD) == 0) return 1;
+    n = clusterLookupNode(g->nodename);
+    if (n == NULL || mstime()-n->ctime < server.cluster_node_timeout*2)
+        return 1;
+    return 0;
+}
+
+/* Encode the PING, PONG or MEET message 'hdr', built in the clusterMsg
+ * format, into the compact format. The returned buffer must be freed with
+ * zfree() by the caller, and its length is stored in '*lenptr'.
+ *
+ * The function returns NULL if the served slots are too fragmented to
+ * make the compact format convenient: in this case the caller should
+ * just send the original message. */
+unsigned char *clusterBuildCompactMessage(clusterMsg *hdr, int alladdr,
+                                          size_t *lenptr) {
+    clusterMsgSlotRange ranges[CLUSTER_COMPACT_MAX_RANGES];
+    int numranges = 0, start = -1, j;
+
+    /* Turn the slots bitmap into ranges, skipping bytes with all the bits
+     * set to the same value of the current state. */
+    for (j = 0; j < CLUSTER_SLOTS; j++) {
+        if ((j & 7) == 0) {
+            unsigned char byte = hdr->myslots[j>>3];
+            if ((byte == 0 && start == -1) || (byte == 0xff && start != -1)) {
+                j += 7;
+                continue;
+            }
+        }
+        if (bitmapTestBit(hdr->myslots,j)) {
+            if (start == -1) start = j;
+        } else if (start != -1) {
+            if (numranges == CLUSTER_COMPACT_MAX_RANGES) return NULL;
+            ranges[numranges].start = htons(start);
+            ranges[numranges].end = htons(j-1);
+            numranges++;
+            start = -1;
+        }
+    }
+    if (start != -1) {
+        if (numranges == CLUSTER_COMPACT_MAX_RANGES) return NULL;
+        ranges[numranges].start = htons(start);
+        ranges[numranges].end = htons(CLUSTER_SLOTS-1);
+        numranges++;
+    }
+
+    /* Allocate for the worst case: every gossip entry with its address. */
+    uint16_t count = ntohs(hdr->count);
+    size_t maxlen = sizeof(clusterMsgCompact) +
+                    sizeof(clusterMsgSlotRange)*numranges +
+                    (sizeof(clusterMsgCompactGossip)+
+                     sizeof(clusterMsgCompactGossipAddr))*count;
+    unsigned char *buf = zcalloc(maxlen), *p;
+    clusterMsgCompact *c = (clusterMsgCompact*) buf;
+
+    memcpy(c->sig,"RCmc",4);
+    c->ver = htons(CLUSTER_COMPACT_PROTO_VER);
+    c->port = hdr->port;
+    c->type = hdr->type;
+    c->count = hdr->count;
+    c->currentEpoch = hdr->currentEpoch;
+    c->configEpoch = hdr->configEpoch;
+    c->offset = hdr->offset;
+    memcpy(c->sender,hdr->sender,CLUSTER_NAMELEN);
+    memcpy(c->slaveof,hdr->slaveof,CLUSTER_NAMELEN);
+    memcpy(c->myip,hdr->myip,NET_IP_STR_LEN);
+    c->cport = hdr->cport;
+    c->flags = hdr->flags;
+    c->state = hdr->state;
+    memcpy(c->mflags,hdr->mflags,sizeof(c->mflags));
+    c->numranges = htons(numranges);
+    p = buf+sizeof(*c);
+    memcpy(p,ranges,sizeof(clusterMsgSlotRange)*numranges);
+    p += sizeof(clusterMsgSlotRange)*numranges;
+
+    /* Entries are not aligned since addresses have an odd size, so we
+     * build them on the stack and copy them in place. */
+    for (j = 0; j < count; j++) {
+        clusterMsgDataGossip *g = &hdr->data.ping.gossip[j];
+        clusterMsgCompactGossip cg;
+        int addr = clusterCompactGossipNeedsAddr(g,alladdr);
+
+        memcpy(cg.nodename,g->nodename,CLUSTER_NAMELEN);
+        cg.ping_sent = g->ping_sent;
+        cg.pong_received = g->pong_received;
+        cg.flags = g->flags;
+        cg.gflags = htons(addr ? CLUSTERMSG_GOSSIP_FLAG_ADDR : 0);
+        memcpy(p,&cg,sizeof(cg));
+        p += sizeof(cg);
+        if (addr) {
+            clusterMsgCompactGossipAddr ca;
+
+            memcpy(ca.ip,g->ip,NET_IP_STR_LEN);
+            ca.port = g->port;
+            ca.cport = g->cport;
+            memcpy(p,&ca,sizeof(ca));
+            p += sizeof(ca);
+        }
+    }
+    *lenptr = p-buf;
+    c->totlen = htonl(*lenptr);
+    return buf;
+}
+
+/* Expand the compact message in link->rcvbuf into the equivalent clusterMsg,
+ * that replaces the content of the receive buffer. Gossip entries without
+ * address about nodes we don't know are dropped, since there is nothing we
+ * could do with them anyway, while for the known ones we use the address
+ * we already have. Returns C_ERR if the message is malformed. */
+int clusterExpandCompactMessage(clusterLink *link) {
+    clusterMsgCompact c;
+    size_t totlen = sdslen(link->rcvbuf), need;
+    unsigned char *p = (unsigned char*) link->rcvbuf, *end = p+totlen;
+    uint16_t type, count, numranges, j;
+
+    if (totlen < sizeof(c)) return C_ERR;
+    memcpy(&c,p,sizeof(c));
+    p += sizeof(c);
+    type = ntohs(c.type);
+    count = ntohs(c.count);
+    numranges = ntohs(c.numranges);
+    if (ntohs(c.ver) != CLUSTER_COMPACT_PROTO_VER) return C_ERR;
+    if (type != CLUSTERMSG_TYPE_PING && type != CLUSTERMSG_TYPE_PONG &&
+        type != CLUSTERMSG_TYPE_MEET) return C_ERR;
+    need = sizeof(clusterMsgSlotRange)*numranges;
+    if ((size_t)(end-p) < need) return C_ERR;
+
+    size_t len = sizeof(clusterMsg)-sizeof(union clusterMsgData)+
+                 sizeof(clusterMsgDataGossip)*count;
+    clusterMsg *hdr = zcalloc(len);
+
+    memcpy(hdr->sig,"RCmb",4);
+    hdr->ver = htons(CLUSTER_PROTO_VER);
+    hdr->port = c.port;
+    hdr->type = c.type;
+    hdr->currentEpoch = c.currentEpoch;
+    hdr->configEpoch = c.configEpoch;
+    hdr->offset = c.offset;
+    memcpy(hdr->sender,c.sender,CLUSTER_NAMELEN);
+    memcpy(hdr->slaveof,c.slaveof,CLUSTER_NAMELEN);
+    memcpy(hdr->myip,c.myip,NET_IP_STR_LEN);
+    hdr->cport = c.cport;
+    hdr->flags = c.flags;
+    hdr->state = c.state;
+    memcpy(hdr->mflags,c.mflags,sizeof(hdr->mflags));
+
+    for (j = 0; j < numranges; j++) {
+        clusterMsgSlotRange r;
+        int start, stop, slot;
+
+        memcpy(&r,p,sizeof(r));
+        p += sizeof(r);
+        start = ntohs(r.start);
+        stop = ntohs(r.end);
+        if (start > stop || stop >= CLUSTER_SLOTS) goto err;
+        for (slot = start; slot <= stop; slot++)
+            bitmapSetBit(hdr->myslots,slot);
+    }
+
+    uint16_t added = 0;
+    for (j = 0; j < count; j++) {
+        clusterMsgDataGossip *g = &hdr->data.ping.gossip[added];
+        clusterMsgCompactGossip cg;
+        clusterNode *n;
+
+        if ((size_t)(end-p) < sizeof(cg)) goto err;
+        memcpy(&cg,p,sizeof(cg));
+        p += sizeof(cg);
+        memcpy(g->nodename,cg.nodename,CLUSTER_NAMELEN);
+        g->ping_sent = cg.ping_sent;
+        g->pong_received = cg.pong_received;
+        g->flags = cg.flags;
+        if (ntohs(cg.gflags) & CLUSTERMSG_GOSSIP_FLAG_ADDR) {
+            clusterMsgCompactGossipAddr ca;
+
+            if ((size_t)(end-p) < sizeof(ca)) goto err;
+            memcpy(&ca,p,sizeof(ca));
+            p += sizeof(ca);
+            memcpy(g->ip,ca.ip,NET_IP_STR_LEN);
+            g->ip[NET_IP_STR_LEN-1] = '\0';
+            g->port = ca.port;
+            g->cport = ca.cport;
+        } else if ((n = clusterLookupNode(g->nodename)) != NULL) {
+            memcpy(g->ip,n->ip,NET_IP_STR_LEN);
+            g->port = htons(n->port);
+            g->cport = htons(n->cport);
+        } else {
+            continue; /* Unknown node without address: skip it. */
+        }
+        added++;
+    }
+    if (p != end) goto err;
+
+    len = sizeof(clusterMsg)-sizeof(union clusterMsgData)+
+          sizeof(clusterMsgDataGossip)*added;
+    hdr->count = htons(added);
+    hdr->totlen = htonl(len);
+    sdsfree(link->rcvbuf);
+    link->rcvbuf = sdsnewlen(hdr,len);
+    zfree(hdr);
+    server.cluster->stats_bus_compact_received++;
+    return C_OK;
+
+err:
+    zfree(hdr);
+    return C_ERR;
+}
+
 /* Read data. Try to read the first field of the header first to check the
  * full length of the packet. When a whole packet is in memory this function
  * will call the function to process the packet. And so forth. */
@@ -2160,8 +2509,12 @@ void clusterReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
             if (rcvbuflen == 8) {
                 /* Perform some sanity check on the message signature
                  * and length. */
-                if (memcmp(hdr->sig,"RCmb",4) != 0 ||
-                    ntohl(hdr->totlen) < CLUSTERMSG_MIN_LEN)
+                int compact = memcmp(hdr->sig,"RCmc",4) == 0;
+                uint32_t minlen = compact ? sizeof(clusterMsgCompact) :
+                                            CLUSTERMSG_MIN_LEN;
+
+                if ((memcmp(hdr->sig,"RCmb",4) != 0 && !compact) ||
+                    ntohl(hdr->totlen) < minlen)
                 {
                     serverLog(LL_WARNING,
                         "Bad message length or signature received "
@@ -2192,6 +2545,15 @@ void clusterReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
 
         /* Total length obtained? Process this packet. */
         if (rcvbuflen >= 8 && rcvbuflen == ntohl(hdr->totlen)) {
+            if (memcmp(hdr->sig,"RCmc",4) == 0 &&
+                clusterExpandCompactMessage(link) == C_ERR)
+            {
+                serverLog(LL_WARNING,
+                    "Bad compact message received from Cluster bus.");
+                sdsfree(link->rcvbuf);
+                link->rcvbuf = sdsempty();
+                continue;
+            }
             if (clusterProcessPacket(link)) {
                 sdsfree(link->rcvbuf);
                 link->rcvbuf = sdsempty();
@@ -2202,15 +2564,51 @@ void clusterReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
     }
 }
 
+/* Don't send the output of 'link' until the cluster config saves requiring
+ * fsync are completed: what we are going to send may depend on it, for
+ * instance a failover auth ACK must never be sent before our vote is on
+ * disk. The output is sent by clusterReleaseHeldLinks(). */
+void clusterHoldLink(clusterLink *link) {
+    if (link->held) return;
+    link->held = 1;
+    listAddNodeTail(server.cluster->held_links,link);
+}
+
+/* Install again the write handler of the links held by clusterHoldLink(),
+ * if the config is now durable. Called before sleeping and by
+ * clusterCron(). */
+void clusterReleaseHeldLinks(void) {
+    listIter li;
+    listNode *ln;
+
+    if (listLength(server.cluster->held_links) == 0 ||
+        !clusterConfigIsDurable()) return;
+
+    listRewind(server.cluster->held_links,&li);
+    while((ln = listNext(&li)) != NULL) {
+        clusterLink *link = listNodeValue(ln);
+
+        link->held = 0;
+        if (sdslen(link->sndbuf))
+            aeCreateFileEvent(server.el,link->fd,AE_WRITABLE|AE_BARRIER,
+                        clusterWriteHandler,link);
+        listDelNode(server.cluster->held_links,ln);
+    }
+}
+
 /* Put stuff into the send buffer.
  *
  * It is guaranteed that this function will never have as a side effect
  * the link to be invalidated, so it is safe to call this function
  * from event handlers that will do stuff with the same link later. */
 void clusterSendMessage(clusterLink *link, unsigned char *msg, size_t msglen) {
-    if (sdslen(link->sndbuf) == 0 && msglen != 0)
-        aeCreateFileEvent(server.el,link->fd,AE_WRITABLE|AE_BARRIER,
-                    clusterWriteHandler,link);
+    if (sdslen(link->sndbuf) == 0 && msglen != 0) {
+        if (clusterConfigIsDurable())
+            aeCreateFileEvent(server.el,link->fd,AE_WRITABLE|AE_BARRIER,
+                        clusterWriteHandler,link);
+        else
+            clusterHoldLink(link);
+    }
 
     link->sndbuf = sdscatlen(link->sndbuf, msg, msglen);
 
@@ -2305,6 +2703,8 @@ void clusterBuildMessageHdr(clusterMsg *hdr, int type) {
     /* Set the message flags. */
     if (nodeIsMaster(myself) && server.cluster->mf_end)
         hdr->mflags[0] |= CLUSTERMSG_FLAG0_PAUSED;
+    if (server.cluster_compact_bus)
+        hdr->mflags[0] |= CLUSTERMSG_FLAG0_COMPACT;
 
     /* Compute the message length for certain messages. For other messages
      * this is up to the caller. */
@@ -2472,6 +2872,28 @@ void clusterSendPing(clusterLink *link, int type) {
     totlen += (sizeof(clusterMsgDataGossip)*gossipcount);
     hdr->count = htons(gossipcount);
     hdr->totlen = htonl(totlen);
+
+    /* Use the compact format if the other side supports it. Nodes that
+     * joined recently, or that we are still handshaking, get all the
+     * addresses: otherwise they would need many round trips to discover
+     * the healthy nodes of the cluster. */
+    if (link->compact && server.cluster_compact_bus) {
+        mstime_t newcomer_period = server.cluster_node_timeout*2;
+        int alladdr = type == CLUSTERMSG_TYPE_MEET ||
+            mstime()-link->newcomer_time < newcomer_period ||
+            (link->node && (nodeInHandshake(link->node) ||
+                            mstime()-link->node->ctime < newcomer_period));
+        size_t clen;
+        unsigned char *cbuf = clusterBuildCompactMessage(hdr,alladdr,&clen);
+
+        if (cbuf) {
+            clusterSendMessage(link,cbuf,clen);
+            server.cluster->stats_bus_compact_sent++;
+            zfree(cbuf);
+            zfree(buf);
+            return;
+        }
+    }
     clusterSendMessage(link,buf,totlen);
     zfree(buf);
 }
@@ -3321,6 +3743,10 @@ void clusterCron(void) {
 
     iteration++; /* Number of times this function was called so far. */
 
+    /* Send the output held while waiting for the config to be fsynced, in
+     * case the save completed while we were sleeping. */
+    clusterReleaseHeldLinks();
+
     /* We want to take myself->ip in sync with the cluster-announce-ip option.
      * The option can be set at runtime via CONFIG SET, so we periodically check
      * if the option changed to reflect this into myself->ip. */
@@ -3347,6 +3773,7 @@ void clusterCron(void) {
             } else {
                 myself->ip[0] = '\0'; /* Force autodetection. */
             }
+            clusterInvalidateSlotsReply();
         }
     }
 
@@ -3606,9 +4033,12 @@ void clusterBeforeSleep(void) {
     if (server.cluster->todo_before_sleep & CLUSTER_TODO_SAVE_CONFIG) {
         int fsync = server.cluster->todo_before_sleep &
                     CLUSTER_TODO_FSYNC_CONFIG;
-        clusterSaveConfigOrDie(fsync);
+        clusterSaveConfigAsync(fsync);
     }
 
+    /* Send the output held while waiting for the config to be fsynced. */
+    clusterReleaseHeldLinks();
+
     /* Reset our flags (not strictly needed since every single function
      * called for flags set should be able to clear its flag). */
     server.cluster->todo_before_sleep = 0;
@@ -3616,6 +4046,7 @@ void clusterBeforeSleep(void) {
 
 void clusterDoBeforeSleep(int flags) {
     server.cluster->todo_before_sleep |= flags;
+    clusterInvalidateSlotsReply();
 }
 
 /* -----------------------------------------------------------------------------
@@ -3661,12 +4092,24 @@ int clusterMastersHaveSlaves(void) {
     return slaves != 0;
 }
 
+/* Forget the cached representation of the slots served by 'n', used by
+ * clusterGenNodeDescription(). Called every time the slots of the node
+ * change. */
+void clusterInvalidateNodeSlotsInfo(clusterNode *n) {
+    if (n->slots_info) {
+        sdsfree(n->slots_info);
+        n->slots_info = NULL;
+    }
+    clusterInvalidateSlotsReply();
+}
+
 /* Set the slot bit and return the old value. */
 int clusterNodeSetSlotBit(clusterNode *n, int slot) {
     int old = bitmapTestBit(n->slots,slot);
     bitmapSetBit(n->slots,slot);
     if (!old) {
         n->numslots++;
+        clusterInvalidateNodeSlotsInfo(n);
         /* When a master gets its first slot, even if it has no slaves,
          * it gets flagged with MIGRATE_TO, that is, the master is a valid
          * target for replicas migration, if and only if at least one of
@@ -3690,7 +4133,10 @@ int clusterNodeSetSlotBit(clusterNode *n, int slot) {
 int clusterNodeClearSlotBit(clusterNode *n, int slot) {
     int old = bitmapTestBit(n->slots,slot);
     bitmapClearBit(n->slots,slot);
-    if (old) n->numslots--;
+    if (old) {
+        n->numslots--;
+        clusterInvalidateNodeSlotsInfo(n);
+    }
     return old;
 }
 
@@ -4015,25 +4461,33 @@ sds clusterGenNodeDescription(clusterNode *node) {
         (node->link || node->flags & CLUSTER_NODE_MYSELF) ?
                     "connected" : "disconnected");
 
-    /* Slots served by this instance */
-    start = -1;
-    for (j = 0; j < CLUSTER_SLOTS; j++) {
-        int bit;
+    /* Slots served by this instance. Scanning the slots of every node is
+     * the most expensive part of the output, so the result is cached in
+     * the node until its slots change. */
+    if (node->slots_info == NULL) {
+        sds si = sdsempty();
 
-        if ((bit = clusterNodeGetSlotBit(node,j)) != 0) {
-            if (start == -1) start = j;
-        }
-        if (start != -1 && (!bit || j == CLUSTER_SLOTS-1)) {
-            if (bit && j == CLUSTER_SLOTS-1) j++;
+        start = -1;
+        for (j = 0; j < CLUSTER_SLOTS && node->numslots; j++) {
+            int bit;
 
-            if (start == j-1) {
-                ci = sdscatprintf(ci," %d",start);
-            } else {
-                ci = sdscatprintf(ci," %d-%d",start,j-1);
+            if ((bit = clusterNodeGetSlotBit(node,j)) != 0) {
+                if (start == -1) start = j;
+            }
+            if (start != -1 && (!bit || j == CLUSTER_SLOTS-1)) {
+                if (bit && j == CLUSTER_SLOTS-1) j++;
+
+                if (start == j-1) {
+                    si = sdscatfmt(si," %i",start);
+                } else {
+                    si = sdscatfmt(si," %i-%i",start,j-1);
+                }
+                start = -1;
             }
-            start = -1;
         }
+        node->slots_info = si;
     }
+    ci = sdscatsds(ci,node->slots_info);
 
     /* Just for MYSELF node we also dump info about slots that
      * we are migrating to other instances or importing from other
@@ -4115,7 +4569,19 @@ int getSlotOrReply(client *c, robj *o) {
     return (int) slot;
 }
 
-void clusterReplyMultiBulkSlots(client *c) {
+/* Append to 'reply' the address of 'node' as a CLUSTER SLOTS nested
+ * reply of three elements: IP, port and node ID. */
+static sds clusterCatSlotsReplyNode(sds reply, clusterNode *node) {
+    reply = sdscatfmt(reply,"*3\r\n$%u\r\n%s\r\n:%i\r\n$%i\r\n",
+        (unsigned int) strlen(node->ip),node->ip,node->port,CLUSTER_NAMELEN);
+    reply = sdscatlen(reply,node->name,CLUSTER_NAMELEN);
+    return sdscatlen(reply,"\r\n",2);
+}
+
+/* Generate the CLUSTER SLOTS reply protocol. The reply only depends on the
+ * cluster configuration, so it is cached in server.cluster->slots_reply and
+ * generated again only after clusterInvalidateSlotsReply() is called. */
+sds clusterGenSlotsReply(void) {
     /* Format: 1) 1) start slot
      *            2) end slot
      *            3) 1) master IP
@@ -4128,7 +4594,7 @@ void clusterReplyMultiBulkSlots(client *c) {
      */
 
     int num_masters = 0;
-    void *slot_replylen = addDeferredMultiBulkLength(c);
+    sds reply = sdsempty();
 
     dictEntry *de;
     dictIterator *di = dictGetSafeIterator(server.cluster->nodes);
@@ -4148,45 +4614,62 @@ void clusterReplyMultiBulkSlots(client *c) {
             }
             if (start != -1 && (!bit || j == CLUSTER_SLOTS-1)) {
                 int nested_elements = 3; /* slots (2) + master addr (1). */
-                void *nested_replylen = addDeferredMultiBulkLength(c);
 
                 if (bit && j == CLUSTER_SLOTS-1) j++;
 
+                /* Count the replicas first, we need the length of the
+                 * nested reply before its elements. */
+                for (i = 0; i < node->numslaves; i++)
+                    if (!nodeFailed(node->slaves[i])) nested_elements++;
+                reply = sdscatfmt(reply,"*%i\r\n",nested_elements);
+
                 /* If slot exists in output map, add to it's list.
                  * else, create a new output map for this slot */
                 if (start == j-1) {
-                    addReplyLongLong(c, start); /* only one slot; low==high */
-                    addReplyLongLong(c, start);
+                    /* only one slot; low==high */
+                    reply = sdscatfmt(reply,":%i\r\n:%i\r\n",start,start);
                 } else {
-                    addReplyLongLong(c, start); /* low */
-                    addReplyLongLong(c, j-1);   /* high */
+                    reply = sdscatfmt(reply,":%i\r\n:%i\r\n",start,j-1);
                 }
                 start = -1;
 
                 /* First node reply position is always the master */
-                addReplyMultiBulkLen(c, 3);
-                addReplyBulkCString(c, node->ip);
-                addReplyLongLong(c, node->port);
-                addReplyBulkCBuffer(c, node->name, CLUSTER_NAMELEN);
+                reply = clusterCatSlotsReplyNode(reply,node);
 
                 /* Remaining nodes in reply are replicas for slot range */
                 for (i = 0; i < node->numslaves; i++) {
                     /* This loop is copy/pasted from clusterGenNodeDescription()
                      * with modifications for per-slot node aggregation */
                     if (nodeFailed(node->slaves[i])) continue;
-                    addReplyMultiBulkLen(c, 3);
-                    addReplyBulkCString(c, node->slaves[i]->ip);
-                    addReplyLongLong(c, node->slaves[i]->port);
-                    addReplyBulkCBuffer(c, node->slaves[i]->name, CLUSTER_NAMELEN);
-                    nested_elements++;
+                    reply = clusterCatSlotsReplyNode(reply,node->slaves[i]);
                 }
-                setDeferredMultiBulkLength(c, nested_replylen, nested_elements);
                 num_masters++;
             }
         }
     }
     dictReleaseIterator(di);
-    setDeferredMultiBulkLength(c, slot_replylen, num_masters);
+
+    sds hdr = sdscatfmt(sdsempty(),"*%i\r\n",num_masters);
+    hdr = sdscatsds(hdr,reply);
+    sdsfree(reply);
+    return hdr;
+}
+
+void clusterReplyMultiBulkSlots(client *c) {
+    if (server.cluster->slots_reply == NULL)
+        server.cluster->slots_reply = clusterGenSlotsReply();
+    addReplyString(c,server.cluster->slots_reply,
+                   sdslen(server.cluster->slots_reply));
+}
+
+/* Forget the cached CLUSTER SLOTS reply. This must be called every time
+ * the slots, the master / replica relations, the address or the failure
+ * state of a node change. */
+void clusterInvalidateSlotsReply(void) {
+    if (server.cluster->slots_reply) {
+        sdsfree(server.cluster->slots_reply);
+        server.cluster->slots_reply = NULL;
+    }
 }
 
 void clusterCommand(client *c) {
@@ -4497,6 +4980,11 @@ NULL
         }
         info = sdscatprintf(info,
             "cluster_stats_messages_received:%lld\r\n", tot_msg_received);
+        info = sdscatprintf(info,
+            "cluster_stats_messages_compact_sent:%lld\r\n"
+            "cluster_stats_messages_compact_received:%lld\r\n",
+            server.cluster->stats_bus_compact_sent,
+            server.cluster->stats_bus_compact_received);
 
         /* Produce the reply protocol. */
         addReplySds(c,sdscatprintf(sdsempty(),"$%lu\r\n",
@@ -4776,14 +5264,19 @@ NULL
  * -------------------------------------------------------------------------- */
 
 /* Generates a DUMP-format representation of the object 'o', adding it to the
- * io stream pointed by 'rio'. This function can't fail. */
-void createDumpPayload(rio *payload, robj *o, robj *key) {
+ * io stream pointed by 'rio'. The timeouts that the fields of 'o' have in
+ * the hash stored at 'key' in 'db' are saved as well. This function can't
+ * fail. */
+void createDumpPayload(rio *payload, redisDb *db, robj *o, robj *key) {
     unsigned char buf[2];
     uint64_t crc;
 
     /* Serialize the object in a RDB-like format. It consist of an object type
-     * byte followed by the serialized object. This is understood by RESTORE. */
+     * byte followed by the serialized object, optionally preceded by the
+     * RDB_OPCODE_HASH_FIELD_EXPIRES opcode. This is understood by RESTORE. */
     rioInitWithBuffer(payload,sdsempty());
+    if (o->type == OBJ_HASH)
+        serverAssert(rdbSaveHashFieldExpires(payload,db,key->ptr,o) != -1);
     serverAssert(rdbSaveObjectType(payload,o));
     serverAssert(rdbSaveObject(payload,o,key));
 
@@ -4843,7 +5336,7 @@ void dumpCommand(client *c) {
     }
 
     /* Create the DUMP encoded representation. */
-    createDumpPayload(&payload,o,c->argv[1]);
+    createDumpPayload(&payload,c->db,o,c->argv[1]);
 
     /* Transfer to the client */
     dumpobj = createObject(OBJ_STRING,payload.io.buffer.ptr);
@@ -4852,18 +5345,93 @@ void dumpCommand(client *c) {
     return;
 }
 
-/* RESTORE key ttl serialized-value [REPLACE] */
+/* Add all the elements of the collection 'src' to 'dst', that is a value
+ * of the same type. This is used by RESTORE ... APPEND in order to rebuild
+ * big values that MIGRATE ASYNC transfers in multiple chunks. */
+void restoreAppendElements(robj *dst, robj *src) {
+    if (src->type == OBJ_LIST) {
+        listTypeIterator *li = listTypeInitIterator(src,0,LIST_TAIL);
+        listTypeEntry entry;
+
+        while (listTypeNext(li,&entry)) {
+            robj *ele = listTypeGet(&entry);
+            listTypePush(dst,ele,LIST_TAIL);
+            decrRefCount(ele);
+        }
+        listTypeReleaseIterator(li);
+    } else if (src->type == OBJ_SET) {
+        setTypeIterator *si = setTypeInitIterator(src);
+        sds ele;
+
+        while ((ele = setTypeNextObject(si)) != NULL) {
+            setTypeAdd(dst,ele);
+            sdsfree(ele);
+        }
+        setTypeReleaseIterator(si);
+    } else if (src->type == OBJ_ZSET) {
+        int flags;
+
+        if (src->encoding == OBJ_ENCODING_LISTPACK) {
+            unsigned char *zl = src->ptr, *eptr, *sptr;
+
+            eptr = lpSeek(zl,0);
+            while (eptr != NULL) {
+                sptr = lpNext(zl,eptr);
+                sds ele = lpGetObject(eptr);
+                flags = ZADD_NONE;
+                zsetAdd(dst,zzlGetScore(sptr),ele,&flags,NULL);
+                sdsfree(ele);
+                zzlNext(zl,&eptr,&sptr);
+            }
+        } else if (src->encoding == OBJ_ENCODING_BTREE) {
+            zbtreeIter it;
+            zbtreeEntry *e = zbtFirst(((zset*)src->ptr)->zbt,&it);
+
+            while (e != NULL) {
+                flags = ZADD_NONE;
+                zsetAdd(dst,e->score,e->ele,&flags,NULL);
+                e = zbtNext(&it);
+            }
+        } else {
+            serverPanic("Unknown sorted set encoding");
+        }
+    } else if (src->type == OBJ_HASH) {
+        hashTypeIterator *hi = hashTypeInitIterator(src);
+
+        while (hashTypeNext(hi) != C_ERR) {
+            sds field = hashTypeCurrentObjectNewSds(hi,OBJ_HASH_KEY);
+            sds value = hashTypeCurrentObjectNewSds(hi,OBJ_HASH_VALUE);
+
+            if (dst->encoding == OBJ_ENCODING_LISTPACK &&
+                (sdslen(field) > server.hash_max_ziplist_value ||
+                 sdslen(value) > server.hash_max_ziplist_value))
+            {
+                hashTypeConvert(dst,OBJ_ENCODING_HT);
+            }
+            hashTypeSet(dst,field,value,
+                HASH_SET_TAKE_FIELD|HASH_SET_TAKE_VALUE);
+        }
+        hashTypeReleaseIterator(hi);
+    } else {
+        serverPanic("Unsupported type for RESTORE APPEND");
+    }
+}
+
+/* RESTORE key ttl serialized-value [REPLACE | APPEND] */
 void restoreCommand(client *c) {
     long long ttl, lfu_freq = -1, lru_idle = -1, lru_clock = -1;
     rio payload;
-    int j, type, replace = 0, absttl = 0;
-    robj *obj;
+    int j, type, replace = 0, append = 0, absttl = 0;
+    robj *obj, *existing;
+    dict *field_expires = NULL;
 
     /* Parse additional options */
     for (j = 4; j < c->argc; j++) {
         int additional = c->argc-j-1;
-        if (!strcasecmp(c->argv[j]->ptr,"replace")) {
+        if (!strcasecmp(c->argv[j]->ptr,"replace") && !append) {
             replace = 1;
+        } else if (!strcasecmp(c->argv[j]->ptr,"append") && !replace) {
+            append = 1;
         } else if (!strcasecmp(c->argv[j]->ptr,"absttl")) {
             absttl = 1;
         } else if (!strcasecmp(c->argv[j]->ptr,"idletime") && additional >= 1 &&
@@ -4893,8 +5461,10 @@ void restoreCommand(client *c) {
         }
     }
 
-    /* Make sure this key does not already exist here... */
-    if (!replace && lookupKeyWrite(c->db,c->argv[1]) != NULL) {
+    /* Make sure this key does not already exist here, unless we are
+     * appending elements to it. */
+    existing = lookupKeyWrite(c->db,c->argv[1]);
+    if (!replace && !append && existing != NULL) {
         addReply(c,shared.busykeyerr);
         return;
     }
@@ -4915,22 +5485,61 @@ void restoreCommand(client *c) {
     }
 
     rioInitWithBuffer(&payload,c->argv[3]->ptr);
-    if (((type = rdbLoadObjectType(&payload)) == -1) ||
-        ((obj = rdbLoadObject(type,&payload,c->argv[1])) == NULL))
+    if ((type = rdbLoadType(&payload)) == RDB_OPCODE_HASH_FIELD_EXPIRES) {
+        field_expires = dictCreate(&setDictType,NULL);
+        if (rdbLoadHashFieldExpires(&payload,field_expires,RDB_VERSION) == -1)
+            type = -1;
+        else
+            type = rdbLoadType(&payload);
+    }
+    if (type == -1 || !rdbIsObjectType(type) ||
+        (obj = rdbLoadObject(type,&payload,c->argv[1])) == NULL)
     {
+        if (field_expires) dictRelease(field_expires);
         addReplyError(c,"Bad data format");
         return;
     }
 
-    /* Remove the old key if needed. */
-    if (replace) dbDelete(c->db,c->argv[1]);
+    if (append && existing != NULL) {
+        if (existing->type != obj->type) {
+            if (field_expires) dictRelease(field_expires);
+            decrRefCount(obj);
+            addReply(c,shared.wrongtypeerr);
+            return;
+        }
+        if (obj->type != OBJ_LIST && obj->type != OBJ_SET &&
+            obj->type != OBJ_ZSET && obj->type != OBJ_HASH)
+        {
+            if (field_expires) dictRelease(field_expires);
+            decrRefCount(obj);
+            addReplyError(c,"APPEND is only supported for lists, sets, "
+                            "sorted sets and hashes");
+            return;
+        }
+        restoreAppendElements(existing,obj);
+        decrRefCount(obj);
+        obj = existing;
+    } else {
+        /* Remove the old key if needed. */
+        if (replace) dbDelete(c->db,c->argv[1]);
+
+        /* Create the key. */
+        dbAdd(c->db,c->argv[1],obj);
+    }
 
-    /* Create the key and set the TTL if any */
-    dbAdd(c->db,c->argv[1],obj);
+    /* Set the TTL if any. */
     if (ttl) {
         if (!absttl) ttl+=mstime();
         setExpire(c,c->db,c->argv[1],ttl);
     }
+
+    /* Set the timeouts of the hash fields, including the ones of the
+     * fields appended. */
+    if (field_expires) {
+        if (obj->type == OBJ_HASH)
+            hashTypeSetFieldExpires(c->db,c->argv[1],obj,field_expires);
+        dictRelease(field_expires);
+    }
     objectSetLRUOrLFU(obj,lfu_freq,lru_idle,lru_clock);
     signalModifiedKey(c->db,c->argv[1]);
     addReply(c,shared.ok);
@@ -5054,15 +5663,737 @@ void migrateCloseTimedoutSockets(void) {
     dictReleaseIterator(di);
 }
 
-/* MIGRATE host port key dbid timeout [COPY | REPLACE | AUTH password]
+/* -----------------------------------------------------------------------------
+ * MIGRATE ASYNC implementation
+ *
+ * With the ASYNC option MIGRATE blocks just the calling client, and not the
+ * whole server: the transfer is performed by the event loop using a
+ * dedicated non blocking connection with the target instance. The RESTORE
+ * commands are pipelined, and the replies are processed as they arrive,
+ * deleting every source key as soon as the target acknowledged it.
+ *
+ * Lists, sets, sorted sets and hashes with more than
+ * MIGRATE_ASYNC_CHUNK_ITEMS elements are not serialized as a single DUMP
+ * payload. They are instead split into smaller values of the same type that
+ * are sent one after the other with RESTORE ... APPEND, so that both the
+ * memory used and the time spent serializing at every event loop iteration
+ * are bounded regardless of the size of the key. The first chunk of a key
+ * is sent alone, and the rest of the chunks are pipelined only after the
+ * target accepted it, so that a BUSYKEY error never results into elements
+ * appended to an unrelated key.
+ *
+ * A key that is modified while it is being transferred interrupts the
+ * migration: it is not deleted locally, and the client receives an error.
+ * In this case the target may be left with a partial copy of the key,
+ * exactly like it happens after an I/O error, and a new MIGRATE with the
+ * REPLACE option is needed.
+ * -------------------------------------------------------------------------- */
+
+#define MIGRATE_ASYNC_CHUNK_ITEMS 1024 /* Max elements in a single chunk. */
+#define MIGRATE_ASYNC_CHUNK_BYTES (1024*1024) /* Max bytes of elements in a
+                                                 single chunk. */
+#define MIGRATE_ASYNC_OBUF_LOW (64*1024) /* Serialize more commands only if
+                                            less than this is pending. */
+#define MIGRATE_ASYNC_MAX_PENDING 128 /* Max commands waiting for reply. */
+#define MIGRATE_ASYNC_READ_LEN (16*1024)
+
+/* Tags associated to every command sent, in order to know what to do with
+ * the reply once it arrives. Non negative tags are the index of the key
+ * that the command completes. */
+#define MIGRATE_ASYNC_TAG_NONE -1        /* AUTH, SELECT, middle chunks. */
+#define MIGRATE_ASYNC_TAG_FIRST_CHUNK -2 /* First chunk of a big key. */
+
+typedef struct migrateAsyncJob {
+    client *c;              /* Client blocked waiting for the transfer. */
+    int fd;                 /* Connection with the target instance. */
+    int connected;          /* True once the non blocking connect succeeded. */
+    int writable;           /* True if the writable handler is installed. */
+    redisDb *db;            /* DB of the keys to migrate. */
+    int copy, replace;      /* COPY and REPLACE options. */
+    long timeout;           /* I/O timeout in milliseconds. */
+    mstime_t last_io;       /* Time of the last successful read or write. */
+    robj **kv;              /* Keys to migrate. */
+    int num_keys;           /* Number of keys in kv. */
+    int next_key;           /* Index of the next key to serialize, or of
+                               the key being chunked if val is not NULL. */
+    int window_start;       /* Index of the first key not yet acknowledged.
+                               Keys in the range [window_start,next_key) are
+                               in flight and must not be modified. */
+    robj *val;              /* Value of the key being chunked, or NULL. */
+    unsigned long remaining;/* Elements of 'val' not yet serialized. */
+    int wait_first;         /* Waiting for the reply to the first chunk. */
+    listTypeIterator *li;   /* Chunking cursor for lists. */
+    dictIterator *di;       /* Chunking cursor for sets and hashes. */
+    zbtreeEntry *ze;        /* Chunking cursor for sorted sets. */
+    zbtreeIter zi;          /* Tree iterator positioned at 'ze'. */
+    sds obuf;               /* Commands to send to the target. */
+    size_t obuf_pos;        /* Bytes of obuf already sent. */
+    sds ibuf;               /* Replies received from the target. */
+    list *replies;          /* Tags of the commands waiting for a reply. */
+    sds error;              /* First error returned by the target, or NULL. */
+    sds abort;              /* If not NULL the job must be terminated ASAP
+                               with this error, see migrateAsyncAbort(). */
+} migrateAsyncJob;
+
+/* Return true if the value 'o' should be transferred in chunks. */
+static int migrateAsyncShouldChunk(robj *o) {
+    switch(o->type) {
+    case OBJ_LIST:
+        return o->encoding == OBJ_ENCODING_QUICKLIST &&
+               listTypeLength(o) > MIGRATE_ASYNC_CHUNK_ITEMS;
+    case OBJ_SET:
+        return o->encoding == OBJ_ENCODING_HT &&
+               setTypeSize(o) > MIGRATE_ASYNC_CHUNK_ITEMS;
+    case OBJ_ZSET:
+        return o->encoding == OBJ_ENCODING_BTREE &&
+               zsetLength(o) > MIGRATE_ASYNC_CHUNK_ITEMS;
+    case OBJ_HASH:
+        return o->encoding == OBJ_ENCODING_HT &&
+               hashTypeLength(o) > MIGRATE_ASYNC_CHUNK_ITEMS;
+    default:
+        return 0;
+    }
+}
+
+/* Drop the chunking cursor and the reference to the value being chunked.
+ * The value may no longer be in the keyspace at this point, so we use
+ * freeObjAsync() in order to avoid releasing a huge value synchronously. */
+static void migrateAsyncReleaseValue(migrateAsyncJob *job) {
+    if (job->li) listTypeReleaseIterator(job->li);
+    if (job->di) dictReleaseIterator(job->di);
+    if (job->val) freeObjAsync(job->val);
+    job->li = NULL;
+    job->di = NULL;
+    job->ze = NULL;
+    job->val = NULL;
+    job->remaining = 0;
+    job->wait_first = 0;
+}
+
+/* Start chunking the value 'o', taking a reference to it. Note that for
+ * hash tables we use a safe iterator, since the incremental rehashing
+ * performed by read only commands would otherwise invalidate the
+ * iterator fingerprint. */
+static void migrateAsyncInitValue(migrateAsyncJob *job, robj *o) {
+    incrRefCount(o);
+    job->val = o;
+    job->wait_first = 0;
+    switch(o->type) {
+    case OBJ_LIST:
+        job->remaining = listTypeLength(o);
+        job->li = listTypeInitIterator(o,0,LIST_TAIL);
+        break;
+    case OBJ_SET:
+        job->remaining = setTypeSize(o);
+        job->di = dictGetSafeIterator(o->ptr);
+        break;
+    case OBJ_ZSET:
+        job->remaining = zsetLength(o);
+        job->ze = zbtFirst(((zset*)o->ptr)->zbt,&job->zi);
+        break;
+    case OBJ_HASH:
+        job->remaining = hashTypeLength(o);
+        job->di = dictGetSafeIterator(o->ptr);
+        break;
+    default:
+        serverPanic("Unsupported type for MIGRATE ASYNC chunking");
+    }
+}
+
+/* Create a new value of the same type of the one being chunked, populated
+ * with its next elements. */
+static robj *migrateAsyncNextChunk(migrateAsyncJob *job) {
+    robj *o = job->val, *chunk;
+    size_t items = 0, bytes = 0;
+    dictEntry *de;
+
+#define CHUNK_HAS_ROOM() \
+    (job->remaining && items < MIGRATE_ASYNC_CHUNK_ITEMS && \
+     bytes < MIGRATE_ASYNC_CHUNK_BYTES)
+
+    if (o->type == OBJ_LIST) {
+        listTypeEntry entry;
+
+        chunk = createQuicklistObject();
+        quicklistSetOptions(chunk->ptr, server.list_max_ziplist_size,
+                            server.list_compress_depth);
+        while (CHUNK_HAS_ROOM() && listTypeNext(job->li,&entry)) {
+            robj *ele = listTypeGet(&entry);
+            bytes += sdsEncodedObject(ele) ? sdslen(ele->ptr) : sizeof(long);
+            listTypePush(chunk,ele,LIST_TAIL);
+            decrRefCount(ele);
+            items++, job->remaining--;
+        }
+    } else if (o->type == OBJ_SET) {
+        chunk = createSetObject();
+        while (CHUNK_HAS_ROOM() && (de = dictNext(job->di)) != NULL) {
+            sds ele = dictGetKey(de);
+            bytes += sdslen(ele);
+            setTypeAdd(chunk,ele);
+            items++, job->remaining--;
+        }
+    } else if (o->type == OBJ_ZSET) {
+        chunk = createZsetObject();
+        while (CHUNK_HAS_ROOM() && job->ze != NULL) {
+            int flags = ZADD_NONE;
+            bytes += sdslen(job->ze->ele);
+            zsetAdd(chunk,job->ze->score,job->ze->ele,&flags,NULL);
+            job->ze = zbtNext(&job->zi);
+            items++, job->remaining--;
+        }
+    } else if (o->type == OBJ_HASH) {
+        chunk = createHashObject();
+        hashTypeConvert(chunk,OBJ_ENCODING_HT);
+        while (CHUNK_HAS_ROOM() && (de = dictNext(job->di)) != NULL) {
+            sds field = dictGetKey(de), value = dictGetVal(de);
+            bytes += sdslen(field)+sdslen(value);
+            hashTypeSet(chunk,field,value,HASH_SET_COPY);
+            items++, job->remaining--;
+        }
+    } else {
+        serverPanic("Unsupported type for MIGRATE ASYNC chunking");
+    }
+#undef CHUNK_HAS_ROOM
+
+    /* The cursor can't reach the end before 'remaining' drops to zero,
+     * since the value can't change while it is being migrated. */
+    serverAssert(items != 0);
+    return chunk;
+}
+
+/* Append a RESTORE command to the output buffer of the job, and remember
+ * the tag to use when processing its reply. */
+static void migrateAsyncEmitRestore(migrateAsyncJob *job, robj *key,
+                                    long long ttl, robj *o, char *option,
+                                    long tag)
+{
+    rio cmd, payload;
+
+    rioInitWithBuffer(&cmd,job->obuf);
+    serverAssert(rioWriteBulkCount(&cmd,'*',option ? 5 : 4));
+    if (server.cluster_enabled)
+        serverAssert(rioWriteBulkString(&cmd,"RESTORE-ASKING",14));
+    else
+        serverAssert(rioWriteBulkString(&cmd,"RESTORE",7));
+    serverAssert(sdsEncodedObject(key));
+    serverAssert(rioWriteBulkString(&cmd,key->ptr,sdslen(key->ptr)));
+    serverAssert(rioWriteBulkLongLong(&cmd,ttl));
+
+    createDumpPayload(&payload,job->db,o,key);
+    serverAssert(rioWriteBulkString(&cmd,payload.io.buffer.ptr,
+                                    sdslen(payload.io.buffer.ptr)));
+    sdsfree(payload.io.buffer.ptr);
+
+    if (option) serverAssert(rioWriteBulkString(&cmd,option,strlen(option)));
+    job->obuf = cmd.io.buffer.ptr;
+    listAddNodeTail(job->replies,(void*)tag);
+}
+
+/* Return the TTL to send for the key at index 'idx', or -1 if the key is
+ * already logically expired. */
+static long long migrateAsyncGetTTL(migrateAsyncJob *job, int idx) {
+    long long ttl, expireat = getExpire(job->db,job->kv[idx]);
+
+    if (expireat == -1) return 0;
+    ttl = expireat-mstime();
+    if (ttl < 0) return -1;
+    return ttl < 1 ? 1 : ttl;
+}
+
+/* Serialize the next command into the output buffer of the job.
+ * Returns 0 if there is nothing more that can be serialized right now. */
+static int migrateAsyncFeed(migrateAsyncJob *job) {
+    if (job->wait_first ||
+        listLength(job->replies) >= MIGRATE_ASYNC_MAX_PENDING) return 0;
+
+    if (job->val == NULL) {
+        robj *key = NULL, *o = NULL;
+        long long ttl = 0;
+
+        /* Seek the next key that still exists and is not expired. */
+        while (job->next_key < job->num_keys) {
+            key = job->kv[job->next_key];
+            if ((o = lookupKeyRead(job->db,key)) != NULL &&
+                (ttl = migrateAsyncGetTTL(job,job->next_key)) != -1) break;
+            job->next_key++;
+        }
+        if (job->next_key == job->num_keys) return 0;
+
+        if (!migrateAsyncShouldChunk(o)) {
+            migrateAsyncEmitRestore(job,key,ttl,o,
+                job->replace ? "REPLACE" : NULL,job->next_key);
+            job->next_key++;
+            return 1;
+        }
+
+        /* Big value: send the first chunk alone, and wait for the target
+         * to accept it before appending the other chunks. */
+        migrateAsyncInitValue(job,o);
+        robj *chunk = migrateAsyncNextChunk(job);
+        migrateAsyncEmitRestore(job,key,0,chunk,
+            job->replace ? "REPLACE" : NULL,MIGRATE_ASYNC_TAG_FIRST_CHUNK);
+        decrRefCount(chunk);
+        job->wait_first = 1;
+        return 1;
+    }
+
+    /* Append the next chunk of the value we are transferring. The TTL is
+     * set only with the last chunk, so that the key can't expire in the
+     * target while it is still incomplete. */
+    robj *key = job->kv[job->next_key];
+    robj *chunk = migrateAsyncNextChunk(job);
+    if (job->remaining) {
+        migrateAsyncEmitRestore(job,key,0,chunk,"APPEND",
+            MIGRATE_ASYNC_TAG_NONE);
+    } else {
+        long long ttl = migrateAsyncGetTTL(job,job->next_key);
+        migrateAsyncEmitRestore(job,key,ttl == -1 ? 1 : ttl,chunk,"APPEND",
+            job->next_key);
+        migrateAsyncReleaseValue(job);
+        job->next_key++;
+    }
+    decrRefCount(chunk);
+    return 1;
+}
+
+/* Return true if all the keys were serialized and acknowledged. */
+static int migrateAsyncCompleted(migrateAsyncJob *job) {
+    return job->connected &&
+           job->val == NULL &&
+           job->next_key == job->num_keys &&
+           job->obuf_pos == sdslen(job->obuf) &&
+           listLength(job->replies) == 0;
+}
+
+/* Free the job, closing the connection with the target. The job must
+ * already be detached from the client. */
+static void migrateAsyncFreeJob(migrateAsyncJob *job) {
+    listNode *ln = listSearchKey(server.migrate_async_jobs,job);
+    int j;
+
+    serverAssert(ln != NULL);
+    listDelNode(server.migrate_async_jobs,ln);
+    migrateAsyncReleaseValue(job);
+    aeDeleteFileEvent(server.el,job->fd,AE_READABLE|AE_WRITABLE);
+    close(job->fd);
+    for (j = 0; j < job->num_keys; j++) decrRefCount(job->kv[j]);
+    zfree(job->kv);
+    sdsfree(job->obuf);
+    sdsfree(job->ibuf);
+    listRelease(job->replies);
+    sdsfree(job->error);
+    sdsfree(job->abort);
+    zfree(job);
+}
+
+/* Terminate the job, reply to the blocked client and unblock it. If the
+ * target returned an error for some key, it is reported in place of
+ * 'ioerr', otherwise 'ioerr' is sent if not NULL, or +OK if the transfer
+ * completed. 'ioerr' is a protocol error string that is freed here. */
+static void migrateAsyncTerminate(migrateAsyncJob *job, sds ioerr) {
+    client *c = job->c;
+
+    if (job->abort && ioerr == NULL) {
+        ioerr = job->abort;
+        job->abort = NULL;
+    }
+
+    if (job->error) {
+        addReplyErrorFormat(c,"Target instance replied with error: %s",
+            job->error);
+    } else if (ioerr) {
+        addReplySds(c,ioerr);
+        ioerr = NULL;
+    } else {
+        addReply(c,shared.ok);
+    }
+    sdsfree(ioerr);
+
+    job->c = NULL;
+    c->bpop.migrate_job = NULL;
+    unblockClient(c);
+    migrateAsyncFreeJob(job);
+}
+
+/* Called by unblockClient() when a client blocked in MIGRATE ASYNC is
+ * unblocked before the transfer completed, for instance because it
+ * disconnected. The transfer is aborted. */
+void unblockClientFromMigrate(client *c) {
+    migrateAsyncJob *job = c->bpop.migrate_job;
+
+    if (job == NULL) return;
+    job->c = NULL;
+    c->bpop.migrate_job = NULL;
+    migrateAsyncFreeJob(job);
+}
+
+static void migrateAsyncWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+
+/* Install or remove the writable handler depending on the fact there is
+ * something to send or not. */
+static void migrateAsyncUpdateWriteHandler(migrateAsyncJob *job) {
+    int want = job->obuf_pos != sdslen(job->obuf) ||
+               (!job->wait_first &&
+                listLength(job->replies) < MIGRATE_ASYNC_MAX_PENDING &&
+                (job->val || job->next_key < job->num_keys));
+
+    if (want && !job->writable) {
+        if (aeCreateFileEvent(server.el,job->fd,AE_WRITABLE,
+            migrateAsyncWriteHandler,job) == AE_ERR) return;
+        job->writable = 1;
+    } else if (!want && job->writable) {
+        aeDeleteFileEvent(server.el,job->fd,AE_WRITABLE);
+        job->writable = 0;
+    }
+}
+
+/* Process a single reply of the target. Returns C_ERR if the job was
+ * terminated. */
+static int migrateAsyncProcessReply(migrateAsyncJob *job, char *reply) {
+    listNode *ln = listFirst(job->replies);
+    long tag;
+
+    if (ln == NULL) {
+        migrateAsyncTerminate(job,sdsnew(
+            "-IOERR unexpected reply from target instance\r\n"));
+        return C_ERR;
+    }
+    tag = (long) listNodeValue(ln);
+    listDelNode(job->replies,ln);
+
+    if (reply[0] == '-') {
+        if (job->error == NULL) job->error = sdsnew(reply+1);
+        if (tag == MIGRATE_ASYNC_TAG_FIRST_CHUNK) {
+            /* The key was refused, skip the rest of its chunks. */
+            migrateAsyncReleaseValue(job);
+            job->next_key++;
+            job->window_start = job->next_key;
+        } else if (tag == MIGRATE_ASYNC_TAG_NONE) {
+            /* AUTH, SELECT or an intermediate chunk failed: there is no
+             * point in going forward. */
+            migrateAsyncTerminate(job,NULL);
+            return C_ERR;
+        } else {
+            job->window_start = tag+1;
+        }
+        return C_OK;
+    }
+
+    if (tag == MIGRATE_ASYNC_TAG_FIRST_CHUNK) {
+        job->wait_first = 0;
+    } else if (tag >= 0) {
+        robj *key = job->kv[tag];
+
+        /* The key is no longer in flight: update the window before
+         * deleting it, since the deletion signals the key as modified. */
+        job->window_start = tag+1;
+        if (!job->copy && dbDelete(job->db,key)) {
+            robj *argv[2];
+
+            signalModifiedKey(job->db,key);
+            server.dirty++;
+
+            /* Propagate the deletion as DEL, like the synchronous MIGRATE
+             * does rewriting its argument vector. */
+            argv[0] = shared.del;
+            argv[1] = key;
+            propagate(server.delCommand,job->db->id,argv,2,
+                PROPAGATE_AOF|PROPAGATE_REPL);
+        }
+    }
+    return C_OK;
+}
+
+static void migrateAsyncReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    migrateAsyncJob *job = privdata;
+    size_t oldlen = sdslen(job->ibuf);
+    char *start, *eol;
+    ssize_t nread;
+    UNUSED(el);
+    UNUSED(mask);
+
+    if (job->abort) {
+        migrateAsyncTerminate(job,NULL);
+        return;
+    }
+
+    job->ibuf = sdsMakeRoomFor(job->ibuf,MIGRATE_ASYNC_READ_LEN);
+    nread = read(fd,job->ibuf+oldlen,MIGRATE_ASYNC_READ_LEN);
+    if (nread == -1 && errno == EAGAIN) return;
+    if (nread <= 0) {
+        migrateAsyncTerminate(job,sdsnew(
+            "-IOERR error or timeout reading to target instance\r\n"));
+        return;
+    }
+    sdsIncrLen(job->ibuf,nread);
+    job->last_io = mstime();
+
+    /* Every reply we expect is a single status or error line. Note that
+     * deleting the acknowledged keys may abort the job, see
+     * migrateAsyncSignalModifiedKey(). */
+    start = job->ibuf;
+    while (!job->abort && (eol = strstr(start,"\r\n")) != NULL) {
+        *eol = '\0';
+        if (migrateAsyncProcessReply(job,start) == C_ERR) return;
+        start = eol+2;
+    }
+    sdsrange(job->ibuf,start-job->ibuf,-1);
+
+    if (job->abort || migrateAsyncCompleted(job)) {
+        migrateAsyncTerminate(job,NULL);
+        return;
+    }
+    migrateAsyncUpdateWriteHandler(job);
+}
+
+static void migrateAsyncWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    migrateAsyncJob *job = privdata;
+    ssize_t nwritten;
+    UNUSED(el);
+    UNUSED(mask);
+
+    if (job->abort) {
+        migrateAsyncTerminate(job,NULL);
+        return;
+    }
+
+    /* Check if the non blocking connect succeeded. */
+    if (!job->connected) {
+        int sockerr = 0;
+        socklen_t errlen = sizeof(sockerr);
+
+        if (getsockopt(fd,SOL_SOCKET,SO_ERROR,&sockerr,&errlen) == -1)
+            sockerr = errno;
+        if (sockerr) {
+            migrateAsyncTerminate(job,sdscatprintf(sdsempty(),
+                "-IOERR error connecting to target instance: %s\r\n",
+                strerror(sockerr)));
+            return;
+        }
+        if (aeCreateFileEvent(server.el,fd,AE_READABLE,
+            migrateAsyncReadHandler,job) == AE_ERR)
+        {
+            migrateAsyncTerminate(job,sdsnew(
+                "-IOERR can't create readable event for target instance\r\n"));
+            return;
+        }
+        job->connected = 1;
+        job->last_io = mstime();
+    }
+
+    /* Serialize more commands if we are running out of data to send. */
+    while (sdslen(job->obuf)-job->obuf_pos < MIGRATE_ASYNC_OBUF_LOW &&
+           migrateAsyncFeed(job));
+
+    if (job->obuf_pos != sdslen(job->obuf)) {
+        nwritten = write(fd,job->obuf+job->obuf_pos,
+                         sdslen(job->obuf)-job->obuf_pos);
+        if (nwritten == -1 && errno != EAGAIN) {
+            migrateAsyncTerminate(job,sdsnew(
+                "-IOERR error or timeout writing to target instance\r\n"));
+            return;
+        }
+        if (nwritten > 0) {
+            job->obuf_pos += nwritten;
+            job->last_io = mstime();
+            if (job->obuf_pos == sdslen(job->obuf)) {
+                sdsclear(job->obuf);
+                job->obuf_pos = 0;
+            }
+        }
+    }
+
+    /* All the keys may be missing or expired at this point. */
+    if (migrateAsyncCompleted(job)) {
+        migrateAsyncTerminate(job,NULL);
+        return;
+    }
+    migrateAsyncUpdateWriteHandler(job);
+}
+
+/* Start the transfer of the specified keys and block the client. On
+ * connection errors the client receives the error and is not blocked. */
+void migrateAsyncStart(client *c, long dbid, int copy, int replace,
+                       char *password, long timeout, robj **kv, int num_keys)
+{
+    migrateAsyncJob *job;
+    rio cmd;
+    int fd, j;
+
+    fd = anetTcpNonBlockConnect(server.neterr,c->argv[1]->ptr,
+                                atoi(c->argv[2]->ptr));
+    if (fd == -1) {
+        addReplyErrorFormat(c,"Can't connect to target node: %s",
+            server.neterr);
+        return;
+    }
+    anetEnableTcpNoDelay(server.neterr,fd);
+
+    job = zcalloc(sizeof(*job));
+    job->c = c;
+    job->fd = fd;
+    job->db = c->db;
+    job->copy = copy;
+    job->replace = replace;
+    job->timeout = timeout;
+    job->last_io = mstime();
+    job->kv = zmalloc(sizeof(robj*)*num_keys);
+    for (j = 0; j < num_keys; j++) {
+        job->kv[j] = kv[j];
+        incrRefCount(kv[j]);
+    }
+    job->num_keys = num_keys;
+    job->obuf = sdsempty();
+    job->ibuf = sdsempty();
+    job->replies = listCreate();
+    listAddNodeTail(server.migrate_async_jobs,job);
+
+    /* The connection is new, so we always need to SELECT. */
+    rioInitWithBuffer(&cmd,job->obuf);
+    if (password) {
+        serverAssert(rioWriteBulkCount(&cmd,'*',2));
+        serverAssert(rioWriteBulkString(&cmd,"AUTH",4));
+        serverAssert(rioWriteBulkString(&cmd,password,strlen(password)));
+        listAddNodeTail(job->replies,(void*)(long)MIGRATE_ASYNC_TAG_NONE);
+    }
+    serverAssert(rioWriteBulkCount(&cmd,'*',2));
+    serverAssert(rioWriteBulkString(&cmd,"SELECT",6));
+    serverAssert(rioWriteBulkLongLong(&cmd,dbid));
+    listAddNodeTail(job->replies,(void*)(long)MIGRATE_ASYNC_TAG_NONE);
+    job->obuf = cmd.io.buffer.ptr;
+
+    /* The writable handler is called once the connection is established. */
+    if (aeCreateFileEvent(server.el,fd,AE_WRITABLE,
+        migrateAsyncWriteHandler,job) == AE_ERR)
+    {
+        migrateAsyncFreeJob(job);
+        addReplyError(c,"Can't create writable event for target node");
+        return;
+    }
+    job->writable = 1;
+
+    c->bpop.timeout = 0;
+    c->bpop.migrate_job = job;
+    blockClient(c,BLOCKED_MIGRATE);
+}
+
+/* Called every serverCron() iteration: terminate the transfers that made
+ * no progress in the specified timeout. */
+void migrateAsyncCron(void) {
+    listIter li;
+    listNode *ln;
+    mstime_t now;
+
+    if (listLength(server.migrate_async_jobs) == 0) return;
+    now = mstime();
+    listRewind(server.migrate_async_jobs,&li);
+    while((ln = listNext(&li)) != NULL) {
+        migrateAsyncJob *job = listNodeValue(ln);
+
+        if (job->abort) {
+            migrateAsyncTerminate(job,NULL);
+            continue;
+        }
+        if (now - job->last_io <= job->timeout) continue;
+        if (!job->connected) {
+            migrateAsyncTerminate(job,sdsnew(
+                "-IOERR error or timeout connecting to the client\r\n"));
+        } else {
+            migrateAsyncTerminate(job,sdscatprintf(sdsempty(),
+                "-IOERR error or timeout %s to target instance\r\n",
+                job->obuf_pos != sdslen(job->obuf) ? "writing" : "reading"));
+        }
+    }
+}
+
+/* Flag the job to be terminated with the specified error as soon as we
+ * return to the event loop. The job is not terminated synchronously since
+ * this is called from the keyspace hooks, possibly while the job itself is
+ * deleting the acknowledged keys. The value being chunked is released ASAP
+ * however, since its cursor is no longer valid. */
+static void migrateAsyncAbort(migrateAsyncJob *job, const char *err) {
+    if (job->abort) return;
+    job->abort = sdsnew(err);
+    migrateAsyncReleaseValue(job);
+    if (!job->writable &&
+        aeCreateFileEvent(server.el,job->fd,AE_WRITABLE,
+            migrateAsyncWriteHandler,job) != AE_ERR)
+    {
+        job->writable = 1;
+    }
+}
+
+/* Called by signalModifiedKey() and when a key is deleted, expired or
+ * evicted: abort the transfers having the key in flight, since the copy in
+ * the target is no longer up to date and the value being chunked may be
+ * about to be freed. */
+void migrateAsyncSignalModifiedKey(redisDb *db, robj *key) {
+    listIter li;
+    listNode *ln;
+
+    if (listLength(server.migrate_async_jobs) == 0) return;
+    listRewind(server.migrate_async_jobs,&li);
+    while((ln = listNext(&li)) != NULL) {
+        migrateAsyncJob *job = listNodeValue(ln);
+        int j, end = job->val ? job->next_key+1 : job->next_key;
+
+        if (job->db != db) continue;
+        for (j = job->window_start; j < end; j++) {
+            if (equalStringObjects(key,job->kv[j])) {
+                migrateAsyncAbort(job,
+                    "-ERR key modified or deleted while MIGRATE ASYNC was in progress\r\n");
+                break;
+            }
+        }
+    }
+}
+
+/* Called when the DB 'dbid' (or all the DBs if -1) is going to be emptied
+ * or swapped: the transfers involving it are aborted. */
+void migrateAsyncSignalFlushedDb(int dbid) {
+    listIter li;
+    listNode *ln;
+
+    if (listLength(server.migrate_async_jobs) == 0) return;
+    listRewind(server.migrate_async_jobs,&li);
+    while((ln = listNext(&li)) != NULL) {
+        migrateAsyncJob *job = listNodeValue(ln);
+
+        if (dbid == -1 || job->db->id == dbid)
+            migrateAsyncAbort(job,
+                "-ERR DB flushed while MIGRATE ASYNC was in progress\r\n");
+    }
+}
+
+/* Return true if the value of the specified key is being transferred in
+ * chunks, so that its internal representation must not change. */
+int migrateAsyncKeyIsBusy(redisDb *db, sds key) {
+    listIter li;
+    listNode *ln;
+
+    if (listLength(server.migrate_async_jobs) == 0) return 0;
+    listRewind(server.migrate_async_jobs,&li);
+    while((ln = listNext(&li)) != NULL) {
+        migrateAsyncJob *job = listNodeValue(ln);
+        robj *jobkey;
+
+        if (job->db != db || job->val == NULL) continue;
+        jobkey = job->kv[job->next_key];
+        if (sdslen(jobkey->ptr) == sdslen(key) &&
+            memcmp(jobkey->ptr,key,sdslen(key)) == 0) return 1;
+    }
+    return 0;
+}
+
+/* MIGRATE host port key dbid timeout [COPY | REPLACE | ASYNC | AUTH password]
  *
  * On in the multiple keys form:
  *
- * MIGRATE host port "" dbid timeout [COPY | REPLACE | AUTH password] KEYS key1
- * key2 ... keyN */
+ * MIGRATE host port "" dbid timeout [COPY | REPLACE | ASYNC | AUTH password]
+ * KEYS key1 key2 ... keyN */
 void migrateCommand(client *c) {
     migrateCachedSocket *cs;
-    int copy = 0, replace = 0, j;
+    int copy = 0, replace = 0, async = 0, j;
     char *password = NULL;
     long timeout;
     long dbid;
@@ -5085,6 +6416,8 @@ void migrateCommand(client *c) {
             copy = 1;
         } else if (!strcasecmp(c->argv[j]->ptr,"replace")) {
             replace = 1;
+        } else if (!strcasecmp(c->argv[j]->ptr,"async")) {
+            async = 1;
         } else if (!strcasecmp(c->argv[j]->ptr,"auth")) {
             if (!moreargs) {
                 addReply(c,shared.syntaxerr);
@@ -5138,6 +6471,15 @@ void migrateCommand(client *c) {
         return;
     }
 
+    /* In the ASYNC form the transfer is performed by the event loop while
+     * the client is blocked. Clients that can't block (MULTI, scripts) just
+     * get the synchronous behavior. */
+    if (async && !(c->flags & (CLIENT_MULTI|CLIENT_LUA))) {
+        migrateAsyncStart(c,dbid,copy,replace,password,timeout,kv,num_keys);
+        zfree(ov); zfree(kv);
+        return;
+    }
+
 try_again:
     write_error = 0;
 
@@ -5204,7 +6546,7 @@ try_again:
 
         /* Emit the payload argument, that is the serialized object using
          * the DUMP format. */
-        createDumpPayload(&payload,ov[j],kv[j]);
+        createDumpPayload(&payload,c->db,ov[j],kv[j]);
         serverAssertWithInfo(c,NULL,
             rioWriteBulkString(&cmd,payload.io.buffer.ptr,
                                sdslen(payload.io.buffer.ptr)));
@@ -5400,24 +6742,107 @@ void askingCommand(client *c) {
     addReply(c,shared.ok);
 }
 
-/* The READONLY command is used by clients to enter the read-only mode.
+/* READONLY [MAXLAG <milliseconds>] [MAXOFFSETLAG <bytes>]
+ *
+ * The READONLY command is used by clients to enter the read-only mode.
  * In this mode slaves will not redirect clients as long as clients access
- * with read-only commands to keys that are served by the slave's master. */
+ * with read-only commands to keys that are served by the slave's master.
+ *
+ * With MAXLAG and MAXOFFSETLAG the client accepts reads served by a replica
+ * only if the replica is not lagging behind its master more than the
+ * specified amount, see clusterGetReplicaLag(). Otherwise the client is
+ * redirected to the master. */
 void readonlyCommand(client *c) {
+    long long maxlag_ms = -1, maxlag_offset = -1;
+    int j;
+
     if (server.cluster_enabled == 0) {
         addReplyError(c,"This instance has cluster support disabled");
         return;
     }
+    for (j = 1; j < c->argc; j++) {
+        int moreargs = (c->argc-1) - j;
+        long long *target;
+
+        if (!strcasecmp(c->argv[j]->ptr,"maxlag") && moreargs) {
+            target = &maxlag_ms;
+        } else if (!strcasecmp(c->argv[j]->ptr,"maxoffsetlag") && moreargs) {
+            target = &maxlag_offset;
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+        if (getLongLongFromObjectOrReply(c,c->argv[++j],target,NULL) != C_OK)
+            return;
+        if (*target < 0) {
+            addReplyError(c,"lag limits must be positive or zero");
+            return;
+        }
+    }
     c->flags |= CLIENT_READONLY;
+    c->readonly_maxlag_ms = maxlag_ms;
+    c->readonly_maxlag_offset = maxlag_offset;
     addReply(c,shared.ok);
 }
 
 /* The READWRITE command just clears the READONLY command state. */
 void readwriteCommand(client *c) {
     c->flags &= ~CLIENT_READONLY;
+    c->readonly_maxlag_ms = -1;
+    c->readonly_maxlag_offset = -1;
     addReply(c,shared.ok);
 }
 
+/* Estimate how much this replica is behind its master.
+ *
+ * The time lag is the time elapsed since we were last known to have all the
+ * data of the master, that is, since we applied everything we had read from
+ * the replication link when it was last drained (see
+ * processInputBufferAndReplicate()), or since we received the offset the
+ * master advertises in the cluster bus, if we already processed it. This is
+ * an upper bound: with an idle master it grows until the next message from
+ * it, so it should not be compared against very small limits.
+ *
+ * The offset lag uses the offset advertised in the cluster bus, so it only
+ * accounts for the writes the master performed before its last message.
+ *
+ * Returns C_ERR if we are not a replica connected with its master, or if
+ * we were never known to be in sync with it, since in this case the lag is
+ * unknown. */
+int clusterGetReplicaLag(long long *lag_offset, mstime_t *lag_ms) {
+    clusterNode *master = myself->slaveof;
+    mstime_t synced;
+
+    if (!nodeIsSlave(myself) || master == NULL || server.master == NULL ||
+        server.repl_state != REPL_STATE_CONNECTED) return C_ERR;
+
+    synced = server.repl_synced_time;
+    if (server.master->reploff >= master->repl_offset &&
+        master->repl_offset_time > synced) synced = master->repl_offset_time;
+    if (synced == 0) return C_ERR;
+
+    *lag_offset = server.master->reploff >= master->repl_offset ? 0 :
+                  master->repl_offset - server.master->reploff;
+    *lag_ms = mstime() - synced;
+    return C_OK;
+}
+
+/* Return true if the replica is fresh enough to serve the reads of the
+ * READONLY client 'c', according to the limits it set. */
+int clusterReplicaCanServeReads(client *c) {
+    long long lag_offset;
+    mstime_t lag_ms;
+
+    if (c->readonly_maxlag_ms == -1 && c->readonly_maxlag_offset == -1)
+        return 1;
+    if (clusterGetReplicaLag(&lag_offset,&lag_ms) == C_ERR) return 0;
+    if (c->readonly_maxlag_ms != -1 && lag_ms > c->readonly_maxlag_ms)
+        return 0;
+    if (c->readonly_maxlag_offset != -1 &&
+        lag_offset > c->readonly_maxlag_offset) return 0;
+    return 1;
+}
+
 /* Return the pointer to the cluster node that is able to serve the command.
  * For the function to succeed the command should only target either:
  *
@@ -5606,12 +7031,14 @@ clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, in
 
     /* Handle the read-only client case reading from a slave: if this
      * node is a slave and the request is about an hash slot our master
-     * is serving, we can reply without redirection. */
+     * is serving, we can reply without redirection, unless we are lagging
+     * more than the client is willing to accept. */
     if (c->flags & CLIENT_READONLY &&
         (cmd->flags & CMD_READONLY || cmd->proc == evalCommand ||
          cmd->proc == evalShaCommand) &&
         nodeIsSlave(myself) &&
-        myself->slaveof == n)
+        myself->slaveof == n &&
+        clusterReplicaCanServeReads(c))
     {
         return myself;
     }
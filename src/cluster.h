@@ -17,6 +17,7 @@
 #define CLUSTER_DEFAULT_SLAVE_VALIDITY 10 /* Slave max data age factor. */
 #define CLUSTER_DEFAULT_REQUIRE_FULL_COVERAGE 1
 #define CLUSTER_DEFAULT_SLAVE_NO_FAILOVER 0 /* Failover by default. */
+#define CLUSTER_DEFAULT_COMPACT_BUS 1 /* Compact messages when possible. */
 #define CLUSTER_FAIL_REPORT_VALIDITY_MULT 2 /* Fail report validity. */
 #define CLUSTER_FAIL_UNDO_TIME_MULT 2 /* Undo fail if master is back. */
 #define CLUSTER_FAIL_UNDO_TIME_ADD 10 /* Some additional time. */
@@ -44,6 +45,13 @@ typedef struct clusterLink {
     sds sndbuf;                 /* Packet send buffer */
     sds rcvbuf;                 /* Packet reception buffer */
     struct clusterNode *node;   /* Node related to this link if any, or NULL */
+    int compact;                /* True if the peer accepts compact messages,
+                                   see clusterMsgCompact. */
+    mstime_t newcomer_time;     /* Last time the peer looked like a node that
+                                   just joined the cluster, see
+                                   clusterSendPing(). */
+    int held;                   /* Output held waiting for the config to be
+                                   fsynced, see clusterHoldLink(). */
 } clusterLink;
 
 /* Cluster node flags and macros. */
@@ -138,6 +146,8 @@ typedef struct clusterNode {
     int cport;                  /* Latest known cluster port of this node. */
     clusterLink *link;          /* TCP/IP link with this node */
     list *fail_reports;         /* List of nodes signaling this as failing */
+    sds slots_info;             /* Cached slots part of the node description,
+                                   NULL if it must be generated again. */
 } clusterNode;
 
 typedef struct clusterState {
@@ -178,6 +188,14 @@ typedef struct clusterState {
     long long stats_bus_messages_received[CLUSTERMSG_TYPE_COUNT];
     long long stats_pfail_nodes;    /* Number of nodes in PFAIL status,
                                        excluding nodes without address. */
+    sds slots_reply;        /* Cached CLUSTER SLOTS reply or NULL. */
+    /* Config saves performed in background. */
+    unsigned long long config_save_jobs; /* Saves queued so far. */
+    unsigned long long config_fsync_job; /* Last queued save with fsync. */
+    list *held_links;       /* Links with output held until the config is
+                               fsynced. */
+    long long stats_bus_compact_sent;     /* Compact PING/PONG/MEET sent. */
+    long long stats_bus_compact_received; /* Compact PING/PONG/MEET received. */
 } clusterState;
 
 /* Redis cluster messages header */
@@ -281,6 +299,71 @@ typedef struct {
 #define CLUSTERMSG_FLAG0_PAUSED (1<<0) /* Master paused for manual failover. */
 #define CLUSTERMSG_FLAG0_FORCEACK (1<<1) /* Give ACK to AUTH_REQUEST even if
                                             master is up. */
+#define CLUSTERMSG_FLAG0_COMPACT (1<<2) /* Sender accepts compact messages. */
+
+/* Compact PING, PONG and MEET messages.
+ *
+ * Nodes advertise with CLUSTERMSG_FLAG0_COMPACT that they are able to
+ * receive the following format, that is used instead of clusterMsg only
+ * on links where the peer set the flag in the last message received, so
+ * older nodes always get the original format.
+ *
+ * The header is the same as clusterMsg without the slots bitmap, that is
+ * replaced by 'numranges' clusterMsgSlotRange structures listing the
+ * ranges of slots served. After the ranges there are 'count' gossip
+ * entries: every entry is a clusterMsgCompactGossip structure, followed
+ * by a clusterMsgCompactGossipAddr structure only if the entry has the
+ * CLUSTERMSG_GOSSIP_FLAG_ADDR flag set. Entries without address are just
+ * state updates about nodes the receiver already knows.
+ *
+ * The receiver expands the message into the clusterMsg format before
+ * processing it, so the two formats have exactly the same semantics. */
+#define CLUSTER_COMPACT_PROTO_VER 1 /* Compact message format version. */
+#define CLUSTER_COMPACT_MAX_RANGES 256 /* Use clusterMsg if the slots
+                                          are more fragmented than that. */
+#define CLUSTER_COMPACT_ADDR_PERIOD 8 /* Send the address of healthy nodes
+                                         in one gossip entry out of N. */
+
+typedef struct {
+    uint16_t start;
+    uint16_t end;       /* Inclusive. */
+} clusterMsgSlotRange;
+
+#define CLUSTERMSG_GOSSIP_FLAG_ADDR (1<<0) /* Address follows the entry. */
+
+typedef struct {
+    char nodename[CLUSTER_NAMELEN];
+    uint32_t ping_sent;
+    uint32_t pong_received;
+    uint16_t flags;             /* node->flags copy */
+    uint16_t gflags;            /* CLUSTERMSG_GOSSIP_FLAG_... */
+} clusterMsgCompactGossip;
+
+typedef struct {
+    char ip[NET_IP_STR_LEN];  /* IP address last time it was seen */
+    uint16_t port;              /* base port last time it was seen */
+    uint16_t cport;             /* cluster port last time it was seen */
+} clusterMsgCompactGossipAddr;
+
+typedef struct {
+    char sig[4];        /* Signature "RCmc" (Redis Cluster message compact). */
+    uint32_t totlen;    /* Total length of this message */
+    uint16_t ver;       /* Compact format version. */
+    uint16_t port;      /* TCP base port number. */
+    uint16_t type;      /* Message type: PING, PONG or MEET. */
+    uint16_t count;     /* Number of gossip entries. */
+    uint64_t currentEpoch;
+    uint64_t configEpoch;
+    uint64_t offset;
+    char sender[CLUSTER_NAMELEN];
+    char slaveof[CLUSTER_NAMELEN];
+    char myip[NET_IP_STR_LEN];
+    uint16_t cport;
+    uint16_t flags;
+    unsigned char state;
+    unsigned char mflags[3];
+    uint16_t numranges; /* Number of clusterMsgSlotRange that follow. */
+} clusterMsgCompact;
 
 /* ---------------------- API exported outside cluster.c -------------------- */
 clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, int argc, int *hashslot, int *ask);
@@ -30,6 +30,7 @@
 
 #include "server.h"
 #include "cluster.h"
+#include "bio.h"
 
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -51,6 +52,7 @@ configEnum maxmemory_policy_enum[] = {
     {"allkeys-lru",MAXMEMORY_ALLKEYS_LRU},
     {"allkeys-lfu",MAXMEMORY_ALLKEYS_LFU},
     {"allkeys-random",MAXMEMORY_ALLKEYS_RANDOM},
+    {"allkeys-tinylfu",MAXMEMORY_ALLKEYS_TINYLFU},
     {"noeviction",MAXMEMORY_NO_EVICTION},
     {NULL, 0}
 };
@@ -169,10 +171,26 @@ void queueLoadModule(sds path, sds *argv, int argc) {
     listAddNodeTail(server.loadmodule_queue,loadmod);
 }
 
+/* Set the memory quota of the DB 'id' (0 means no quota). When the
+ * databases already exist, the memory accounting of the DB is started or
+ * stopped accordingly. */
+void setDbMaxmemory(int id, unsigned long long bytes) {
+    if (id >= server.db_maxmemory_len) {
+        if (bytes == 0) return;
+        server.db_maxmemory = zrealloc(server.db_maxmemory,
+            sizeof(unsigned long long)*(id+1));
+        memset(server.db_maxmemory+server.db_maxmemory_len,0,
+            sizeof(unsigned long long)*(id+1-server.db_maxmemory_len));
+        server.db_maxmemory_len = id+1;
+    }
+    server.db_maxmemory[id] = bytes;
+    if (server.db) dbUpdateMemoryAccounting(server.db+id);
+}
+
 void loadServerConfigFromString(char *config) {
     char *err = NULL;
     int linenum = 0, totlines, i;
-    int slaveof_linenum = 0;
+    int slaveof_linenum = 0, dbmaxmemory_linenum = 0;
     sds *lines;
 
     lines = sdssplitlen(config,strlen(config),"\n",1,&totlines);
@@ -322,12 +340,35 @@ void loadServerConfigFromString(char *config) {
                 err = "Invalid maxmemory policy";
                 goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"db-maxmemory") && argc == 3) {
+            int id = atoi(argv[1]);
+            if (id < 0) {
+                err = "Invalid DB index"; goto loaderr;
+            }
+            setDbMaxmemory(id,memtoll(argv[2],NULL));
+            /* Remember the line of the greatest DB index for the sanity
+             * check below, since "databases" may follow. */
+            if (id >= server.db_maxmemory_len-1) dbmaxmemory_linenum = linenum;
         } else if (!strcasecmp(argv[0],"maxmemory-samples") && argc == 2) {
             server.maxmemory_samples = atoi(argv[1]);
             if (server.maxmemory_samples <= 0) {
                 err = "maxmemory-samples must be 1 or greater";
                 goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"maxmemory-low-watermark") && argc == 2) {
+            server.maxmemory_low_watermark = atoi(argv[1]);
+            if (server.maxmemory_low_watermark < 0 ||
+                server.maxmemory_low_watermark > 100) {
+                err = "maxmemory-low-watermark must be between 0 and 100";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"maxmemory-eviction-pool-size") && argc == 2) {
+            server.maxmemory_eviction_pool_size = atoi(argv[1]);
+            if (server.maxmemory_eviction_pool_size < 1 ||
+                server.maxmemory_eviction_pool_size > 1024) {
+                err = "maxmemory-eviction-pool-size must be between 1 and 1024";
+                goto loaderr;
+            }
         } else if ((!strcasecmp(argv[0],"proto-max-bulk-len")) && argc == 2) {
             server.proto_max_bulk_len = memtoll(argv[1],NULL);
         } else if ((!strcasecmp(argv[0],"client-query-buffer-limit")) && argc == 2) {
@@ -440,6 +481,13 @@ void loadServerConfigFromString(char *config) {
             if ((server.lazyfree_lazy_server_del = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"lazyfree-threads") && argc == 2) {
+            server.lazyfree_threads = atoi(argv[1]);
+            if (server.lazyfree_threads < 1 ||
+                server.lazyfree_threads > BIO_MAX_THREADS_PER_OP)
+            {
+                err = "Invalid number of lazyfree threads"; goto loaderr;
+            }
         } else if ((!strcasecmp(argv[0],"slave-lazy-flush") ||
                     !strcasecmp(argv[0],"replica-lazy-flush")) && argc == 2)
         {
@@ -455,6 +503,14 @@ void loadServerConfigFromString(char *config) {
                 err = "active defrag can't be enabled without proper jemalloc support"; goto loaderr;
 #endif
             }
+        } else if (!strcasecmp(argv[0],"memory-accounting") && argc == 2) {
+            if ((server.memory_accounting = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"active-defrag-threaded") && argc == 2) {
+            if ((server.active_defrag_threaded = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"daemonize") && argc == 2) {
             if ((server.daemonize = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
@@ -598,6 +654,10 @@ void loadServerConfigFromString(char *config) {
             server.list_compress_depth = atoi(argv[1]);
         } else if (!strcasecmp(argv[0],"set-max-intset-entries") && argc == 2) {
             server.set_max_intset_entries = memtoll(argv[1], NULL);
+        } else if (!strcasecmp(argv[0],"set-max-listpack-entries") && argc == 2) {
+            server.set_max_listpack_entries = memtoll(argv[1], NULL);
+        } else if (!strcasecmp(argv[0],"set-max-listpack-value") && argc == 2) {
+            server.set_max_listpack_value = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"zset-max-ziplist-entries") && argc == 2) {
             server.zset_max_ziplist_entries = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"zset-max-ziplist-value") && argc == 2) {
@@ -692,6 +752,12 @@ void loadServerConfigFromString(char *config) {
                 err = "argument must be 'yes' or 'no'";
                 goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"cluster-compact-bus") && argc == 2) {
+            server.cluster_compact_bus = yesnotoi(argv[1]);
+            if (server.cluster_compact_bus == -1) {
+                err = "argument must be 'yes' or 'no'";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"lua-time-limit") && argc == 2) {
             server.lua_time_limit = strtoll(argv[1],NULL,10);
         } else if (!strcasecmp(argv[0],"lua-replicate-commands") && argc == 2) {
@@ -812,6 +878,14 @@ void loadServerConfigFromString(char *config) {
         err = "replicaof directive not allowed in cluster mode";
         goto loaderr;
     }
+    for (int j = server.dbnum; j < server.db_maxmemory_len; j++) {
+        if (server.db_maxmemory[j]) {
+            linenum = dbmaxmemory_linenum;
+            i = linenum-1;
+            err = "db-maxmemory set for a DB index out of range";
+            goto loaderr;
+        }
+    }
 
     sdsfreesplitres(lines,totlines);
     return;
@@ -1005,6 +1079,39 @@ void configSetCommand(client *c) {
             addReplyErrorFormat(c,"Changing directory: %s", strerror(errno));
             return;
         }
+    } config_set_special_field("db-maxmemory") {
+        int vlen, j;
+        sds *v = sdssplitlen(o->ptr,sdslen(o->ptr)," ",1,&vlen);
+
+        /* Perform sanity check before setting the new config:
+         * - Even number of args
+         * - DB index in range, and valid memory values. */
+        if (vlen & 1) {
+            sdsfreesplitres(v,vlen);
+            goto badfmt;
+        }
+        for (j = 0; j < vlen; j++) {
+            char *eptr;
+            long val;
+
+            if ((j & 1) == 0) {
+                val = strtol(v[j], &eptr, 10);
+                if (eptr[0] != '\0' || val < 0 || val >= server.dbnum) {
+                    sdsfreesplitres(v,vlen);
+                    goto badfmt;
+                }
+            } else {
+                val = memtoll(v[j], &err);
+                if (err || val < 0) {
+                    sdsfreesplitres(v,vlen);
+                    goto badfmt;
+                }
+            }
+        }
+        /* Finally set the new quotas. */
+        for (j = 0; j < vlen; j += 2)
+            setDbMaxmemory(atoi(v[j]),memtoll(v[j+1],NULL));
+        sdsfreesplitres(v,vlen);
     } config_set_special_field("client-output-buffer-limit") {
         int vlen, j;
         sds *v = sdssplitlen(o->ptr,sdslen(o->ptr)," ",1,&vlen);
@@ -1076,6 +1183,8 @@ void configSetCommand(client *c) {
       "cluster-slave-no-failover",server.cluster_slave_no_failover) {
     } config_set_bool_field(
       "cluster-replica-no-failover",server.cluster_slave_no_failover) {
+    } config_set_bool_field(
+      "cluster-compact-bus",server.cluster_compact_bus) {
     } config_set_bool_field(
       "aof-rewrite-incremental-fsync",server.aof_rewrite_incremental_fsync) {
     } config_set_bool_field(
@@ -1098,6 +1207,12 @@ void configSetCommand(client *c) {
       "replica-ignore-maxmemory",server.repl_slave_ignore_maxmemory) {
     } config_set_bool_field(
       "activerehashing",server.activerehashing) {
+    } config_set_bool_field(
+      "active-defrag-threaded",server.active_defrag_threaded) {
+    } config_set_bool_field(
+      "memory-accounting",server.memory_accounting) {
+        for (int j = 0; j < server.dbnum; j++)
+            dbUpdateMemoryAccounting(server.db+j);
     } config_set_bool_field(
       "activedefrag",server.active_defrag_enabled) {
 #ifndef HAVE_DEFRAG
@@ -1136,6 +1251,11 @@ void configSetCommand(client *c) {
       "tcp-keepalive",server.tcpkeepalive,0,INT_MAX) {
     } config_set_numerical_field(
       "maxmemory-samples",server.maxmemory_samples,1,INT_MAX) {
+    } config_set_numerical_field(
+      "maxmemory-low-watermark",server.maxmemory_low_watermark,0,100) {
+    } config_set_numerical_field(
+      "maxmemory-eviction-pool-size",server.maxmemory_eviction_pool_size,1,1024) {
+        evictionPoolResize();
     } config_set_numerical_field(
       "lfu-log-factor",server.lfu_log_factor,0,INT_MAX) {
     } config_set_numerical_field(
@@ -1170,6 +1290,10 @@ void configSetCommand(client *c) {
       "list-compress-depth",server.list_compress_depth,0,INT_MAX) {
     } config_set_numerical_field(
       "set-max-intset-entries",server.set_max_intset_entries,0,LONG_MAX) {
+    } config_set_numerical_field(
+      "set-max-listpack-entries",server.set_max_listpack_entries,0,LONG_MAX) {
+    } config_set_numerical_field(
+      "set-max-listpack-value",server.set_max_listpack_value,0,LONG_MAX) {
     } config_set_numerical_field(
       "zset-max-ziplist-entries",server.zset_max_ziplist_entries,0,LONG_MAX) {
     } config_set_numerical_field(
@@ -1265,6 +1389,10 @@ void configSetCommand(client *c) {
       "loglevel",server.verbosity,loglevel_enum) {
     } config_set_enum_field(
       "maxmemory-policy",server.maxmemory_policy,maxmemory_policy_enum) {
+        if (server.maxmemory_policy == MAXMEMORY_ALLKEYS_TINYLFU)
+            tinylfuInit();
+        else
+            tinylfuRelease();
     } config_set_enum_field(
       "appendfsync",server.aof_fsync,aof_fsync_enum) {
 
@@ -1346,6 +1474,8 @@ void configGetCommand(client *c) {
     config_get_numerical_field("proto-max-bulk-len",server.proto_max_bulk_len);
     config_get_numerical_field("client-query-buffer-limit",server.client_max_querybuf_len);
     config_get_numerical_field("maxmemory-samples",server.maxmemory_samples);
+    config_get_numerical_field("maxmemory-low-watermark",server.maxmemory_low_watermark);
+    config_get_numerical_field("maxmemory-eviction-pool-size",server.maxmemory_eviction_pool_size);
     config_get_numerical_field("lfu-log-factor",server.lfu_log_factor);
     config_get_numerical_field("lfu-decay-time",server.lfu_decay_time);
     config_get_numerical_field("timeout",server.maxidletime);
@@ -1373,6 +1503,10 @@ void configGetCommand(client *c) {
             server.list_compress_depth);
     config_get_numerical_field("set-max-intset-entries",
             server.set_max_intset_entries);
+    config_get_numerical_field("set-max-listpack-entries",
+            server.set_max_listpack_entries);
+    config_get_numerical_field("set-max-listpack-value",
+            server.set_max_listpack_value);
     config_get_numerical_field("zset-max-ziplist-entries",
             server.zset_max_ziplist_entries);
     config_get_numerical_field("zset-max-ziplist-value",
@@ -1407,6 +1541,7 @@ void configGetCommand(client *c) {
     config_get_numerical_field("min-slaves-max-lag",server.repl_min_slaves_max_lag);
     config_get_numerical_field("min-replicas-max-lag",server.repl_min_slaves_max_lag);
     config_get_numerical_field("hz",server.config_hz);
+    config_get_numerical_field("lazyfree-threads",server.lazyfree_threads);
     config_get_numerical_field("cluster-node-timeout",server.cluster_node_timeout);
     config_get_numerical_field("cluster-migration-barrier",server.cluster_migration_barrier);
     config_get_numerical_field("cluster-slave-validity-factor",server.cluster_slave_validity_factor);
@@ -1421,6 +1556,8 @@ void configGetCommand(client *c) {
             server.cluster_slave_no_failover);
     config_get_bool_field("cluster-replica-no-failover",
             server.cluster_slave_no_failover);
+    config_get_bool_field("cluster-compact-bus",
+            server.cluster_compact_bus);
     config_get_bool_field("no-appendfsync-on-rewrite",
             server.aof_no_fsync_on_rewrite);
     config_get_bool_field("slave-serve-stale-data",
@@ -1442,6 +1579,8 @@ void configGetCommand(client *c) {
     config_get_bool_field("rdbchecksum", server.rdb_checksum);
     config_get_bool_field("activerehashing", server.activerehashing);
     config_get_bool_field("activedefrag", server.active_defrag_enabled);
+    config_get_bool_field("active-defrag-threaded", server.active_defrag_threaded);
+    config_get_bool_field("memory-accounting", server.memory_accounting);
     config_get_bool_field("protected-mode", server.protected_mode);
     config_get_bool_field("repl-disable-tcp-nodelay",
             server.repl_disable_tcp_nodelay);
@@ -1513,6 +1652,20 @@ void configGetCommand(client *c) {
         sdsfree(buf);
         matches++;
     }
+    if (stringmatch(pattern,"db-maxmemory",1)) {
+        sds buf = sdsempty();
+        int j;
+
+        for (j = 0; j < server.db_maxmemory_len; j++) {
+            if (!server.db_maxmemory[j]) continue;
+            if (sdslen(buf)) buf = sdscatlen(buf," ",1);
+            buf = sdscatprintf(buf,"%d %llu",j,server.db_maxmemory[j]);
+        }
+        addReplyBulkCString(c,"db-maxmemory");
+        addReplyBulkCString(c,buf);
+        sdsfree(buf);
+        matches++;
+    }
     if (stringmatch(pattern,"client-output-buffer-limit",1)) {
         sds buf = sdsempty();
         int j;
@@ -1888,6 +2041,22 @@ void rewriteConfigSaveOption(struct rewriteConfigState *state) {
     rewriteConfigMarkAsProcessed(state,"save");
 }
 
+/* Rewrite the db-maxmemory option, one line per DB with a quota. */
+void rewriteConfigDbMaxmemoryOption(struct rewriteConfigState *state) {
+    int j;
+    sds line;
+    char buf[64];
+
+    for (j = 0; j < server.db_maxmemory_len; j++) {
+        if (!server.db_maxmemory[j]) continue;
+        rewriteConfigFormatMemory(buf,sizeof(buf),server.db_maxmemory[j]);
+        line = sdscatprintf(sdsempty(),"db-maxmemory %d %s",j,buf);
+        rewriteConfigRewriteLine(state,"db-maxmemory",line,1);
+    }
+    /* Mark "db-maxmemory" as processed in case no DB has a quota. */
+    rewriteConfigMarkAsProcessed(state,"db-maxmemory");
+}
+
 /* Rewrite the dir option, always using absolute paths.*/
 void rewriteConfigDirOption(struct rewriteConfigState *state) {
     char cwd[1024];
@@ -2167,6 +2336,8 @@ int rewriteConfig(char *path) {
     rewriteConfigBytesOption(state,"client-query-buffer-limit",server.client_max_querybuf_len,PROTO_MAX_QUERYBUF_LEN);
     rewriteConfigEnumOption(state,"maxmemory-policy",server.maxmemory_policy,maxmemory_policy_enum,CONFIG_DEFAULT_MAXMEMORY_POLICY);
     rewriteConfigNumericalOption(state,"maxmemory-samples",server.maxmemory_samples,CONFIG_DEFAULT_MAXMEMORY_SAMPLES);
+    rewriteConfigNumericalOption(state,"maxmemory-low-watermark",server.maxmemory_low_watermark,CONFIG_DEFAULT_MAXMEMORY_LOW_WATERMARK);
+    rewriteConfigNumericalOption(state,"maxmemory-eviction-pool-size",server.maxmemory_eviction_pool_size,CONFIG_DEFAULT_MAXMEMORY_EVICTION_POOL_SIZE);
     rewriteConfigNumericalOption(state,"lfu-log-factor",server.lfu_log_factor,CONFIG_DEFAULT_LFU_LOG_FACTOR);
     rewriteConfigNumericalOption(state,"lfu-decay-time",server.lfu_decay_time,CONFIG_DEFAULT_LFU_DECAY_TIME);
     rewriteConfigNumericalOption(state,"active-defrag-threshold-lower",server.active_defrag_threshold_lower,CONFIG_DEFAULT_DEFRAG_THRESHOLD_LOWER);
@@ -2186,6 +2357,7 @@ int rewriteConfig(char *path) {
     rewriteConfigStringOption(state,"cluster-config-file",server.cluster_configfile,CONFIG_DEFAULT_CLUSTER_CONFIG_FILE);
     rewriteConfigYesNoOption(state,"cluster-require-full-coverage",server.cluster_require_full_coverage,CLUSTER_DEFAULT_REQUIRE_FULL_COVERAGE);
     rewriteConfigYesNoOption(state,"cluster-replica-no-failover",server.cluster_slave_no_failover,CLUSTER_DEFAULT_SLAVE_NO_FAILOVER);
+    rewriteConfigYesNoOption(state,"cluster-compact-bus",server.cluster_compact_bus,CLUSTER_DEFAULT_COMPACT_BUS);
     rewriteConfigNumericalOption(state,"cluster-node-timeout",server.cluster_node_timeout,CLUSTER_DEFAULT_NODE_TIMEOUT);
     rewriteConfigNumericalOption(state,"cluster-migration-barrier",server.cluster_migration_barrier,CLUSTER_DEFAULT_MIGRATION_BARRIER);
     rewriteConfigNumericalOption(state,"cluster-replica-validity-factor",server.cluster_slave_validity_factor,CLUSTER_DEFAULT_SLAVE_VALIDITY);
@@ -2200,13 +2372,18 @@ int rewriteConfig(char *path) {
     rewriteConfigNumericalOption(state,"list-max-ziplist-size",server.list_max_ziplist_size,OBJ_LIST_MAX_ZIPLIST_SIZE);
     rewriteConfigNumericalOption(state,"list-compress-depth",server.list_compress_depth,OBJ_LIST_COMPRESS_DEPTH);
     rewriteConfigNumericalOption(state,"set-max-intset-entries",server.set_max_intset_entries,OBJ_SET_MAX_INTSET_ENTRIES);
+    rewriteConfigNumericalOption(state,"set-max-listpack-entries",server.set_max_listpack_entries,OBJ_SET_MAX_LISTPACK_ENTRIES);
+    rewriteConfigNumericalOption(state,"set-max-listpack-value",server.set_max_listpack_value,OBJ_SET_MAX_LISTPACK_VALUE);
     rewriteConfigNumericalOption(state,"zset-max-ziplist-entries",server.zset_max_ziplist_entries,OBJ_ZSET_MAX_ZIPLIST_ENTRIES);
     rewriteConfigNumericalOption(state,"zset-max-ziplist-value",server.zset_max_ziplist_value,OBJ_ZSET_MAX_ZIPLIST_VALUE);
     rewriteConfigNumericalOption(state,"hll-sparse-max-bytes",server.hll_sparse_max_bytes,CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES);
     rewriteConfigYesNoOption(state,"activerehashing",server.activerehashing,CONFIG_DEFAULT_ACTIVE_REHASHING);
     rewriteConfigYesNoOption(state,"activedefrag",server.active_defrag_enabled,CONFIG_DEFAULT_ACTIVE_DEFRAG);
+    rewriteConfigYesNoOption(state,"active-defrag-threaded",server.active_defrag_threaded,CONFIG_DEFAULT_ACTIVE_DEFRAG_THREADED);
+    rewriteConfigYesNoOption(state,"memory-accounting",server.memory_accounting,CONFIG_DEFAULT_MEMORY_ACCOUNTING);
     rewriteConfigYesNoOption(state,"protected-mode",server.protected_mode,CONFIG_DEFAULT_PROTECTED_MODE);
     rewriteConfigClientoutputbufferlimitOption(state);
+    rewriteConfigDbMaxmemoryOption(state);
     rewriteConfigNumericalOption(state,"hz",server.config_hz,CONFIG_DEFAULT_HZ);
     rewriteConfigYesNoOption(state,"aof-rewrite-incremental-fsync",server.aof_rewrite_incremental_fsync,CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC);
     rewriteConfigYesNoOption(state,"rdb-save-incremental-fsync",server.rdb_save_incremental_fsync,CONFIG_DEFAULT_RDB_SAVE_INCREMENTAL_FSYNC);
@@ -2216,6 +2393,7 @@ int rewriteConfig(char *path) {
     rewriteConfigYesNoOption(state,"lazyfree-lazy-eviction",server.lazyfree_lazy_eviction,CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION);
     rewriteConfigYesNoOption(state,"lazyfree-lazy-expire",server.lazyfree_lazy_expire,CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE);
     rewriteConfigYesNoOption(state,"lazyfree-lazy-server-del",server.lazyfree_lazy_server_del,CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL);
+    rewriteConfigNumericalOption(state,"lazyfree-threads",server.lazyfree_threads,CONFIG_DEFAULT_LAZYFREE_THREADS);
     rewriteConfigYesNoOption(state,"replica-lazy-flush",server.repl_slave_lazy_flush,CONFIG_DEFAULT_SLAVE_LAZY_FLUSH);
     rewriteConfigYesNoOption(state,"dynamic-hz",server.dynamic_hz,CONFIG_DEFAULT_DYNAMIC_HZ);
 
@@ -66,6 +66,8 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
         {
             if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
                 updateLFU(val);
+                if (server.maxmemory_policy == MAXMEMORY_ALLKEYS_TINYLFU)
+                    tinylfuRecord(key->ptr);
             } else {
                 val->lru = LRU_CLOCK();
             }
@@ -130,10 +132,25 @@ robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags) {
             return NULL;
         }
     }
+    hashExpireFieldsIfNeeded(db,key);
     val = lookupKey(db,key,flags);
-    if (val == NULL)
+    /* Like expired keys, hide the expired fields of hashes from the read
+     * only commands executed by slaves. */
+    if (val && val->type == OBJ_HASH && server.masterhost &&
+        server.current_client &&
+        server.current_client != server.master &&
+        server.current_client->cmd &&
+        server.current_client->cmd->flags & CMD_READONLY)
+    {
+        val = hashTypeHideExpiredFields(db,key,val);
+    }
+    if (val == NULL) {
         server.stat_keyspace_misses++;
-    else
+        /* TinyLFU also tracks the frequency of keys not in memory, so
+         * that keys often requested are admitted once written. */
+        if (server.maxmemory_policy == MAXMEMORY_ALLKEYS_TINYLFU &&
+            !(flags & LOOKUP_NOTOUCH)) tinylfuRecord(key->ptr);
+    } else
         server.stat_keyspace_hits++;
     return val;
 }
@@ -151,6 +168,7 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
  * does not exist in the specified DB. */
 robj *lookupKeyWrite(redisDb *db, robj *key) {
     expireIfNeeded(db,key);
+    hashExpireFieldsIfNeeded(db,key);
     return lookupKey(db,key,LOOKUP_NONE);
 }
 
@@ -175,6 +193,9 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
     int retval = dictAdd(db->dict, copy, val);
 
     serverAssertWithInfo(NULL,key,retval == DICT_OK);
+    dbAccountKey(db,copy);
+    if (server.maxmemory_policy == MAXMEMORY_ALLKEYS_TINYLFU &&
+        !server.loading) tinylfuAdmit(key->ptr,val);
     if (val->type == OBJ_LIST ||
         val->type == OBJ_ZSET)
         signalKeyAsReady(db, key);
@@ -183,13 +204,15 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
 
 /* Overwrite an existing key with a new value. Incrementing the reference
  * count of the new value is up to the caller.
- * This function does not modify the expire time of the existing key.
+ * This function does not modify the expire time of the existing key, but
+ * the timeouts of the fields of an old hash value are removed.
  *
  * The program is aborted if the key was not already present. */
 void dbOverwrite(redisDb *db, robj *key, robj *val) {
     dictEntry *de = dictFind(db->dict,key->ptr);
 
     serverAssertWithInfo(NULL,key,de != NULL);
+    if (dictSize(db->hexpires) > 0) dbDeleteHashFieldExpires(db,key->ptr);
     dictEntry auxentry = *de;
     robj *old = dictGetVal(de);
     if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
@@ -203,6 +226,7 @@ void dbOverwrite(redisDb *db, robj *key, robj *val) {
     }
 
     dictFreeVal(db->dict, &auxentry);
+    dbAccountKey(db,key->ptr);
 }
 
 /* High level Set operation. This function can be used in order to set
@@ -269,9 +293,15 @@ robj *dbRandomKey(redisDb *db) {
 
 /* Delete a key, value, and associated expiration entry if any, from the DB */
 int dbSyncDelete(redisDb *db, robj *key) {
+    /* Expired and evicted keys don't go through signalModifiedKey(), but
+     * a transfer can't survive the deletion of its key either. */
+    migrateAsyncSignalModifiedKey(db,key);
+
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
+    if (dictSize(db->expires) > 0) dbDeleteExpire(db,key->ptr);
+    if (dictSize(db->hexpires) > 0) dbDeleteHashFieldExpires(db,key->ptr);
+    dbUnaccountKey(db,key->ptr);
     if (dictDelete(db->dict,key->ptr) == DICT_OK) {
         if (server.cluster_enabled) slotToKeyDel(key);
         return 1;
@@ -348,6 +378,10 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
         return -1;
     }
 
+    /* Stop MIGRATE ASYNC transfers referencing the values we are going
+     * to release. */
+    migrateAsyncSignalFlushedDb(dbnum);
+
     int startdb, enddb;
     if (dbnum == -1) {
         startdb = 0;
@@ -363,6 +397,15 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
         } else {
             dictEmpty(server.db[j].dict,callback);
             dictEmpty(server.db[j].expires,callback);
+            raxFree(server.db[j].expires_index);
+            server.db[j].expires_index = raxNew();
+            dictEmpty(server.db[j].hexpires,NULL);
+            raxFree(server.db[j].hexpires_index);
+            server.db[j].hexpires_index = raxNew();
+            if (server.db[j].key_sizes) {
+                dictEmpty(server.db[j].key_sizes,NULL);
+                dbResetMemoryAccounting(server.db+j);
+            }
         }
     }
     if (server.cluster_enabled) {
@@ -393,7 +436,9 @@ int selectDb(client *c, int id) {
  *----------------------------------------------------------------------------*/
 
 void signalModifiedKey(redisDb *db, robj *key) {
+    dbAccountKey(db,key->ptr);
     touchWatchedKey(db,key);
+    migrateAsyncSignalModifiedKey(db,key);
 }
 
 void signalFlushedDb(int dbid) {
@@ -582,7 +627,7 @@ void scanCallback(void *privdata, const dictEntry *de) {
     } else if (o->type == OBJ_ZSET) {
         sds sdskey = dictGetKey(de);
         key = createStringObject(sdskey,sdslen(sdskey));
-        val = createStringObjectFromLongDouble(*(double*)dictGetVal(de),0);
+        val = createStringObjectFromLongDouble(dictGetDoubleVal(de),0);
     } else {
         serverPanic("Type not handled in SCAN callback.");
     }
@@ -671,7 +716,7 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
 
     /* Step 2: Iterate the collection.
      *
-     * Note that if the object is encoded with a ziplist, intset, or any other
+     * Note that if the object is encoded with a listpack, intset, or any other
      * representation that is not a hash table, we are sure that it is also
      * composed of a small number of elements. So to avoid taking state we
      * just return everything inside the object in a single call, setting the
@@ -686,7 +731,7 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
     } else if (o->type == OBJ_HASH && o->encoding == OBJ_ENCODING_HT) {
         ht = o->ptr;
         count *= 2; /* We return key / value for this type. */
-    } else if (o->type == OBJ_ZSET && o->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (o->type == OBJ_ZSET && o->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = o->ptr;
         ht = zs->dict;
         count *= 2; /* We return key / value for this type. */
@@ -710,25 +755,25 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         } while (cursor &&
               maxiterations-- &&
               listLength(keys) < (unsigned long)count);
-    } else if (o->type == OBJ_SET) {
+    } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_INTSET) {
         int pos = 0;
         int64_t ll;
 
         while(intsetGet(o->ptr,pos++,&ll))
             listAddNodeTail(keys,createStringObjectFromLongLong(ll));
         cursor = 0;
-    } else if (o->type == OBJ_HASH || o->type == OBJ_ZSET) {
-        unsigned char *p = ziplistIndex(o->ptr,0);
+    } else if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *p = lpSeek(o->ptr,0);
         unsigned char *vstr;
         unsigned int vlen;
         long long vll;
 
         while(p) {
-            ziplistGet(p,&vstr,&vlen,&vll);
+            lpGetValue(p,&vstr,&vlen,&vll);
             listAddNodeTail(keys,
                 (vstr != NULL) ? createStringObject((char*)vstr,vlen) :
                                  createStringObjectFromLongLong(vll));
-            p = ziplistNext(o->ptr,p);
+            p = lpNext(o->ptr,p);
         }
         cursor = 0;
     } else {
@@ -868,6 +913,7 @@ void shutdownCommand(client *c) {
 
 void renameGenericCommand(client *c, int nx) {
     robj *o;
+    hashFieldExpires *hfe;
     long long expire;
     int samekey = 0;
 
@@ -895,8 +941,11 @@ void renameGenericCommand(client *c, int nx) {
          * with the same name. */
         dbDelete(c->db,c->argv[2]);
     }
+    /* The timeouts of the fields of a hash follow the value. */
+    hfe = dbUnlinkHashFieldExpires(c->db,c->argv[1]->ptr);
     dbAdd(c->db,c->argv[2],o);
     if (expire != -1) setExpire(c,c->db,c->argv[2],expire);
+    if (hfe) dbLinkHashFieldExpires(c->db,c->argv[2],hfe);
     dbDelete(c->db,c->argv[1]);
     signalModifiedKey(c->db,c->argv[1]);
     signalModifiedKey(c->db,c->argv[2]);
@@ -919,6 +968,7 @@ void renamenxCommand(client *c) {
 void moveCommand(client *c) {
     robj *o;
     redisDb *src, *dst;
+    hashFieldExpires *hfe;
     int srcid;
     long long dbid, expire;
 
@@ -961,8 +1011,16 @@ void moveCommand(client *c) {
         addReply(c,shared.czero);
         return;
     }
+
+    /* processCommand() only enforced the memory quota of the source DB. */
+    if (freeDbMemoryIfNeededAndSafe(dst) == C_ERR) {
+        addReply(c,shared.dboomerr);
+        return;
+    }
+    hfe = dbUnlinkHashFieldExpires(src,c->argv[1]->ptr);
     dbAdd(dst,c->argv[1],o);
     if (expire != -1) setExpire(c,dst,c->argv[1],expire);
+    if (hfe) dbLinkHashFieldExpires(dst,c->argv[1],hfe);
     incrRefCount(o);
 
     /* OK! key moved, free the entry in the source DB */
@@ -1004,16 +1062,40 @@ int dbSwapDatabases(int id1, int id2) {
     redisDb aux = server.db[id1];
     redisDb *db1 = &server.db[id1], *db2 = &server.db[id2];
 
+    /* MIGRATE ASYNC jobs refer to the keys by DB, so they can't survive
+     * the swap. */
+    migrateAsyncSignalFlushedDb(id1);
+    migrateAsyncSignalFlushedDb(id2);
+
     /* Swap hash tables. Note that we don't swap blocking_keys,
      * ready_keys and watched_keys, since we want clients to
      * remain in the same DB they were. */
     db1->dict = db2->dict;
     db1->expires = db2->expires;
+    db1->expires_index = db2->expires_index;
+    db1->hexpires = db2->hexpires;
+    db1->hexpires_index = db2->hexpires_index;
     db1->avg_ttl = db2->avg_ttl;
+    db1->key_sizes = db2->key_sizes;
+    db1->used_memory = db2->used_memory;
+    memcpy(db1->used_memory_type,db2->used_memory_type,
+           sizeof(db1->used_memory_type));
 
     db2->dict = aux.dict;
     db2->expires = aux.expires;
+    db2->expires_index = aux.expires_index;
+    db2->hexpires = aux.hexpires;
+    db2->hexpires_index = aux.hexpires_index;
     db2->avg_ttl = aux.avg_ttl;
+    db2->key_sizes = aux.key_sizes;
+    db2->used_memory = aux.used_memory;
+    memcpy(db2->used_memory_type,aux.used_memory_type,
+           sizeof(db2->used_memory_type));
+
+    /* Memory quotas belong to the DB index and not to the data set, so
+     * the accounting may need to be started or stopped. */
+    dbUpdateMemoryAccounting(db1);
+    dbUpdateMemoryAccounting(db2);
 
     /* Now we need to handle clients blocked on lists: as an effect
      * of swapping the two DBs, a client that was waiting for list
@@ -1052,9 +1134,147 @@ void swapdbCommand(client *c) {
     if (dbSwapDatabases(id1,id2) == C_ERR) {
         addReplyError(c,"DB index is out of range");
         return;
-    } else {
-        server.dirty++;
-        addReply(c,shared.ok);
+    }
+
+    /* The memory quotas belong to the DB indexes, so the swap is undone if
+     * a data set is now over the quota of its index. We can't evict here,
+     * since the evictions would be propagated before SWAPDB itself. Slaves
+     * and the AOF loading must execute the command anyway. */
+    if (!server.loading && !server.masterhost &&
+        (dbOverMemoryQuota(&server.db[id1]) ||
+         dbOverMemoryQuota(&server.db[id2])))
+    {
+        dbSwapDatabases(id1,id2);
+        addReply(c,shared.dboomerr);
+        return;
+    }
+    server.dirty++;
+    addReply(c,shared.ok);
+}
+
+/*-----------------------------------------------------------------------------
+ * Memory accounting and quotas of DBs
+ *----------------------------------------------------------------------------*/
+
+/* When a DB has a memory quota (see the db-maxmemory option), or when the
+ * memory-accounting option is enabled, the memory used by every key is
+ * estimated with objectComputeSize() and remembered in db->key_sizes, a
+ * dictionary sharing the key names with the main one like db->expires does,
+ * so that db->used_memory is updated incrementally when keys are added,
+ * deleted, overwritten, or modified (signalModifiedKey()).
+ *
+ * Since we remember the size charged for every key, a key modified without
+ * being signaled only makes the accounting imprecise until its next change
+ * or its deletion: errors never accumulate in db->used_memory.
+ *
+ * The value of the key_sizes entries also remembers the type of the value
+ * the size was computed for, in the most significant bits, so that the
+ * per type totals in db->used_memory_type can be updated when the key is
+ * overwritten by a value of another type or deleted. */
+#define KEY_SIZE_TYPE_SHIFT 56
+#define KEY_SIZE_USAGE_MASK ((1ULL<<KEY_SIZE_TYPE_SHIFT)-1)
+#define KEY_SIZE_TYPE(v) ((int)((v) >> KEY_SIZE_TYPE_SHIFT))
+#define KEY_SIZE_USAGE(v) ((size_t)((v) & KEY_SIZE_USAGE_MASK))
+
+/* Return the memory quota of the DB 'id', or 0 if it has no quota. */
+unsigned long long dbGetMaxmemory(int id) {
+    if (id >= server.db_maxmemory_len) return 0;
+    return server.db_maxmemory[id];
+}
+
+/* Return true if the memory accounted to 'db' is over its quota. */
+int dbOverMemoryQuota(redisDb *db) {
+    unsigned long long quota = dbGetMaxmemory(db->id);
+
+    return quota && db->key_sizes && db->used_memory > quota;
+}
+
+/* Account the memory used by the key at the dictionary entry 'de'. */
+static void dbAccountKeyEntry(redisDb *db, dictEntry *de) {
+    dictEntry *se, *existing;
+    sds key = dictGetKey(de);
+    robj *val = dictGetVal(de);
+    size_t usage = sdsAllocSize(key)+sizeof(dictEntry)+
+                   objectComputeSize(val,OBJ_COMPUTE_SIZE_DEF_SAMPLES);
+
+    se = dictAddRaw(db->key_sizes,key,&existing);
+    if (se == NULL) {
+        uint64_t old = dictGetUnsignedIntegerVal(existing);
+        se = existing;
+        db->used_memory -= KEY_SIZE_USAGE(old);
+        db->used_memory_type[KEY_SIZE_TYPE(old)] -= KEY_SIZE_USAGE(old);
+    }
+    usage &= KEY_SIZE_USAGE_MASK;
+    dictSetUnsignedIntegerVal(se,
+        ((uint64_t)val->type << KEY_SIZE_TYPE_SHIFT) | usage);
+    db->used_memory += usage;
+    db->used_memory_type[val->type] += usage;
+}
+
+/* Update the memory accounted to 'key' after it was created or modified,
+ * or stop accounting it if the key no longer exists. */
+void dbAccountKey(redisDb *db, sds key) {
+    dictEntry *de;
+
+    if (db->key_sizes == NULL) return;
+    if ((de = dictFind(db->dict,key)) != NULL)
+        dbAccountKeyEntry(db,de);
+    else
+        dbUnaccountKey(db,key);
+}
+
+/* Stop accounting 'key', that is going to be deleted. This must be called
+ * before the key name is released, since it is shared with db->key_sizes. */
+void dbUnaccountKey(redisDb *db, sds key) {
+    dictEntry *se;
+
+    if (db->key_sizes == NULL) return;
+    if ((se = dictFind(db->key_sizes,key)) == NULL) return;
+    uint64_t old = dictGetUnsignedIntegerVal(se);
+    db->used_memory -= KEY_SIZE_USAGE(old);
+    db->used_memory_type[KEY_SIZE_TYPE(old)] -= KEY_SIZE_USAGE(old);
+    dictDelete(db->key_sizes,key);
+}
+
+/* If the memory of the keys of 'db' is accounted, store in '*usage' the
+ * memory accounted to 'key', the same MEMORY USAGE would report with the
+ * default number of samples, and return 1. Otherwise return 0. */
+int dbGetAccountedKeyMemory(redisDb *db, sds key, size_t *usage) {
+    dictEntry *se;
+
+    if (db->key_sizes == NULL) return 0;
+    if ((se = dictFind(db->key_sizes,key)) == NULL) return 0;
+    *usage = KEY_SIZE_USAGE(dictGetUnsignedIntegerVal(se));
+    return 1;
+}
+
+/* Zero the memory accounted to 'db', after db->key_sizes was emptied. */
+void dbResetMemoryAccounting(redisDb *db) {
+    db->used_memory = 0;
+    memset(db->used_memory_type,0,sizeof(db->used_memory_type));
+}
+
+/* Start the memory accounting of 'db' if it has a quota or if the
+ * memory-accounting option is enabled, computing the memory of all its keys,
+ * or stop it if it is no longer needed. Starting the accounting of a big DB
+ * takes time proportional to the number of keys. */
+void dbUpdateMemoryAccounting(redisDb *db) {
+    int needed = server.memory_accounting || dbGetMaxmemory(db->id) != 0;
+
+    if (needed && db->key_sizes == NULL) {
+        dictIterator *di;
+        dictEntry *de;
+
+        db->key_sizes = dictCreate(&keyptrDictType,NULL);
+        dbResetMemoryAccounting(db);
+        if (dictSize(db->dict)) dictExpand(db->key_sizes,dictSize(db->dict));
+        di = dictGetIterator(db->dict);
+        while((de = dictNext(di)) != NULL) dbAccountKeyEntry(db,de);
+        dictReleaseIterator(di);
+    } else if (!needed && db->key_sizes) {
+        freeDictAsync(db->key_sizes);
+        db->key_sizes = NULL;
+        dbResetMemoryAccounting(db);
     }
 }
 
@@ -1062,11 +1282,65 @@ void swapdbCommand(client *c) {
  * Expires API
  *----------------------------------------------------------------------------*/
 
+/* Every key with an expire is also stored in db->expires_index, a radix
+ * tree where the element is the expire time as a 64 bit big endian number
+ * followed by the key name, so that iterating the tree returns the keys in
+ * the order they expire. This allows activeExpireCycle() to reclaim exactly
+ * the expired keys, instead of sampling db->expires at random. The hashes
+ * with expiring fields are indexed the same way in db->hexpires_index.
+ *
+ * This function adds (or removes, if 'add' is zero) to 'index' the element
+ * for 'key' expiring at 'when'. */
+void expireIndexUpdate(rax *index, sds key, long long when, int add) {
+    unsigned char buf[64];
+    unsigned char *indexed = buf;
+    size_t keylen = sdslen(key);
+    uint64_t t = when < 0 ? 0 : (uint64_t) when;
+    int j;
+
+    if (keylen+8 > 64) indexed = zmalloc(keylen+8);
+    for (j = 7; j >= 0; j--) {
+        indexed[j] = t & 0xff;
+        t >>= 8;
+    }
+    memcpy(indexed+8,key,keylen);
+    if (add) {
+        raxInsert(index,indexed,keylen+8,NULL,NULL);
+    } else {
+        raxRemove(index,indexed,keylen+8,NULL);
+    }
+    if (indexed != buf) zfree(indexed);
+}
+
+static void expireIndexUpdateKey(redisDb *db, sds key, long long when, int add) {
+    expireIndexUpdate(db->expires_index,key,when,add);
+}
+
+/* Decode the expire time of an element of db->expires_index. */
+long long expireIndexGetTime(unsigned char *indexed) {
+    uint64_t t = 0;
+    int j;
+
+    for (j = 0; j < 8; j++) t = (t << 8) | indexed[j];
+    return (long long) t;
+}
+
+/* Remove the expire of 'key' from db->expires and db->expires_index.
+ * Return 1 if the key had an expire, otherwise 0. */
+int dbDeleteExpire(redisDb *db, sds key) {
+    dictEntry *de = dictUnlink(db->expires,key);
+
+    if (de == NULL) return 0;
+    expireIndexUpdateKey(db,key,dictGetSignedIntegerVal(de),0);
+    dictFreeUnlinkedEntry(db->expires,de);
+    return 1;
+}
+
 int removeExpire(redisDb *db, robj *key) {
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
     serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictDelete(db->expires,key->ptr) == DICT_OK;
+    return dbDeleteExpire(db,key->ptr);
 }
 
 /* Set an expire to the specified key. If the expire is set in the context
@@ -1074,13 +1348,19 @@ int removeExpire(redisDb *db, robj *key) {
  * to NULL. The 'when' parameter is the absolute unix time in milliseconds
  * after which the key will no longer be considered valid. */
 void setExpire(client *c, redisDb *db, robj *key, long long when) {
-    dictEntry *kde, *de;
+    dictEntry *kde, *de, *existing;
 
     /* Reuse the sds from the main dict in the expire dict */
     kde = dictFind(db->dict,key->ptr);
     serverAssertWithInfo(NULL,key,kde != NULL);
-    de = dictAddOrFind(db->expires,dictGetKey(kde));
+    de = dictAddRaw(db->expires,dictGetKey(kde),&existing);
+    if (de == NULL) {
+        de = existing;
+        expireIndexUpdateKey(db,dictGetKey(kde),
+                             dictGetSignedIntegerVal(de),0);
+    }
     dictSetSignedIntegerVal(de,when);
+    expireIndexUpdateKey(db,dictGetKey(kde),when,1);
 
     int writable_slave = server.masterhost && server.repl_slave_ro == 0;
     if (c && writable_slave && !(c->flags & CLIENT_MASTER))
@@ -1324,6 +1604,29 @@ int *evalGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys)
     return keys;
 }
 
+/* Helper function to extract keys from the SINTERCARD command.
+ * SINTERCARD <num-keys> <key> <key> ... <key> [LIMIT <limit>] */
+int *sintercardGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys) {
+    int i, num, *keys;
+    UNUSED(cmd);
+
+    num = atoi(argv[1]->ptr);
+    /* Sanity check. Don't return any key if the command is going to
+     * reply with syntax error. */
+    if (num <= 0 || num > (argc-2)) {
+        *numkeys = 0;
+        return NULL;
+    }
+
+    keys = zmalloc(sizeof(int)*num);
+    *numkeys = num;
+
+    /* Add all key positions for argv[2...n] to keys[] */
+    for (i = 0; i < num; i++) keys[i] = 2+i;
+
+    return keys;
+}
+
 /* Helper function to extract keys from the SORT command.
  *
  * SORT <sort-key> ... STORE <store-key> ...
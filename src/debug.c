@@ -147,7 +147,7 @@ void xorObjectDigest(redisDb *db, robj *keyobj, unsigned char *digest, robj *o)
     } else if (o->type == OBJ_ZSET) {
         unsigned char eledigest[20];
 
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
             unsigned char *zl = o->ptr;
             unsigned char *eptr, *sptr;
             unsigned char *vstr;
@@ -155,13 +155,13 @@ void xorObjectDigest(redisDb *db, robj *keyobj, unsigned char *digest, robj *o)
             long long vll;
             double score;
 
-            eptr = ziplistIndex(zl,0);
+            eptr = lpSeek(zl,0);
             serverAssert(eptr != NULL);
-            sptr = ziplistNext(zl,eptr);
+            sptr = lpNext(zl,eptr);
             serverAssert(sptr != NULL);
 
             while (eptr != NULL) {
-                serverAssert(ziplistGet(eptr,&vstr,&vlen,&vll));
+                serverAssert(lpGetValue(eptr,&vstr,&vlen,&vll));
                 score = zzlGetScore(sptr);
 
                 memset(eledigest,0,20);
@@ -177,16 +177,16 @@ void xorObjectDigest(redisDb *db, robj *keyobj, unsigned char *digest, robj *o)
                 xorDigest(digest,eledigest,20);
                 zzlNext(zl,&eptr,&sptr);
             }
-        } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (o->encoding == OBJ_ENCODING_BTREE) {
             zset *zs = o->ptr;
             dictIterator *di = dictGetIterator(zs->dict);
             dictEntry *de;
 
             while((de = dictNext(di)) != NULL) {
                 sds sdsele = dictGetKey(de);
-                double *score = dictGetVal(de);
+                double score = dictGetDoubleVal(de);
 
-                snprintf(buf,sizeof(buf),"%.17g",*score);
+                snprintf(buf,sizeof(buf),"%.17g",score);
                 memset(eledigest,0,20);
                 mixDigest(eledigest,sdsele,sdslen(sdsele));
                 mixDigest(eledigest,buf,strlen(buf));
@@ -247,6 +247,27 @@ void xorObjectDigest(redisDb *db, robj *keyobj, unsigned char *digest, robj *o)
     }
     /* If the key has an expire, add it to the mix */
     if (expiretime != -1) xorDigest(digest,"!!expire!!",10);
+
+    /* The same for the fields of a hash with a timeout. */
+    if (o->type == OBJ_HASH && dictSize(db->hexpires)) {
+        dictEntry *de = dictFind(db->hexpires,keyobj->ptr);
+
+        if (de) {
+            hashFieldExpires *hfe = dictGetVal(de);
+            dictIterator *di = dictGetIterator(hfe->fields);
+            unsigned char eledigest[20];
+
+            while((de = dictNext(di)) != NULL) {
+                sds field = dictGetKey(de);
+
+                memset(eledigest,0,20);
+                mixDigest(eledigest,field,sdslen(field));
+                mixDigest(eledigest,"!!expire!!",10);
+                xorDigest(digest,eledigest,20);
+            }
+            dictReleaseIterator(di);
+        }
+    }
 }
 
 /* Compute the dataset digest. Since keys, sets elements, hashes elements
@@ -318,6 +339,7 @@ void debugCommand(client *c) {
 "RESTART -- Graceful restart: save config, db, restart.",
 "SDSLEN <key> -- Show low level SDS string info representing key and value.",
 "SEGFAULT -- Crash the server with sigsegv.",
+"REPLICATION-PAUSE <0|1> -- Setting it to 1 makes a replica stop applying the replication stream, that is still received and buffered. Setting it to 0 resumes it.",
 "SET-ACTIVE-EXPIRE <0|1> -- Setting it to 0 disables expiring keys in background when they are not accessed (otherwise the Redis behavior). Setting it to 1 reenables back the default.",
 "SLEEP <seconds> -- Stop the server for <seconds>. Decimals allowed.",
 "STRUCTSIZE -- Return the size of different Redis core C structures.",
@@ -543,6 +565,13 @@ NULL
     {
         server.active_expire_enabled = atoi(c->argv[2]->ptr);
         addReply(c,shared.ok);
+    } else if (!strcasecmp(c->argv[1]->ptr,"replication-pause") &&
+               c->argc == 3)
+    {
+        server.repl_debug_pause = atoi(c->argv[2]->ptr);
+        if (!server.repl_debug_pause && server.master)
+            queueClientForReprocessing(server.master);
+        addReply(c,shared.ok);
     } else if (!strcasecmp(c->argv[1]->ptr,"lua-always-replicate-commands") &&
                c->argc == 3)
     {
@@ -596,7 +625,7 @@ NULL
 
         /* Get the hash table reference from the object, if possible. */
         switch (o->encoding) {
-        case OBJ_ENCODING_SKIPLIST:
+        case OBJ_ENCODING_BTREE:
             {
                 zset *zs = o->ptr;
                 ht = zs->dict;
@@ -688,8 +717,8 @@ void serverLogObjectDebugInfo(const robj *o) {
         serverLog(LL_WARNING,"Hash size: %d", (int) hashTypeLength(o));
     } else if (o->type == OBJ_ZSET) {
         serverLog(LL_WARNING,"Sorted set size: %d", (int) zsetLength(o));
-        if (o->encoding == OBJ_ENCODING_SKIPLIST)
-            serverLog(LL_WARNING,"Skiplist level: %d", (int) ((const zset*)o->ptr)->zsl->level);
+        if (o->encoding == OBJ_ENCODING_BTREE)
+            serverLog(LL_WARNING,"B+tree height: %d", (int) ((const zset*)o->ptr)->zbt->height);
     }
 }
 
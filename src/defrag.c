@@ -35,12 +35,32 @@
  */
 
 #include "server.h"
+#include "atomicvar.h"
 #include <time.h>
 #include <assert.h>
 #include <stddef.h>
 
 #ifdef HAVE_DEFRAG
 
+/* Set by the main thread while it waits to acquire the GIL held by the
+ * defrag thread, so that the defrag thread releases it ASAP. */
+static int defrag_main_waiting = 0;
+/* Only referenced by the atomicvar.h macros when they fall back to a mutex. */
+static pthread_mutex_t defrag_main_waiting_mutex __attribute__((unused)) =
+    PTHREAD_MUTEX_INITIALIZER;
+/* Signaled by the main thread when it clears defrag_main_waiting, so that
+ * the defrag thread can sleep until then. */
+static pthread_mutex_t defrag_main_done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t defrag_main_done_cond = PTHREAD_COND_INITIALIZER;
+
+/* Return true if the defrag work must stop now: the time limit was reached
+ * or, when defragging from the defrag thread, the main thread wants to run. */
+static int defragTimeIsUp(long long endtime) {
+    int main_waiting;
+    atomicGet(defrag_main_waiting,main_waiting);
+    return main_waiting || ustime() > endtime;
+}
+
 /* this method was added to jemalloc in order to help us understand which
  * pointers are worthwhile moving and which aren't */
 int je_get_defrag_hint(void* ptr, int *bin_util, int *run_util);
@@ -186,78 +206,74 @@ long dictDefragTables(dict* d) {
     return defragged;
 }
 
-/* Internal function used by zslDefrag */
-void zslUpdateNode(zskiplist *zsl, zskiplistNode *oldnode, zskiplistNode *newnode, zskiplistNode **update) {
-    int i;
-    for (i = 0; i < zsl->level; i++) {
-        if (update[i]->level[i].forward == oldnode)
-            update[i]->level[i].forward = newnode;
-    }
-    serverAssert(zsl->header!=oldnode);
-    if (newnode->level[0].forward) {
-        serverAssert(newnode->level[0].forward->backward==oldnode);
-        newnode->level[0].forward->backward = newnode;
-    } else {
-        serverAssert(zsl->tail==oldnode);
-        zsl->tail = newnode;
-    }
+/* Internal function used by zbtDefrag */
+void zbtUpdateLeaf(zbtree *zbt, zbtreeLeaf *newleaf) {
+    if (newleaf->prev)
+        newleaf->prev->next = newleaf;
+    else
+        zbt->head = newleaf;
+    if (newleaf->next)
+        newleaf->next->prev = newleaf;
+    else
+        zbt->tail = newleaf;
 }
 
 /* Defrag helper for sorted set.
- * Update the robj pointer, defrag the skiplist struct and return the new score
- * reference. We may not access oldele pointer (not even the pointer stored in
- * the skiplist), as it was already freed. Newele may be null, in which case we
- * only need to defrag the skiplist, but not update the obj pointer.
- * When return value is non-NULL, it is the score reference that must be updated
- * in the dict record. */
-double *zslDefrag(zskiplist *zsl, double score, sds oldele, sds newele) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x, *newx;
-    int i;
-    sds ele = newele? newele: oldele;
-
-    /* find the skiplist node referring to the object that was moved,
-     * and all pointers that need to be updated if we'll end up moving the skiplist node. */
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-            x->level[i].forward->ele != oldele && /* make sure not to access the
-                                                     ->obj pointer if it matches
-                                                     oldele */
-            (x->level[i].forward->score < score ||
-                (x->level[i].forward->score == score &&
-                sdscmp(x->level[i].forward->ele,ele) < 0)))
-            x = x->level[i].forward;
-        update[i] = x;
+ * Look up the B+tree entry of 'ele', that must still be valid (the caller
+ * defrags the sds only after this returns), and try to defrag the nodes
+ * having 'ele' as their smallest element along the way: since every node
+ * has exactly one smallest element, scanning the whole dict tries every node
+ * once (the root is handled by the caller). The addresses of the slots
+ * referencing 'ele' are stored in 'refs', so that the caller can update them
+ * if the sds is moved. Returns the number of slots stored. */
+int zbtDefrag(zbtree *zbt, double score, sds ele, sds **refs, long *defragged) {
+    void *x = zbt->root, *newx;
+    zbtreeLeaf *leaf;
+    unsigned int i;
+    int level, numrefs = 0;
+
+    for (level = zbt->height; level > 1; level--) {
+        zbtreeInner *in = x;
+
+        /* Go to the last child whose smallest element is <= ele. */
+        i = 0;
+        while (i+1 < in->count &&
+               (in->scores[i+1] < score ||
+                (in->scores[i+1] == score &&
+                 (in->eles[i+1] == ele || sdscmp(in->eles[i+1],ele) < 0))))
+            i++;
+        if (in->eles[i] == ele) {
+            refs[numrefs++] = &in->eles[i];
+            if ((newx = activeDefragAlloc(in->children[i]))) {
+                (*defragged)++;
+                in->children[i] = newx;
+                if (level == 2) zbtUpdateLeaf(zbt,newx);
+            }
+        }
+        x = in->children[i];
     }
 
-    /* update the robj pointer inside the skip list record. */
-    x = x->level[0].forward;
-    serverAssert(x && score == x->score && x->ele==oldele);
-    if (newele)
-        x->ele = newele;
-
-    /* try to defrag the skiplist record itself */
-    newx = activeDefragAlloc(x);
-    if (newx) {
-        zslUpdateNode(zsl, x, newx, update);
-        return &newx->score;
-    }
-    return NULL;
+    leaf = x;
+    for (i = 0; i < leaf->count && leaf->entries[i].ele != ele; i++);
+    serverAssert(i < leaf->count && leaf->entries[i].score == score);
+    refs[numrefs++] = &leaf->entries[i].ele;
+    return numrefs;
 }
 
 /* Defrag helpler for sorted set.
- * Defrag a single dict entry key name, and corresponding skiplist struct */
+ * Defrag a single dict entry key name, and corresponding B+tree nodes */
 long activeDefragZsetEntry(zset *zs, dictEntry *de) {
+    sds *refs[ZBTREE_MAX_HEIGHT];
     sds newsds;
-    double* newscore;
     long defragged = 0;
     sds sdsele = dictGetKey(de);
-    if ((newsds = activeDefragSds(sdsele)))
+    int j, numrefs;
+
+    numrefs = zbtDefrag(zs->zbt, dictGetDoubleVal(de), sdsele, refs,
+                        &defragged);
+    if ((newsds = activeDefragSds(sdsele))) {
         defragged++, de->key = newsds;
-    newscore = zslDefrag(zs->zsl, *(double*)dictGetVal(de), sdsele, newsds);
-    if (newscore) {
-        dictSetVal(zs->dict, de, newscore);
-        defragged++;
+        for (j = 0; j < numrefs; j++) *refs[j] = newsds;
     }
     return defragged;
 }
@@ -410,8 +426,17 @@ dictEntry* replaceSateliteDictKeyPtrAndOrDefragDictEntry(dict *d, sds oldkey, sd
 
 long activeDefragQuickListNodes(quicklist *ql) {
     quicklistNode *node = ql->head, *newnode;
+    quicklistNodeIndex *qi = ql->index, *newqi;
+    quicklistIndexEntry *newentries, *ie = NULL;
     long defragged = 0;
-    unsigned char *newzl;
+    unsigned char *newlp;
+    if (qi) {
+        if ((newqi = activeDefragAlloc(qi)))
+            defragged++, ql->index = qi = newqi;
+        if ((newentries = activeDefragAlloc(qi->entries)))
+            defragged++, qi->entries = newentries;
+        ie = qi->entries+qi->first;
+    }
     while (node) {
         if ((newnode = activeDefragAlloc(node))) {
             if (newnode->prev)
@@ -422,12 +447,15 @@ long activeDefragQuickListNodes(quicklist *ql) {
                 newnode->next->prev = newnode;
             else
                 ql->tail = newnode;
+            /* The node index references the nodes in the same order. */
+            if (ie) ie->node = newnode;
             node = newnode;
             defragged++;
         }
-        if ((newzl = activeDefragAlloc(node->zl)))
-            defragged++, node->zl = newzl;
+        if ((newlp = activeDefragAlloc(node->lp)))
+            defragged++, node->lp = newlp;
         node = node->next;
+        if (ie) ie++;
     }
     return defragged;
 }
@@ -461,7 +489,7 @@ void scanLaterZsetCallback(void *privdata, const dictEntry *_de) {
 }
 
 long scanLaterZset(robj *ob, unsigned long *cursor) {
-    if (ob->type != OBJ_ZSET || ob->encoding != OBJ_ENCODING_SKIPLIST)
+    if (ob->type != OBJ_ZSET || ob->encoding != OBJ_ENCODING_BTREE)
         return 0;
     zset *zs = (zset*)ob->ptr;
     dict *d = zs->dict;
@@ -523,22 +551,24 @@ long defragQuicklist(redisDb *db, dictEntry *kde) {
     return defragged;
 }
 
-long defragZsetSkiplist(redisDb *db, dictEntry *kde) {
+long defragZsetBtree(redisDb *db, dictEntry *kde) {
     robj *ob = dictGetVal(kde);
     long defragged = 0;
     zset *zs = (zset*)ob->ptr;
     zset *newzs;
-    zskiplist *newzsl;
+    zbtree *newzbt;
     dict *newdict;
     dictEntry *de;
-    struct zskiplistNode *newheader;
-    serverAssert(ob->type == OBJ_ZSET && ob->encoding == OBJ_ENCODING_SKIPLIST);
+    void *newroot;
+    serverAssert(ob->type == OBJ_ZSET && ob->encoding == OBJ_ENCODING_BTREE);
     if ((newzs = activeDefragAlloc(zs)))
         defragged++, ob->ptr = zs = newzs;
-    if ((newzsl = activeDefragAlloc(zs->zsl)))
-        defragged++, zs->zsl = newzsl;
-    if ((newheader = activeDefragAlloc(zs->zsl->header)))
-        defragged++, zs->zsl->header = newheader;
+    if ((newzbt = activeDefragAlloc(zs->zbt)))
+        defragged++, zs->zbt = newzbt;
+    if ((newroot = activeDefragAlloc(zs->zbt->root))) {
+        defragged++, zs->zbt->root = newroot;
+        if (zs->zbt->height == 1) zbtUpdateLeaf(zs->zbt,newroot);
+    }
     if (dictSize(zs->dict) > server.active_defrag_max_scan_fields)
         defragLater(db, kde);
     else {
@@ -639,7 +669,7 @@ int scanLaterStraemListpacks(robj *ob, unsigned long *cursor, long long endtime,
         if (newdata)
             raxSetData(ri.node, ri.data=newdata), (*defragged)++;
         if (++iterations > 16) {
-            if (ustime() > endtime) {
+            if (defragTimeIsUp(endtime)) {
                 serverAssert(ri.key_len==sizeof(last));
                 memcpy(last,ri.key,ri.key_len);
                 raxStop(&ri);
@@ -778,6 +808,20 @@ long defragKey(redisDb *db, dictEntry *de) {
         uint64_t hash = dictGetHash(db->dict, de->key);
         replaceSateliteDictKeyPtrAndOrDefragDictEntry(db->expires, keysds, newsds, hash, &defragged);
     }
+    if (db->key_sizes) {
+        /* Same as above for the memory accounted to the key. */
+        uint64_t hash = dictGetHash(db->dict, de->key);
+        replaceSateliteDictKeyPtrAndOrDefragDictEntry(db->key_sizes, keysds, newsds, hash, &defragged);
+    }
+    if (dictSize(db->hexpires)) {
+        /* And for the timeouts of the fields of a hash. */
+        uint64_t hash = dictGetHash(db->dict, de->key);
+        replaceSateliteDictKeyPtrAndOrDefragDictEntry(db->hexpires, keysds, newsds, hash, &defragged);
+    }
+
+    /* The value of a key that MIGRATE ASYNC is transferring in chunks is
+     * referenced by the migration cursor, so we can't move it. */
+    if (migrateAsyncKeyIsBusy(db, de->key)) return defragged;
 
     /* Try to defrag robj and / or string value. */
     ob = dictGetVal(de);
@@ -804,20 +848,23 @@ long defragKey(redisDb *db, dictEntry *de) {
             intset *newis, *is = ob->ptr;
             if ((newis = activeDefragAlloc(is)))
                 defragged++, ob->ptr = newis;
+        } else if (ob->encoding == OBJ_ENCODING_LISTPACK) {
+            if ((newzl = activeDefragAlloc(ob->ptr)))
+                defragged++, ob->ptr = newzl;
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (ob->type == OBJ_ZSET) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
-        } else if (ob->encoding == OBJ_ENCODING_SKIPLIST) {
-            defragged += defragZsetSkiplist(db, de);
+        } else if (ob->encoding == OBJ_ENCODING_BTREE) {
+            defragged += defragZsetBtree(db, de);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (ob->type == OBJ_HASH) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
         } else if (ob->encoding == OBJ_ENCODING_HT) {
@@ -954,6 +1001,10 @@ int defragLaterStep(redisDb *db, long long endtime) {
 
         /* each time we enter this function we need to fetch the key from the dict again (if it still exists) */
         dictEntry *de = dictFind(db->dict, current_key);
+        /* MIGRATE ASYNC holds cursors into the value of the key it is
+         * transferring, so drop the key just like defragKey() skips it: the
+         * next scan will queue it again once the transfer is over. */
+        if (de && migrateAsyncKeyIsBusy(db, current_key)) de = NULL;
         key_defragged = server.stat_active_defrag_hits;
         do {
             int quit = 0;
@@ -971,7 +1022,7 @@ int defragLaterStep(redisDb *db, long long endtime) {
             if (quit || (++iterations > 16 ||
                             server.stat_active_defrag_hits - prev_defragged > 512 ||
                             server.stat_active_defrag_scanned - prev_scanned > 64)) {
-                if (quit || ustime() > endtime) {
+                if (quit || defragTimeIsUp(endtime)) {
                     if(key_defragged != server.stat_active_defrag_hits)
                         server.stat_active_defrag_key_hits++;
                     else
@@ -1024,50 +1075,35 @@ void computeDefragCycles() {
     }
 }
 
-/* Perform incremental defragmentation work from the serverCron.
- * This works in a similar way to activeExpireCycle, in the sense that
- * we do incremental work across calls. */
-void activeDefragCycle(void) {
-    static int current_db = -1;
-    static unsigned long cursor = 0;
-    static redisDb *db = NULL;
-    static long long start_scan, start_stat;
+/* State of the incremental scan, shared by the main thread and the defrag
+ * thread, that never run at the same time since they both hold the GIL. */
+static int defrag_current_db = -1;
+static unsigned long defrag_cursor = 0;
+static redisDb *defrag_db = NULL;
+static long long defrag_start_scan, defrag_start_stat;
+
+/* Perform incremental defragmentation work till 'endtime': this is the
+ * actual scan of activeDefragCycle(), also used by the defrag thread. */
+static void activeDefragScan(long long endtime) {
     unsigned int iterations = 0;
     unsigned long long prev_defragged = server.stat_active_defrag_hits;
     unsigned long long prev_scanned = server.stat_active_defrag_scanned;
-    long long start, timelimit, endtime;
     mstime_t latency;
     int quit = 0;
 
-    if (server.aof_child_pid!=-1 || server.rdb_child_pid!=-1)
-        return; /* Defragging memory while there's a fork will just do damage. */
-
-    /* Once a second, check if we the fragmentation justfies starting a scan
-     * or making it more aggressive. */
-    run_with_period(1000) {
-        computeDefragCycles();
-    }
-    if (!server.active_defrag_running)
-        return;
-
-    /* See activeExpireCycle for how timelimit is handled. */
-    start = ustime();
-    timelimit = 1000000*server.active_defrag_running/server.hz/100;
-    if (timelimit <= 0) timelimit = 1;
-    endtime = start + timelimit;
     latencyStartMonitor(latency);
 
     do {
         /* if we're not continuing a scan from the last call or loop, start a new one */
-        if (!cursor) {
+        if (!defrag_cursor) {
             /* finish any leftovers from previous db before moving to the next one */
-            if (db && defragLaterStep(db, endtime)) {
+            if (defrag_db && defragLaterStep(defrag_db, endtime)) {
                 quit = 1; /* time is up, we didn't finish all the work */
                 break; /* this will exit the function and we'll continue on the next cycle */
             }
 
             /* Move on to next database, and stop if we reached the last one. */
-            if (++current_db >= server.dbnum) {
+            if (++defrag_current_db >= server.dbnum) {
                 /* defrag other items not part of the db / keys */
                 defragOtherGlobals();
 
@@ -1076,47 +1112,47 @@ void activeDefragCycle(void) {
                 float frag_pct = getAllocatorFragmentation(&frag_bytes);
                 serverLog(LL_VERBOSE,
                     "Active defrag done in %dms, reallocated=%d, frag=%.0f%%, frag_bytes=%zu",
-                    (int)((now - start_scan)/1000), (int)(server.stat_active_defrag_hits - start_stat), frag_pct, frag_bytes);
+                    (int)((now - defrag_start_scan)/1000), (int)(server.stat_active_defrag_hits - defrag_start_stat), frag_pct, frag_bytes);
 
-                start_scan = now;
-                current_db = -1;
-                cursor = 0;
-                db = NULL;
+                defrag_start_scan = now;
+                defrag_current_db = -1;
+                defrag_cursor = 0;
+                defrag_db = NULL;
                 server.active_defrag_running = 0;
 
                 computeDefragCycles(); /* if another scan is needed, start it right away */
-                if (server.active_defrag_running != 0 && ustime() < endtime)
+                if (server.active_defrag_running != 0 && !defragTimeIsUp(endtime))
                     continue;
                 break;
             }
-            else if (current_db==0) {
+            else if (defrag_current_db==0) {
                 /* Start a scan from the first database. */
-                start_scan = ustime();
-                start_stat = server.stat_active_defrag_hits;
+                defrag_start_scan = ustime();
+                defrag_start_stat = server.stat_active_defrag_hits;
             }
 
-            db = &server.db[current_db];
-            cursor = 0;
+            defrag_db = &server.db[defrag_current_db];
+            defrag_cursor = 0;
         }
 
         do {
             /* before scanning the next bucket, see if we have big keys left from the previous bucket to scan */
-            if (defragLaterStep(db, endtime)) {
+            if (defragLaterStep(defrag_db, endtime)) {
                 quit = 1; /* time is up, we didn't finish all the work */
                 break; /* this will exit the function and we'll continue on the next cycle */
             }
 
-            cursor = dictScan(db->dict, cursor, defragScanCallback, defragDictBucketCallback, db);
+            defrag_cursor = dictScan(defrag_db->dict, defrag_cursor, defragScanCallback, defragDictBucketCallback, defrag_db);
 
             /* Once in 16 scan iterations, 512 pointer reallocations. or 64 keys
              * (if we have a lot of pointers in one hash bucket or rehasing),
              * check if we reached the time limit.
              * But regardless, don't start a new db in this loop, this is because after
              * the last db we call defragOtherGlobals, which must be done in once cycle */
-            if (!cursor || (++iterations > 16 ||
+            if (!defrag_cursor || (++iterations > 16 ||
                             server.stat_active_defrag_hits - prev_defragged > 512 ||
                             server.stat_active_defrag_scanned - prev_scanned > 64)) {
-                if (!cursor || ustime() > endtime) {
+                if (!defrag_cursor || defragTimeIsUp(endtime)) {
                     quit = 1;
                     break;
                 }
@@ -1124,17 +1160,172 @@ void activeDefragCycle(void) {
                 prev_defragged = server.stat_active_defrag_hits;
                 prev_scanned = server.stat_active_defrag_scanned;
             }
-        } while(cursor && !quit);
+        } while(defrag_cursor && !quit);
     } while(!quit);
 
     latencyEndMonitor(latency);
     latencyAddSampleIfNeeded("active-defrag-cycle",latency);
 }
 
+/* ----------------------------------------------------------------------------
+ * Threaded defrag: with active-defrag-threaded enabled, the scan is performed
+ * by a dedicated thread, taking the GIL while the main thread is sleeping in
+ * the event loop, like thread safe module contexts do. So the hint queries
+ * and the reallocations, and the pointer replacements as well, all happen
+ * when the main thread has nothing else to do, in slices of at most
+ * DEFRAG_THREAD_SLICE microseconds: when the main thread wakes up it flags
+ * defrag_main_waiting, and the defrag thread releases the GIL at its next
+ * time check, so commands are delayed at most by a few reallocations.
+ *
+ * Note that the main thread and the defrag thread never touch the dataset
+ * at the same time, this is what makes it safe to move the allocations and
+ * swap the pointers without locking every data structure. If the server is
+ * so busy that the defrag thread did not run in the last cron period, the
+ * main thread still performs the usual cycle, using active-defrag-cycle-min
+ * as CPU effort, so that the defrag always makes progress.
+ * --------------------------------------------------------------------------*/
+
+#define DEFRAG_THREAD_SLICE 1000 /* Microseconds. */
+
+static pthread_t defrag_thread;
+static int defrag_thread_started = 0;
+static long long defrag_thread_last_run = 0; /* ustime() of the last slice. */
+
+/* Return true if the defrag thread needs the main thread to release the GIL
+ * while sleeping. */
+int activeDefragThreadActive(void) {
+    return defrag_thread_started && server.active_defrag_enabled &&
+           server.active_defrag_threaded;
+}
+
+/* Used by the main thread to take the GIL back after sleeping, asking the
+ * defrag thread to stop ASAP. */
+void activeDefragAcquireGIL(void) {
+    atomicSet(defrag_main_waiting,1);
+    moduleAcquireGIL();
+    pthread_mutex_lock(&defrag_main_done_mutex);
+    atomicSet(defrag_main_waiting,0);
+    pthread_cond_signal(&defrag_main_done_cond);
+    pthread_mutex_unlock(&defrag_main_done_mutex);
+}
+
+/* The defrag thread runs with the arena of the main thread, passed as
+ * argument: jemalloc would otherwise assign it an arena of its own, so the
+ * allocations would be moved away from the arena where the main thread
+ * allocates and frees, and the hints would no longer tell what is worth
+ * moving in the arena the allocations end in. */
+void *activeDefragThreadMain(void *arg) {
+    sigset_t sigset;
+    int arena = (int)(intptr_t)arg;
+
+    if (zmalloc_set_thread_arena(arena) != 0)
+        serverLog(LL_WARNING,
+            "Warning: can't set the arena of the defrag thread.");
+
+    /* Block SIGALRM so we are sure that only the main thread will
+     * receive the watchdog signal. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    if (pthread_sigmask(SIG_BLOCK, &sigset, NULL))
+        serverLog(LL_WARNING,
+            "Warning: can't mask SIGALRM in the defrag thread: %s",
+            strerror(errno));
+
+    while(1) {
+        int main_waiting, work, hz;
+
+        /* Don't take the GIL again if the main thread is waiting for it. */
+        pthread_mutex_lock(&defrag_main_done_mutex);
+        while(1) {
+            atomicGet(defrag_main_waiting,main_waiting);
+            if (!main_waiting) break;
+            pthread_cond_wait(&defrag_main_done_cond,&defrag_main_done_mutex);
+        }
+        pthread_mutex_unlock(&defrag_main_done_mutex);
+
+        moduleAcquireGIL();
+        work = server.active_defrag_enabled && server.active_defrag_threaded &&
+               server.active_defrag_running &&
+               server.aof_child_pid == -1 && server.rdb_child_pid == -1;
+        if (work) {
+            defrag_thread_last_run = ustime();
+            activeDefragScan(defrag_thread_last_run+DEFRAG_THREAD_SLICE);
+        }
+        hz = server.hz;
+        moduleReleaseGIL();
+
+        /* Nothing to do: check again at the next cron period. */
+        if (!work) usleep(1000000/hz);
+    }
+    return NULL;
+}
+
+/* Start the defrag thread the first time it is needed. */
+static void activeDefragThreadStart(void) {
+    int arena;
+
+    if (defrag_thread_started) return;
+    arena = zmalloc_get_thread_arena();
+    if (arena == -1 ||
+        pthread_create(&defrag_thread,NULL,activeDefragThreadMain,
+                       (void*)(intptr_t)arena) != 0)
+    {
+        serverLog(LL_WARNING,
+            "Can't create the defrag thread, defragging from the main thread.");
+        server.active_defrag_threaded = 0;
+        return;
+    }
+    defrag_thread_started = 1;
+}
+
+/* Perform incremental defragmentation work from the serverCron.
+ * This works in a similar way to activeExpireCycle, in the sense that
+ * we do incremental work across calls. */
+void activeDefragCycle(void) {
+    long long start, timelimit;
+    int cpu_pct;
+
+    if (server.aof_child_pid!=-1 || server.rdb_child_pid!=-1)
+        return; /* Defragging memory while there's a fork will just do damage. */
+
+    /* Once a second, check if we the fragmentation justfies starting a scan
+     * or making it more aggressive. */
+    run_with_period(1000) {
+        computeDefragCycles();
+    }
+    if (!server.active_defrag_running)
+        return;
+
+    /* With the threaded defrag the main thread only helps if the defrag
+     * thread was not able to run recently, see above. */
+    start = ustime();
+    cpu_pct = server.active_defrag_running;
+    if (server.active_defrag_threaded) {
+        activeDefragThreadStart();
+        if (defrag_thread_started) {
+            if (start - defrag_thread_last_run < 1000000/server.hz) return;
+            cpu_pct = server.active_defrag_cycle_min;
+        }
+    }
+
+    /* See activeExpireCycle for how timelimit is handled. */
+    timelimit = 1000000*cpu_pct/server.hz/100;
+    if (timelimit <= 0) timelimit = 1;
+    activeDefragScan(start + timelimit);
+}
+
 #else /* HAVE_DEFRAG */
 
 void activeDefragCycle(void) {
     /* Not implemented yet. */
 }
 
+int activeDefragThreadActive(void) {
+    return 0;
+}
+
+void activeDefragAcquireGIL(void) {
+    moduleAcquireGIL();
+}
+
 #endif
@@ -48,17 +48,21 @@
  * instead of the idle time, so that we still evict by larger value (larger
  * inverse frequency means to evict keys with the least frequent accesses).
  *
+ * The number of entries is set by the maxmemory-eviction-pool-size option.
+ *
  * Empty entries have the key pointer set to NULL. */
-#define EVPOOL_SIZE 16
 #define EVPOOL_CACHED_SDS_SIZE 255
 struct evictionPoolEntry {
     unsigned long long idle;    /* Object idle time (inverse frequency for LFU) */
     sds key;                    /* Key name. */
     sds cached;                 /* Cached SDS object for key name. */
     int dbid;                   /* Key DB number. */
+    unsigned lru:LRU_BITS;      /* Object LRU/LFU field when the idle score
+                                   was computed. */
 };
 
 static struct evictionPoolEntry *EvictionPoolLRU;
+static int EvictionPoolSize;
 
 /* ----------------------------------------------------------------------------
  * Implementation of eviction, aging and LRU
@@ -120,7 +124,7 @@ unsigned long long estimateObjectIdleTime(robj *o) {
  * Redis uses an approximation of the LRU algorithm that runs in constant
  * memory. Every time there is a key to expire, we sample N keys (with
  * N very small, usually in around 5) to populate a pool of best keys to
- * evict of M keys (the pool size is defined by EVPOOL_SIZE).
+ * evict of M keys (the pool size is set by maxmemory-eviction-pool-size).
  *
  * The N keys sampled are added in the pool of good keys to expire (the one
  * with an old access time) if they are better than one of the current keys
@@ -138,16 +142,59 @@ unsigned long long estimateObjectIdleTime(robj *o) {
 /* Create a new eviction pool. */
 void evictionPoolAlloc(void) {
     struct evictionPoolEntry *ep;
-    int j;
+    int j, size = server.maxmemory_eviction_pool_size;
 
-    ep = zmalloc(sizeof(*ep)*EVPOOL_SIZE);
-    for (j = 0; j < EVPOOL_SIZE; j++) {
+    ep = zmalloc(sizeof(*ep)*size);
+    for (j = 0; j < size; j++) {
         ep[j].idle = 0;
         ep[j].key = NULL;
         ep[j].cached = sdsnewlen(NULL,EVPOOL_CACHED_SDS_SIZE);
         ep[j].dbid = 0;
+        ep[j].lru = 0;
     }
     EvictionPoolLRU = ep;
+    EvictionPoolSize = size;
+}
+
+/* Release the eviction pool and allocate it again with the size set by
+ * maxmemory-eviction-pool-size. The candidates found so far are lost, the
+ * pool will be populated again at the next eviction. */
+void evictionPoolResize(void) {
+    struct evictionPoolEntry *ep = EvictionPoolLRU;
+    int j;
+
+    if (server.maxmemory_eviction_pool_size == EvictionPoolSize) return;
+    for (j = 0; j < EvictionPoolSize; j++) {
+        if (ep[j].key != ep[j].cached) sdsfree(ep[j].key);
+        sdsfree(ep[j].cached);
+    }
+    zfree(ep);
+    evictionPoolAlloc();
+}
+
+/* Remove the entry at position 'k' from the pool, shifting the entries on
+ * its right, so that the populated entries are always on the left. */
+static void evictionPoolRemove(struct evictionPoolEntry *pool, int k) {
+    sds cached = pool[k].cached;
+
+    if (pool[k].key != pool[k].cached) sdsfree(pool[k].key);
+    memmove(pool+k,pool+k+1,sizeof(pool[0])*(EvictionPoolSize-k-1));
+    k = EvictionPoolSize-1;
+    pool[k].cached = cached;
+    pool[k].key = NULL;
+    pool[k].idle = 0;
+}
+
+/* Return true if the key 'key' of the DB 'dbid' is already in the pool. */
+static int evictionPoolContains(struct evictionPoolEntry *pool, int dbid, sds key) {
+    size_t klen = sdslen(key);
+    int k;
+
+    for (k = 0; k < EvictionPoolSize && pool[k].key; k++) {
+        if (pool[k].dbid == dbid && sdslen(pool[k].key) == klen &&
+            memcmp(pool[k].key,key,klen) == 0) return 1;
+    }
+    return 0;
 }
 
 /* This is an helper function for freeMemoryIfNeeded(), it is used in order
@@ -157,21 +204,27 @@ void evictionPoolAlloc(void) {
  *
  * We insert keys on place in ascending order, so keys with the smaller
  * idle time are on the left, and keys with the higher idle time on the
- * right. */
+ * right.
+ *
+ * 'numsamples' is the number of keys to sample from this DB: the caller
+ * distributes maxmemory-samples across the DBs proportionally to their
+ * size. Sampled keys already in the pool are skipped, so that their
+ * cached idle score is not computed again. */
 
-void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evictionPoolEntry *pool) {
+void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evictionPoolEntry *pool, int numsamples) {
     int j, k, count;
-    dictEntry *samples[server.maxmemory_samples];
+    dictEntry *samples[numsamples];
 
-    count = dictGetSomeKeys(sampledict,samples,server.maxmemory_samples);
+    count = dictGetSomeKeys(sampledict,samples,numsamples);
     for (j = 0; j < count; j++) {
         unsigned long long idle;
         sds key;
-        robj *o;
+        robj *o = NULL;
         dictEntry *de;
 
         de = samples[j];
         key = dictGetKey(de);
+        if (evictionPoolContains(pool,dbid,key)) continue;
 
         /* If the dictionary we are sampling from is not the main
          * dictionary (but the expires one) we need to lookup the key
@@ -206,26 +259,26 @@ void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evic
          * First, find the first empty bucket or the first populated
          * bucket that has an idle time smaller than our idle time. */
         k = 0;
-        while (k < EVPOOL_SIZE &&
+        while (k < EvictionPoolSize &&
                pool[k].key &&
                pool[k].idle < idle) k++;
-        if (k == 0 && pool[EVPOOL_SIZE-1].key != NULL) {
+        if (k == 0 && pool[EvictionPoolSize-1].key != NULL) {
             /* Can't insert if the element is < the worst element we have
              * and there are no empty buckets. */
             continue;
-        } else if (k < EVPOOL_SIZE && pool[k].key == NULL) {
+        } else if (k < EvictionPoolSize && pool[k].key == NULL) {
             /* Inserting into empty position. No setup needed before insert. */
         } else {
             /* Inserting in the middle. Now k points to the first element
              * greater than the element to insert.  */
-            if (pool[EVPOOL_SIZE-1].key == NULL) {
+            if (pool[EvictionPoolSize-1].key == NULL) {
                 /* Free space on the right? Insert at k shifting
                  * all the elements from k to end to the right. */
 
                 /* Save SDS before overwriting. */
-                sds cached = pool[EVPOOL_SIZE-1].cached;
+                sds cached = pool[EvictionPoolSize-1].cached;
                 memmove(pool+k+1,pool+k,
-                    sizeof(pool[0])*(EVPOOL_SIZE-k-1));
+                    sizeof(pool[0])*(EvictionPoolSize-k-1));
                 pool[k].cached = cached;
             } else {
                 /* No free space on right? Insert at k-1 */
@@ -253,6 +306,7 @@ void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evic
         }
         pool[k].idle = idle;
         pool[k].dbid = dbid;
+        pool[k].lru = o ? o->lru : 0;
     }
 }
 
@@ -341,6 +395,106 @@ unsigned long LFUDecrAndReturn(robj *o) {
     return counter;
 }
 
+/* ----------------------------------------------------------------------------
+ * TinyLFU admission for the allkeys-tinylfu policy
+ * --------------------------------------------------------------------------*/
+
+/* With allkeys-tinylfu the eviction works like allkeys-lfu, but the access
+ * frequency of every key, including keys that are not (or no longer) in
+ * the dataset, is also recorded into a count-min sketch. When a new key is
+ * added we compare its estimated frequency with the one of the last key
+ * we evicted: if the new key is not more popular than the victim, it is
+ * admitted "on probation" setting its LFU counter to zero instead of
+ * LFU_INIT_VAL, so that it is the first to go at the next eviction unless
+ * it gets accessed again. This way a scan writing many one-off keys (for
+ * instance a batch backfill) does not push the hot keys out of memory.
+ *
+ * The sketch uses TINYLFU_DEPTH rows of TINYLFU_WIDTH 8 bit saturating
+ * counters. Every TINYLFU_WIDTH*10 recorded accesses all the counters are
+ * halved, so that the history fades over time like in TinyLFU. */
+
+#define TINYLFU_DEPTH 4
+#define TINYLFU_WIDTH (1<<15)
+#define TINYLFU_RESET_SAMPLES (TINYLFU_WIDTH*10)
+
+static uint8_t *TinyLFUSketch = NULL;
+static unsigned long TinyLFUSamples = 0;  /* Accesses since the last reset. */
+static unsigned long TinyLFUVictimFreq = 0; /* Frequency of the last victim. */
+
+/* Allocate the sketch, if not already allocated. */
+void tinylfuInit(void) {
+    if (TinyLFUSketch) return;
+    TinyLFUSketch = zcalloc(TINYLFU_DEPTH*TINYLFU_WIDTH);
+    TinyLFUSamples = 0;
+    TinyLFUVictimFreq = 0;
+}
+
+/* Release the sketch memory when switching to another policy. */
+void tinylfuRelease(void) {
+    zfree(TinyLFUSketch);
+    TinyLFUSketch = NULL;
+}
+
+/* Compute the counter index of 'key' for each row of the sketch, using
+ * double hashing on the two halves of the 64 bit key hash. */
+static void tinylfuIndexes(sds key, unsigned long *idx) {
+    uint64_t hash = dictGenHashFunction(key,sdslen(key));
+    uint32_t h1 = hash & 0xffffffff, h2 = hash >> 32;
+    int j;
+
+    for (j = 0; j < TINYLFU_DEPTH; j++)
+        idx[j] = j*TINYLFU_WIDTH + ((h1 + j*h2) & (TINYLFU_WIDTH-1));
+}
+
+/* Return the estimated number of accesses of 'key', that is the minimum
+ * of its counters. */
+unsigned long tinylfuEstimate(sds key) {
+    unsigned long idx[TINYLFU_DEPTH], min = 255;
+    int j;
+
+    if (!TinyLFUSketch) return 0;
+    tinylfuIndexes(key,idx);
+    for (j = 0; j < TINYLFU_DEPTH; j++)
+        if (TinyLFUSketch[idx[j]] < min) min = TinyLFUSketch[idx[j]];
+    return min;
+}
+
+/* Record an access to 'key' into the sketch. Only the counters equal to
+ * the current minimum are incremented (conservative update), which reduces
+ * the overestimation caused by collisions. */
+void tinylfuRecord(sds key) {
+    unsigned long idx[TINYLFU_DEPTH], min = 255;
+    int j;
+
+    if (!TinyLFUSketch) tinylfuInit();
+    tinylfuIndexes(key,idx);
+    for (j = 0; j < TINYLFU_DEPTH; j++)
+        if (TinyLFUSketch[idx[j]] < min) min = TinyLFUSketch[idx[j]];
+    if (min < 255) {
+        for (j = 0; j < TINYLFU_DEPTH; j++)
+            if (TinyLFUSketch[idx[j]] == min) TinyLFUSketch[idx[j]]++;
+    }
+
+    if (++TinyLFUSamples >= TINYLFU_RESET_SAMPLES) {
+        for (j = 0; j < TINYLFU_DEPTH*TINYLFU_WIDTH; j++)
+            TinyLFUSketch[j] >>= 1;
+        TinyLFUVictimFreq >>= 1;
+        TinyLFUSamples = 0;
+    }
+}
+
+/* Called by dbAdd() when the allkeys-tinylfu policy is in use: record the
+ * access to the new key and decide if the value is admitted with the usual
+ * LFU counter, or on probation with a counter of zero. */
+void tinylfuAdmit(sds key, robj *val) {
+    tinylfuRecord(key);
+    if (val->refcount == OBJ_SHARED_REFCOUNT) return;
+    if (tinylfuEstimate(key) <= TinyLFUVictimFreq) {
+        val->lru = LFUGetTimeInMinutes()<<8;
+        server.stat_tinylfu_rejected++;
+    }
+}
+
 /* ----------------------------------------------------------------------------
  * The external API for eviction: freeMemroyIfNeeded() is called by the
  * server when there is data to add in order to make space if needed.
@@ -348,7 +502,8 @@ unsigned long LFUDecrAndReturn(robj *o) {
 
 /* We don't want to count AOF buffers and slaves output buffers as
  * used memory: the eviction should use mostly data size. This function
- * returns the sum of AOF and slaves buffer. */
+ * returns the sum of AOF and slaves buffer, plus the memory of the objects
+ * queued for lazy freeing, that is going to be released soon anyway. */
 size_t freeMemoryGetNotCountedMemory(void) {
     size_t overhead = 0;
     int slaves = listLength(server.slaves);
@@ -366,6 +521,7 @@ size_t freeMemoryGetNotCountedMemory(void) {
     if (server.aof_state != AOF_OFF) {
         overhead += sdsalloc(server.aof_buf)+aofRewriteBufferSize();
     }
+    overhead += lazyfreeGetPendingMemory();
     return overhead;
 }
 
@@ -434,6 +590,176 @@ int getMaxmemoryState(size_t *total, size_t *logical, size_t *tofree, float *lev
     return C_ERR;
 }
 
+/* Select the best key to evict according to the current maxmemory policy
+ * and delete it, propagating the deletion to AOF and replicas. The amount
+ * of memory released by the deletion alone is stored into '*freed'.
+ *
+ * 'cycle_latency' is the latency monitor of the caller eviction cycle, so
+ * that the latency of the single deletion is not accounted twice.
+ *
+ * If 'dbid' is not -1 only keys of the specified DB are considered, this
+ * is used to enforce the memory quotas of DBs.
+ *
+ * Returns 1 if a key was evicted, or 0 if there are no keys to evict. */
+static int evictOneKey(int dbid, long long *freed, mstime_t *cycle_latency) {
+    int j, k, i;
+    static unsigned int next_db = 0;
+    sds bestkey = NULL;
+    int bestdbid;
+    redisDb *db;
+    dict *dict;
+    dictEntry *de;
+    mstime_t eviction_latency;
+    long long delta;
+
+    if (server.maxmemory_policy & (MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_LFU) ||
+        server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL)
+    {
+        struct evictionPoolEntry *pool = EvictionPoolLRU;
+
+        while(bestkey == NULL) {
+            unsigned long total_keys = 0, keys;
+
+            /* We don't want to make local-db choices when expiring keys,
+             * so to start populate the eviction pool sampling keys from
+             * every DB. The maxmemory-samples keys are distributed across
+             * the DBs proportionally to their size, so that every key has
+             * the same chance to be sampled regardless of its DB. We use
+             * systematic sampling with a random offset: the samples of a
+             * DB are the integers falling in its slice of the cumulative
+             * [offset, offset+maxmemory-samples) interval. */
+            for (i = 0; i < server.dbnum; i++) {
+                if (dbid != -1 && i != dbid) continue;
+                db = server.db+i;
+                dict = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
+                        db->dict : db->expires;
+                total_keys += dictSize(dict);
+            }
+            if (!total_keys) break; /* No keys to evict. */
+
+            double offset = (double)rand()/((double)RAND_MAX+1);
+            unsigned long cumulative = 0;
+            long prev = 0;
+            for (i = 0; i < server.dbnum; i++) {
+                long upto;
+
+                if (dbid != -1 && i != dbid) continue;
+                db = server.db+i;
+                dict = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
+                        db->dict : db->expires;
+                if ((keys = dictSize(dict)) == 0) continue;
+                cumulative += keys;
+                upto = (long)(offset + (double)server.maxmemory_samples*
+                                       cumulative/total_keys);
+                if (upto > prev)
+                    evictionPoolPopulate(i, dict, db->dict, pool, upto-prev);
+                prev = upto;
+            }
+
+            /* Go backward from best to worst element to evict. */
+            for (k = EvictionPoolSize-1; k >= 0; k--) {
+                if (pool[k].key == NULL) continue;
+                if (dbid != -1 && pool[k].dbid != dbid) continue;
+                bestdbid = pool[k].dbid;
+
+                if (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) {
+                    de = dictFind(server.db[pool[k].dbid].dict,
+                        pool[k].key);
+                } else {
+                    de = dictFind(server.db[pool[k].dbid].expires,
+                        pool[k].key);
+                }
+
+                /* If the key was accessed after it was sampled, its cached
+                 * idle score is stale: treat it as a ghost, it will be
+                 * sampled again with its updated score. */
+                if (de && server.maxmemory_policy != MAXMEMORY_VOLATILE_TTL) {
+                    robj *o = dictGetVal(
+                        (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
+                        de : dictFind(server.db[pool[k].dbid].dict,
+                                      pool[k].key));
+                    if (o->lru != pool[k].lru) de = NULL;
+                }
+
+                /* Remove the entry from the pool. */
+                evictionPoolRemove(pool,k);
+
+                /* If the key exists, is our pick. Otherwise it is
+                 * a ghost and we need to try the next element. */
+                if (de) {
+                    bestkey = dictGetKey(de);
+                    break;
+                } else {
+                    /* Ghost... Iterate again. */
+                }
+            }
+        }
+    }
+
+    /* volatile-random and allkeys-random policy */
+    else if (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM ||
+             server.maxmemory_policy == MAXMEMORY_VOLATILE_RANDOM)
+    {
+        /* When evicting a random key, we try to evict a key for
+         * each DB, so we use the static 'next_db' variable to
+         * incrementally visit all DBs. */
+        for (i = 0; i < server.dbnum; i++) {
+            j = (dbid != -1) ? dbid : (int)((++next_db) % server.dbnum);
+            db = server.db+j;
+            dict = (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM) ?
+                    db->dict : db->expires;
+            if (dictSize(dict) != 0) {
+                de = dictGetRandomKey(dict);
+                bestkey = dictGetKey(de);
+                bestdbid = j;
+                break;
+            }
+        }
+    }
+
+    if (!bestkey) return 0;
+
+    /* Remember how popular was the victim, new keys will have to beat it
+     * in order to be admitted by TinyLFU. */
+    if (server.maxmemory_policy == MAXMEMORY_ALLKEYS_TINYLFU)
+        TinyLFUVictimFreq = tinylfuEstimate(bestkey);
+
+    /* Finally remove the selected key. */
+    db = server.db+bestdbid;
+    robj *keyobj = createStringObject(bestkey,sdslen(bestkey));
+    propagateExpire(db,keyobj,server.lazyfree_lazy_eviction);
+    /* We compute the amount of memory freed by db*Delete() alone.
+     * It is possible that actually the memory needed to propagate
+     * the DEL in AOF and replication link is greater than the one
+     * we are freeing removing the key, but we can't account for
+     * that otherwise we would never exit the loop.
+     *
+     * AOF and Output buffer memory will be freed eventually so
+     * we only care about memory used by the key space.
+     *
+     * With lazyfree-lazy-eviction the value is queued for lazy freeing,
+     * so we also count the growth of the memory pending to be freed, that
+     * is not counted by freeMemoryIfNeeded() either. */
+    delta = (long long) zmalloc_used_memory();
+    delta -= (long long) lazyfreeGetPendingMemory();
+    latencyStartMonitor(eviction_latency);
+    if (server.lazyfree_lazy_eviction)
+        dbAsyncDelete(db,keyobj);
+    else
+        dbSyncDelete(db,keyobj);
+    latencyEndMonitor(eviction_latency);
+    latencyAddSampleIfNeeded("eviction-del",eviction_latency);
+    latencyRemoveNestedEvent(*cycle_latency,eviction_latency);
+    delta -= (long long) zmalloc_used_memory();
+    delta += (long long) lazyfreeGetPendingMemory();
+    *freed = delta;
+    server.stat_evictedkeys++;
+    notifyKeyspaceEvent(NOTIFY_EVICTED, "evicted",
+        keyobj, db->id);
+    decrRefCount(keyobj);
+    return 1;
+}
+
 /* This function is periodically called to see if there is memory to free
  * according to the current "maxmemory" settings. In case we are over the
  * memory limit, the function will try to free some memory to return back
@@ -449,9 +775,9 @@ int freeMemoryIfNeeded(void) {
     if (server.masterhost && server.repl_slave_ignore_maxmemory) return C_OK;
 
     size_t mem_reported, mem_tofree, mem_freed;
-    mstime_t latency, eviction_latency;
+    mstime_t latency;
     long long delta;
-    int slaves = listLength(server.slaves);
+    int slaves = listLength(server.slaves), keys_freed = 0;
 
     /* When clients are paused the dataset should be static not just from the
      * POV of clients not being able to write, but also from the POV of
@@ -467,144 +793,33 @@ int freeMemoryIfNeeded(void) {
 
     latencyStartMonitor(latency);
     while (mem_freed < mem_tofree) {
-        int j, k, i, keys_freed = 0;
-        static unsigned int next_db = 0;
-        sds bestkey = NULL;
-        int bestdbid;
-        redisDb *db;
-        dict *dict;
-        dictEntry *de;
-
-        if (server.maxmemory_policy & (MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_LFU) ||
-            server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL)
-        {
-            struct evictionPoolEntry *pool = EvictionPoolLRU;
-
-            while(bestkey == NULL) {
-                unsigned long total_keys = 0, keys;
-
-                /* We don't want to make local-db choices when expiring keys,
-                 * so to start populate the eviction pool sampling keys from
-                 * every DB. */
-                for (i = 0; i < server.dbnum; i++) {
-                    db = server.db+i;
-                    dict = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
-                            db->dict : db->expires;
-                    if ((keys = dictSize(dict)) != 0) {
-                        evictionPoolPopulate(i, dict, db->dict, pool);
-                        total_keys += keys;
-                    }
-                }
-                if (!total_keys) break; /* No keys to evict. */
-
-                /* Go backward from best to worst element to evict. */
-                for (k = EVPOOL_SIZE-1; k >= 0; k--) {
-                    if (pool[k].key == NULL) continue;
-                    bestdbid = pool[k].dbid;
-
-                    if (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) {
-                        de = dictFind(server.db[pool[k].dbid].dict,
-                            pool[k].key);
-                    } else {
-                        de = dictFind(server.db[pool[k].dbid].expires,
-                            pool[k].key);
-                    }
-
-                    /* Remove the entry from the pool. */
-                    if (pool[k].key != pool[k].cached)
-                        sdsfree(pool[k].key);
-                    pool[k].key = NULL;
-                    pool[k].idle = 0;
-
-                    /* If the key exists, is our pick. Otherwise it is
-                     * a ghost and we need to try the next element. */
-                    if (de) {
-                        bestkey = dictGetKey(de);
-                        break;
-                    } else {
-                        /* Ghost... Iterate again. */
-                    }
-                }
-            }
-        }
-
-        /* volatile-random and allkeys-random policy */
-        else if (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM ||
-                 server.maxmemory_policy == MAXMEMORY_VOLATILE_RANDOM)
-        {
-            /* When evicting a random key, we try to evict a key for
-             * each DB, so we use the static 'next_db' variable to
-             * incrementally visit all DBs. */
-            for (i = 0; i < server.dbnum; i++) {
-                j = (++next_db) % server.dbnum;
-                db = server.db+j;
-                dict = (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM) ?
-                        db->dict : db->expires;
-                if (dictSize(dict) != 0) {
-                    de = dictGetRandomKey(dict);
-                    bestkey = dictGetKey(de);
-                    bestdbid = j;
-                    break;
-                }
-            }
-        }
-
-        /* Finally remove the selected key. */
-        if (bestkey) {
-            db = server.db+bestdbid;
-            robj *keyobj = createStringObject(bestkey,sdslen(bestkey));
-            propagateExpire(db,keyobj,server.lazyfree_lazy_eviction);
-            /* We compute the amount of memory freed by db*Delete() alone.
-             * It is possible that actually the memory needed to propagate
-             * the DEL in AOF and replication link is greater than the one
-             * we are freeing removing the key, but we can't account for
-             * that otherwise we would never exit the loop.
-             *
-             * AOF and Output buffer memory will be freed eventually so
-             * we only care about memory used by the key space. */
-            delta = (long long) zmalloc_used_memory();
-            latencyStartMonitor(eviction_latency);
-            if (server.lazyfree_lazy_eviction)
-                dbAsyncDelete(db,keyobj);
-            else
-                dbSyncDelete(db,keyobj);
-            latencyEndMonitor(eviction_latency);
-            latencyAddSampleIfNeeded("eviction-del",eviction_latency);
-            latencyRemoveNestedEvent(latency,eviction_latency);
-            delta -= (long long) zmalloc_used_memory();
-            mem_freed += delta;
-            server.stat_evictedkeys++;
-            notifyKeyspaceEvent(NOTIFY_EVICTED, "evicted",
-                keyobj, db->id);
-            decrRefCount(keyobj);
-            keys_freed++;
-
-            /* When the memory to free starts to be big enough, we may
-             * start spending so much time here that is impossible to
-             * deliver data to the slaves fast enough, so we force the
-             * transmission here inside the loop. */
-            if (slaves) flushSlavesOutputBuffers();
-
-            /* Normally our stop condition is the ability to release
-             * a fixed, pre-computed amount of memory. However when we
-             * are deleting objects in another thread, it's better to
-             * check, from time to time, if we already reached our target
-             * memory, since the "mem_freed" amount is computed only
-             * across the dbAsyncDelete() call, while the thread can
-             * release the memory all the time. */
-            if (server.lazyfree_lazy_eviction && !(keys_freed % 16)) {
-                if (getMaxmemoryState(NULL,NULL,NULL,NULL) == C_OK) {
-                    /* Let's satisfy our stop condition. */
-                    mem_freed = mem_tofree;
-                }
-            }
-        }
-
-        if (!keys_freed) {
+        if (!evictOneKey(-1,&delta,&latency)) {
             latencyEndMonitor(latency);
             latencyAddSampleIfNeeded("eviction-cycle",latency);
             goto cant_free; /* nothing to free... */
         }
+        mem_freed += delta;
+        keys_freed++;
+
+        /* When the memory to free starts to be big enough, we may
+         * start spending so much time here that is impossible to
+         * deliver data to the slaves fast enough, so we force the
+         * transmission here inside the loop. */
+        if (slaves) flushSlavesOutputBuffers();
+
+        /* Normally our stop condition is the ability to release
+         * a fixed, pre-computed amount of memory. However when we
+         * are deleting objects in another thread, it's better to
+         * check, from time to time, if we already reached our target
+         * memory, since the "mem_freed" amount is computed only
+         * across the dbAsyncDelete() call, while the thread can
+         * release the memory all the time. */
+        if (server.lazyfree_lazy_eviction && !(keys_freed % 16)) {
+            if (getMaxmemoryState(NULL,NULL,NULL,NULL) == C_OK) {
+                /* Let's satisfy our stop condition. */
+                mem_freed = mem_tofree;
+            }
+        }
     }
     latencyEndMonitor(latency);
     latencyAddSampleIfNeeded("eviction-cycle",latency);
@@ -613,7 +828,9 @@ int freeMemoryIfNeeded(void) {
 cant_free:
     /* We are here if we are not able to reclaim memory. There is only one
      * last thing we can try: check if the lazyfree thread has jobs in queue
-     * and wait... */
+     * and wait... The objects still in the current batch must be sent to
+     * the lazyfree threads first, or we would wait for nothing. */
+    lazyfreeFlushBatch();
     while(bioPendingJobsOfType(BIO_LAZY_FREE)) {
         if (((mem_reported - zmalloc_used_memory()) + mem_freed) >= mem_tofree)
             break;
@@ -633,3 +850,152 @@ int freeMemoryIfNeededAndSafe(void) {
     if (server.lua_timedout || server.loading) return C_OK;
     return freeMemoryIfNeeded();
 }
+
+/* Enforce the memory quota of 'db' (db-maxmemory) evicting keys of this DB
+ * only, according to the maxmemory policy, until the memory accounted to
+ * the DB is under the quota. Returns C_OK if the DB has no quota or it is
+ * under its quota, otherwise C_ERR if it was not possible to free enough
+ * memory. */
+int freeDbMemoryIfNeeded(redisDb *db) {
+    unsigned long long quota = dbGetMaxmemory(db->id);
+    mstime_t latency;
+    int slaves = listLength(server.slaves), keys_freed = 0;
+
+    if (!quota || db->key_sizes == NULL || db->used_memory <= quota)
+        return C_OK;
+    if (server.masterhost && server.repl_slave_ignore_maxmemory) return C_OK;
+    if (clientsArePaused()) return C_OK;
+    if (server.maxmemory_policy == MAXMEMORY_NO_EVICTION) return C_ERR;
+
+    latencyStartMonitor(latency);
+    while (db->used_memory > quota) {
+        long long delta;
+
+        if (!evictOneKey(db->id,&delta,&latency)) break;
+        if (slaves && !(++keys_freed % 16)) flushSlavesOutputBuffers();
+    }
+    latencyEndMonitor(latency);
+    latencyAddSampleIfNeeded("eviction-cycle",latency);
+    return db->used_memory > quota ? C_ERR : C_OK;
+}
+
+/* Like freeMemoryIfNeededAndSafe() but for the quota of 'db'. This is used
+ * by the commands adding data to a DB other than the one processCommand()
+ * checked: MOVE, and the commands following a SELECT in scripts and
+ * transactions. */
+int freeDbMemoryIfNeededAndSafe(redisDb *db) {
+    if (server.lua_timedout || server.loading) return C_OK;
+    return freeDbMemoryIfNeeded(db);
+}
+
+/* ----------------------------------------------------------------------------
+ * Proactive eviction: when maxmemory-low-watermark is set, keys are evicted
+ * incrementally from serverCron() and beforeSleep() as soon as the memory
+ * used goes over the low watermark, so that the instance normally stays
+ * under maxmemory and freeMemoryIfNeeded() can return ASAP in the command
+ * path, where evicting adds latency exactly when load is highest.
+ * --------------------------------------------------------------------------*/
+
+/* Return the memory limit proactive eviction tries to stay under, that is
+ * the low watermark when configured, otherwise maxmemory itself. */
+static size_t evictionTargetMemory(void) {
+    if (!server.maxmemory_low_watermark) return server.maxmemory;
+    return (size_t)(server.maxmemory/100*server.maxmemory_low_watermark);
+}
+
+/* Return the memory counted for eviction in excess of the eviction target
+ * (see evictionTargetMemory()), or 0 if we are under the target. */
+static size_t evictionExcessMemory(void) {
+    size_t target = evictionTargetMemory();
+    size_t used = zmalloc_used_memory();
+
+    if (used <= target) return 0;
+    size_t overhead = freeMemoryGetNotCountedMemory();
+    used = (used > overhead) ? used-overhead : 0;
+    return (used > target) ? used-target : 0;
+}
+
+/* Report how far behind eviction is: the memory used in excess of the
+ * eviction target, and for how many milliseconds we have been over it. */
+void getEvictionLag(size_t *bytes, mstime_t *ms) {
+    *bytes = server.maxmemory ? evictionExcessMemory() : 0;
+    *ms = server.stat_eviction_lag_start ?
+          mstime()-server.stat_eviction_lag_start : 0;
+}
+
+/* Evict keys until the memory used goes under the low watermark, or the
+ * time limit is reached. Like activeExpireCycle() there are two kind of
+ * cycles: EVICTION_CYCLE_SLOW called from serverCron() using a percentage
+ * of the cron period, and EVICTION_CYCLE_FAST called from beforeSleep() for
+ * at most EVICTION_CYCLE_FAST_DURATION microseconds, only when the previous
+ * cycle was not able to reach the low watermark in its time limit. */
+void proactiveEvictionCycle(int type) {
+    static int timelimit_exit = 0;      /* Time limit hit in previous call? */
+    static long long last_fast_cycle = 0; /* When last fast cycle ran. */
+    long long start, timelimit;
+    mstime_t latency;
+    size_t excess;
+    int slaves = listLength(server.slaves), keys_freed = 0;
+
+    if (!server.maxmemory ||
+        (server.masterhost && server.repl_slave_ignore_maxmemory) ||
+        server.lua_timedout || server.loading || clientsArePaused())
+    {
+        server.stat_eviction_lag_start = 0;
+        timelimit_exit = 0;
+        return;
+    }
+
+    /* Track since when we are over the eviction target, that's our
+     * eviction lag. */
+    excess = evictionExcessMemory();
+    if (excess == 0) {
+        server.stat_eviction_lag_start = 0;
+        timelimit_exit = 0;
+        return;
+    }
+    if (server.stat_eviction_lag_start == 0)
+        server.stat_eviction_lag_start = mstime();
+
+    if (!server.maxmemory_low_watermark ||
+        server.maxmemory_policy == MAXMEMORY_NO_EVICTION) return;
+
+    start = ustime();
+    if (type == EVICTION_CYCLE_FAST) {
+        if (!timelimit_exit) return;
+        if (start < last_fast_cycle + EVICTION_CYCLE_FAST_DURATION*2) return;
+        last_fast_cycle = start;
+        timelimit = EVICTION_CYCLE_FAST_DURATION;
+    } else {
+        timelimit = 1000000*EVICTION_CYCLE_SLOW_TIME_PERC/server.hz/100;
+        if (timelimit <= 0) timelimit = 1;
+    }
+    timelimit_exit = 0;
+
+    latencyStartMonitor(latency);
+    while(1) {
+        long long delta;
+
+        if (!evictOneKey(-1,&delta,&latency)) break;
+        server.stat_evictedkeys_proactive++;
+        keys_freed++;
+
+        /* Check the time limit and the memory state once every 16 keys:
+         * with lazyfree-lazy-eviction the memory is released by the
+         * background thread, so we can't simply sum the deltas. */
+        if (!(keys_freed % 16)) {
+            if (slaves) flushSlavesOutputBuffers();
+            if (evictionExcessMemory() == 0) break;
+            if (ustime()-start > timelimit) {
+                timelimit_exit = 1;
+                break;
+            }
+        } else if (!server.lazyfree_lazy_eviction && delta > 0) {
+            excess = (excess > (size_t)delta) ? excess-delta : 0;
+            if (excess == 0) break;
+        }
+    }
+    latencyEndMonitor(latency);
+    latencyAddSampleIfNeeded("eviction-cycle",latency);
+    if (evictionExcessMemory() == 0) server.stat_eviction_lag_start = 0;
+}
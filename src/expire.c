@@ -72,10 +72,12 @@ int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
     }
 }
 
-/* Try to expire a few timed out keys. The algorithm used is adaptive and
- * will use few CPU cycles if there are few expiring keys, otherwise
- * it will get more aggressive to avoid that too much memory is used by
- * keys that can be removed from the keyspace.
+/* Try to expire the timed out keys. Every database keeps its keys with an
+ * expire in db->expires_index, ordered by expire time, so we just need to
+ * reclaim keys from the head of the index until we find one that is not
+ * yet expired, without wasting time on keys expiring in the future.
+ * The expired fields of hashes are reclaimed the same way from
+ * db->hexpires_index, where the hashes are ordered by first field timeout.
  *
  * No more than CRON_DBS_PER_CALL databases are tested at every
  * iteration.
@@ -144,65 +146,111 @@ void activeExpireCycle(int type) {
      * about the number of keys that are already logically expired, but still
      * existing inside the database. */
     long total_sampled = 0;
-    long total_expired = 0;
+    long total_stale = 0;
 
     for (j = 0; j < dbs_per_call && timelimit_exit == 0; j++) {
-        int expired;
         redisDb *db = server.db+(current_db % server.dbnum);
+        long long now;
+        raxIterator ri;
 
         /* Increment the DB now so we are sure if we run out of time
          * in the current DB we'll restart from the next. This allows to
          * distribute the time evenly across DBs. */
         current_db++;
 
-        /* Continue to expire if at the end of the cycle more than 25%
-         * of the keys were expired. */
-        do {
-            unsigned long num, slots;
-            long long now, ttl_sum;
-            int ttl_samples;
+        /* If there is nothing to expire try next DB ASAP. */
+        if (dictSize(db->expires) == 0) {
+            db->avg_ttl = 0;
+            if (dictSize(db->hexpires) == 0) continue;
+        }
+        now = mstime();
+
+        /* Reclaim the expired keys from the head of the index. Deleting
+         * a key invalidates the iterator, so we seek again every time. */
+        raxStart(&ri,db->expires_index);
+        while(1) {
+            dictEntry *de;
+            robj *keyobj;
+
             iteration++;
+            raxSeek(&ri,"^",NULL,0);
+            if (!raxNext(&ri)) break;
+            if (expireIndexGetTime(ri.key) >= now) break;
 
-            /* If there is nothing to expire try next DB ASAP. */
-            if ((num = dictSize(db->expires)) == 0) {
-                db->avg_ttl = 0;
-                break;
+            keyobj = createStringObject((char*)ri.key+8,ri.key_len-8);
+            de = dictFind(db->expires,keyobj->ptr);
+            serverAssertWithInfo(NULL,keyobj,de != NULL);
+            activeExpireCycleTryExpire(db,de,now);
+            decrRefCount(keyobj);
+
+            /* We can't block forever here even if there are many keys to
+             * expire. So after a given amount of milliseconds return to the
+             * caller waiting for the other active expire cycle. */
+            if ((iteration & 0xf) == 0) { /* check once every 16 iterations. */
+                elapsed = ustime()-start;
+                if (elapsed > timelimit) {
+                    timelimit_exit = 1;
+                    server.stat_expired_time_cap_reached_count++;
+                    break;
+                }
             }
-            slots = dictSlots(db->expires);
-            now = mstime();
+        }
+        raxStop(&ri);
+
+        /* Then reclaim the expired fields of hashes the same way, from
+         * the head of the index of the hashes by first field timeout. */
+        raxStart(&ri,db->hexpires_index);
+        while(!timelimit_exit) {
+            robj *keyobj;
 
-            /* When there are less than 1% filled slots getting random
-             * keys is expensive, so stop here waiting for better times...
-             * The dictionary will be resized asap. */
-            if (num && slots > DICT_HT_INITIAL_SIZE &&
-                (num*100/slots < 1)) break;
+            iteration++;
+            raxSeek(&ri,"^",NULL,0);
+            if (!raxNext(&ri)) break;
+            if (expireIndexGetTime(ri.key) >= now) break;
+
+            keyobj = createStringObject((char*)ri.key+8,ri.key_len-8);
+            serverAssertWithInfo(NULL,keyobj,
+                dictFind(db->hexpires,keyobj->ptr) != NULL);
+            hashExpireFields(db,keyobj,now);
+            decrRefCount(keyobj);
+
+            if ((iteration & 0xf) == 0) {
+                elapsed = ustime()-start;
+                if (elapsed > timelimit) {
+                    timelimit_exit = 1;
+                    server.stat_expired_time_cap_reached_count++;
+                    break;
+                }
+            }
+        }
+        raxStop(&ri);
 
-            /* The main collection cycle. Sample random keys among keys
-             * with an expire set, checking for expired ones. */
-            expired = 0;
-            ttl_sum = 0;
-            ttl_samples = 0;
+        /* Update the average TTL stats for this database, and our estimate
+         * of the keys already expired but not yet reclaimed (that's only
+         * possible if we run out of time), sampling a few random keys. */
+        if (type == ACTIVE_EXPIRE_CYCLE_SLOW) {
+            unsigned long num = dictSize(db->expires);
+            long long ttl_sum = 0;
+            int ttl_samples = 0;
 
             if (num > ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP)
                 num = ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP;
-
             while (num--) {
                 dictEntry *de;
                 long long ttl;
 
                 if ((de = dictGetRandomKey(db->expires)) == NULL) break;
                 ttl = dictGetSignedIntegerVal(de)-now;
-                if (activeExpireCycleTryExpire(db,de,now)) expired++;
                 if (ttl > 0) {
                     /* We want the average TTL of keys yet not expired. */
                     ttl_sum += ttl;
                     ttl_samples++;
+                } else {
+                    total_stale++;
                 }
                 total_sampled++;
             }
-            total_expired += expired;
 
-            /* Update the average TTL stats for this database. */
             if (ttl_samples) {
                 long long avg_ttl = ttl_sum/ttl_samples;
 
@@ -212,21 +260,7 @@ void activeExpireCycle(int type) {
                 if (db->avg_ttl == 0) db->avg_ttl = avg_ttl;
                 db->avg_ttl = (db->avg_ttl/50)*49 + (avg_ttl/50);
             }
-
-            /* We can't block forever here even if there are many keys to
-             * expire. So after a given amount of milliseconds return to the
-             * caller waiting for the other active expire cycle. */
-            if ((iteration & 0xf) == 0) { /* check once every 16 iterations. */
-                elapsed = ustime()-start;
-                if (elapsed > timelimit) {
-                    timelimit_exit = 1;
-                    server.stat_expired_time_cap_reached_count++;
-                    break;
-                }
-            }
-            /* We don't repeat the cycle if there are less than 25% of keys
-             * found expired in the current DB. */
-        } while (expired > ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP/4);
+        }
     }
 
     elapsed = ustime()-start;
@@ -234,13 +268,11 @@ void activeExpireCycle(int type) {
 
     /* Update our estimate of keys existing but yet to be expired.
      * Running average with this sample accounting for 5%. */
-    double current_perc;
     if (total_sampled) {
-        current_perc = (double)total_expired/total_sampled;
-    } else
-        current_perc = 0;
-    server.stat_expired_stale_perc = (current_perc*0.05)+
-                                     (server.stat_expired_stale_perc*0.95);
+        double current_perc = (double)total_stale/total_sampled;
+        server.stat_expired_stale_perc = (current_perc*0.05)+
+                                         (server.stat_expired_stale_perc*0.95);
+    }
 }
 
 /*-----------------------------------------------------------------------------
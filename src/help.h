@@ -594,7 +594,7 @@ struct commandHelp {
     1,
     "1.0.0" },
     { "MIGRATE",
-    "host port key|"" destination-db timeout [COPY] [REPLACE] [KEYS key]",
+    "host port key|"" destination-db timeout [COPY] [REPLACE] [ASYNC] [KEYS key]",
     "Atomically transfer a key from a Redis instance to another one.",
     0,
     "2.6.0" },
@@ -704,7 +704,7 @@ struct commandHelp {
     0,
     "1.0.0" },
     { "READONLY",
-    "-",
+    "[MAXLAG milliseconds] [MAXOFFSETLAG bytes]",
     "Enables read queries for a connection to a cluster replica node",
     12,
     "3.0.0" },
@@ -729,7 +729,7 @@ struct commandHelp {
     9,
     "5.0.0" },
     { "RESTORE",
-    "key ttl serialized-value [REPLACE]",
+    "key ttl serialized-value [REPLACE|APPEND]",
     "Create a key using the provided serialized value, previously obtained using DUMP.",
     0,
     "2.6.0" },
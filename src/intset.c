@@ -108,23 +108,64 @@ static intset *intsetResize(intset *is, uint32_t len) {
     return is;
 }
 
+/* Ranges of at most this many elements are searched with a linear scan
+ * instead of being bisected further: the scan has no data dependent branches
+ * and the compiler vectorizes it, while bisecting such a small range is mostly
+ * paying for branch mispredictions. */
+#define INTSET_LINEAR_SEARCH_MAX 16
+
+/* Return the number of elements smaller than "value" in the sorted range
+ * [lo,hi) of the intset. */
+static uint32_t intsetCountSmaller(intset *is, int64_t value, uint32_t lo, uint32_t hi) {
+    uint32_t count = 0, j;
+#if (BYTE_ORDER == LITTLE_ENDIAN)
+    uint32_t encoding = intrev32ifbe(is->encoding);
+
+    if (encoding == INTSET_ENC_INT64) {
+        int64_t *v = (int64_t*)is->contents;
+        for (j = lo; j < hi; j++) count += v[j] < value;
+    } else if (encoding == INTSET_ENC_INT32) {
+        int32_t *v = (int32_t*)is->contents;
+        for (j = lo; j < hi; j++) count += v[j] < value;
+    } else {
+        int16_t *v = (int16_t*)is->contents;
+        for (j = lo; j < hi; j++) count += v[j] < value;
+    }
+#else
+    for (j = lo; j < hi; j++) count += _intsetGet(is,j) < value;
+#endif
+    return count;
+}
+
+/* Return the position of the first element of the sorted range [lo,hi)
+ * that is not smaller than "value", or "hi" if there is no such element. */
+static uint32_t intsetLowerBound(intset *is, int64_t value, uint32_t lo, uint32_t hi) {
+    while (hi-lo > INTSET_LINEAR_SEARCH_MAX) {
+        uint32_t mid = lo+((hi-lo)>>1);
+        if (_intsetGet(is,mid) < value)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo+intsetCountSmaller(is,value,lo,hi);
+}
+
 /* Search for the position of "value". Return 1 when the value was found and
  * sets "pos" to the position of the value within the intset. Return 0 when
  * the value is not present in the intset and sets "pos" to the position
  * where "value" can be inserted. */
 static uint8_t intsetSearch(intset *is, int64_t value, uint32_t *pos) {
-    int min = 0, max = intrev32ifbe(is->length)-1, mid = -1;
-    int64_t cur = -1;
+    uint32_t len = intrev32ifbe(is->length), p;
 
     /* The value can never be found when the set is empty */
-    if (intrev32ifbe(is->length) == 0) {
+    if (len == 0) {
         if (pos) *pos = 0;
         return 0;
     } else {
         /* Check for the case where we know we cannot find the value,
          * but do know the insert position. */
-        if (value > _intsetGet(is,max)) {
-            if (pos) *pos = intrev32ifbe(is->length);
+        if (value > _intsetGet(is,len-1)) {
+            if (pos) *pos = len;
             return 0;
         } else if (value < _intsetGet(is,0)) {
             if (pos) *pos = 0;
@@ -132,25 +173,31 @@ static uint8_t intsetSearch(intset *is, int64_t value, uint32_t *pos) {
         }
     }
 
-    while(max >= min) {
-        mid = ((unsigned int)min + (unsigned int)max) >> 1;
-        cur = _intsetGet(is,mid);
-        if (value > cur) {
-            min = mid+1;
-        } else if (value < cur) {
-            max = mid-1;
-        } else {
-            break;
-        }
-    }
+    p = intsetLowerBound(is,value,0,len);
+    if (pos) *pos = p;
+    return p < len && _intsetGet(is,p) == value;
+}
 
-    if (value == cur) {
-        if (pos) *pos = mid;
-        return 1;
-    } else {
-        if (pos) *pos = min;
-        return 0;
+/* Like intsetSearch(), but only considers the elements starting at "*pos",
+ * probing exponentially growing distances from it before bisecting. This is
+ * the way to look up an increasing sequence of values, like when merging two
+ * intsets: the cost is logarithmic in the distance from the previous match
+ * instead of in the size of the set. On return "*pos" is set to the position
+ * of the first element not smaller than "value". */
+static uint8_t intsetGallop(intset *is, int64_t value, uint32_t *pos) {
+    uint32_t len = intrev32ifbe(is->length);
+    uint32_t lo = *pos, hi = *pos, step = 1;
+
+    while (hi < len && _intsetGet(is,hi) < value) {
+        lo = hi+1;
+        hi += step;
+        step <<= 1;
     }
+    /* Now every element before "lo" is smaller than "value", while the
+     * element at "hi", if any, is not. */
+    hi = (hi < len) ? hi+1 : len;
+    *pos = intsetLowerBound(is,value,lo,hi);
+    return *pos < len && _intsetGet(is,*pos) == value;
 }
 
 /* Upgrades the intset to a larger encoding and inserts the given integer. */
@@ -250,12 +297,101 @@ intset *intsetRemove(intset *is, int64_t value, int *success) {
     return is;
 }
 
+/* Create an intset with the specified encoding and room for "len"
+ * elements, to be filled in order with _intsetSet(). */
+static intset *intsetCreate(uint8_t encoding, uint32_t len) {
+    intset *is = zmalloc(sizeof(intset)+len*encoding);
+    is->encoding = intrev32ifbe(encoding);
+    is->length = intrev32ifbe(len);
+    return is;
+}
+
+/* Set the final length of an intset created with intsetCreate(), releasing
+ * the unused space. */
+static intset *intsetTruncate(intset *is, uint32_t len) {
+    is->length = intrev32ifbe(len);
+    return intsetResize(is,len);
+}
+
+/* Return a new intset with the elements that are both in "a" and "b". Every
+ * element of the smaller set is looked up in the larger one with
+ * intsetGallop(), so the work is O(M*log(N/M)) with M and N the sizes of the
+ * two sets, instead of O(M*log(N)) for independent lookups. */
+intset *intsetIntersection(intset *a, intset *b) {
+    uint32_t alen = intrev32ifbe(a->length), blen = intrev32ifbe(b->length);
+    uint32_t i, j = 0, len = 0;
+    intset *res;
+
+    if (alen > blen) {
+        intset *tmp = a; a = b; b = tmp;
+        alen = blen; blen = intrev32ifbe(b->length);
+    }
+
+    /* The common elements fit the smaller of the two encodings. */
+    res = intsetCreate(intrev32ifbe(a->encoding) < intrev32ifbe(b->encoding) ?
+                       intrev32ifbe(a->encoding) : intrev32ifbe(b->encoding),
+                       alen);
+    for (i = 0; i < alen && j < blen; i++) {
+        int64_t value = _intsetGet(a,i);
+        if (intsetGallop(b,value,&j)) _intsetSet(res,len++,value);
+    }
+    return intsetTruncate(res,len);
+}
+
+/* Return a new intset with the elements that are in "a" or in "b". */
+intset *intsetUnion(intset *a, intset *b) {
+    uint32_t alen = intrev32ifbe(a->length), blen = intrev32ifbe(b->length);
+    uint32_t i = 0, j = 0, len = 0;
+    intset *res;
+
+    res = intsetCreate(intrev32ifbe(a->encoding) > intrev32ifbe(b->encoding) ?
+                       intrev32ifbe(a->encoding) : intrev32ifbe(b->encoding),
+                       alen+blen);
+    while (i < alen && j < blen) {
+        int64_t va = _intsetGet(a,i), vb = _intsetGet(b,j);
+        if (va <= vb) {
+            _intsetSet(res,len++,va);
+            i++;
+            if (va == vb) j++;
+        } else {
+            _intsetSet(res,len++,vb);
+            j++;
+        }
+    }
+    while (i < alen) _intsetSet(res,len++,_intsetGet(a,i++));
+    while (j < blen) _intsetSet(res,len++,_intsetGet(b,j++));
+    return intsetTruncate(res,len);
+}
+
+/* Return a new intset with the elements of "a" that are not in "b". */
+intset *intsetDifference(intset *a, intset *b) {
+    uint32_t alen = intrev32ifbe(a->length), blen = intrev32ifbe(b->length);
+    uint32_t i, j = 0, len = 0;
+    intset *res;
+
+    res = intsetCreate(intrev32ifbe(a->encoding),alen);
+    for (i = 0; i < alen; i++) {
+        int64_t value = _intsetGet(a,i);
+        if (j < blen && intsetGallop(b,value,&j)) continue;
+        _intsetSet(res,len++,value);
+    }
+    return intsetTruncate(res,len);
+}
+
 /* Determine whether a value belongs to this set */
 uint8_t intsetFind(intset *is, int64_t value) {
     uint8_t valenc = _intsetValueEncoding(value);
     return valenc <= intrev32ifbe(is->encoding) && intsetSearch(is,value,NULL);
 }
 
+/* Determine whether a value belongs to this set, only looking at the elements
+ * starting at "*pos", that is updated to the position of the first element
+ * not smaller than "value". Start with "*pos" set to zero and look up values
+ * in increasing order to walk the set with galloping searches. */
+uint8_t intsetFindFrom(intset *is, int64_t value, uint32_t *pos) {
+    return intsetGallop(is,value,pos);
+}
+
 /* Return random member */
 int64_t intsetRandom(intset *is) {
     return _intsetGet(is,rand()%intrev32ifbe(is->length));
@@ -487,6 +623,53 @@ int intsetTest(int argc, char **argv) {
         ok();
     }
 
+    printf("Search against a linear scan: "); {
+        int64_t v;
+        uint32_t pos, expected;
+        is = createSet(20,1000);
+        for (i = 0; i < 10000; i++) {
+            v = rand() % (1<<20);
+            for (expected = 0; expected < intsetLen(is); expected++)
+                if (_intsetGet(is,expected) >= v) break;
+            intsetSearch(is,v,&pos);
+            assert(pos == expected);
+            pos = rand() % (expected+1);
+            intsetGallop(is,v,&pos);
+            assert(pos == expected);
+        }
+        ok();
+    }
+
+    printf("Intersection, union and difference: "); {
+        for (i = 0; i < 100; i++) {
+            intset *a = createSet(rand() % 2 ? 10 : 40,rand() % 500);
+            intset *b = createSet(rand() % 2 ? 10 : 40,rand() % 500);
+            intset *inter = intsetIntersection(a,b);
+            intset *uni = intsetUnion(a,b);
+            intset *diff = intsetDifference(a,b);
+            int64_t v;
+            uint32_t j;
+
+            for (j = 0; intsetGet(a,j,&v); j++) {
+                assert(intsetFind(uni,v));
+                assert(intsetFind(inter,v) == intsetFind(b,v));
+                assert(intsetFind(diff,v) == !intsetFind(b,v));
+            }
+            for (j = 0; intsetGet(b,j,&v); j++) {
+                assert(intsetFind(uni,v));
+                assert(!intsetFind(diff,v));
+            }
+            assert(intsetLen(uni) ==
+                   intsetLen(a)+intsetLen(b)-intsetLen(inter));
+            assert(intsetLen(diff) == intsetLen(a)-intsetLen(inter));
+            if (intsetLen(inter) > 1) checkConsistency(inter);
+            if (intsetLen(uni) > 1) checkConsistency(uni);
+            if (intsetLen(diff) > 1) checkConsistency(diff);
+            zfree(a); zfree(b); zfree(inter); zfree(uni); zfree(diff);
+        }
+        ok();
+    }
+
     return 0;
 }
 #endif
@@ -5,6 +5,28 @@
 
 static size_t lazyfree_objects = 0;
 pthread_mutex_t lazyfree_objects_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t lazyfree_memory = 0;
+pthread_mutex_t lazyfree_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t lazyfreed_objects = 0;
+pthread_mutex_t lazyfreed_objects_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Objects to free are not sent to the lazyfree threads one by one: they are
+ * accumulated into a batch that becomes a single bio job when it is full,
+ * when the free effort of its objects is big enough to keep a thread busy
+ * for a while, or at the latest in beforeSleep(). This way an UNLINK of
+ * many keys, or an eviction cycle, does not pay a mutex and condition
+ * variable round trip for every object. */
+#define LAZYFREE_BATCH_SIZE 64
+#define LAZYFREE_BATCH_EFFORT (1024*16)
+
+typedef struct lazyfreeBatch {
+    size_t count;       /* Number of objects in the batch. */
+    size_t effort;      /* Sum of lazyfreeGetFreeEffort() of the objects. */
+    size_t memory;      /* Estimated memory used by the objects. */
+    robj *objs[LAZYFREE_BATCH_SIZE];
+} lazyfreeBatch;
+
+static lazyfreeBatch *lazyfree_batch = NULL; /* Batch being filled. */
 
 /* Return the number of currently pending objects to free. */
 size_t lazyfreeGetPendingObjectsCount(void) {
@@ -13,6 +35,60 @@ size_t lazyfreeGetPendingObjectsCount(void) {
     return aux;
 }
 
+/* Return the number of objects released by the lazyfree threads since the
+ * server was started or the stats were reset. */
+size_t lazyfreeGetFreedObjectsCount(void) {
+    size_t aux;
+    atomicGet(lazyfreed_objects,aux);
+    return aux;
+}
+
+void lazyfreeResetStats(void) {
+    atomicSet(lazyfreed_objects,0);
+}
+
+/* Return the estimated amount of memory used by the objects that were
+ * scheduled for lazy freeing and are not yet released. This is memory that
+ * is going to be reclaimed soon, so freeMemoryIfNeeded() does not count it
+ * as used, otherwise it would evict more keys while the lazyfree threads are
+ * catching up. Note that only objects are accounted, not the DBs released
+ * by FLUSHDB / FLUSHALL ASYNC, since computing their size would not be
+ * cheap. */
+size_t lazyfreeGetPendingMemory(void) {
+    size_t aux;
+    atomicGet(lazyfree_memory,aux);
+    return aux;
+}
+
+/* Send the current batch of objects to the lazyfree threads, if any. */
+void lazyfreeFlushBatch(void) {
+    if (lazyfree_batch == NULL) return;
+    bioCreateBackgroundJob(BIO_LAZY_FREE,lazyfree_batch,NULL,NULL);
+    lazyfree_batch = NULL;
+}
+
+/* Add an object to the batch of objects to release in background, sending
+ * the batch to the lazyfree threads if it is full or if it has enough
+ * work for a thread. */
+static void lazyfreeAddObject(robj *o, size_t free_effort) {
+    lazyfreeBatch *b = lazyfree_batch;
+    size_t memory = objectComputeSize(o,OBJ_COMPUTE_SIZE_DEF_SAMPLES);
+
+    if (b == NULL) {
+        b = lazyfree_batch = zmalloc(sizeof(*b));
+        b->count = 0;
+        b->effort = 0;
+        b->memory = 0;
+    }
+    b->objs[b->count++] = o;
+    b->effort += free_effort;
+    b->memory += memory;
+    atomicIncr(lazyfree_objects,1);
+    atomicIncr(lazyfree_memory,memory);
+    if (b->count == LAZYFREE_BATCH_SIZE || b->effort >= LAZYFREE_BATCH_EFFORT)
+        lazyfreeFlushBatch();
+}
+
 /* Return the amount of work needed in order to free an object.
  * The return value is not always the actual number of allocations the
  * object is compoesd of, but a number proportional to it.
@@ -35,9 +111,9 @@ size_t lazyfreeGetFreeEffort(robj *obj) {
     } else if (obj->type == OBJ_SET && obj->encoding == OBJ_ENCODING_HT) {
         dict *ht = obj->ptr;
         return dictSize(ht);
-    } else if (obj->type == OBJ_ZSET && obj->encoding == OBJ_ENCODING_SKIPLIST){
+    } else if (obj->type == OBJ_ZSET && obj->encoding == OBJ_ENCODING_BTREE){
         zset *zs = obj->ptr;
-        return zs->zsl->length;
+        return zs->zbt->length;
     } else if (obj->type == OBJ_HASH && obj->encoding == OBJ_ENCODING_HT) {
         dict *ht = obj->ptr;
         return dictSize(ht);
@@ -52,9 +128,15 @@ size_t lazyfreeGetFreeEffort(robj *obj) {
  * will be reclaimed in a different bio.c thread. */
 #define LAZYFREE_THRESHOLD 64
 int dbAsyncDelete(redisDb *db, robj *key) {
+    /* Expired and evicted keys don't go through signalModifiedKey(), but
+     * a transfer can't survive the deletion of its key either. */
+    migrateAsyncSignalModifiedKey(db,key);
+
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
+    if (dictSize(db->expires) > 0) dbDeleteExpire(db,key->ptr);
+    if (dictSize(db->hexpires) > 0) dbDeleteHashFieldExpires(db,key->ptr);
+    dbUnaccountKey(db,key->ptr);
 
     /* If the value is composed of a few allocations, to free in a lazy way
      * is actually just slower... So under a certain limit we just free
@@ -73,8 +155,7 @@ int dbAsyncDelete(redisDb *db, robj *key) {
          * through and reach the dictFreeUnlinkedEntry() call, that will be
          * equivalent to just calling decrRefCount(). */
         if (free_effort > LAZYFREE_THRESHOLD && val->refcount == 1) {
-            atomicIncr(lazyfree_objects,1);
-            bioCreateBackgroundJob(BIO_LAZY_FREE,val,NULL,NULL);
+            lazyfreeAddObject(val,free_effort);
             dictSetVal(db->dict,de,NULL);
         }
     }
@@ -94,8 +175,7 @@ int dbAsyncDelete(redisDb *db, robj *key) {
 void freeObjAsync(robj *o) {
     size_t free_effort = lazyfreeGetFreeEffort(o);
     if (free_effort > LAZYFREE_THRESHOLD && o->refcount == 1) {
-        atomicIncr(lazyfree_objects,1);
-        bioCreateBackgroundJob(BIO_LAZY_FREE,o,NULL,NULL);
+        lazyfreeAddObject(o,free_effort);
     } else {
         decrRefCount(o);
     }
@@ -106,10 +186,38 @@ void freeObjAsync(robj *o) {
  * lazy freeing. */
 void emptyDbAsync(redisDb *db) {
     dict *oldht1 = db->dict, *oldht2 = db->expires;
+    rax *oldidx = db->expires_index, *oldhidx = db->hexpires_index;
     db->dict = dictCreate(&dbDictType,NULL);
     db->expires = dictCreate(&keyptrDictType,NULL);
+    db->expires_index = raxNew();
+    freeDictAsync(db->hexpires);
+    db->hexpires = dictCreate(&hexpiresDictType,NULL);
+    db->hexpires_index = raxNew();
+    if (db->key_sizes) {
+        freeDictAsync(db->key_sizes);
+        db->key_sizes = dictCreate(&keyptrDictType,NULL);
+        dbResetMemoryAccounting(db);
+    }
     atomicIncr(lazyfree_objects,dictSize(oldht1));
     bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,oldht1,oldht2);
+
+    /* The expires index is a radix tree like the slots-keys map, so it
+     * can be released by the same kind of job. */
+    atomicIncr(lazyfree_objects,oldidx->numele);
+    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,NULL,oldidx);
+    atomicIncr(lazyfree_objects,oldhidx->numele);
+    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,NULL,oldhidx);
+}
+
+/* Release a dictionary not owning its keys and values, like the memory
+ * accounting of a DB, in the lazyfree thread if it is big enough. */
+void freeDictAsync(dict *d) {
+    if (dictSize(d) > LAZYFREE_THRESHOLD) {
+        atomicIncr(lazyfree_objects,dictSize(d));
+        bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,d,NULL);
+    } else {
+        dictRelease(d);
+    }
 }
 
 /* Empty the slots-keys map of Redis CLuster by creating a new empty one
@@ -124,11 +232,17 @@ void slotToKeyFlushAsync(void) {
     bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,NULL,old);
 }
 
-/* Release objects from the lazyfree thread. It's just decrRefCount()
- * updating the count of objects to release. */
-void lazyfreeFreeObjectFromBioThread(robj *o) {
-    decrRefCount(o);
-    atomicDecr(lazyfree_objects,1);
+/* Release a batch of objects from a lazyfree thread. It's just
+ * decrRefCount() for every object, updating the count of objects and the
+ * memory to release. */
+void lazyfreeFreeBatchFromBioThread(lazyfreeBatch *b) {
+    size_t j;
+
+    for (j = 0; j < b->count; j++) decrRefCount(b->objs[j]);
+    atomicDecr(lazyfree_objects,b->count);
+    atomicDecr(lazyfree_memory,b->memory);
+    atomicIncr(lazyfreed_objects,b->count);
+    zfree(b);
 }
 
 /* Release a database from the lazyfree thread. The 'db' pointer is the
@@ -143,6 +257,13 @@ void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2) {
     atomicDecr(lazyfree_objects,numkeys);
 }
 
+/* Release a dictionary scheduled by freeDictAsync(). */
+void lazyfreeFreeDictFromBioThread(dict *d) {
+    size_t len = dictSize(d);
+    dictRelease(d);
+    atomicDecr(lazyfree_objects,len);
+}
+
 /* Release the skiplist mapping Redis Cluster keys to slots in the
  * lazyfree thread. */
 void lazyfreeFreeSlotsMapFromBioThread(rax *rt) {
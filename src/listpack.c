@@ -568,6 +568,87 @@ unsigned char *lpGet(unsigned char *p, int64_t *count, unsigned char *intbuf) {
     }
 }
 
+/* Get the listpack element pointed by 'p' with the same interface of
+ * ziplistGet(): if the element is a string '*sstr' is set to point to it
+ * (inside the listpack) and '*slen' to its length, otherwise '*sstr' is set
+ * to NULL and the integer value is stored in '*sval'. Returns 0 if 'p' is
+ * NULL or points to the EOF element, otherwise 1 is returned. */
+int lpGetValue(unsigned char *p, unsigned char **sstr, unsigned int *slen, long long *sval) {
+    int64_t count;
+
+    if (p == NULL || p[0] == LP_EOF) return 0;
+    *sstr = lpGet(p,&count,NULL);
+    if (*sstr)
+        *slen = count;
+    else
+        *sval = count;
+    return 1;
+}
+
+/* Return 1 if the listpack element pointed by 'p' is equal to the string
+ * 's' of length 'slen', otherwise 0 is returned. */
+int lpCompare(unsigned char *p, unsigned char *s, uint32_t slen) {
+    unsigned char *value;
+    int64_t count, sval;
+
+    value = lpGet(p,&count,NULL);
+    if (value)
+        return count == slen && memcmp(value,s,slen) == 0;
+    if (!lpStringToInt64((const char*)s,slen,&sval))
+        return 0;
+    return sval == count;
+}
+
+/* Find the element equal to the string 's' of length 'slen', starting the
+ * search at the element pointed by 'p' and comparing only one element every
+ * 'skip'+1 ones (so that with 'skip' set to 1 only the fields of a sequence
+ * of field-value pairs are checked). Returns the pointer to the element
+ * found, or NULL if there is no such element.
+ *
+ * The search string is parsed as an integer only once: since elements are
+ * always stored with the integer encoding when lpStringToInt64() accepts
+ * them, only integer encoded elements can match an integer, and only string
+ * encoded elements of the same length can match a string. All the other
+ * elements are skipped just looking at their encoding byte, without ever
+ * decoding them. */
+unsigned char *lpFind(unsigned char *lp, unsigned char *p, unsigned char *s, uint32_t slen, unsigned int skip) {
+    unsigned int skipcnt = 0;
+    int64_t sval = 0, count;
+    int isint = lpStringToInt64((const char*)s,slen,&sval);
+    uint32_t len;
+    unsigned char *value;
+
+    ((void) lp);
+    if (p == NULL) return NULL;
+    while (p[0] != LP_EOF) {
+        if (skipcnt == 0) {
+            if (LP_ENCODING_IS_7BIT_UINT(p[0])) {
+                if (isint && (p[0] & 0x7f) == sval) return p;
+            } else if (LP_ENCODING_IS_6BIT_STR(p[0])) {
+                len = LP_ENCODING_6BIT_STR_LEN(p);
+                if (!isint && len == slen && memcmp(p+1,s,slen) == 0)
+                    return p;
+            } else if (LP_ENCODING_IS_12BIT_STR(p[0])) {
+                len = LP_ENCODING_12BIT_STR_LEN(p);
+                if (!isint && len == slen && memcmp(p+2,s,slen) == 0)
+                    return p;
+            } else if (LP_ENCODING_IS_32BIT_STR(p[0])) {
+                len = LP_ENCODING_32BIT_STR_LEN(p);
+                if (!isint && len == slen && memcmp(p+5,s,slen) == 0)
+                    return p;
+            } else if (isint) {
+                value = lpGet(p,&count,NULL);
+                if (value == NULL && count == sval) return p;
+            }
+            skipcnt = skip;
+        } else {
+            skipcnt--;
+        }
+        p = lpSkip(p);
+    }
+    return NULL;
+}
+
 /* Insert, delete or replace the specified element 'ele' of length 'len' at
  * the specified position 'p', with 'p' being a listpack element pointer
  * obtained with lpFirst(), lpLast(), lpIndex(), lpNext(), lpPrev() or
@@ -739,6 +820,13 @@ unsigned char *lpAppend(unsigned char *lp, unsigned char *ele, uint32_t size) {
     return lpInsert(lp,ele,size,eofptr,LP_BEFORE,NULL);
 }
 
+/* Insert the specified element 'ele' of length 'len' at the start of the
+ * listpack. It is implemented in terms of lpInsert(), so the return value is
+ * the same as lpInsert(). */
+unsigned char *lpPrepend(unsigned char *lp, unsigned char *ele, uint32_t size) {
+    return lpInsert(lp,ele,size,lp+LP_HDR_SIZE,LP_BEFORE,NULL);
+}
+
 /* Remove the element pointed by 'p', and return the resulting listpack.
  * If 'newp' is not NULL, the next element pointer (to the right of the
  * deleted one) is returned by reference. If the deleted element was the
@@ -747,6 +835,98 @@ unsigned char *lpDelete(unsigned char *lp, unsigned char *p, unsigned char **new
     return lpInsert(lp,NULL,0,p,LP_REPLACE,newp);
 }
 
+/* Remove 'num' elements starting at the zero-based 'index', with the same
+ * semantics of lpSeek() for negative indexes, and return the resulting
+ * listpack. If there are less than 'num' elements after 'index', all the
+ * elements up to the end of the listpack are removed. Unlike repeated calls
+ * to lpDelete(), the tail of the listpack is moved only once. */
+unsigned char *lpDeleteRange(unsigned char *lp, long index, unsigned long num) {
+    unsigned char *first, *last;
+    unsigned long deleted = 0;
+    uint32_t bytes = lpGetTotalBytes(lp);
+    uint32_t numele = lpGetNumElements(lp);
+
+    if (num == 0 || (first = lpSeek(lp,index)) == NULL) return lp;
+
+    /* Skip the elements to remove: 'last' is the first element (or the
+     * EOF byte) that is kept. */
+    last = first;
+    while (deleted < num && last[0] != LP_EOF) {
+        last = lpSkip(last);
+        deleted++;
+    }
+
+    memmove(first,last,bytes-(last-lp));
+    bytes -= last-first;
+    lpSetTotalBytes(lp,bytes);
+    if (numele != LP_HDR_NUMELE_UNKNOWN)
+        lpSetNumElements(lp,numele-deleted);
+    return lp_realloc(lp,bytes);
+}
+
+/* Merge the listpacks pointed by 'first' and 'second', appending the
+ * elements of 'second' to the ones of 'first'. Like ziplistMerge(), the
+ * bigger listpack is reallocated to hold the result, so that the smaller
+ * one is the only one copied: the other listpack is freed and its pointer
+ * is set to NULL, while the resulting listpack is stored in the pointer of
+ * the reallocated one, and also returned.
+ *
+ * Returns NULL, without changing anything, if one of the arguments is NULL,
+ * if the two arguments are the same listpack, or if the result would exceed
+ * the max allowed size of 2^32-1 bytes. */
+unsigned char *lpMerge(unsigned char **first, unsigned char **second) {
+    if (first == NULL || *first == NULL || second == NULL || *second == NULL)
+        return NULL;
+    if (*first == *second) return NULL;
+
+    uint32_t first_bytes = lpGetTotalBytes(*first);
+    uint32_t second_bytes = lpGetTotalBytes(*second);
+    uint32_t first_len = lpGetNumElements(*first);
+    uint32_t second_len = lpGetNumElements(*second);
+    /* Both the header and the EOF byte of one of the listpacks go away. */
+    uint64_t lpbytes = (uint64_t)first_bytes+second_bytes-LP_HDR_SIZE-1;
+    if (lpbytes > UINT32_MAX) return NULL;
+
+    int append = first_bytes >= second_bytes;
+    unsigned char *target = append ? *first : *second;
+    unsigned char *source = append ? *second : *first;
+    uint32_t source_bytes = append ? second_bytes : first_bytes;
+    uint32_t target_bytes = append ? first_bytes : second_bytes;
+
+    target = lp_realloc(target,lpbytes);
+    if (append) {
+        /* Copy the elements of the source over the EOF of the target. */
+        memcpy(target+target_bytes-1,source+LP_HDR_SIZE,
+               source_bytes-LP_HDR_SIZE);
+    } else {
+        /* Make room for the elements of the source before the ones of the
+         * target, then copy them in place. */
+        memmove(target+source_bytes-1,target+LP_HDR_SIZE,
+                target_bytes-LP_HDR_SIZE);
+        memcpy(target+LP_HDR_SIZE,source+LP_HDR_SIZE,
+               source_bytes-LP_HDR_SIZE-1);
+    }
+    lpSetTotalBytes(target,lpbytes);
+    if (first_len == LP_HDR_NUMELE_UNKNOWN ||
+        second_len == LP_HDR_NUMELE_UNKNOWN ||
+        first_len+second_len >= LP_HDR_NUMELE_UNKNOWN)
+    {
+        lpSetNumElements(target,LP_HDR_NUMELE_UNKNOWN);
+    } else {
+        lpSetNumElements(target,first_len+second_len);
+    }
+    lp_free(source);
+
+    if (append) {
+        *first = target;
+        *second = NULL;
+    } else {
+        *first = NULL;
+        *second = target;
+    }
+    return target;
+}
+
 /* Return the total number of bytes the listpack is composed of. */
 uint32_t lpBytes(unsigned char *lp) {
     return lpGetTotalBytes(lp);
@@ -113,6 +113,29 @@ void execCommandPropagateMulti(client *c) {
     decrRefCount(multistring);
 }
 
+/* Enforce the memory quota of the DBs, other than the selected one, that
+ * the transaction of 'c' adds data to after a SELECT. Returns C_ERR if one
+ * of them is over its quota and no memory could be freed. */
+static int execEnforceDbMemoryQuotas(client *c) {
+    int j, dbid = c->db->id;
+
+    if (server.db_maxmemory_len == 0) return C_OK;
+    for (j = 0; j < c->mstate.count; j++) {
+        multiCmd *mc = c->mstate.commands+j;
+        long long id;
+
+        if (mc->cmd->proc == selectCommand) {
+            if (getLongLongFromObject(mc->argv[1],&id) == C_OK &&
+                id >= 0 && id < server.dbnum) dbid = id;
+        } else if (mc->cmd->flags & CMD_DENYOOM && dbid != c->db->id &&
+                   freeDbMemoryIfNeededAndSafe(server.db+dbid) == C_ERR)
+        {
+            return C_ERR;
+        }
+    }
+    return C_OK;
+}
+
 void execCommand(client *c) {
     int j;
     robj **orig_argv;
@@ -154,6 +177,15 @@ void execCommand(client *c) {
         goto handle_monitor;
     }
 
+    /* The memory quota of the selected DB was enforced when the commands
+     * were queued, but the transaction may SELECT other DBs: their quota is
+     * enforced now, since we can't stop in the middle. */
+    if (execEnforceDbMemoryQuotas(c) == C_ERR) {
+        addReply(c, shared.dboomerr);
+        discardTransaction(c);
+        goto handle_monitor;
+    }
+
     /* Exec all the queued commands */
     unwatchAllKeys(c); /* Unwatch ASAP otherwise we'll waste CPU cycles */
     orig_argv = c->argv;
@@ -55,16 +55,25 @@ size_t getStringObjectSdsUsedMemory(robj *o) {
     }
 }
 
-/* Client.reply list dup and free methods. */
+/* Client.reply list dup and free methods.
+ *
+ * Reply blocks and query buffers live in the buffers arena, see
+ * zmalloc_set_arena(), so that their churn does not fragment the pages
+ * holding the dataset: every allocation, reallocation and free of such
+ * buffers is performed with the buffers arena selected. */
 void *dupClientReplyValue(void *o) {
     clientReplyBlock *old = o;
+    int arena = zmalloc_set_arena(ZMALLOC_ARENA_BUFFERS);
     clientReplyBlock *buf = zmalloc(sizeof(clientReplyBlock) + old->size);
+    zmalloc_set_arena(arena);
     memcpy(buf, o, sizeof(clientReplyBlock) + old->size);
     return buf;
 }
 
 void freeClientReplyValue(void *o) {
+    int arena = zmalloc_set_arena(ZMALLOC_ARENA_BUFFERS);
     zfree(o);
+    zmalloc_set_arena(arena);
 }
 
 int listMatchObjects(void *a, void *b) {
@@ -112,8 +121,10 @@ client *createClient(int fd) {
     c->name = NULL;
     c->bufpos = 0;
     c->qb_pos = 0;
+    int arena = zmalloc_set_arena(ZMALLOC_ARENA_BUFFERS);
     c->querybuf = sdsempty();
     c->pending_querybuf = sdsempty();
+    zmalloc_set_arena(arena);
     c->querybuf_peak = 0;
     c->reqtype = 0;
     c->argc = 0;
@@ -148,6 +159,9 @@ client *createClient(int fd) {
     c->bpop.xread_group_noack = 0;
     c->bpop.numreplicas = 0;
     c->bpop.reploffset = 0;
+    c->bpop.migrate_job = NULL;
+    c->readonly_maxlag_ms = -1;
+    c->readonly_maxlag_offset = -1;
     c->woff = 0;
     c->watched_keys = listCreate();
     c->pubsub_channels = dictCreate(&objectKeyPointerValueDictType,NULL);
@@ -278,7 +292,9 @@ void _addReplyStringToList(client *c, const char *s, size_t len) {
         /* Create a new node, make sure it is allocated to at
          * least PROTO_REPLY_CHUNK_BYTES */
         size_t size = len < PROTO_REPLY_CHUNK_BYTES? PROTO_REPLY_CHUNK_BYTES: len;
+        int arena = zmalloc_set_arena(ZMALLOC_ARENA_BUFFERS);
         tail = zmalloc(size + sizeof(clientReplyBlock));
+        zmalloc_set_arena(arena);
         /* take over the allocation's internal fragmentation */
         tail->size = zmalloc_usable(tail) - sizeof(clientReplyBlock);
         tail->used = len;
@@ -457,7 +473,9 @@ void setDeferredMultiBulkLength(client *c, void *node, long length) {
         listDelNode(c->reply,ln);
     } else {
         /* Create a new node */
+        int arena = zmalloc_set_arena(ZMALLOC_ARENA_BUFFERS);
         clientReplyBlock *buf = zmalloc(lenstr_len + sizeof(clientReplyBlock));
+        zmalloc_set_arena(arena);
         /* Take over the allocation's internal fragmentation */
         buf->size = zmalloc_usable(buf) - sizeof(clientReplyBlock);
         buf->used = lenstr_len;
@@ -877,8 +895,10 @@ void freeClient(client *c) {
     }
 
     /* Free the query buffer */
+    int arena = zmalloc_set_arena(ZMALLOC_ARENA_BUFFERS);
     sdsfree(c->querybuf);
     sdsfree(c->pending_querybuf);
+    zmalloc_set_arena(arena);
     c->querybuf = NULL;
 
     /* Deallocate structures used to block on blocking ops. */
@@ -1372,11 +1392,22 @@ int processMultibulkBuffer(client *c) {
                  * ll+2, trimming querybuf is just a waste of time, because
                  * at this time the querybuf contains not only our bulk. */
                 if (sdslen(c->querybuf)-c->qb_pos <= (size_t)ll+2) {
-                    sdsrange(c->querybuf,c->qb_pos,-1);
+                    /* Move what we have of the bulk to a new buffer with
+                     * room for all of it. The buffer is going to become the
+                     * argument object, that may end inside the dataset, so
+                     * unlike the query buffer it is allocated in the data
+                     * arena. */
+                    size_t len = sdslen(c->querybuf)-c->qb_pos;
+                    sds bulk = sdsnewlen(SDS_NOINIT,ll+2);
+
+                    memcpy(bulk,c->querybuf+c->qb_pos,len);
+                    sdssetlen(bulk,len);
+                    bulk[len] = '\0';
+                    int arena = zmalloc_set_arena(ZMALLOC_ARENA_BUFFERS);
+                    sdsfree(c->querybuf);
+                    zmalloc_set_arena(arena);
+                    c->querybuf = bulk;
                     c->qb_pos = 0;
-                    /* Hint the sds library about the amount of bytes this string is
-                     * going to contain. */
-                    c->querybuf = sdsMakeRoomFor(c->querybuf,ll+2);
                 }
             }
             c->bulklen = ll;
@@ -1396,10 +1427,12 @@ int processMultibulkBuffer(client *c) {
             {
                 c->argv[c->argc++] = createObject(OBJ_STRING,c->querybuf);
                 sdsIncrLen(c->querybuf,-2); /* remove CRLF */
-                /* Assume that if we saw a fat argument we'll see another one
-                 * likely... */
-                c->querybuf = sdsnewlen(SDS_NOINIT,c->bulklen+2);
-                sdsclear(c->querybuf);
+                /* The next fat argument, if any, gets a buffer of its own
+                 * above, so the new query buffer starts small, in the
+                 * buffers arena. */
+                int arena = zmalloc_set_arena(ZMALLOC_ARENA_BUFFERS);
+                c->querybuf = sdsempty();
+                zmalloc_set_arena(arena);
             } else {
                 c->argv[c->argc++] =
                     createStringObject(c->querybuf+c->qb_pos,c->bulklen);
@@ -1438,6 +1471,9 @@ void processInputBuffer(client *c) {
          * later resume the processing. */
         if (server.lua_timedout && c->flags & CLIENT_MASTER) break;
 
+        /* The same when the replication stream is paused for testing. */
+        if (server.repl_debug_pause && c->flags & CLIENT_MASTER) break;
+
         /* CLIENT_CLOSE_AFTER_REPLY closes the connection once the reply is
          * written to the client. Make sure to not let the reply grow after
          * this flag has been set (i.e. don't process more commands).
@@ -1512,6 +1548,13 @@ void processInputBufferAndReplicate(client *c) {
                     c->pending_querybuf, applied);
             sdsrange(c->pending_querybuf,applied,-1);
         }
+        /* If we applied all the master sent us up to the last time its
+         * link was drained, our data is at least as fresh as that time. */
+        if (c->reploff >= server.repl_drained_reploff &&
+            server.repl_drained_time > server.repl_synced_time)
+        {
+            server.repl_synced_time = server.repl_drained_time;
+        }
     }
 }
 
@@ -1541,7 +1584,9 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
 
     qblen = sdslen(c->querybuf);
     if (c->querybuf_peak < qblen) c->querybuf_peak = qblen;
+    int arena = zmalloc_set_arena(ZMALLOC_ARENA_BUFFERS);
     c->querybuf = sdsMakeRoomFor(c->querybuf, readlen);
+    zmalloc_set_arena(arena);
     nread = read(fd, c->querybuf+qblen, readlen);
     if (nread == -1) {
         if (errno == EAGAIN) {
@@ -1559,13 +1604,22 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
         /* Append the query buffer to the pending (not applied) buffer
          * of the master. We'll use this buffer later in order to have a
          * copy of the string applied by the last command executed. */
+        arena = zmalloc_set_arena(ZMALLOC_ARENA_BUFFERS);
         c->pending_querybuf = sdscatlen(c->pending_querybuf,
                                         c->querybuf+qblen,nread);
+        zmalloc_set_arena(arena);
     }
 
     sdsIncrLen(c->querybuf,nread);
     c->lastinteraction = server.unixtime;
-    if (c->flags & CLIENT_MASTER) c->read_reploff += nread;
+    if (c->flags & CLIENT_MASTER) {
+        c->read_reploff += nread;
+        /* A short read means the master sent nothing else so far. */
+        if (nread < readlen) {
+            server.repl_drained_reploff = c->read_reploff;
+            server.repl_drained_time = mstime();
+        }
+    }
     server.stat_net_input_bytes += nread;
     if (sdslen(c->querybuf) > server.client_max_querybuf_len) {
         sds ci = catClientInfoString(sdsempty(),c), bytes = sdsempty();
@@ -1,4 +1,4 @@
-/* quicklist.c - A doubly linked list of ziplists
+/* quicklist.c - A doubly linked list of listpacks
  *
  * Copyright (c) 2014, Matt Stancliff <matt@genges.com>
  * All rights reserved.
@@ -32,8 +32,10 @@
 #include "quicklist.h"
 #include "zmalloc.h"
 #include "ziplist.h"
+#include "listpack.h"
 #include "util.h" /* for ll2string */
 #include "lzf.h"
+#include "redisassert.h"
 
 #if defined(REDIS_TEST) || defined(REDIS_TEST_VERBOSE)
 #include <stdio.h> /* for printf (debug printing), snprintf (genstr) */
@@ -46,11 +48,11 @@
 /* Optimization levels for size-based filling */
 static const size_t optimization_level[] = {4096, 8192, 16384, 32768, 65536};
 
-/* Maximum size in bytes of any multi-element ziplist.
- * Larger values will live in their own isolated ziplists. */
+/* Maximum size in bytes of any multi-element listpack.
+ * Larger values will live in their own isolated listpacks. */
 #define SIZE_SAFETY_LIMIT 8192
 
-/* Minimum ziplist size in bytes for attempting compression. */
+/* Minimum listpack size in bytes for attempting compression. */
 #define MIN_COMPRESS_BYTES 48
 
 /* Minimum size reduction in bytes to store compressed quicklistNode data.
@@ -100,6 +102,7 @@ quicklist *quicklistCreate(void) {
     quicklist->count = 0;
     quicklist->compress = 0;
     quicklist->fill = -2;
+    quicklist->index = NULL;
     return quicklist;
 }
 
@@ -138,12 +141,12 @@ quicklist *quicklistNew(int fill, int compress) {
 REDIS_STATIC quicklistNode *quicklistCreateNode(void) {
     quicklistNode *node;
     node = zmalloc(sizeof(*node));
-    node->zl = NULL;
+    node->lp = NULL;
     node->count = 0;
     node->sz = 0;
     node->next = node->prev = NULL;
     node->encoding = QUICKLIST_NODE_ENCODING_RAW;
-    node->container = QUICKLIST_NODE_CONTAINER_ZIPLIST;
+    node->container = QUICKLIST_NODE_CONTAINER_PACKED;
     node->recompress = 0;
     return node;
 }
@@ -161,7 +164,7 @@ void quicklistRelease(quicklist *quicklist) {
     while (len--) {
         next = current->next;
 
-        zfree(current->zl);
+        zfree(current->lp);
         quicklist->count -= current->count;
 
         zfree(current);
@@ -169,17 +172,141 @@ void quicklistRelease(quicklist *quicklist) {
         quicklist->len--;
         current = next;
     }
+    quicklistReleaseIndex(quicklist);
     zfree(quicklist);
 }
 
-/* Compress the ziplist in 'node' and update encoding details.
- * Returns 1 if ziplist compressed successfully.
- * Returns 0 if compression failed or if ziplist too small to compress. */
+/* Lists with less nodes than this are not indexed, since walking them is
+ * fast enough. */
+#define QUICKLIST_INDEX_MIN_NODES 64
+
+/* Release the node index of the list, if any. */
+void quicklistReleaseIndex(quicklist *quicklist) {
+    if (quicklist->index == NULL)
+        return;
+    zfree(quicklist->index->entries);
+    zfree(quicklist->index);
+    quicklist->index = NULL;
+}
+
+/* Return the memory used by the node index of the list. */
+size_t quicklistIndexBytes(const quicklist *quicklist) {
+    if (quicklist->index == NULL)
+        return 0;
+    return sizeof(quicklistNodeIndex) +
+           quicklist->index->alloc * sizeof(quicklistIndexEntry);
+}
+
+/* Build the node index of the list walking all its nodes, if the list is
+ * long enough to need one and it is not already indexed. Returns 1 if the
+ * index was built, otherwise 0.
+ *
+ * The index is part of the memory of the list, so this is not done by
+ * quicklistIndex() itself: it is up to the caller to build it before
+ * accessing the list by position, and to account for the memory used. */
+int quicklistBuildIndex(quicklist *quicklist) {
+    quicklistNodeIndex *qi;
+    quicklistNode *node;
+    long long start = 0;
+    unsigned long j;
+
+    if (quicklist->index || quicklist->len < QUICKLIST_INDEX_MIN_NODES)
+        return 0;
+    qi = zmalloc(sizeof(*qi));
+
+    /* Leave free slots at both sides for the nodes added later. */
+    qi->alloc = quicklist->len * 2;
+    qi->first = quicklist->len / 2;
+    qi->len = quicklist->len;
+    qi->origin = 0;
+    qi->entries = zmalloc(sizeof(quicklistIndexEntry) * qi->alloc);
+    for (node = quicklist->head, j = qi->first; node; node = node->next, j++) {
+        qi->entries[j].node = node;
+        qi->entries[j].start = start;
+        start += node->count;
+    }
+    quicklist->index = qi;
+    return 1;
+}
+
+/* Make room in the index for a node at the head if 'head' is true,
+ * otherwise at the tail, moving the nodes in the middle of a new array
+ * if there are no free slots left at that side. */
+REDIS_STATIC void __quicklistIndexMakeRoom(quicklistNodeIndex *qi, int head) {
+    quicklistIndexEntry *entries;
+    unsigned long alloc, first;
+
+    if (head ? qi->first > 0 : qi->first + qi->len < qi->alloc)
+        return;
+
+    alloc = (qi->len + 1) * 2;
+    first = (alloc - qi->len) / 2;
+    entries = zmalloc(sizeof(quicklistIndexEntry) * alloc);
+    memcpy(entries + first, qi->entries + qi->first,
+           sizeof(quicklistIndexEntry) * qi->len);
+    zfree(qi->entries);
+    qi->entries = entries;
+    qi->alloc = alloc;
+    qi->first = first;
+}
+
+/* Update the index when 'new_node' is about to be inserted near 'old_node'
+ * (see __quicklistInsertNode()). The elements of 'new_node' must not be
+ * counted yet in quicklist->count. Only nodes added at the head or at the
+ * tail are handled, otherwise the index is released. */
+REDIS_STATIC void __quicklistIndexInsertNode(quicklist *quicklist,
+                                             quicklistNode *old_node,
+                                             quicklistNode *new_node,
+                                             int after) {
+    quicklistNodeIndex *qi = quicklist->index;
+    quicklistIndexEntry *e;
+
+    if (after && old_node == quicklist->tail) {
+        __quicklistIndexMakeRoom(qi, 0);
+        e = qi->entries + qi->first + qi->len;
+        e->node = new_node;
+        e->start = qi->origin + quicklist->count;
+        qi->len++;
+    } else if (!after && old_node == quicklist->head) {
+        __quicklistIndexMakeRoom(qi, 1);
+        qi->first--;
+        qi->origin -= new_node->count;
+        e = qi->entries + qi->first;
+        e->node = new_node;
+        e->start = qi->origin;
+        qi->len++;
+    } else {
+        quicklistReleaseIndex(quicklist);
+    }
+}
+
+/* Update the index when 'delta' elements were added to the head node (or
+ * removed from it if negative), at any position inside the node. */
+REDIS_STATIC void __quicklistIndexUpdateHead(quicklist *quicklist,
+                                             int delta) {
+    quicklistNodeIndex *qi = quicklist->index;
+
+    qi->origin -= delta;
+    qi->entries[qi->first].start -= delta;
+}
+
+/* Compress the listpack in 'node' and update encoding details.
+ * Returns 1 if listpack compressed successfully.
+ * Returns 0 if compression failed or if listpack too small to compress. */
 REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
 #ifdef REDIS_TEST
     node->attempted_compress = 1;
 #endif
 
+    /* The head and the tail are never compressed: they are accessed
+     * without going through the compression depth logic. */
+    assert(node->prev && node->next);
+
+    /* Clear the flag even if we end up not compressing the node: a
+     * stale flag would make a later quicklistRecompressOnly() compress
+     * the node after it became the head or the tail. */
+    node->recompress = 0;
+
     /* Don't bother compressing small values */
     if (node->sz < MIN_COMPRESS_BYTES)
         return 0;
@@ -187,7 +314,7 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
     quicklistLZF *lzf = zmalloc(sizeof(*lzf) + node->sz);
 
     /* Cancel if compression fails or doesn't compress small enough */
-    if (((lzf->sz = lzf_compress(node->zl, node->sz, lzf->compressed,
+    if (((lzf->sz = lzf_compress(node->lp, node->sz, lzf->compressed,
                                  node->sz)) == 0) ||
         lzf->sz + MIN_COMPRESS_IMPROVE >= node->sz) {
         /* lzf_compress aborts/rejects compression if value not compressable. */
@@ -195,10 +322,9 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
         return 0;
     }
     lzf = zrealloc(lzf, sizeof(*lzf) + lzf->sz);
-    zfree(node->zl);
-    node->zl = (unsigned char *)lzf;
+    zfree(node->lp);
+    node->lp = (unsigned char *)lzf;
     node->encoding = QUICKLIST_NODE_ENCODING_LZF;
-    node->recompress = 0;
     return 1;
 }
 
@@ -210,7 +336,7 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
         }                                                                      \
     } while (0)
 
-/* Uncompress the ziplist in 'node' and update encoding details.
+/* Uncompress the listpack in 'node' and update encoding details.
  * Returns 1 on successful decode, 0 on failure to decode. */
 REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 #ifdef REDIS_TEST
@@ -218,14 +344,14 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 #endif
 
     void *decompressed = zmalloc(node->sz);
-    quicklistLZF *lzf = (quicklistLZF *)node->zl;
+    quicklistLZF *lzf = (quicklistLZF *)node->lp;
     if (lzf_decompress(lzf->compressed, lzf->sz, decompressed, node->sz) == 0) {
         /* Someone requested decompress, but we can't decompress.  Not good. */
         zfree(decompressed);
         return 0;
     }
     zfree(lzf);
-    node->zl = decompressed;
+    node->lp = decompressed;
     node->encoding = QUICKLIST_NODE_ENCODING_RAW;
     return 1;
 }
@@ -251,7 +377,7 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
  * Pointer to LZF data is assigned to '*data'.
  * Return value is the length of compressed LZF data. */
 size_t quicklistGetLzf(const quicklistNode *node, void **data) {
-    quicklistLZF *lzf = (quicklistLZF *)node->zl;
+    quicklistLZF *lzf = (quicklistLZF *)node->lp;
     *data = lzf->compressed;
     return lzf->sz;
 }
@@ -313,7 +439,9 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
         if (forward == node || reverse == node)
             in_depth = 1;
 
-        if (forward == reverse)
+        /* We passed into compress depth of opposite side of the quicklist
+         * so there's no need to compress anything and we can exit. */
+        if (forward == reverse || forward->next == reverse)
             return;
 
         forward = forward->next;
@@ -352,6 +480,9 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
 REDIS_STATIC void __quicklistInsertNode(quicklist *quicklist,
                                         quicklistNode *old_node,
                                         quicklistNode *new_node, int after) {
+    if (quicklist->index)
+        __quicklistIndexInsertNode(quicklist, old_node, new_node, after);
+
     if (after) {
         new_node->prev = old_node;
         if (old_node) {
@@ -422,23 +553,25 @@ REDIS_STATIC int _quicklistNodeAllowInsert(const quicklistNode *node,
     if (unlikely(!node))
         return 0;
 
-    int ziplist_overhead;
-    /* size of previous offset */
-    if (sz < 254)
-        ziplist_overhead = 1;
+    int listpack_overhead;
+    /* size of the encoding header */
+    if (sz < 64)
+        listpack_overhead = 1;
+    else if (likely(sz < 4096))
+        listpack_overhead = 2;
     else
-        ziplist_overhead = 5;
+        listpack_overhead = 5;
 
-    /* size of forward offset */
-    if (sz < 64)
-        ziplist_overhead += 1;
-    else if (likely(sz < 16384))
-        ziplist_overhead += 2;
+    /* size of the back length, that also covers the header */
+    if (sz + listpack_overhead < 128)
+        listpack_overhead += 1;
+    else if (likely(sz + listpack_overhead < 16384))
+        listpack_overhead += 2;
     else
-        ziplist_overhead += 5;
+        listpack_overhead += 5;
 
     /* new_sz overestimates if 'sz' encodes to an integer type */
-    unsigned int new_sz = node->sz + sz + ziplist_overhead;
+    unsigned int new_sz = node->sz + sz + listpack_overhead;
     if (likely(_quicklistNodeSizeMeetsOptimizationRequirement(new_sz, fill)))
         return 1;
     else if (!sizeMeetsSafetyLimit(new_sz))
@@ -455,9 +588,9 @@ REDIS_STATIC int _quicklistNodeAllowMerge(const quicklistNode *a,
     if (!a || !b)
         return 0;
 
-    /* approximate merged ziplist size (- 11 to remove one ziplist
+    /* approximate merged listpack size (- 7 to remove one listpack
      * header/trailer) */
-    unsigned int merge_sz = a->sz + b->sz - 11;
+    unsigned int merge_sz = a->sz + b->sz - 7;
     if (likely(_quicklistNodeSizeMeetsOptimizationRequirement(merge_sz, fill)))
         return 1;
     else if (!sizeMeetsSafetyLimit(merge_sz))
@@ -470,7 +603,7 @@ REDIS_STATIC int _quicklistNodeAllowMerge(const quicklistNode *a,
 
 #define quicklistNodeUpdateSz(node)                                            \
     do {                                                                       \
-        (node)->sz = ziplistBlobLen((node)->zl);                               \
+        (node)->sz = lpBytes((node)->lp);                                      \
     } while (0)
 
 /* Add new entry to head node of quicklist.
@@ -481,18 +614,19 @@ int quicklistPushHead(quicklist *quicklist, void *value, size_t sz) {
     quicklistNode *orig_head = quicklist->head;
     if (likely(
             _quicklistNodeAllowInsert(quicklist->head, quicklist->fill, sz))) {
-        quicklist->head->zl =
-            ziplistPush(quicklist->head->zl, value, sz, ZIPLIST_HEAD);
+        quicklist->head->lp = lpPrepend(quicklist->head->lp, value, sz);
         quicklistNodeUpdateSz(quicklist->head);
     } else {
         quicklistNode *node = quicklistCreateNode();
-        node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        node->lp = lpPrepend(lpNew(), value, sz);
 
         quicklistNodeUpdateSz(node);
         _quicklistInsertNodeBefore(quicklist, quicklist->head, node);
     }
     quicklist->count++;
     quicklist->head->count++;
+    if (quicklist->index)
+        __quicklistIndexUpdateHead(quicklist, 1);
     return (orig_head != quicklist->head);
 }
 
@@ -504,12 +638,11 @@ int quicklistPushTail(quicklist *quicklist, void *value, size_t sz) {
     quicklistNode *orig_tail = quicklist->tail;
     if (likely(
             _quicklistNodeAllowInsert(quicklist->tail, quicklist->fill, sz))) {
-        quicklist->tail->zl =
-            ziplistPush(quicklist->tail->zl, value, sz, ZIPLIST_TAIL);
+        quicklist->tail->lp = lpAppend(quicklist->tail->lp, value, sz);
         quicklistNodeUpdateSz(quicklist->tail);
     } else {
         quicklistNode *node = quicklistCreateNode();
-        node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_TAIL);
+        node->lp = lpAppend(lpNew(), value, sz);
 
         quicklistNodeUpdateSz(node);
         _quicklistInsertNodeAfter(quicklist, quicklist->tail, node);
@@ -519,15 +652,15 @@ int quicklistPushTail(quicklist *quicklist, void *value, size_t sz) {
     return (orig_tail != quicklist->tail);
 }
 
-/* Create new node consisting of a pre-formed ziplist.
- * Used for loading RDBs where entire ziplists have been stored
+/* Create new node consisting of a pre-formed listpack.
+ * Used for loading RDBs where entire listpacks have been stored
  * to be retrieved later. */
-void quicklistAppendZiplist(quicklist *quicklist, unsigned char *zl) {
+void quicklistAppendListpack(quicklist *quicklist, unsigned char *lp) {
     quicklistNode *node = quicklistCreateNode();
 
-    node->zl = zl;
-    node->count = ziplistLen(node->zl);
-    node->sz = ziplistBlobLen(zl);
+    node->lp = lp;
+    node->count = lpLength(node->lp);
+    node->sz = lpBytes(lp);
 
     _quicklistInsertNodeAfter(quicklist, quicklist->tail, node);
     quicklist->count += node->count;
@@ -536,7 +669,7 @@ void quicklistAppendZiplist(quicklist *quicklist, unsigned char *zl) {
 /* Append all values of ziplist 'zl' individually into 'quicklist'.
  *
  * This allows us to restore old RDB ziplists into new quicklists
- * with smaller ziplist sizes than the saved RDB ziplist.
+ * made of listpacks, with the node sizes of the current configuration.
  *
  * Returns 'quicklist' argument. Frees passed-in ziplist 'zl' */
 quicklist *quicklistAppendValuesFromZiplist(quicklist *quicklist,
@@ -578,6 +711,21 @@ quicklist *quicklistCreateFromZiplist(int fill, int compress,
 
 REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
                                      quicklistNode *node) {
+    /* Only nodes removed from the head or the tail are removed from the
+     * index, otherwise the index is released. */
+    if (quicklist->index) {
+        quicklistNodeIndex *qi = quicklist->index;
+        if (node == quicklist->head) {
+            qi->origin += node->count;
+            qi->first++;
+            qi->len--;
+        } else if (node == quicklist->tail) {
+            qi->len--;
+        } else {
+            quicklistReleaseIndex(quicklist);
+        }
+    }
+
     if (node->next)
         node->next->prev = node->prev;
     if (node->prev)
@@ -597,7 +745,7 @@ REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
 
     quicklist->count -= node->count;
 
-    zfree(node->zl);
+    zfree(node->lp);
     zfree(node);
     quicklist->len--;
 }
@@ -609,12 +757,19 @@ REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
  *       already had to get *p from an uncompressed node somewhere.
  *
  * Returns 1 if the entire node was deleted, 0 if node still exists.
- * Also updates in/out param 'p' with the next offset in the ziplist. */
+ * Also updates in/out param 'p' with the next offset in the listpack. */
 REDIS_STATIC int quicklistDelIndex(quicklist *quicklist, quicklistNode *node,
                                    unsigned char **p) {
     int gone = 0;
 
-    node->zl = ziplistDelete(node->zl, p);
+    if (quicklist->index) {
+        if (node == quicklist->head)
+            __quicklistIndexUpdateHead(quicklist, -1);
+        else if (node != quicklist->tail)
+            quicklistReleaseIndex(quicklist);
+    }
+
+    node->lp = lpDelete(node->lp, *p, p);
     node->count--;
     if (node->count == 0) {
         gone = 1;
@@ -630,7 +785,7 @@ REDIS_STATIC int quicklistDelIndex(quicklist *quicklist, quicklistNode *node,
 /* Delete one element represented by 'entry'
  *
  * 'entry' stores enough metadata to delete the proper position in
- * the correct ziplist in the correct quicklist node. */
+ * the correct listpack in the correct quicklist node. */
 void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry) {
     quicklistNode *prev = entry->node->prev;
     quicklistNode *next = entry->node->next;
@@ -656,7 +811,7 @@ void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry) {
      *   - [1, 2, 3] => delete offset 1 => [1, 3]: next element still offset 1
      *   - [1, 2, 3] => delete offset 0 => [2, 3]: next element still offset 0
      *  if we deleted the last element at offet N and now
-     *  length of this ziplist is N-1, the next call into
+     *  length of this listpack is N-1, the next call into
      *  quicklistNext() will jump to the next node. */
 }
 
@@ -669,8 +824,8 @@ int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data,
     quicklistEntry entry;
     if (likely(quicklistIndex(quicklist, index, &entry))) {
         /* quicklistIndex provides an uncompressed node */
-        entry.node->zl = ziplistDelete(entry.node->zl, &entry.zi);
-        entry.node->zl = ziplistInsert(entry.node->zl, entry.zi, data, sz);
+        entry.node->lp = lpInsert(entry.node->lp, data, sz, entry.zi,
+                                  LP_REPLACE, NULL);
         quicklistNodeUpdateSz(entry.node);
         quicklistCompress(quicklist, entry.node);
         return 1;
@@ -679,9 +834,9 @@ int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data,
     }
 }
 
-/* Given two nodes, try to merge their ziplists.
+/* Given two nodes, try to merge their listpacks.
  *
- * This helps us not have a quicklist with 3 element ziplists if
+ * This helps us not have a quicklist with 3 element listpacks if
  * our fill factor can handle much higher levels.
  *
  * Note: 'a' must be to the LEFT of 'b'.
@@ -692,24 +847,24 @@ int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data,
  *
  * Returns the input node picked to merge against or NULL if
  * merging was not possible. */
-REDIS_STATIC quicklistNode *_quicklistZiplistMerge(quicklist *quicklist,
+REDIS_STATIC quicklistNode *_quicklistListpackMerge(quicklist *quicklist,
                                                    quicklistNode *a,
                                                    quicklistNode *b) {
     D("Requested merge (a,b) (%u, %u)", a->count, b->count);
 
     quicklistDecompressNode(a);
     quicklistDecompressNode(b);
-    if ((ziplistMerge(&a->zl, &b->zl))) {
-        /* We merged ziplists! Now remove the unused quicklistNode. */
+    if ((lpMerge(&a->lp, &b->lp))) {
+        /* We merged listpacks! Now remove the unused quicklistNode. */
         quicklistNode *keep = NULL, *nokeep = NULL;
-        if (!a->zl) {
+        if (!a->lp) {
             nokeep = a;
             keep = b;
-        } else if (!b->zl) {
+        } else if (!b->lp) {
             nokeep = b;
             keep = a;
         }
-        keep->count = ziplistLen(keep->zl);
+        keep->count = lpLength(keep->lp);
         quicklistNodeUpdateSz(keep);
 
         nokeep->count = 0;
@@ -722,7 +877,7 @@ REDIS_STATIC quicklistNode *_quicklistZiplistMerge(quicklist *quicklist,
     }
 }
 
-/* Attempt to merge ziplists within two nodes on either side of 'center'.
+/* Attempt to merge listpacks within two nodes on either side of 'center'.
  *
  * We attempt to merge:
  *   - (center->prev->prev, center->prev)
@@ -750,19 +905,19 @@ REDIS_STATIC void _quicklistMergeNodes(quicklist *quicklist,
 
     /* Try to merge prev_prev and prev */
     if (_quicklistNodeAllowMerge(prev, prev_prev, fill)) {
-        _quicklistZiplistMerge(quicklist, prev_prev, prev);
+        _quicklistListpackMerge(quicklist, prev_prev, prev);
         prev_prev = prev = NULL; /* they could have moved, invalidate them. */
     }
 
     /* Try to merge next and next_next */
     if (_quicklistNodeAllowMerge(next, next_next, fill)) {
-        _quicklistZiplistMerge(quicklist, next, next_next);
+        _quicklistListpackMerge(quicklist, next, next_next);
         next = next_next = NULL; /* they could have moved, invalidate them. */
     }
 
     /* Try to merge center node and previous node */
     if (_quicklistNodeAllowMerge(center, center->prev, fill)) {
-        target = _quicklistZiplistMerge(quicklist, center->prev, center);
+        target = _quicklistListpackMerge(quicklist, center->prev, center);
         center = NULL; /* center could have been deleted, invalidate it. */
     } else {
         /* else, we didn't merge here, but target needs to be valid below. */
@@ -771,7 +926,7 @@ REDIS_STATIC void _quicklistMergeNodes(quicklist *quicklist,
 
     /* Use result of center merge (or original) to merge with next node. */
     if (_quicklistNodeAllowMerge(target, target->next, fill)) {
-        _quicklistZiplistMerge(quicklist, target, target->next);
+        _quicklistListpackMerge(quicklist, target, target->next);
     }
 }
 
@@ -796,13 +951,13 @@ REDIS_STATIC void _quicklistMergeNodes(quicklist *quicklist,
  * Returns newly created node or NULL if split not possible. */
 REDIS_STATIC quicklistNode *_quicklistSplitNode(quicklistNode *node, int offset,
                                                 int after) {
-    size_t zl_sz = node->sz;
+    size_t lp_sz = node->sz;
 
     quicklistNode *new_node = quicklistCreateNode();
-    new_node->zl = zmalloc(zl_sz);
+    new_node->lp = zmalloc(lp_sz);
 
-    /* Copy original ziplist so we can split it */
-    memcpy(new_node->zl, node->zl, zl_sz);
+    /* Copy original listpack so we can split it */
+    memcpy(new_node->lp, node->lp, lp_sz);
 
     /* -1 here means "continue deleting until the list ends" */
     int orig_start = after ? offset + 1 : 0;
@@ -813,12 +968,12 @@ REDIS_STATIC quicklistNode *_quicklistSplitNode(quicklistNode *node, int offset,
     D("After %d (%d); ranges: [%d, %d], [%d, %d]", after, offset, orig_start,
       orig_extent, new_start, new_extent);
 
-    node->zl = ziplistDeleteRange(node->zl, orig_start, orig_extent);
-    node->count = ziplistLen(node->zl);
+    node->lp = lpDeleteRange(node->lp, orig_start, orig_extent);
+    node->count = lpLength(node->lp);
     quicklistNodeUpdateSz(node);
 
-    new_node->zl = ziplistDeleteRange(new_node->zl, new_start, new_extent);
-    new_node->count = ziplistLen(new_node->zl);
+    new_node->lp = lpDeleteRange(new_node->lp, new_start, new_extent);
+    new_node->count = lpLength(new_node->lp);
     quicklistNodeUpdateSz(new_node);
 
     D("After split lengths: orig (%d), new (%d)", node->count, new_node->count);
@@ -836,11 +991,15 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
     quicklistNode *node = entry->node;
     quicklistNode *new_node = NULL;
 
+    /* Nodes may be split and merged here: just drop the index. */
+    quicklistReleaseIndex(quicklist);
+
     if (!node) {
         /* we have no reference node, so let's create only node in the list */
         D("No node given!");
         new_node = quicklistCreateNode();
-        new_node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        new_node->lp = lpAppend(lpNew(), value, sz);
+        quicklistNodeUpdateSz(new_node);
         __quicklistInsertNode(quicklist, NULL, new_node, after);
         new_node->count++;
         quicklist->count++;
@@ -855,7 +1014,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
     }
 
     if (after && (entry->offset == node->count)) {
-        D("At Tail of current ziplist");
+        D("At Tail of current listpack");
         at_tail = 1;
         if (!_quicklistNodeAllowInsert(node->next, fill, sz)) {
             D("Next node is full too.");
@@ -876,19 +1035,14 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
     if (!full && after) {
         D("Not full, inserting after current position.");
         quicklistDecompressNodeForUse(node);
-        unsigned char *next = ziplistNext(node->zl, entry->zi);
-        if (next == NULL) {
-            node->zl = ziplistPush(node->zl, value, sz, ZIPLIST_TAIL);
-        } else {
-            node->zl = ziplistInsert(node->zl, next, value, sz);
-        }
+        node->lp = lpInsert(node->lp, value, sz, entry->zi, LP_AFTER, NULL);
         node->count++;
         quicklistNodeUpdateSz(node);
         quicklistRecompressOnly(quicklist, node);
     } else if (!full && !after) {
         D("Not full, inserting before current position.");
         quicklistDecompressNodeForUse(node);
-        node->zl = ziplistInsert(node->zl, entry->zi, value, sz);
+        node->lp = lpInsert(node->lp, value, sz, entry->zi, LP_BEFORE, NULL);
         node->count++;
         quicklistNodeUpdateSz(node);
         quicklistRecompressOnly(quicklist, node);
@@ -898,7 +1052,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         D("Full and tail, but next isn't full; inserting next node head");
         new_node = node->next;
         quicklistDecompressNodeForUse(new_node);
-        new_node->zl = ziplistPush(new_node->zl, value, sz, ZIPLIST_HEAD);
+        new_node->lp = lpPrepend(new_node->lp, value, sz);
         new_node->count++;
         quicklistNodeUpdateSz(new_node);
         quicklistRecompressOnly(quicklist, new_node);
@@ -908,7 +1062,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         D("Full and head, but prev isn't full, inserting prev node tail");
         new_node = node->prev;
         quicklistDecompressNodeForUse(new_node);
-        new_node->zl = ziplistPush(new_node->zl, value, sz, ZIPLIST_TAIL);
+        new_node->lp = lpAppend(new_node->lp, value, sz);
         new_node->count++;
         quicklistNodeUpdateSz(new_node);
         quicklistRecompressOnly(quicklist, new_node);
@@ -918,7 +1072,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
          *   - create new node and attach to quicklist */
         D("\tprovisioning new node...");
         new_node = quicklistCreateNode();
-        new_node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        new_node->lp = lpAppend(lpNew(), value, sz);
         new_node->count++;
         quicklistNodeUpdateSz(new_node);
         __quicklistInsertNode(quicklist, node, new_node, after);
@@ -928,8 +1082,10 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         D("\tsplitting node...");
         quicklistDecompressNodeForUse(node);
         new_node = _quicklistSplitNode(node, entry->offset, after);
-        new_node->zl = ziplistPush(new_node->zl, value, sz,
-                                   after ? ZIPLIST_HEAD : ZIPLIST_TAIL);
+        if (after)
+            new_node->lp = lpPrepend(new_node->lp, value, sz);
+        else
+            new_node->lp = lpAppend(new_node->lp, value, sz);
         new_node->count++;
         quicklistNodeUpdateSz(new_node);
         __quicklistInsertNode(quicklist, node, new_node, after);
@@ -974,6 +1130,9 @@ int quicklistDelRange(quicklist *quicklist, const long start,
     if (!quicklistIndex(quicklist, start, &entry))
         return 0;
 
+    /* Nodes in the middle may be removed or trimmed. */
+    quicklistReleaseIndex(quicklist);
+
     D("Quicklist delete request for start %ld, count %ld, extent: %ld", start,
       count, extent);
     quicklistNode *node = entry.node;
@@ -986,7 +1145,7 @@ int quicklistDelRange(quicklist *quicklist, const long start,
         int delete_entire_node = 0;
         if (entry.offset == 0 && extent >= node->count) {
             /* If we are deleting more than the count of this node, we
-             * can just delete the entire node without ziplist math. */
+             * can just delete the entire node without listpack math. */
             delete_entire_node = 1;
             del = node->count;
         } else if (entry.offset >= 0 && extent >= node->count) {
@@ -1020,7 +1179,7 @@ int quicklistDelRange(quicklist *quicklist, const long start,
             __quicklistDelNode(quicklist, node);
         } else {
             quicklistDecompressNodeForUse(node);
-            node->zl = ziplistDeleteRange(node->zl, entry.offset, del);
+            node->lp = lpDeleteRange(node->lp, entry.offset, del);
             quicklistNodeUpdateSz(node);
             node->count -= del;
             quicklist->count -= del;
@@ -1038,9 +1197,27 @@ int quicklistDelRange(quicklist *quicklist, const long start,
     return 1;
 }
 
-/* Passthrough to ziplistCompare() */
+/* Return 1 if the listpack element at 'p1' is equal to the string 'p2' of
+ * length 'p2_len', 0 otherwise. Like ziplistCompare(), integer encoded
+ * elements are compared against the integer value of 'p2', if any. */
 int quicklistCompare(unsigned char *p1, unsigned char *p2, int p2_len) {
-    return ziplistCompare(p1, p2, p2_len);
+    return lpCompare(p1, p2, p2_len);
+}
+
+/* Populate the value fields of 'entry' with the element at 'entry->zi'
+ * like ziplistGet() does: 'value' and 'sz' for strings, or 'value' set to
+ * NULL and 'longval' for integers. Returns 0 if 'entry->zi' is NULL. */
+REDIS_STATIC int quicklistGetEntryValue(quicklistEntry *entry) {
+    int64_t count;
+
+    if (entry->zi == NULL)
+        return 0;
+    entry->value = lpGet(entry->zi, &count, NULL);
+    if (entry->value)
+        entry->sz = count;
+    else
+        entry->longval = count;
+    return 1;
 }
 
 /* Returns a quicklist iterator 'iter'. After the initialization every
@@ -1136,17 +1313,17 @@ int quicklistNext(quicklistIter *iter, quicklistEntry *entry) {
     if (!iter->zi) {
         /* If !zi, use current index. */
         quicklistDecompressNodeForUse(iter->current);
-        iter->zi = ziplistIndex(iter->current->zl, iter->offset);
+        iter->zi = lpSeek(iter->current->lp, iter->offset);
     } else {
         /* else, use existing iterator offset and get prev/next as necessary. */
         if (iter->direction == AL_START_HEAD) {
-            nextFn = ziplistNext;
+            nextFn = lpNext;
             offset_update = 1;
         } else if (iter->direction == AL_START_TAIL) {
-            nextFn = ziplistPrev;
+            nextFn = lpPrev;
             offset_update = -1;
         }
-        iter->zi = nextFn(iter->current->zl, iter->zi);
+        iter->zi = nextFn(iter->current->lp, iter->zi);
         iter->offset += offset_update;
     }
 
@@ -1154,11 +1331,11 @@ int quicklistNext(quicklistIter *iter, quicklistEntry *entry) {
     entry->offset = iter->offset;
 
     if (iter->zi) {
-        /* Populate value from existing ziplist position */
-        ziplistGet(entry->zi, &entry->value, &entry->sz, &entry->longval);
+        /* Populate value from existing listpack position */
+        quicklistGetEntryValue(entry);
         return 1;
     } else {
-        /* We ran out of ziplist entries.
+        /* We ran out of listpack entries.
          * Pick next node, update offset, then re-run retrieval. */
         quicklistCompress(iter->quicklist, iter->current);
         if (iter->direction == AL_START_HEAD) {
@@ -1193,13 +1370,13 @@ quicklist *quicklistDup(quicklist *orig) {
         quicklistNode *node = quicklistCreateNode();
 
         if (current->encoding == QUICKLIST_NODE_ENCODING_LZF) {
-            quicklistLZF *lzf = (quicklistLZF *)current->zl;
+            quicklistLZF *lzf = (quicklistLZF *)current->lp;
             size_t lzf_sz = sizeof(*lzf) + lzf->sz;
-            node->zl = zmalloc(lzf_sz);
-            memcpy(node->zl, current->zl, lzf_sz);
+            node->lp = zmalloc(lzf_sz);
+            memcpy(node->lp, current->lp, lzf_sz);
         } else if (current->encoding == QUICKLIST_NODE_ENCODING_RAW) {
-            node->zl = zmalloc(current->sz);
-            memcpy(node->zl, current->zl, current->sz);
+            node->lp = zmalloc(current->sz);
+            memcpy(node->lp, current->lp, current->sz);
         }
 
         node->count = current->count;
@@ -1243,14 +1420,40 @@ int quicklistIndex(const quicklist *quicklist, const long long idx,
     if (index >= quicklist->count)
         return 0;
 
-    while (likely(n)) {
-        if ((accum + n->count) > index) {
-            break;
-        } else {
-            D("Skipping over (%p) %u at accum %lld", (void *)n, n->count,
-              accum);
-            accum += n->count;
-            n = forward ? n->next : n->prev;
+    if (quicklist->index) {
+        /* Binary search the last node starting at or before the element. */
+        quicklistNodeIndex *qi = quicklist->index;
+        unsigned long lo, hi, mid;
+        long long pos;
+        unsigned long long h;
+
+        pos = qi->origin +
+              (long long)(forward ? index : quicklist->count - 1 - index);
+        lo = qi->first;
+        hi = qi->first + qi->len - 1;
+        while (lo < hi) {
+            mid = lo + (hi - lo + 1) / 2;
+            if (qi->entries[mid].start <= pos)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        n = qi->entries[lo].node;
+        /* 'h' is the offset of the element from the head of the node,
+         * and 'accum' the number of elements skipped in the other nodes,
+         * like the walk below would compute. */
+        h = pos - qi->entries[lo].start;
+        accum = forward ? index - h : index - (n->count - 1 - h);
+    } else {
+        while (likely(n)) {
+            if ((accum + n->count) > index) {
+                break;
+            } else {
+                D("Skipping over (%p) %u at accum %lld", (void *)n, n->count,
+                  accum);
+                accum += n->count;
+                n = forward ? n->next : n->prev;
+            }
         }
     }
 
@@ -1271,8 +1474,8 @@ int quicklistIndex(const quicklist *quicklist, const long long idx,
     }
 
     quicklistDecompressNodeForUse(entry->node);
-    entry->zi = ziplistIndex(entry->node->zl, entry->offset);
-    ziplistGet(entry->zi, &entry->value, &entry->sz, &entry->longval);
+    entry->zi = lpSeek(entry->node->lp, entry->offset);
+    quicklistGetEntryValue(entry);
     /* The caller will use our result, so we don't re-compress here.
      * The caller can recompress or delete the node as needed. */
     return 1;
@@ -1284,28 +1487,22 @@ void quicklistRotate(quicklist *quicklist) {
         return;
 
     /* First, get the tail entry */
-    unsigned char *p = ziplistIndex(quicklist->tail->zl, -1);
+    unsigned char *p = lpSeek(quicklist->tail->lp, -1);
     unsigned char *value;
-    long long longval;
-    unsigned int sz;
-    char longstr[32] = {0};
-    ziplistGet(p, &value, &sz, &longval);
+    int64_t sz;
+    unsigned char longstr[LP_INTBUF_SIZE];
 
-    /* If value found is NULL, then ziplistGet populated longval instead */
-    if (!value) {
-        /* Write the longval as a string so we can re-add it */
-        sz = ll2string(longstr, sizeof(longstr), longval);
-        value = (unsigned char *)longstr;
-    }
+    /* Integers are returned as strings in 'longstr' so we can re-add them */
+    value = lpGet(p, &sz, longstr);
 
     /* Add tail entry to head (must happen before tail is deleted). */
     quicklistPushHead(quicklist, value, sz);
 
-    /* If quicklist has only one node, the head ziplist is also the
-     * tail ziplist and PushHead() could have reallocated our single ziplist,
-     * which would make our pre-existing 'p' unusable. */
+    /* If quicklist has only one node, the head listpack is also the
+     * tail listpack and PushHead() could have reallocated our single
+     * listpack, which would make our pre-existing 'p' unusable. */
     if (quicklist->len == 1) {
-        p = ziplistIndex(quicklist->tail->zl, -1);
+        p = lpSeek(quicklist->tail->lp, -1);
     }
 
     /* Remove tail entry. */
@@ -1326,8 +1523,7 @@ int quicklistPopCustom(quicklist *quicklist, int where, unsigned char **data,
                        void *(*saver)(unsigned char *data, unsigned int sz)) {
     unsigned char *p;
     unsigned char *vstr;
-    unsigned int vlen;
-    long long vlong;
+    int64_t vlen;
     int pos = (where == QUICKLIST_HEAD) ? 0 : -1;
 
     if (quicklist->count == 0)
@@ -1349,8 +1545,9 @@ int quicklistPopCustom(quicklist *quicklist, int where, unsigned char **data,
         return 0;
     }
 
-    p = ziplistIndex(node->zl, pos);
-    if (ziplistGet(p, &vstr, &vlen, &vlong)) {
+    p = lpSeek(node->lp, pos);
+    if (p) {
+        vstr = lpGet(p, &vlen, NULL);
         if (vstr) {
             if (data)
                 *data = saver(vstr, vlen);
@@ -1360,7 +1557,7 @@ int quicklistPopCustom(quicklist *quicklist, int where, unsigned char **data,
             if (data)
                 *data = NULL;
             if (sval)
-                *sval = vlong;
+                *sval = vlen;
         }
         quicklistDelIndex(quicklist, node, &p);
         return 1;
@@ -1413,8 +1610,10 @@ void quicklistPush(quicklist *quicklist, void *value, const size_t sz,
 /* The rest of this file is test cases and test helpers. */
 #ifdef REDIS_TEST
 #include <stdint.h>
+#include <stdlib.h>
 #include <sys/time.h>
 
+#undef assert
 #define assert(_e)                                                             \
     do {                                                                       \
         if (!(_e)) {                                                           \
@@ -1452,9 +1651,9 @@ static void ql_info(quicklist *ql) {
     printf("Container length: %lu\n", ql->len);
     printf("Container size: %lu\n", ql->count);
     if (ql->head)
-        printf("\t(zsize head: %d)\n", ziplistLen(ql->head->zl));
+        printf("\t(zsize head: %d)\n", lpLength(ql->head->lp));
     if (ql->tail)
-        printf("\t(zsize tail: %d)\n", ziplistLen(ql->tail->zl));
+        printf("\t(zsize tail: %d)\n", lpLength(ql->tail->lp));
     printf("\n");
 #else
     UNUSED(ql);
@@ -1552,18 +1751,18 @@ static int _ql_verify(quicklist *ql, uint32_t len, uint32_t count,
     }
 
     if (ql->head && head_count != ql->head->count &&
-        head_count != ziplistLen(ql->head->zl)) {
+        head_count != lpLength(ql->head->lp)) {
         yell("quicklist head count wrong: expected %d, "
              "got cached %d vs. actual %d",
-             head_count, ql->head->count, ziplistLen(ql->head->zl));
+             head_count, ql->head->count, lpLength(ql->head->lp));
         errors++;
     }
 
     if (ql->tail && tail_count != ql->tail->count &&
-        tail_count != ziplistLen(ql->tail->zl)) {
+        tail_count != lpLength(ql->tail->lp)) {
         yell("quicklist tail count wrong: expected %d, "
              "got cached %u vs. actual %d",
-             tail_count, ql->tail->count, ziplistLen(ql->tail->zl));
+             tail_count, ql->tail->count, lpLength(ql->tail->lp));
         errors++;
     }
 
@@ -1596,6 +1795,29 @@ static int _ql_verify(quicklist *ql, uint32_t len, uint32_t count,
         }
     }
 
+    if (ql->index) {
+        quicklistNodeIndex *qi = ql->index;
+        quicklistNode *node = ql->head;
+        long long start = qi->origin;
+
+        if (qi->len != ql->len) {
+            yell("quicklist index length wrong: expected %lu, got %lu",
+                 ql->len, qi->len);
+            errors++;
+        }
+        for (unsigned long i = 0; node && i < qi->len; i++, node = node->next) {
+            quicklistIndexEntry *e = qi->entries + qi->first + i;
+            if (e->node != node || e->start != start) {
+                yell("quicklist index entry %lu wrong: expected node %p "
+                     "at %lld, got node %p at %lld",
+                     i, (void *)node, start, (void *)e->node, e->start);
+                errors++;
+                break;
+            }
+            start += node->count;
+        }
+    }
+
     if (!errors)
         OK;
     return errors;
@@ -2117,6 +2339,51 @@ int quicklistTest(int argc, char *argv[]) {
             }
         }
 
+        TEST("node index follows pushes and pops at both ends") {
+            quicklist *ql = quicklistNew(4, options[_i]);
+            long long head = 0, tail = 0; /* Values are in [head, tail). */
+            char *s;
+            for (int i = 0; i < 2000; i++) {
+                s = genstr("v", tail++);
+                quicklistPushTail(ql, s, strlen(s));
+            }
+            if (!quicklistBuildIndex(ql))
+                ERR("Node index not built for a list of %lu nodes", ql->len);
+            for (int i = 0; i < 20000; i++) {
+                int op = rand() % 4;
+                if (op == 0) {
+                    s = genstr("v", --head);
+                    quicklistPushHead(ql, s, strlen(s));
+                } else if (op == 1) {
+                    s = genstr("v", tail++);
+                    quicklistPushTail(ql, s, strlen(s));
+                } else if (ql->count > 1) {
+                    unsigned char *data;
+                    unsigned int sz;
+                    long long lv;
+                    quicklistPop(ql, op == 2 ? QUICKLIST_HEAD : QUICKLIST_TAIL,
+                                 &data, &sz, &lv);
+                    zfree(data);
+                    if (op == 2) head++;
+                    else tail--;
+                }
+                quicklistEntry entry;
+                long long idx = rand() % ql->count;
+                char *expected = genstr("v", head + idx);
+                if (!quicklistIndex(ql, idx, &entry) ||
+                    entry.sz != strlen(expected) ||
+                    memcmp(entry.value, expected, entry.sz)) {
+                    ERR("Index %lld should be %s", idx, expected);
+                    break;
+                }
+            }
+            if (!ql->index)
+                ERR("Node index dropped for a list of %lu nodes", ql->len);
+            ql_verify(ql, ql->len, tail - head, ql->head->count,
+                      ql->tail->count);
+            quicklistRelease(ql);
+        }
+
         TEST("delete range empty list") {
             quicklist *ql = quicklistNew(-2, options[_i]);
             quicklistDelRange(ql, 5, 20);
@@ -628,26 +628,28 @@ int rdbSaveObjectType(rio *rdb, robj *o) {
         return rdbSaveType(rdb,RDB_TYPE_STRING);
     case OBJ_LIST:
         if (o->encoding == OBJ_ENCODING_QUICKLIST)
-            return rdbSaveType(rdb,RDB_TYPE_LIST_QUICKLIST);
+            return rdbSaveType(rdb,RDB_TYPE_LIST_QUICKLIST_2);
         else
             serverPanic("Unknown list encoding");
     case OBJ_SET:
         if (o->encoding == OBJ_ENCODING_INTSET)
             return rdbSaveType(rdb,RDB_TYPE_SET_INTSET);
+        else if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_SET_LISTPACK);
         else if (o->encoding == OBJ_ENCODING_HT)
             return rdbSaveType(rdb,RDB_TYPE_SET);
         else
             serverPanic("Unknown set encoding");
     case OBJ_ZSET:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_ZSET_ZIPLIST);
-        else if (o->encoding == OBJ_ENCODING_SKIPLIST)
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_ZSET_LISTPACK);
+        else if (o->encoding == OBJ_ENCODING_BTREE)
             return rdbSaveType(rdb,RDB_TYPE_ZSET_2);
         else
             serverPanic("Unknown sorted set encoding");
     case OBJ_HASH:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_HASH_ZIPLIST);
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_HASH_LISTPACK);
         else if (o->encoding == OBJ_ENCODING_HT)
             return rdbSaveType(rdb,RDB_TYPE_HASH);
         else
@@ -768,13 +770,15 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
             nwritten += n;
 
             while(node) {
+                if ((n = rdbSaveLen(rdb,node->container)) == -1) return -1;
+                nwritten += n;
                 if (quicklistNodeIsCompressed(node)) {
                     void *data;
                     size_t compress_len = quicklistGetLzf(node, &data);
                     if ((n = rdbSaveLzfBlob(rdb,data,compress_len,node->sz)) == -1) return -1;
                     nwritten += n;
                 } else {
-                    if ((n = rdbSaveRawString(rdb,node->zl,node->sz)) == -1) return -1;
+                    if ((n = rdbSaveRawString(rdb,node->lp,node->sz)) == -1) return -1;
                     nwritten += n;
                 }
                 node = node->next;
@@ -809,6 +813,11 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
         } else if (o->encoding == OBJ_ENCODING_INTSET) {
             size_t l = intsetBlobLen((intset*)o->ptr);
 
+            if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
+            nwritten += n;
+        } else if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
+
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
         } else {
@@ -816,44 +825,45 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
         }
     } else if (o->type == OBJ_ZSET) {
         /* Save a sorted set value */
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
-        } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (o->encoding == OBJ_ENCODING_BTREE) {
             zset *zs = o->ptr;
-            zskiplist *zsl = zs->zsl;
+            zbtree *zbt = zs->zbt;
+            zbtreeEntry *e;
+            zbtreeIter it;
 
-            if ((n = rdbSaveLen(rdb,zsl->length)) == -1) return -1;
+            if ((n = rdbSaveLen(rdb,zbt->length)) == -1) return -1;
             nwritten += n;
 
-            /* We save the skiplist elements from the greatest to the smallest
-             * (that's trivial since the elements are already ordered in the
-             * skiplist): this improves the load process, since the next loaded
-             * element will always be the smaller, so adding to the skiplist
-             * will always immediately stop at the head, making the insertion
-             * O(1) instead of O(log(N)). */
-            zskiplistNode *zn = zsl->tail;
-            while (zn != NULL) {
+            /* We save the elements from the greatest to the smallest (that's
+             * trivial since the elements are already ordered in the tree):
+             * this improves the load process, since the next loaded element
+             * will always be the smaller one, so the tree nodes are filled
+             * completely and never split in halves. The same would happen
+             * saving them in ascending order, but older versions of Redis
+             * loaded this order faster. */
+            for (e = zbtLast(zbt,&it); e != NULL; e = zbtPrev(&it)) {
                 if ((n = rdbSaveRawString(rdb,
-                    (unsigned char*)zn->ele,sdslen(zn->ele))) == -1)
+                    (unsigned char*)e->ele,sdslen(e->ele))) == -1)
                 {
                     return -1;
                 }
                 nwritten += n;
-                if ((n = rdbSaveBinaryDoubleValue(rdb,zn->score)) == -1)
+                if ((n = rdbSaveBinaryDoubleValue(rdb,e->score)) == -1)
                     return -1;
                 nwritten += n;
-                zn = zn->backward;
             }
         } else {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (o->type == OBJ_HASH) {
         /* Save a hash value */
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
@@ -1044,6 +1054,72 @@ int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val, long long expiretime) {
     return 1;
 }
 
+/* Save the timeouts of the fields of the hash stored at 'key', if any, as
+ * an RDB_OPCODE_HASH_FIELD_EXPIRES opcode preceding the key, followed by the
+ * number of fields and the field-time pairs. If 'o' is not NULL only the
+ * fields of the hash 'o' are saved: this is used by DUMP and MIGRATE, that
+ * may serialize a part of the value.
+ * On error -1 is returned, otherwise 1 if the opcode was saved or 0. */
+int rdbSaveHashFieldExpires(rio *rdb, redisDb *db, sds key, robj *o) {
+    dictIterator *di;
+    dictEntry *de;
+    hashFieldExpires *hfe;
+    unsigned long count = 0;
+
+    if (dictSize(db->hexpires) == 0) return 0;
+    if ((de = dictFind(db->hexpires,key)) == NULL) return 0;
+    hfe = dictGetVal(de);
+
+    if (o == NULL) {
+        count = dictSize(hfe->fields);
+    } else {
+        di = dictGetIterator(hfe->fields);
+        while((de = dictNext(di)) != NULL)
+            if (hashTypeExists(o,dictGetKey(de))) count++;
+        dictReleaseIterator(di);
+    }
+    if (count == 0) return 0;
+
+    if (rdbSaveType(rdb,RDB_OPCODE_HASH_FIELD_EXPIRES) == -1) return -1;
+    if (rdbSaveLen(rdb,count) == -1) return -1;
+    di = dictGetIterator(hfe->fields);
+    while((de = dictNext(di)) != NULL) {
+        sds field = dictGetKey(de);
+
+        if (o && !hashTypeExists(o,field)) continue;
+        if (rdbSaveRawString(rdb,(unsigned char*)field,sdslen(field)) == -1 ||
+            rdbSaveMillisecondTime(rdb,dictGetSignedIntegerVal(de)) == -1)
+        {
+            dictReleaseIterator(di);
+            return -1;
+        }
+    }
+    dictReleaseIterator(di);
+    return 1;
+}
+
+/* Load the field-time pairs of an RDB_OPCODE_HASH_FIELD_EXPIRES opcode,
+ * adding them to the dictionary 'field_expires'. Returns -1 on short read or
+ * if a field is duplicated, otherwise 0. */
+int rdbLoadHashFieldExpires(rio *rdb, dict *field_expires, int rdbver) {
+    uint64_t count;
+
+    if ((count = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+    while(count--) {
+        dictEntry *de;
+        sds field;
+
+        field = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL);
+        if (field == NULL) return -1;
+        if ((de = dictAddRaw(field_expires,field,NULL)) == NULL) {
+            sdsfree(field);
+            return -1;
+        }
+        dictSetSignedIntegerVal(de,rdbLoadMillisecondTime(rdb,rdbver));
+    }
+    return 0;
+}
+
 /* Save an AUX field. */
 ssize_t rdbSaveAuxField(rio *rdb, void *key, size_t keylen, void *val, size_t vallen) {
     ssize_t ret, len = 0;
@@ -1184,6 +1260,8 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi) {
 
             initStaticStringObject(key,keystr);
             expire = getExpire(db,&key);
+            if (o->type == OBJ_HASH &&
+                rdbSaveHashFieldExpires(rdb,db,keystr,NULL) == -1) goto werr;
             if (rdbSaveKeyValuePair(rdb,&key,o,expire) == -1) goto werr;
 
             /* When this RDB is produced as part of an AOF rewrite, move
@@ -1422,6 +1500,30 @@ robj *rdbLoadCheckModuleValue(rio *rdb, char *modulename) {
     return createStringObject("module-dummy-value",18);
 }
 
+/* Return a listpack with the same elements of the ziplist 'zl', that is
+ * freed. Used to load the small hashes and sorted sets of RDB files created
+ * before they were encoded as listpacks. */
+static unsigned char *rdbConvertZiplistToListpack(unsigned char *zl) {
+    unsigned char *lp = lpNew();
+    unsigned char *p = ziplistIndex(zl,0);
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vll;
+    char buf[LONG_STR_SIZE];
+
+    while (p != NULL) {
+        ziplistGet(p,&vstr,&vlen,&vll);
+        if (vstr == NULL) {
+            vlen = ll2string(buf,sizeof(buf),vll);
+            vstr = (unsigned char*)buf;
+        }
+        lp = lpAppend(lp,vstr,vlen);
+        p = ziplistNext(zl,p);
+    }
+    zfree(zl);
+    return lp;
+}
+
 /* Load a Redis object of the specified type from the specified file.
  * On success a newly allocated object is returned, otherwise NULL. */
 robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
@@ -1477,6 +1579,22 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                 /* Fetch integer value from element. */
                 if (isSdsRepresentableAsLongLong(sdsele,&llval) == C_OK) {
                     o->ptr = intsetAdd(o->ptr,llval,NULL);
+                } else if (len <= server.set_max_listpack_entries &&
+                           sdslen(sdsele) <= server.set_max_listpack_value)
+                {
+                    setTypeConvert(o,OBJ_ENCODING_LISTPACK);
+                } else {
+                    setTypeConvert(o,OBJ_ENCODING_HT);
+                    dictExpand(o->ptr,len);
+                }
+            }
+
+            /* Small sets of strings are loaded as listpacks, unless an
+             * element is too long. */
+            if (o->encoding == OBJ_ENCODING_LISTPACK) {
+                if (sdslen(sdsele) <= server.set_max_listpack_value) {
+                    o->ptr = lpAppend(o->ptr,(unsigned char*)sdsele,
+                                      sdslen(sdsele));
                 } else {
                     setTypeConvert(o,OBJ_ENCODING_HT);
                     dictExpand(o->ptr,len);
@@ -1508,7 +1626,6 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
         while(zsetlen--) {
             sds sdsele;
             double score;
-            zskiplistNode *znode;
 
             if ((sdsele = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
                 == NULL) return NULL;
@@ -1522,14 +1639,13 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
             /* Don't care about integer-encoded strings. */
             if (sdslen(sdsele) > maxelelen) maxelelen = sdslen(sdsele);
 
-            znode = zslInsert(zs->zsl,score,sdsele);
-            dictAdd(zs->dict,sdsele,&znode->score);
+            zsetAddNew(zs,score,sdsele);
         }
 
         /* Convert *after* loading, since sorted sets are not stored ordered. */
         if (zsetLength(o) <= server.zset_max_ziplist_entries &&
             maxelelen <= server.zset_max_ziplist_value)
-                zsetConvert(o,OBJ_ENCODING_ZIPLIST);
+                zsetConvert(o,OBJ_ENCODING_LISTPACK);
     } else if (rdbtype == RDB_TYPE_HASH) {
         uint64_t len;
         int ret;
@@ -1544,8 +1660,8 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
         if (len > server.hash_max_ziplist_entries)
             hashTypeConvert(o, OBJ_ENCODING_HT);
 
-        /* Load every field and value into the ziplist */
-        while (o->encoding == OBJ_ENCODING_ZIPLIST && len > 0) {
+        /* Load every field and value into the listpack */
+        while (o->encoding == OBJ_ENCODING_LISTPACK && len > 0) {
             len--;
             /* Load raw strings */
             if ((field = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
@@ -1553,11 +1669,9 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
             if ((value = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
                 == NULL) return NULL;
 
-            /* Add pair to ziplist */
-            o->ptr = ziplistPush(o->ptr, (unsigned char*)field,
-                    sdslen(field), ZIPLIST_TAIL);
-            o->ptr = ziplistPush(o->ptr, (unsigned char*)value,
-                    sdslen(value), ZIPLIST_TAIL);
+            /* Add pair to listpack */
+            o->ptr = lpAppend(o->ptr, (unsigned char*)field, sdslen(field));
+            o->ptr = lpAppend(o->ptr, (unsigned char*)value, sdslen(value));
 
             /* Convert to hash table if size threshold is exceeded */
             if (sdslen(field) > server.hash_max_ziplist_value ||
@@ -1593,23 +1707,41 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
 
         /* All pairs should be read by now */
         serverAssert(len == 0);
-    } else if (rdbtype == RDB_TYPE_LIST_QUICKLIST) {
+    } else if (rdbtype == RDB_TYPE_LIST_QUICKLIST ||
+               rdbtype == RDB_TYPE_LIST_QUICKLIST_2)
+    {
         if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
         o = createQuicklistObject();
         quicklistSetOptions(o->ptr, server.list_max_ziplist_size,
                             server.list_compress_depth);
 
         while (len--) {
-            unsigned char *zl =
+            uint64_t container = QUICKLIST_NODE_CONTAINER_PACKED;
+            if (rdbtype == RDB_TYPE_LIST_QUICKLIST_2 &&
+                (container = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+            if (container != QUICKLIST_NODE_CONTAINER_PACKED)
+                rdbExitReportCorruptRDB("Unknown quicklist node container %llu",
+                    (unsigned long long)container);
+
+            unsigned char *data =
                 rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,NULL);
-            if (zl == NULL) return NULL;
-            quicklistAppendZiplist(o->ptr, zl);
+            if (data == NULL) return NULL;
+            if (rdbtype == RDB_TYPE_LIST_QUICKLIST) {
+                /* Nodes of older RDB files are ziplists: their elements
+                 * are added one by one to listpack nodes. */
+                quicklistAppendValuesFromZiplist(o->ptr, data);
+            } else {
+                quicklistAppendListpack(o->ptr, data);
+            }
         }
     } else if (rdbtype == RDB_TYPE_HASH_ZIPMAP  ||
                rdbtype == RDB_TYPE_LIST_ZIPLIST ||
                rdbtype == RDB_TYPE_SET_INTSET   ||
+               rdbtype == RDB_TYPE_SET_LISTPACK ||
                rdbtype == RDB_TYPE_ZSET_ZIPLIST ||
-               rdbtype == RDB_TYPE_HASH_ZIPLIST)
+               rdbtype == RDB_TYPE_HASH_ZIPLIST ||
+               rdbtype == RDB_TYPE_ZSET_LISTPACK ||
+               rdbtype == RDB_TYPE_HASH_LISTPACK)
     {
         unsigned char *encoded =
             rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,NULL);
@@ -1624,10 +1756,10 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
          * converted. */
         switch(rdbtype) {
             case RDB_TYPE_HASH_ZIPMAP:
-                /* Convert to ziplist encoded hash. This must be deprecated
+                /* Convert to listpack encoded hash. This must be deprecated
                  * when loading dumps created by Redis 2.4 gets deprecated. */
                 {
-                    unsigned char *zl = ziplistNew();
+                    unsigned char *lp = lpNew();
                     unsigned char *zi = zipmapRewind(o->ptr);
                     unsigned char *fstr, *vstr;
                     unsigned int flen, vlen;
@@ -1636,14 +1768,14 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                     while ((zi = zipmapNext(zi, &fstr, &flen, &vstr, &vlen)) != NULL) {
                         if (flen > maxlen) maxlen = flen;
                         if (vlen > maxlen) maxlen = vlen;
-                        zl = ziplistPush(zl, fstr, flen, ZIPLIST_TAIL);
-                        zl = ziplistPush(zl, vstr, vlen, ZIPLIST_TAIL);
+                        lp = lpAppend(lp, fstr, flen);
+                        lp = lpAppend(lp, vstr, vlen);
                     }
 
                     zfree(o->ptr);
-                    o->ptr = zl;
+                    o->ptr = lp;
                     o->type = OBJ_HASH;
-                    o->encoding = OBJ_ENCODING_ZIPLIST;
+                    o->encoding = OBJ_ENCODING_LISTPACK;
 
                     if (hashTypeLength(o) > server.hash_max_ziplist_entries ||
                         maxlen > server.hash_max_ziplist_value)
@@ -1663,15 +1795,29 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                 if (intsetLen(o->ptr) > server.set_max_intset_entries)
                     setTypeConvert(o,OBJ_ENCODING_HT);
                 break;
+            case RDB_TYPE_SET_LISTPACK:
+                o->type = OBJ_SET;
+                o->encoding = OBJ_ENCODING_LISTPACK;
+                if (setTypeSize(o) > server.set_max_listpack_entries)
+                    setTypeConvert(o,OBJ_ENCODING_HT);
+                break;
             case RDB_TYPE_ZSET_ZIPLIST:
+            case RDB_TYPE_ZSET_LISTPACK:
+                /* Sorted sets of older RDB files are ziplists. */
+                if (rdbtype == RDB_TYPE_ZSET_ZIPLIST)
+                    o->ptr = rdbConvertZiplistToListpack(o->ptr);
                 o->type = OBJ_ZSET;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
+                o->encoding = OBJ_ENCODING_LISTPACK;
                 if (zsetLength(o) > server.zset_max_ziplist_entries)
-                    zsetConvert(o,OBJ_ENCODING_SKIPLIST);
+                    zsetConvert(o,OBJ_ENCODING_BTREE);
                 break;
             case RDB_TYPE_HASH_ZIPLIST:
+            case RDB_TYPE_HASH_LISTPACK:
+                /* Hashes of older RDB files are ziplists. */
+                if (rdbtype == RDB_TYPE_HASH_ZIPLIST)
+                    o->ptr = rdbConvertZiplistToListpack(o->ptr);
                 o->type = OBJ_HASH;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
+                o->encoding = OBJ_ENCODING_LISTPACK;
                 if (hashTypeLength(o) > server.hash_max_ziplist_entries)
                     hashTypeConvert(o, OBJ_ENCODING_HT);
                 break;
@@ -1916,7 +2062,8 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi, int loading_aof) {
     /* Key-specific attributes, set by opcodes before the key type. */
     long long lru_idle = -1, lfu_freq = -1, expiretime = -1, now = mstime();
     long long lru_clock = LRU_CLOCK();
-    
+    dict *field_expires = NULL;
+
     while(1) {
         robj *key, *val;
 
@@ -1948,6 +2095,13 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi, int loading_aof) {
             if ((qword = rdbLoadLen(rdb,NULL)) == RDB_LENERR) goto eoferr;
             lru_idle = qword;
             continue; /* Read next opcode. */
+        } else if (type == RDB_OPCODE_HASH_FIELD_EXPIRES) {
+            /* HASH_FIELD_EXPIRES: timeouts of fields of the next key. */
+            if (field_expires == NULL)
+                field_expires = dictCreate(&setDictType,NULL);
+            if (rdbLoadHashFieldExpires(rdb,field_expires,rdbver) == -1)
+                rdbExitReportCorruptRDB("Bad hash field timeouts");
+            continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_EOF) {
             /* EOF: End of file, exit the main loop. */
             break;
@@ -2087,7 +2241,12 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi, int loading_aof) {
 
             /* Set the expire time if needed */
             if (expiretime != -1) setExpire(NULL,db,key,expiretime);
-            
+
+            /* Set the timeouts of the fields of a hash. Fields already
+             * expired are reclaimed later by the master. */
+            if (field_expires && val->type == OBJ_HASH)
+                hashTypeSetFieldExpires(db,key,val,field_expires);
+
             /* Set usage information (for eviction). */
             objectSetLRUOrLFU(val,lfu_freq,lru_idle,lru_clock);
 
@@ -2101,6 +2260,10 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi, int loading_aof) {
         expiretime = -1;
         lfu_freq = -1;
         lru_idle = -1;
+        if (field_expires) {
+            dictRelease(field_expires);
+            field_expires = NULL;
+        }
     }
     /* Verify the checksum if RDB version is >= 5 */
     if (rdbver >= 5) {
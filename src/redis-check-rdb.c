@@ -85,7 +85,12 @@ char *rdb_type_string[] = {
     "zset-ziplist",
     "hash-ziplist",
     "quicklist",
-    "stream"
+    "stream",
+    "hash-listpack",
+    "zset-listpack",
+    "quicklist-v2",
+    "",
+    "set-listpack"
 };
 
 /* Show a few stats collected into 'rdbstate' */
@@ -234,6 +239,18 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
             /* IDLE: LRU idle time. */
             if (rdbLoadLen(&rdb,NULL) == RDB_LENERR) goto eoferr;
             continue; /* Read next opcode. */
+        } else if (type == RDB_OPCODE_HASH_FIELD_EXPIRES) {
+            /* HASH_FIELD_EXPIRES: timeouts of fields of the next key. */
+            uint64_t count;
+            rdbstate.doing = RDB_CHECK_DOING_READ_EXPIRE;
+            if ((count = rdbLoadLen(&rdb,NULL)) == RDB_LENERR) goto eoferr;
+            while(count--) {
+                sds field = rdbGenericLoadStringObject(&rdb,RDB_LOAD_SDS,NULL);
+                if (field == NULL) goto eoferr;
+                sdsfree(field);
+                if (rdbLoadMillisecondTime(&rdb,rdbver) == -1) goto eoferr;
+            }
+            continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_EOF) {
             /* EOF: End of file, exit the main loop. */
             break;
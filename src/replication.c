@@ -77,7 +77,9 @@ char *replicationGetSlaveName(client *c) {
 
 void createReplicationBacklog(void) {
     serverAssert(server.repl_backlog == NULL);
+    int arena = zmalloc_set_arena(ZMALLOC_ARENA_BUFFERS);
     server.repl_backlog = zmalloc(server.repl_backlog_size);
+    zmalloc_set_arena(arena);
     server.repl_backlog_histlen = 0;
     server.repl_backlog_idx = 0;
 
@@ -105,8 +107,10 @@ void resizeReplicationBacklog(long long newsize) {
          * The reason is that copying a few gigabytes adds latency and even
          * worse often we need to alloc additional space before freeing the
          * old buffer. */
+        int arena = zmalloc_set_arena(ZMALLOC_ARENA_BUFFERS);
         zfree(server.repl_backlog);
         server.repl_backlog = zmalloc(server.repl_backlog_size);
+        zmalloc_set_arena(arena);
         server.repl_backlog_histlen = 0;
         server.repl_backlog_idx = 0;
         /* Next byte we have is... the next since the buffer is empty. */
@@ -116,7 +120,9 @@ void resizeReplicationBacklog(long long newsize) {
 
 void freeReplicationBacklog(void) {
     serverAssert(listLength(server.slaves) == 0);
+    int arena = zmalloc_set_arena(ZMALLOC_ARENA_BUFFERS);
     zfree(server.repl_backlog);
+    zmalloc_set_arena(arena);
     server.repl_backlog = NULL;
 }
 
@@ -1106,6 +1112,9 @@ void replicationCreateMasterClient(int fd, int dbid) {
     server.master->authenticated = 1;
     server.master->reploff = server.master_initial_offset;
     server.master->read_reploff = server.master->reploff;
+    /* The offsets of the previous master may not make sense here. */
+    server.repl_drained_reploff = server.master->read_reploff;
+    server.repl_drained_time = 0;
     memcpy(server.master->replid, server.master_replid,
         sizeof(server.master_replid));
     /* If master offset is set to -1, this master is old and is not
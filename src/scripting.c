@@ -529,6 +529,18 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
         }
     }
 
+    /* The same for the memory quota of the DB, that processCommand() only
+     * enforced for the DB selected by the caller. */
+    if (c->db != server.lua_caller->db &&
+        !server.masterhost &&
+        server.lua_write_dirty == 0 &&
+        (cmd->flags & CMD_DENYOOM) &&
+        freeDbMemoryIfNeededAndSafe(c->db) == C_ERR)
+    {
+        luaPushError(lua, shared.dboomerr->ptr);
+        goto cleanup;
+    }
+
     if (cmd->flags & CMD_RANDOM) server.lua_random_dirty = 1;
     if (cmd->flags & CMD_WRITE) server.lua_write_dirty = 1;
 
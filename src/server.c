@@ -161,6 +161,7 @@ struct redisCommand redisCommandTable[] = {
     {"lrange",lrangeCommand,4,"r",0,NULL,1,1,1,0,0},
     {"ltrim",ltrimCommand,4,"w",0,NULL,1,1,1,0,0},
     {"lrem",lremCommand,4,"w",0,NULL,1,1,1,0,0},
+    {"lpos",lposCommand,-3,"r",0,NULL,1,1,1,0,0},
     {"rpoplpush",rpoplpushCommand,3,"wm",0,NULL,1,2,1,0,0},
     {"sadd",saddCommand,-3,"wmF",0,NULL,1,1,1,0,0},
     {"srem",sremCommand,-3,"wF",0,NULL,1,1,1,0,0},
@@ -171,6 +172,7 @@ struct redisCommand redisCommandTable[] = {
     {"srandmember",srandmemberCommand,-2,"rR",0,NULL,1,1,1,0,0},
     {"sinter",sinterCommand,-2,"rS",0,NULL,1,-1,1,0,0},
     {"sinterstore",sinterstoreCommand,-3,"wm",0,NULL,1,-1,1,0,0},
+    {"sintercard",sinterCardCommand,-3,"r",0,sintercardGetKeys,0,0,0,0,0},
     {"sunion",sunionCommand,-2,"rS",0,NULL,1,-1,1,0,0},
     {"sunionstore",sunionstoreCommand,-3,"wm",0,NULL,1,-1,1,0,0},
     {"sdiff",sdiffCommand,-2,"rS",0,NULL,1,-1,1,0,0},
@@ -189,6 +191,7 @@ struct redisCommand redisCommandTable[] = {
     {"zrangebyscore",zrangebyscoreCommand,-4,"r",0,NULL,1,1,1,0,0},
     {"zrevrangebyscore",zrevrangebyscoreCommand,-4,"r",0,NULL,1,1,1,0,0},
     {"zrangebylex",zrangebylexCommand,-4,"r",0,NULL,1,1,1,0,0},
+    {"zrangestore",zrangestoreCommand,-5,"wm",0,NULL,1,2,1,0,0},
     {"zrevrangebylex",zrevrangebylexCommand,-4,"r",0,NULL,1,1,1,0,0},
     {"zcount",zcountCommand,4,"rF",0,NULL,1,1,1,0,0},
     {"zlexcount",zlexcountCommand,4,"rF",0,NULL,1,1,1,0,0},
@@ -210,6 +213,13 @@ struct redisCommand redisCommandTable[] = {
     {"hincrby",hincrbyCommand,4,"wmF",0,NULL,1,1,1,0,0},
     {"hincrbyfloat",hincrbyfloatCommand,4,"wmF",0,NULL,1,1,1,0,0},
     {"hdel",hdelCommand,-3,"wF",0,NULL,1,1,1,0,0},
+    {"hexpire",hexpireCommand,-6,"wF",0,NULL,1,1,1,0,0},
+    {"hpexpire",hpexpireCommand,-6,"wF",0,NULL,1,1,1,0,0},
+    {"hexpireat",hexpireatCommand,-6,"wF",0,NULL,1,1,1,0,0},
+    {"hpexpireat",hpexpireatCommand,-6,"wF",0,NULL,1,1,1,0,0},
+    {"httl",httlCommand,-5,"rF",0,NULL,1,1,1,0,0},
+    {"hpttl",hpttlCommand,-5,"rF",0,NULL,1,1,1,0,0},
+    {"hpersist",hpersistCommand,-5,"wF",0,NULL,1,1,1,0,0},
     {"hlen",hlenCommand,2,"rF",0,NULL,1,1,1,0,0},
     {"hstrlen",hstrlenCommand,3,"rF",0,NULL,1,1,1,0,0},
     {"hkeys",hkeysCommand,2,"rS",0,NULL,1,1,1,0,0},
@@ -278,7 +288,7 @@ struct redisCommand redisCommandTable[] = {
     {"restore-asking",restoreCommand,-4,"wmk",0,NULL,1,1,1,0,0},
     {"migrate",migrateCommand,-6,"wR",0,migrateGetKeys,0,0,0,0,0},
     {"asking",askingCommand,1,"F",0,NULL,0,0,0,0,0},
-    {"readonly",readonlyCommand,1,"F",0,NULL,0,0,0,0,0},
+    {"readonly",readonlyCommand,-1,"F",0,NULL,0,0,0,0,0},
     {"readwrite",readwriteCommand,1,"F",0,NULL,0,0,0,0,0},
     {"dump",dumpCommand,2,"rR",0,NULL,1,1,1,0,0},
     {"object",objectCommand,-2,"rR",0,NULL,2,2,1,0,0},
@@ -505,6 +515,13 @@ void dictSdsDestructor(void *privdata, void *val)
     sdsfree(val);
 }
 
+void dictHashFieldExpiresDestructor(void *privdata, void *val)
+{
+    DICT_NOTUSED(privdata);
+
+    freeHashFieldExpires(val);
+}
+
 int dictObjKeyCompare(void *privdata, const void *key1,
         const void *key2)
 {
@@ -598,13 +615,14 @@ dictType setDictType = {
     NULL                       /* val destructor */
 };
 
-/* Sorted sets hash (note: a skiplist is used in addition to the hash table) */
+/* Sorted sets hash (note: a B+tree is used in addition to the hash table,
+ * the score is stored inside the dict entry) */
 dictType zsetDictType = {
     dictSdsHash,               /* hash function */
     NULL,                      /* key dup */
     NULL,                      /* val dup */
     dictSdsKeyCompare,         /* key compare */
-    NULL,                      /* Note: SDS string shared & freed by skiplist */
+    NULL,                      /* Note: SDS string shared & freed by B+tree */
     NULL                       /* val destructor */
 };
 
@@ -638,6 +656,17 @@ dictType keyptrDictType = {
     NULL                        /* val destructor */
 };
 
+/* Db->hexpires, keys are shared with db->dict like in db->expires, vals are
+ * hashFieldExpires structures. */
+dictType hexpiresDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    NULL,                       /* key destructor */
+    dictHashFieldExpiresDestructor /* val destructor */
+};
+
 /* Command table. sds string -> command struct pointer. */
 dictType commandTableDictType = {
     dictSdsCaseHash,            /* hash function */
@@ -859,15 +888,23 @@ int clientsCronResizeQueryBuffer(client *c) {
 
     /* There are two conditions to resize the query buffer:
      * 1) Query buffer is > BIG_ARG and too big for latest peak.
-     * 2) Query buffer is > BIG_ARG and client is idle. */
-    if (querybuf_size > PROTO_MBULK_BIG_ARG &&
+     * 2) Query buffer is > BIG_ARG and client is idle.
+     * The buffer is never resized while a big argument is being read into
+     * it: it was sized for the argument, and it lives in the data arena
+     * since it is going to become the argument object (see
+     * processMultibulkBuffer()). */
+    int bigarg = c->reqtype == PROTO_REQ_MULTIBULK && c->bulklen != -1 &&
+                 c->bulklen >= PROTO_MBULK_BIG_ARG;
+    if (!bigarg && querybuf_size > PROTO_MBULK_BIG_ARG &&
          ((querybuf_size/(c->querybuf_peak+1)) > 2 ||
           idletime > 2))
     {
         /* Only resize the query buffer if it is actually wasting
          * at least a few kbytes. */
         if (sdsavail(c->querybuf) > 1024*4) {
+            int arena = zmalloc_set_arena(ZMALLOC_ARENA_BUFFERS);
             c->querybuf = sdsRemoveFreeSpace(c->querybuf);
+            zmalloc_set_arena(arena);
         }
     }
     /* Reset the peak again to capture the peak memory usage in the next
@@ -887,7 +924,9 @@ int clientsCronResizeQueryBuffer(client *c) {
         if(pending_querybuf_size > LIMIT_PENDING_QUERYBUF &&
            sdslen(c->pending_querybuf) < (pending_querybuf_size/2))
         {
+            int arena = zmalloc_set_arena(ZMALLOC_ARENA_BUFFERS);
             c->pending_querybuf = sdsRemoveFreeSpace(c->pending_querybuf);
+            zmalloc_set_arena(arena);
         }
     }
     return 0;
@@ -1013,6 +1052,9 @@ void databasesCron(void) {
         }
     }
 
+    /* Evict keys in advance when over the maxmemory low watermark. */
+    proactiveEvictionCycle(EVICTION_CYCLE_SLOW);
+
     /* Defrag keys gradually. */
     if (server.active_defrag_enabled)
         activeDefragCycle();
@@ -1171,6 +1213,10 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         zmalloc_get_allocator_info(&server.cron_malloc_stats.allocator_allocated,
                                    &server.cron_malloc_stats.allocator_active,
                                    &server.cron_malloc_stats.allocator_resident);
+        zmalloc_get_arena_info(ZMALLOC_ARENA_BUFFERS,
+                               &server.cron_malloc_stats.buffers_allocated,
+                               &server.cron_malloc_stats.buffers_active,
+                               &server.cron_malloc_stats.buffers_resident);
         /* in case the allocator isn't providing these stats, fake them so that
          * fragmention info still shows some (inaccurate metrics) */
         if (!server.cron_malloc_stats.allocator_resident) {
@@ -1348,6 +1394,9 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         migrateCloseTimedoutSockets();
     }
 
+    /* Handle timeouts of MIGRATE ... ASYNC transfers. */
+    migrateAsyncCron();
+
     /* Start a scheduled BGSAVE if the corresponding flag is set. This is
      * useful when we are forced to postpone a BGSAVE because an AOF
      * rewrite is in progress.
@@ -1387,6 +1436,10 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     if (server.active_expire_enabled && server.masterhost == NULL)
         activeExpireCycle(ACTIVE_EXPIRE_CYCLE_FAST);
 
+    /* Run a fast proactive eviction cycle if the slow one was not able
+     * to go under the maxmemory low watermark. */
+    proactiveEvictionCycle(EVICTION_CYCLE_FAST);
+
     /* Send all the slaves an ACK request if at least one client blocked
      * during the previous event loop iteration. */
     if (server.get_ack_from_slaves) {
@@ -1415,6 +1468,10 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     if (listLength(server.unblocked_clients))
         processUnblockedClients();
 
+    /* Send the objects deleted in this event loop iteration to the lazyfree
+     * threads, if they were not already sent in a full batch. */
+    lazyfreeFlushBatch();
+
     /* Write the AOF buffer on disk */
     flushAppendOnlyFile(0);
 
@@ -1424,7 +1481,7 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     /* Before we are going to sleep, let the threads access the dataset by
      * releasing the GIL. Redis main thread will not touch anything at this
      * time. */
-    if (moduleCount()) moduleReleaseGIL();
+    if (moduleCount() || activeDefragThreadActive()) moduleReleaseGIL();
 }
 
 /* This function is called immadiately after the event loop multiplexing
@@ -1432,7 +1489,7 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
  * the different events callbacks. */
 void afterSleep(struct aeEventLoop *eventLoop) {
     UNUSED(eventLoop);
-    if (moduleCount()) moduleAcquireGIL();
+    if (moduleCount() || activeDefragThreadActive()) activeDefragAcquireGIL();
 }
 
 /* =========================== Server initialization ======================== */
@@ -1479,6 +1536,8 @@ void createSharedObjects(void) {
         "-NOAUTH Authentication required.\r\n"));
     shared.oomerr = createObject(OBJ_STRING,sdsnew(
         "-OOM command not allowed when used memory > 'maxmemory'.\r\n"));
+    shared.dboomerr = createObject(OBJ_STRING,sdsnew(
+        "-OOM command not allowed when used memory of the DB > 'db-maxmemory'.\r\n"));
     shared.execaborterr = createObject(OBJ_STRING,sdsnew(
         "-EXECABORT Transaction discarded because of previous errors.\r\n"));
     shared.noreplicaserr = createObject(OBJ_STRING,sdsnew(
@@ -1564,6 +1623,8 @@ void initServerConfig(void) {
     server.tcpkeepalive = CONFIG_DEFAULT_TCP_KEEPALIVE;
     server.active_expire_enabled = 1;
     server.active_defrag_enabled = CONFIG_DEFAULT_ACTIVE_DEFRAG;
+    server.active_defrag_threaded = CONFIG_DEFAULT_ACTIVE_DEFRAG_THREADED;
+    server.memory_accounting = CONFIG_DEFAULT_MEMORY_ACCOUNTING;
     server.active_defrag_ignore_bytes = CONFIG_DEFAULT_DEFRAG_IGNORE_BYTES;
     server.active_defrag_threshold_lower = CONFIG_DEFAULT_DEFRAG_THRESHOLD_LOWER;
     server.active_defrag_threshold_upper = CONFIG_DEFAULT_DEFRAG_THRESHOLD_UPPER;
@@ -1617,6 +1678,8 @@ void initServerConfig(void) {
     server.maxmemory = CONFIG_DEFAULT_MAXMEMORY;
     server.maxmemory_policy = CONFIG_DEFAULT_MAXMEMORY_POLICY;
     server.maxmemory_samples = CONFIG_DEFAULT_MAXMEMORY_SAMPLES;
+    server.maxmemory_low_watermark = CONFIG_DEFAULT_MAXMEMORY_LOW_WATERMARK;
+    server.maxmemory_eviction_pool_size = CONFIG_DEFAULT_MAXMEMORY_EVICTION_POOL_SIZE;
     server.lfu_log_factor = CONFIG_DEFAULT_LFU_LOG_FACTOR;
     server.lfu_decay_time = CONFIG_DEFAULT_LFU_DECAY_TIME;
     server.hash_max_ziplist_entries = OBJ_HASH_MAX_ZIPLIST_ENTRIES;
@@ -1624,6 +1687,8 @@ void initServerConfig(void) {
     server.list_max_ziplist_size = OBJ_LIST_MAX_ZIPLIST_SIZE;
     server.list_compress_depth = OBJ_LIST_COMPRESS_DEPTH;
     server.set_max_intset_entries = OBJ_SET_MAX_INTSET_ENTRIES;
+    server.set_max_listpack_entries = OBJ_SET_MAX_LISTPACK_ENTRIES;
+    server.set_max_listpack_value = OBJ_SET_MAX_LISTPACK_VALUE;
     server.zset_max_ziplist_entries = OBJ_ZSET_MAX_ZIPLIST_ENTRIES;
     server.zset_max_ziplist_value = OBJ_ZSET_MAX_ZIPLIST_VALUE;
     server.hll_sparse_max_bytes = CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES;
@@ -1636,17 +1701,20 @@ void initServerConfig(void) {
     server.cluster_slave_validity_factor = CLUSTER_DEFAULT_SLAVE_VALIDITY;
     server.cluster_require_full_coverage = CLUSTER_DEFAULT_REQUIRE_FULL_COVERAGE;
     server.cluster_slave_no_failover = CLUSTER_DEFAULT_SLAVE_NO_FAILOVER;
+    server.cluster_compact_bus = CLUSTER_DEFAULT_COMPACT_BUS;
     server.cluster_configfile = zstrdup(CONFIG_DEFAULT_CLUSTER_CONFIG_FILE);
     server.cluster_announce_ip = CONFIG_DEFAULT_CLUSTER_ANNOUNCE_IP;
     server.cluster_announce_port = CONFIG_DEFAULT_CLUSTER_ANNOUNCE_PORT;
     server.cluster_announce_bus_port = CONFIG_DEFAULT_CLUSTER_ANNOUNCE_BUS_PORT;
     server.cluster_module_flags = CLUSTER_MODULE_FLAG_NONE;
     server.migrate_cached_sockets = dictCreate(&migrateCacheDictType,NULL);
+    server.migrate_async_jobs = listCreate();
     server.next_client_id = 1; /* Client IDs, start from 1 .*/
     server.loading_process_events_interval_bytes = (1024*1024*2);
     server.lazyfree_lazy_eviction = CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION;
     server.lazyfree_lazy_expire = CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE;
     server.lazyfree_lazy_server_del = CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL;
+    server.lazyfree_threads = CONFIG_DEFAULT_LAZYFREE_THREADS;
     server.always_show_logo = CONFIG_DEFAULT_ALWAYS_SHOW_LOGO;
     server.lua_time_limit = LUA_SCRIPT_TIME_LIMIT;
 
@@ -1672,6 +1740,8 @@ void initServerConfig(void) {
     server.repl_slave_ignore_maxmemory = CONFIG_DEFAULT_SLAVE_IGNORE_MAXMEMORY;
     server.repl_slave_lazy_flush = CONFIG_DEFAULT_SLAVE_LAZY_FLUSH;
     server.repl_down_since = 0; /* Never connected, repl is down since EVER. */
+    server.repl_synced_time = 0;
+    server.repl_debug_pause = 0;
     server.repl_disable_tcp_nodelay = CONFIG_DEFAULT_REPL_DISABLE_TCP_NODELAY;
     server.repl_diskless_sync = CONFIG_DEFAULT_REPL_DISKLESS_SYNC;
     server.repl_diskless_sync_delay = CONFIG_DEFAULT_REPL_DISKLESS_SYNC_DELAY;
@@ -1722,6 +1792,8 @@ void initServerConfig(void) {
     server.pexpireCommand = lookupCommandByCString("pexpire");
     server.xclaimCommand = lookupCommandByCString("xclaim");
     server.xgroupCommand = lookupCommandByCString("xgroup");
+    server.hdelCommand = lookupCommandByCString("hdel");
+    server.hpexpireatCommand = lookupCommandByCString("hpexpireat");
 
     /* Slow log */
     server.slowlog_log_slower_than = CONFIG_DEFAULT_SLOWLOG_LOG_SLOWER_THAN;
@@ -2000,9 +2072,13 @@ void resetServerStats(void) {
     server.stat_numcommands = 0;
     server.stat_numconnections = 0;
     server.stat_expiredkeys = 0;
+    server.stat_expired_hash_fields = 0;
     server.stat_expired_stale_perc = 0;
     server.stat_expired_time_cap_reached_count = 0;
     server.stat_evictedkeys = 0;
+    server.stat_evictedkeys_proactive = 0;
+    server.stat_tinylfu_rejected = 0;
+    lazyfreeResetStats();
     server.stat_keyspace_misses = 0;
     server.stat_keyspace_hits = 0;
     server.stat_active_defrag_hits = 0;
@@ -2053,6 +2129,8 @@ void initServer(void) {
     server.slaveseldb = -1; /* Force to emit the first SELECT command. */
     server.unblocked_clients = listCreate();
     server.ready_keys = listCreate();
+    server.hash_read_copies = listCreate();
+    listSetFreeMethod(server.hash_read_copies,decrRefCountVoid);
     server.clients_waiting_acks = listCreate();
     server.get_ack_from_slaves = 0;
     server.clients_paused = 0;
@@ -2096,12 +2174,18 @@ void initServer(void) {
     for (j = 0; j < server.dbnum; j++) {
         server.db[j].dict = dictCreate(&dbDictType,NULL);
         server.db[j].expires = dictCreate(&keyptrDictType,NULL);
+        server.db[j].expires_index = raxNew();
+        server.db[j].hexpires = dictCreate(&hexpiresDictType,NULL);
+        server.db[j].hexpires_index = raxNew();
         server.db[j].blocking_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].ready_keys = dictCreate(&objectKeyPointerValueDictType,NULL);
         server.db[j].watched_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].id = j;
         server.db[j].avg_ttl = 0;
         server.db[j].defrag_later = listCreate();
+        server.db[j].key_sizes = NULL;
+        dbResetMemoryAccounting(server.db+j);
+        dbUpdateMemoryAccounting(server.db+j);
     }
     evictionPoolAlloc(); /* Initialize the LRU keys pool. */
     server.pubsub_channels = dictCreate(&keylistDictType,NULL);
@@ -2124,6 +2208,7 @@ void initServer(void) {
     server.rdb_save_time_start = -1;
     server.dirty = 0;
     resetServerStats();
+    server.stat_eviction_lag_start = 0;
     /* A few stats we don't want to reset: server startup time, and peak mem. */
     server.stat_starttime = time(NULL);
     server.stat_peak_memory = 0;
@@ -2134,6 +2219,9 @@ void initServer(void) {
     server.cron_malloc_stats.allocator_allocated = 0;
     server.cron_malloc_stats.allocator_active = 0;
     server.cron_malloc_stats.allocator_resident = 0;
+    server.cron_malloc_stats.buffers_allocated = 0;
+    server.cron_malloc_stats.buffers_active = 0;
+    server.cron_malloc_stats.buffers_resident = 0;
     server.lastbgsave_status = C_OK;
     server.aof_last_write_status = C_OK;
     server.aof_last_write_errno = 0;
@@ -2467,6 +2555,7 @@ void call(client *c, int flags) {
     start = server.ustime;
     c->cmd->proc(c);
     duration = ustime()-start;
+    if (listLength(server.hash_read_copies)) listEmpty(server.hash_read_copies);
     dirty = server.dirty-dirty;
     if (dirty < 0) dirty = 0;
 
@@ -2664,6 +2753,23 @@ int processCommand(client *c) {
         }
     }
 
+    /* Handle the memory quota of the selected DB (db-maxmemory), evicting
+     * keys of this DB only, in the same conditions as above. */
+    if (c->db->key_sizes && dbGetMaxmemory(c->db->id) &&
+        !server.lua_timedout && !server.loading)
+    {
+        int out_of_memory = freeDbMemoryIfNeeded(c->db) == C_ERR;
+        if (server.current_client == NULL) return C_ERR;
+
+        if (out_of_memory &&
+            (c->cmd->flags & CMD_DENYOOM ||
+             (c->flags & CLIENT_MULTI && c->cmd->proc != execCommand))) {
+            flagTransaction(c);
+            addReply(c, shared.dboomerr);
+            return C_OK;
+        }
+    }
+
     /* Don't accept write commands if there are problems persisting on disk
      * and if this is a master instance. */
     int deny_write_type = writeCommandsDeniedByDiskError();
@@ -2823,6 +2929,10 @@ int prepareForShutdown(int flags) {
         redis_fsync(server.aof_fd);
     }
 
+    /* Make sure the cluster config saves performed in background reach
+     * the disk before exiting. */
+    if (server.cluster_enabled) clusterWaitConfigSaves();
+
     /* Create a new RDB file before exiting. */
     if ((server.saveparamslen > 0 && !nosave) || save) {
         serverLog(LL_NOTICE,"Saving the final RDB snapshot before exiting.");
@@ -3247,6 +3357,22 @@ sds genRedisInfoString(char *section) {
         bytesToHuman(used_memory_rss_hmem,server.cron_malloc_stats.process_rss);
         bytesToHuman(maxmemory_hmem,server.maxmemory);
 
+        /* Fragmentation of the buffers arena and of everything else. */
+        struct malloc_stats *ms = &server.cron_malloc_stats;
+        size_t dataset_arena_allocated = 0, dataset_arena_active = 0;
+        float dataset_arena_frag = 1, buffers_arena_frag = 1;
+        if (ms->allocator_allocated > ms->buffers_allocated)
+            dataset_arena_allocated = ms->allocator_allocated -
+                                      ms->buffers_allocated;
+        if (ms->allocator_active > ms->buffers_active)
+            dataset_arena_active = ms->allocator_active - ms->buffers_active;
+        if (dataset_arena_allocated)
+            dataset_arena_frag =
+                (float)dataset_arena_active / dataset_arena_allocated;
+        if (ms->buffers_allocated)
+            buffers_arena_frag =
+                (float)ms->buffers_active / ms->buffers_allocated;
+
         if (sections++) info = sdscat(info,"\r\n");
         info = sdscatprintf(info,
             "# Memory\r\n"
@@ -3287,9 +3413,17 @@ sds genRedisInfoString(char *section) {
             "mem_clients_slaves:%zu\r\n"
             "mem_clients_normal:%zu\r\n"
             "mem_aof_buffer:%zu\r\n"
+            "mem_arena_dataset_allocated:%zu\r\n"
+            "mem_arena_dataset_frag_ratio:%.2f\r\n"
+            "mem_arena_buffers_allocated:%zu\r\n"
+            "mem_arena_buffers_active:%zu\r\n"
+            "mem_arena_buffers_resident:%zu\r\n"
+            "mem_arena_buffers_frag_ratio:%.2f\r\n"
             "mem_allocator:%s\r\n"
             "active_defrag_running:%d\r\n"
-            "lazyfree_pending_objects:%zu\r\n",
+            "lazyfree_pending_objects:%zu\r\n"
+            "lazyfree_pending_memory:%zu\r\n"
+            "lazyfreed_objects:%zu\r\n",
             zmalloc_used,
             hmem,
             server.cron_malloc_stats.process_rss,
@@ -3327,11 +3461,37 @@ sds genRedisInfoString(char *section) {
             mh->clients_slaves,
             mh->clients_normal,
             mh->aof_buffer,
+            dataset_arena_allocated,
+            dataset_arena_frag,
+            server.cron_malloc_stats.buffers_allocated,
+            server.cron_malloc_stats.buffers_active,
+            server.cron_malloc_stats.buffers_resident,
+            buffers_arena_frag,
             ZMALLOC_LIB,
             server.active_defrag_running,
-            lazyfreeGetPendingObjectsCount()
+            lazyfreeGetPendingObjectsCount(),
+            lazyfreeGetPendingMemory(),
+            lazyfreeGetFreedObjectsCount()
         );
         freeMemoryOverheadData(mh);
+
+        /* Memory used by the keys of every type, see memory-accounting. */
+        if (server.memory_accounting) {
+            static char *typenames[OBJ_TYPE_MAX] = {
+                "string","list","set","zset","hash","module","stream"
+            };
+            size_t total[OBJ_TYPE_MAX] = {0}, keys_total = 0;
+            for (j = 0; j < server.dbnum; j++) {
+                for (int t = 0; t < OBJ_TYPE_MAX; t++)
+                    total[t] += server.db[j].used_memory_type[t];
+                keys_total += server.db[j].used_memory;
+            }
+            info = sdscatprintf(info,"used_memory_keys:%zu\r\n",keys_total);
+            for (int t = 0; t < OBJ_TYPE_MAX; t++) {
+                info = sdscatprintf(info,"used_memory_keys_%s:%zu\r\n",
+                    typenames[t], total[t]);
+            }
+        }
     }
 
     /* Persistence */
@@ -3426,6 +3586,10 @@ sds genRedisInfoString(char *section) {
 
     /* Stats */
     if (allsections || defsections || !strcasecmp(section,"stats")) {
+        size_t eviction_lag_bytes;
+        mstime_t eviction_lag_ms;
+
+        getEvictionLag(&eviction_lag_bytes,&eviction_lag_ms);
         if (sections++) info = sdscat(info,"\r\n");
         info = sdscatprintf(info,
             "# Stats\r\n"
@@ -3441,15 +3605,21 @@ sds genRedisInfoString(char *section) {
             "sync_partial_ok:%lld\r\n"
             "sync_partial_err:%lld\r\n"
             "expired_keys:%lld\r\n"
+            "expired_hash_fields:%lld\r\n"
             "expired_stale_perc:%.2f\r\n"
             "expired_time_cap_reached_count:%lld\r\n"
             "evicted_keys:%lld\r\n"
+            "evicted_keys_proactive:%lld\r\n"
+            "eviction_lag_bytes:%zu\r\n"
+            "eviction_lag_ms:%lld\r\n"
+            "tinylfu_rejected_keys:%lld\r\n"
             "keyspace_hits:%lld\r\n"
             "keyspace_misses:%lld\r\n"
             "pubsub_channels:%ld\r\n"
             "pubsub_patterns:%lu\r\n"
             "latest_fork_usec:%lld\r\n"
             "migrate_cached_sockets:%ld\r\n"
+            "migrate_async_in_progress:%lu\r\n"
             "slave_expires_tracked_keys:%zu\r\n"
             "active_defrag_hits:%lld\r\n"
             "active_defrag_misses:%lld\r\n"
@@ -3467,15 +3637,21 @@ sds genRedisInfoString(char *section) {
             server.stat_sync_partial_ok,
             server.stat_sync_partial_err,
             server.stat_expiredkeys,
+            server.stat_expired_hash_fields,
             server.stat_expired_stale_perc*100,
             server.stat_expired_time_cap_reached_count,
             server.stat_evictedkeys,
+            server.stat_evictedkeys_proactive,
+            eviction_lag_bytes,
+            (long long)eviction_lag_ms,
+            server.stat_tinylfu_rejected,
             server.stat_keyspace_hits,
             server.stat_keyspace_misses,
             dictSize(server.pubsub_channels),
             listLength(server.pubsub_patterns),
             server.stat_fork_time,
             dictSize(server.migrate_cached_sockets),
+            listLength(server.migrate_async_jobs),
             getSlaveKeyWithExpireCount(),
             server.stat_active_defrag_hits,
             server.stat_active_defrag_misses,
@@ -3535,6 +3711,18 @@ sds genRedisInfoString(char *section) {
                 "slave_read_only:%d\r\n",
                 server.slave_priority,
                 server.repl_slave_ro);
+
+            if (server.cluster_enabled) {
+                long long lag_offset;
+                mstime_t lag_ms;
+
+                if (clusterGetReplicaLag(&lag_offset,&lag_ms) == C_ERR)
+                    lag_offset = lag_ms = -1;
+                info = sdscatprintf(info,
+                    "slave_read_lag_offset:%lld\r\n"
+                    "slave_read_lag_ms:%lld\r\n",
+                    lag_offset, (long long) lag_ms);
+            }
         }
 
         info = sdscatprintf(info,
@@ -3666,8 +3854,13 @@ sds genRedisInfoString(char *section) {
             vkeys = dictSize(server.db[j].expires);
             if (keys || vkeys) {
                 info = sdscatprintf(info,
-                    "db%d:keys=%lld,expires=%lld,avg_ttl=%lld\r\n",
+                    "db%d:keys=%lld,expires=%lld,avg_ttl=%lld",
                     j, keys, vkeys, server.db[j].avg_ttl);
+                if (server.db[j].key_sizes) {
+                    info = sdscatprintf(info,",used_memory=%zu,maxmemory=%llu",
+                        server.db[j].used_memory, dbGetMaxmemory(j));
+                }
+                info = sdscat(info,"\r\n");
             }
         }
     }
@@ -59,6 +59,7 @@ typedef long long ustime_t; /* microsecond time type. */
 #include "zmalloc.h" /* total memory usage aware version of malloc/free */
 #include "anet.h"    /* Networking the easy way */
 #include "ziplist.h" /* Compact list data structure */
+#include "listpack.h" /* Compact list of strings and integers */
 #include "intset.h"  /* Compact integer set structure */
 #include "version.h" /* Version macro */
 #include "util.h"    /* Misc functions useful in many places */
@@ -138,6 +139,8 @@ typedef long long ustime_t; /* microsecond time type. */
 #define CONFIG_DEFAULT_REPL_DISABLE_TCP_NODELAY 0
 #define CONFIG_DEFAULT_MAXMEMORY 0
 #define CONFIG_DEFAULT_MAXMEMORY_SAMPLES 5
+#define CONFIG_DEFAULT_MAXMEMORY_LOW_WATERMARK 0
+#define CONFIG_DEFAULT_MAXMEMORY_EVICTION_POOL_SIZE 16
 #define CONFIG_DEFAULT_LFU_LOG_FACTOR 10
 #define CONFIG_DEFAULT_LFU_DECAY_TIME 1
 #define CONFIG_DEFAULT_AOF_FILENAME "appendonly.aof"
@@ -156,10 +159,13 @@ typedef long long ustime_t; /* microsecond time type. */
 #define CONFIG_DEFAULT_LATENCY_MONITOR_THRESHOLD 0
 #define CONFIG_DEFAULT_SLAVE_LAZY_FLUSH 0
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION 0
-#define CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE 0
-#define CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL 0
+#define CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE 1
+#define CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL 1
+#define CONFIG_DEFAULT_LAZYFREE_THREADS 1
 #define CONFIG_DEFAULT_ALWAYS_SHOW_LOGO 0
 #define CONFIG_DEFAULT_ACTIVE_DEFRAG 0
+#define CONFIG_DEFAULT_ACTIVE_DEFRAG_THREADED 0
+#define CONFIG_DEFAULT_MEMORY_ACCOUNTING 0
 #define CONFIG_DEFAULT_DEFRAG_THRESHOLD_LOWER 10 /* don't defrag when fragmentation is below 10% */
 #define CONFIG_DEFAULT_DEFRAG_THRESHOLD_UPPER 100 /* maximum defrag force at 100% fragmentation */
 #define CONFIG_DEFAULT_DEFRAG_IGNORE_BYTES (100<<20) /* don't defrag if frag overhead is below 100mb */
@@ -174,6 +180,12 @@ typedef long long ustime_t; /* microsecond time type. */
 #define ACTIVE_EXPIRE_CYCLE_SLOW 0
 #define ACTIVE_EXPIRE_CYCLE_FAST 1
 
+/* Proactive eviction cycles, see proactiveEvictionCycle(). */
+#define EVICTION_CYCLE_FAST_DURATION 1000 /* Microseconds */
+#define EVICTION_CYCLE_SLOW_TIME_PERC 25 /* CPU max % for proactive eviction */
+#define EVICTION_CYCLE_SLOW 0
+#define EVICTION_CYCLE_FAST 1
+
 /* Instantaneous metrics tracking. */
 #define STATS_METRIC_SAMPLES 16     /* Number of samples per metric. */
 #define STATS_METRIC_COMMAND 0      /* Number of commands executed. */
@@ -267,7 +279,8 @@ typedef long long ustime_t; /* microsecond time type. */
 #define BLOCKED_MODULE 3  /* Blocked by a loadable module. */
 #define BLOCKED_STREAM 4  /* XREAD. */
 #define BLOCKED_ZSET 5    /* BZPOP et al. */
-#define BLOCKED_NUM 6     /* Number of blocked states. */
+#define BLOCKED_MIGRATE 6 /* MIGRATE ... ASYNC. */
+#define BLOCKED_NUM 7     /* Number of blocked states. */
 
 /* Client request types */
 #define PROTO_REQ_INLINE 1
@@ -347,8 +360,9 @@ typedef long long ustime_t; /* microsecond time type. */
 /* Anti-warning macro... */
 #define UNUSED(V) ((void) V)
 
-#define ZSKIPLIST_MAXLEVEL 64 /* Should be enough for 2^64 elements */
-#define ZSKIPLIST_P 0.25      /* Skiplist P = 1/4 */
+#define ZBTREE_LEAF_ENTRIES 30 /* Elements per leaf: 512 bytes leaves. */
+#define ZBTREE_FANOUT 15       /* Children per inner node: 512 bytes too. */
+#define ZBTREE_MAX_HEIGHT 64
 
 /* Append only defines */
 #define AOF_FSYNC_NO 0
@@ -360,6 +374,8 @@ typedef long long ustime_t; /* microsecond time type. */
 #define OBJ_HASH_MAX_ZIPLIST_ENTRIES 512
 #define OBJ_HASH_MAX_ZIPLIST_VALUE 64
 #define OBJ_SET_MAX_INTSET_ENTRIES 512
+#define OBJ_SET_MAX_LISTPACK_ENTRIES 128
+#define OBJ_SET_MAX_LISTPACK_VALUE 64
 #define OBJ_ZSET_MAX_ZIPLIST_ENTRIES 128
 #define OBJ_ZSET_MAX_ZIPLIST_VALUE 64
 #define OBJ_STREAM_NODE_MAX_BYTES 4096
@@ -394,6 +410,7 @@ typedef long long ustime_t; /* microsecond time type. */
 #define MAXMEMORY_ALLKEYS_LFU ((5<<8)|MAXMEMORY_FLAG_LFU|MAXMEMORY_FLAG_ALLKEYS)
 #define MAXMEMORY_ALLKEYS_RANDOM ((6<<8)|MAXMEMORY_FLAG_ALLKEYS)
 #define MAXMEMORY_NO_EVICTION (7<<8)
+#define MAXMEMORY_ALLKEYS_TINYLFU ((8<<8)|MAXMEMORY_FLAG_LFU|MAXMEMORY_FLAG_ALLKEYS)
 
 #define CONFIG_DEFAULT_MAXMEMORY_POLICY MAXMEMORY_NO_EVICTION
 
@@ -483,6 +500,7 @@ typedef long long ustime_t; /* microsecond time type. */
  * encoding version. */
 #define OBJ_MODULE 5    /* Module object. */
 #define OBJ_STREAM 6    /* Stream object. */
+#define OBJ_TYPE_MAX 7  /* Number of object types. */
 
 /* Extract encver / signature from a module type ID. */
 #define REDISMODULE_TYPE_ENCVER_BITS 10
@@ -602,10 +620,12 @@ typedef struct RedisModuleDigest {
 #define OBJ_ENCODING_LINKEDLIST 4 /* No longer used: old list encoding. */
 #define OBJ_ENCODING_ZIPLIST 5 /* Encoded as ziplist */
 #define OBJ_ENCODING_INTSET 6  /* Encoded as intset */
-#define OBJ_ENCODING_SKIPLIST 7  /* Encoded as skiplist */
+/* 7 was OBJ_ENCODING_SKIPLIST, the old encoding of large zsets. */
 #define OBJ_ENCODING_EMBSTR 8  /* Embedded sds string encoding */
-#define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of ziplists */
+#define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of listpacks */
 #define OBJ_ENCODING_STREAM 10 /* Encoded as a radix tree of listpacks */
+#define OBJ_ENCODING_LISTPACK 11 /* Encoded as a listpack */
+#define OBJ_ENCODING_BTREE 12  /* Encoded as an order-statistic B+tree */
 
 #define LRU_BITS 24
 #define LRU_CLOCK_MAX ((1<<LRU_BITS)-1) /* Max value of obj->lru */
@@ -648,12 +668,20 @@ typedef struct clientReplyBlock {
 typedef struct redisDb {
     dict *dict;                 /* The keyspace for this DB */
     dict *expires;              /* Timeout of keys with a timeout set */
+    rax *expires_index;         /* Keys with a timeout ordered by time. */
+    dict *hexpires;             /* Hashes with fields having a timeout. */
+    rax *hexpires_index;        /* Such hashes ordered by first timeout. */
     dict *blocking_keys;        /* Keys with clients waiting for data (BLPOP)*/
     dict *ready_keys;           /* Blocked keys that received a PUSH */
     dict *watched_keys;         /* WATCHED keys for MULTI/EXEC CAS */
     int id;                     /* Database ID */
     long long avg_ttl;          /* Average TTL, just for stats */
     list *defrag_later;         /* List of key names to attempt to defrag one by one, gradually. */
+    dict *key_sizes;            /* Memory accounted to every key when the DB
+                                   has a quota (db-maxmemory) or when
+                                   memory-accounting is enabled, or NULL. */
+    size_t used_memory;         /* Sum of the key_sizes values. */
+    size_t used_memory_type[OBJ_TYPE_MAX]; /* used_memory by value type. */
 } redisDb;
 
 /* Client MULTI/EXEC state */
@@ -701,6 +729,10 @@ typedef struct blockingState {
     void *module_blocked_handle; /* RedisModuleBlockedClient structure.
                                     which is opaque for the Redis core, only
                                     handled in module.c. */
+
+    /* BLOCKED_MIGRATE */
+    void *migrate_job;      /* migrateAsyncJob structure, opaque outside of
+                               cluster.c. */
 } blockingState;
 
 /* The following structure represents a node in the server.ready_keys list,
@@ -765,6 +797,8 @@ typedef struct client {
     int slave_listening_port; /* As configured with: SLAVECONF listening-port */
     char slave_ip[NET_IP_STR_LEN]; /* Optionally given by REPLCONF ip-address */
     int slave_capa;         /* Slave capabilities: SLAVE_CAPA_* bitwise OR. */
+    long long readonly_maxlag_ms;     /* READONLY MAXLAG or -1. */
+    long long readonly_maxlag_offset; /* READONLY MAXOFFSETLAG or -1. */
     multiState mstate;      /* MULTI/EXEC state */
     int btype;              /* Type of blocking op if CLIENT_BLOCKED. */
     blockingState bpop;     /* blocking state */
@@ -797,7 +831,7 @@ struct sharedObjectsStruct {
     *emptymultibulk, *wrongtypeerr, *nokeyerr, *syntaxerr, *sameobjecterr,
     *outofrangeerr, *noscripterr, *loadingerr, *slowscripterr, *bgsaveerr,
     *masterdownerr, *roslaveerr, *execaborterr, *noautherr, *noreplicaserr,
-    *busykeyerr, *oomerr, *plus, *messagebulk, *pmessagebulk, *subscribebulk,
+    *busykeyerr, *oomerr, *dboomerr, *plus, *messagebulk, *pmessagebulk, *subscribebulk,
     *unsubscribebulk, *psubscribebulk, *punsubscribebulk, *del, *unlink,
     *rpop, *lpop, *lpush, *rpoplpush, *zpopmin, *zpopmax, *emptyscan,
     *select[PROTO_SHARED_SELECT_CMDS],
@@ -807,26 +841,49 @@ struct sharedObjectsStruct {
     sds minstring, maxstring;
 };
 
-/* ZSETs use a specialized version of Skiplists */
-typedef struct zskiplistNode {
+/* Large ZSETs keep their elements ordered in an order-statistic B+tree.
+ * The elements live in the leaves sorted by score and then by element, and
+ * the leaves are linked in both directions so that ranges are scanned
+ * sequentially. For every child an inner node stores the number of elements
+ * below it, used to seek by rank, and the smallest element below it, used to
+ * seek by score or element. Nodes are a few cache lines in size, so that
+ * lookups and range scans touch contiguous memory. */
+typedef struct zbtreeEntry {
     sds ele;
     double score;
-    struct zskiplistNode *backward;
-    struct zskiplistLevel {
-        struct zskiplistNode *forward;
-        unsigned long span;
-    } level[];
-} zskiplistNode;
-
-typedef struct zskiplist {
-    struct zskiplistNode *header, *tail;
+} zbtreeEntry;
+
+typedef struct zbtreeLeaf {
+    struct zbtreeLeaf *prev, *next;
+    unsigned int count;
+    zbtreeEntry entries[ZBTREE_LEAF_ENTRIES];
+} zbtreeLeaf;
+
+typedef struct zbtreeInner {
+    unsigned int count;                     /* Number of children. */
+    unsigned long sizes[ZBTREE_FANOUT];     /* Elements below every child. */
+    double scores[ZBTREE_FANOUT];           /* Smallest element below every */
+    sds eles[ZBTREE_FANOUT];                /* child, score and element. */
+    void *children[ZBTREE_FANOUT];
+} zbtreeInner;
+
+typedef struct zbtree {
+    void *root;             /* A leaf when height is 1. */
+    zbtreeLeaf *head, *tail;
     unsigned long length;
-    int level;
-} zskiplist;
+    int height;
+} zbtree;
+
+/* Position of an element inside the B+tree. */
+typedef struct zbtreeIter {
+    zbtreeLeaf *leaf;
+    unsigned int pos;
+} zbtreeIter;
 
 typedef struct zset {
-    dict *dict;
-    zskiplist *zsl;
+    dict *dict;             /* Element -> score, the score is stored inside
+                               the dict entry. */
+    zbtree *zbt;
 } zset;
 
 typedef struct clientBufferLimitsConfig {
@@ -920,6 +977,9 @@ struct malloc_stats {
     size_t allocator_allocated;
     size_t allocator_active;
     size_t allocator_resident;
+    size_t buffers_allocated;   /* Same as above, buffers arena only. */
+    size_t buffers_active;
+    size_t buffers_resident;
 };
 
 /*-----------------------------------------------------------------------------
@@ -996,6 +1056,7 @@ struct redisServer {
     mstime_t clients_pause_end_time; /* Time when we undo clients_paused */
     char neterr[ANET_ERR_LEN];   /* Error buffer for anet.c */
     dict *migrate_cached_sockets;/* MIGRATE cached sockets */
+    list *migrate_async_jobs;   /* MIGRATE ... ASYNC jobs in progress. */
     uint64_t next_client_id;    /* Next client unique ID. Incremental. */
     int protected_mode;         /* Don't accept external connections. */
     /* RDB / AOF loading information */
@@ -1009,15 +1070,20 @@ struct redisServer {
                         *lpopCommand, *rpopCommand, *zpopminCommand,
                         *zpopmaxCommand, *sremCommand, *execCommand,
                         *expireCommand, *pexpireCommand, *xclaimCommand,
-                        *xgroupCommand;
+                        *xgroupCommand, *hdelCommand, *hpexpireatCommand;
     /* Fields used only for stats */
     time_t stat_starttime;          /* Server start time */
     long long stat_numcommands;     /* Number of processed commands */
     long long stat_numconnections;  /* Number of connections received */
     long long stat_expiredkeys;     /* Number of expired keys */
+    long long stat_expired_hash_fields; /* Number of expired hash fields */
     double stat_expired_stale_perc; /* Percentage of keys probably expired */
     long long stat_expired_time_cap_reached_count; /* Early expire cylce stops.*/
     long long stat_evictedkeys;     /* Number of evicted keys (maxmemory) */
+    long long stat_evictedkeys_proactive; /* Keys evicted by proactive eviction */
+    long long stat_tinylfu_rejected; /* Keys admitted on probation by TinyLFU */
+    mstime_t stat_eviction_lag_start; /* Since when we are over the eviction
+                                         target, or 0. */
     long long stat_keyspace_hits;   /* Number of successful lookups of keys */
     long long stat_keyspace_misses; /* Number of failed lookups of keys */
     long long stat_active_defrag_hits;      /* number of allocations moved */
@@ -1055,6 +1121,8 @@ struct redisServer {
     int tcpkeepalive;               /* Set SO_KEEPALIVE if non-zero. */
     int active_expire_enabled;      /* Can be disabled for testing purposes. */
     int active_defrag_enabled;
+    int active_defrag_threaded;        /* Defrag from a thread while the main thread sleeps */
+    int memory_accounting;          /* Account the memory of every key. */
     size_t active_defrag_ignore_bytes; /* minimum amount of fragmentation waste to start active defrag */
     int active_defrag_threshold_lower; /* minimum percentage of fragmentation to start active defrag */
     int active_defrag_threshold_upper; /* maximum percentage of fragmentation at which we use maximum effort */
@@ -1181,6 +1249,13 @@ struct redisServer {
     int repl_slave_ro;          /* Slave is read only? */
     int repl_slave_ignore_maxmemory;    /* If true slaves do not evict. */
     time_t repl_down_since; /* Unix time at which link with master went down */
+    long long repl_drained_reploff; /* Master read offset when we last read
+                                       all the data pending in its link. */
+    mstime_t repl_drained_time;     /* Time of the read above. */
+    mstime_t repl_synced_time;  /* Last time we had applied everything the
+                                   master sent, see clusterGetReplicaLag(). */
+    int repl_debug_pause;       /* Don't apply the replication stream. Can be
+                                   set for testing purposes. */
     int repl_disable_tcp_nodelay;   /* Disable TCP_NODELAY after SYNC? */
     int slave_priority;             /* Reported in INFO and used by Sentinel. */
     int slave_announce_port;        /* Give the master this listening port. */
@@ -1203,6 +1278,11 @@ struct redisServer {
     unsigned long long maxmemory;   /* Max number of memory bytes to use */
     int maxmemory_policy;           /* Policy for key eviction */
     int maxmemory_samples;          /* Pricision of random sampling */
+    int maxmemory_low_watermark;    /* % of maxmemory where proactive eviction
+                                       starts, 0 = disabled. */
+    int maxmemory_eviction_pool_size; /* Entries of the eviction pool. */
+    unsigned long long *db_maxmemory; /* Memory quota of every DB, 0 = none */
+    int db_maxmemory_len;           /* Number of entries of db_maxmemory. */
     int lfu_log_factor;             /* LFU logarithmic counter factor. */
     int lfu_decay_time;             /* LFU counter decay factor. */
     long long proto_max_bulk_len;   /* Protocol bulk length maximum size. */
@@ -1211,6 +1291,8 @@ struct redisServer {
     unsigned int blocked_clients_by_type[BLOCKED_NUM];
     list *unblocked_clients; /* list of clients to unblock before next loop */
     list *ready_keys;        /* List of readyList structures for BLPOP & co */
+    list *hash_read_copies;  /* Hashes built by hashTypeHideExpiredFields()
+                                for the command being executed. */
     /* Sort parameters - qsort_r() is only available under BSD so we
      * have to take this state global, in order to pass it to sortCompare() */
     int sort_desc;
@@ -1221,6 +1303,8 @@ struct redisServer {
     size_t hash_max_ziplist_entries;
     size_t hash_max_ziplist_value;
     size_t set_max_intset_entries;
+    size_t set_max_listpack_entries;
+    size_t set_max_listpack_value;
     size_t zset_max_ziplist_entries;
     size_t zset_max_ziplist_value;
     size_t hll_sparse_max_bytes;
@@ -1251,6 +1335,8 @@ struct redisServer {
                                           there is at least an uncovered slot.*/
     int cluster_slave_no_failover;  /* Prevent slave from starting a failover
                                        if the master is in failure state. */
+    int cluster_compact_bus;    /* Use compact PING/PONG messages with the
+                                   nodes supporting them. */
     char *cluster_announce_ip;  /* IP address to announce on cluster bus. */
     int cluster_announce_port;     /* base port to announce on cluster bus. */
     int cluster_announce_bus_port; /* bus port to announce on cluster bus. */
@@ -1281,6 +1367,7 @@ struct redisServer {
     int lazyfree_lazy_eviction;
     int lazyfree_lazy_expire;
     int lazyfree_lazy_server_del;
+    int lazyfree_threads;           /* Number of lazy free bio threads. */
     /* Latency monitor */
     long long latency_monitor_threshold;
     dict *latency_events;
@@ -1360,6 +1447,7 @@ typedef struct {
     robj *subject;
     int encoding;
     int ii; /* intset iterator */
+    unsigned char *lpi; /* listpack iterator */
     dictIterator *di;
 } setTypeIterator;
 
@@ -1377,6 +1465,15 @@ typedef struct {
     dictEntry *de;
 } hashTypeIterator;
 
+/* The timeouts of the fields of a hash, stored in db->hexpires. The hash is
+ * also indexed in db->hexpires_index by 'min': no field expires before that
+ * time, but 'min' may be older than the first timeout after fields were
+ * persisted, in which case it is just computed again when reached. */
+typedef struct hashFieldExpires {
+    dict *fields;       /* Field sds -> unix time in milliseconds. */
+    long long min;      /* Time the hash is indexed with. */
+} hashFieldExpires;
+
 #include "stream.h"  /* Stream data type header file. */
 
 #define OBJ_HASH_KEY 1
@@ -1400,6 +1497,7 @@ extern double R_Zero, R_PosInf, R_NegInf, R_Nan;
 extern dictType hashDictType;
 extern dictType replScriptCacheDictType;
 extern dictType keyptrDictType;
+extern dictType hexpiresDictType;
 extern dictType modulesDictType;
 
 /*-----------------------------------------------------------------------------
@@ -1565,9 +1663,10 @@ robj *createQuicklistObject(void);
 robj *createZiplistObject(void);
 robj *createSetObject(void);
 robj *createIntsetObject(void);
+robj *createSetListpackObject(void);
 robj *createHashObject(void);
 robj *createZsetObject(void);
-robj *createZsetZiplistObject(void);
+robj *createZsetListpackObject(void);
 robj *createStreamObject(void);
 robj *createModuleObject(moduleType *mt, void *value);
 int getLongFromObjectOrReply(client *c, robj *o, long *target, const char *msg);
@@ -1684,13 +1783,19 @@ typedef struct {
     int minex, maxex; /* are min or max exclusive? */
 } zlexrangespec;
 
-zskiplist *zslCreate(void);
-void zslFree(zskiplist *zsl);
-zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele);
+zbtree *zbtCreate(void);
+void zbtFree(zbtree *zbt);
+void zbtInsert(zbtree *zbt, double score, sds ele);
+void zbtBulkLoad(zbtree *zbt, zbtreeEntry *entries, unsigned long count);
 unsigned char *zzlInsert(unsigned char *zl, sds ele, double score);
-int zslDelete(zskiplist *zsl, double score, sds ele, zskiplistNode **node);
-zskiplistNode *zslFirstInRange(zskiplist *zsl, zrangespec *range);
-zskiplistNode *zslLastInRange(zskiplist *zsl, zrangespec *range);
+int zbtDelete(zbtree *zbt, double score, sds ele);
+zbtreeEntry *zbtFirst(zbtree *zbt, zbtreeIter *it);
+zbtreeEntry *zbtLast(zbtree *zbt, zbtreeIter *it);
+zbtreeEntry *zbtNext(zbtreeIter *it);
+zbtreeEntry *zbtPrev(zbtreeIter *it);
+zbtreeEntry *zbtGetElementByRank(zbtree *zbt, unsigned long rank, zbtreeIter *it);
+zbtreeEntry *zbtFirstInRange(zbtree *zbt, zrangespec *range, zbtreeIter *it);
+zbtreeEntry *zbtLastInRange(zbtree *zbt, zrangespec *range, zbtreeIter *it);
 double zzlGetScore(unsigned char *sptr);
 void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr);
 void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr);
@@ -1698,22 +1803,23 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range);
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range);
 unsigned long zsetLength(const robj *zobj);
 void zsetConvert(robj *zobj, int encoding);
-void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen);
+void zsetAddNew(zset *zs, double score, sds ele);
+void zsetConvertToListpackIfNeeded(robj *zobj, size_t maxelelen);
 int zsetScore(robj *zobj, sds member, double *score);
-unsigned long zslGetRank(zskiplist *zsl, double score, sds o);
+unsigned long zbtGetRank(zbtree *zbt, double score, sds ele);
 int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore);
 long zsetRank(robj *zobj, sds ele, int reverse);
 int zsetDel(robj *zobj, sds ele);
 void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey, robj *countarg);
-sds ziplistGetObject(unsigned char *sptr);
+sds lpGetObject(unsigned char *sptr);
 int zslValueGteMin(double value, zrangespec *spec);
 int zslValueLteMax(double value, zrangespec *spec);
 void zslFreeLexRange(zlexrangespec *spec);
 int zslParseLexRange(robj *min, robj *max, zlexrangespec *spec);
 unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range);
 unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range);
-zskiplistNode *zslFirstInLexRange(zskiplist *zsl, zlexrangespec *range);
-zskiplistNode *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range);
+zbtreeEntry *zbtFirstInLexRange(zbtree *zbt, zlexrangespec *range, zbtreeIter *it);
+zbtreeEntry *zbtLastInLexRange(zbtree *zbt, zlexrangespec *range, zbtreeIter *it);
 int zzlLexValueGteMin(unsigned char *p, zlexrangespec *spec);
 int zzlLexValueLteMax(unsigned char *p, zlexrangespec *spec);
 int zslLexValueGteMin(sds value, zlexrangespec *spec);
@@ -1724,6 +1830,10 @@ int getMaxmemoryState(size_t *total, size_t *logical, size_t *tofree, float *lev
 size_t freeMemoryGetNotCountedMemory();
 int freeMemoryIfNeeded(void);
 int freeMemoryIfNeededAndSafe(void);
+int freeDbMemoryIfNeeded(redisDb *db);
+int freeDbMemoryIfNeededAndSafe(redisDb *db);
+void proactiveEvictionCycle(int type);
+void getEvictionLag(size_t *bytes, mstime_t *ms);
 int processCommand(client *c);
 void setupSignalHandlers(void);
 struct redisCommand *lookupCommand(sds name);
@@ -1757,6 +1867,8 @@ void closeListeningSockets(int unlink_unix_socket);
 void updateCachedTime(int update_daylight_info);
 void resetServerStats(void);
 void activeDefragCycle(void);
+int activeDefragThreadActive(void);
+void activeDefragAcquireGIL(void);
 unsigned int getLRUClock(void);
 unsigned int LRU_CLOCK(void);
 const char *evictPolicyToString(void);
@@ -1771,13 +1883,16 @@ int restartServer(int flags, mstime_t delay);
 /* Set data type */
 robj *setTypeCreate(sds value);
 int setTypeAdd(robj *subject, sds value);
+int setTypeAddAux(robj *set, char *str, size_t len, int64_t llval, int str_is_sds);
 int setTypeRemove(robj *subject, sds value);
+int setTypeRemoveAux(robj *set, char *str, size_t len, int64_t llval, int str_is_sds);
 int setTypeIsMember(robj *subject, sds value);
+int setTypeIsMemberAux(robj *set, char *str, size_t len, int64_t llval, int str_is_sds);
 setTypeIterator *setTypeInitIterator(robj *subject);
 void setTypeReleaseIterator(setTypeIterator *si);
-int setTypeNext(setTypeIterator *si, sds *sdsele, int64_t *llele);
+int setTypeNext(setTypeIterator *si, char **str, size_t *len, int64_t *llele);
 sds setTypeNextObject(setTypeIterator *si);
-int setTypeRandomElement(robj *setobj, sds *sdsele, int64_t *llele);
+int setTypeRandomElement(robj *setobj, char **str, size_t *len, int64_t *llele);
 unsigned long setTypeRandomElements(robj *set, unsigned long count, robj *aux_set);
 unsigned long setTypeSize(const robj *subject);
 void setTypeConvert(robj *subject, int enc);
@@ -1796,16 +1911,27 @@ unsigned long hashTypeLength(const robj *o);
 hashTypeIterator *hashTypeInitIterator(robj *subject);
 void hashTypeReleaseIterator(hashTypeIterator *hi);
 int hashTypeNext(hashTypeIterator *hi);
-void hashTypeCurrentFromZiplist(hashTypeIterator *hi, int what,
-                                unsigned char **vstr,
-                                unsigned int *vlen,
-                                long long *vll);
+void hashTypeCurrentFromListpack(hashTypeIterator *hi, int what,
+                                 unsigned char **vstr,
+                                 unsigned int *vlen,
+                                 long long *vll);
 sds hashTypeCurrentFromHashTable(hashTypeIterator *hi, int what);
 void hashTypeCurrentObject(hashTypeIterator *hi, int what, unsigned char **vstr, unsigned int *vlen, long long *vll);
 sds hashTypeCurrentObjectNewSds(hashTypeIterator *hi, int what);
 robj *hashTypeLookupWriteOrCreate(client *c, robj *key);
 robj *hashTypeGetValueObject(robj *o, sds field);
 int hashTypeSet(robj *o, sds field, sds value, int flags);
+void hashTypeSetFieldExpire(redisDb *db, robj *key, sds field, long long when);
+long long hashTypeGetFieldExpire(redisDb *db, robj *key, sds field);
+int hashTypeRemoveFieldExpire(redisDb *db, robj *key, sds field);
+int dbDeleteHashFieldExpires(redisDb *db, sds key);
+hashFieldExpires *dbUnlinkHashFieldExpires(redisDb *db, sds key);
+void dbLinkHashFieldExpires(redisDb *db, robj *key, hashFieldExpires *hfe);
+void freeHashFieldExpires(hashFieldExpires *hfe);
+int hashExpireFields(redisDb *db, robj *key, long long now);
+int hashExpireFieldsIfNeeded(redisDb *db, robj *key);
+void hashTypeSetFieldExpires(redisDb *db, robj *key, robj *o, dict *field_expires);
+robj *hashTypeHideExpiredFields(redisDb *db, robj *key, robj *o);
 
 /* Pub / Sub */
 int pubsubUnsubscribeAllChannels(client *c, int notify);
@@ -1829,6 +1955,16 @@ int rewriteConfig(char *path);
 
 /* db.c -- Keyspace access API */
 int removeExpire(redisDb *db, robj *key);
+int dbDeleteExpire(redisDb *db, sds key);
+unsigned long long dbGetMaxmemory(int id);
+int dbOverMemoryQuota(redisDb *db);
+void dbAccountKey(redisDb *db, sds key);
+int dbGetAccountedKeyMemory(redisDb *db, sds key, size_t *usage);
+void dbResetMemoryAccounting(redisDb *db);
+void dbUnaccountKey(redisDb *db, sds key);
+void dbUpdateMemoryAccounting(redisDb *db);
+void expireIndexUpdate(rax *index, sds key, long long when, int add);
+long long expireIndexGetTime(unsigned char *indexed);
 void propagateExpire(redisDb *db, robj *key, int lazy);
 int expireIfNeeded(redisDb *db, robj *key);
 long long getExpire(redisDb *db, robj *key);
@@ -1872,8 +2008,13 @@ void slotToKeyDel(robj *key);
 void slotToKeyFlush(void);
 int dbAsyncDelete(redisDb *db, robj *key);
 void emptyDbAsync(redisDb *db);
+void freeDictAsync(dict *d);
 void slotToKeyFlushAsync(void);
 size_t lazyfreeGetPendingObjectsCount(void);
+size_t lazyfreeGetPendingMemory(void);
+size_t lazyfreeGetFreedObjectsCount(void);
+void lazyfreeResetStats(void);
+void lazyfreeFlushBatch(void);
 void freeObjAsync(robj *o);
 
 /* API to get key arguments from commands */
@@ -1881,6 +2022,7 @@ int *getKeysFromCommand(struct redisCommand *cmd, robj **argv, int argc, int *nu
 void getKeysFreeResult(int *result);
 int *zunionInterGetKeys(struct redisCommand *cmd,robj **argv, int argc, int *numkeys);
 int *evalGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
+int *sintercardGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 int *sortGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 int *migrateGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 int *georadiusGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
@@ -1893,7 +2035,14 @@ unsigned int keyHashSlot(char *key, int keylen);
 void clusterCron(void);
 void clusterPropagatePublish(robj *channel, robj *message);
 void migrateCloseTimedoutSockets(void);
+void migrateAsyncCron(void);
+void migrateAsyncSignalModifiedKey(redisDb *db, robj *key);
+void migrateAsyncSignalFlushedDb(int dbid);
+int migrateAsyncKeyIsBusy(redisDb *db, sds key);
+void unblockClientFromMigrate(client *c);
 void clusterBeforeSleep(void);
+void clusterWaitConfigSaves(void);
+int clusterGetReplicaLag(long long *lag_offset, mstime_t *lag_ms);
 int clusterSendModuleMessageToTarget(const char *target, uint64_t module_id, uint8_t type, unsigned char *payload, uint32_t len);
 
 /* Sentinel */
@@ -1934,12 +2083,22 @@ void rememberSlaveKeyWithExpire(redisDb *db, robj *key);
 void flushSlaveKeysWithExpireList(void);
 size_t getSlaveKeyWithExpireCount(void);
 
+/* object.c -- memory usage estimate. */
+#define OBJ_COMPUTE_SIZE_DEF_SAMPLES 5 /* Default sample size. */
+size_t objectComputeSize(robj *o, size_t sample_size);
+
 /* evict.c -- maxmemory handling and LRU eviction. */
 void evictionPoolAlloc(void);
+void evictionPoolResize(void);
 #define LFU_INIT_VAL 5
 unsigned long LFUGetTimeInMinutes(void);
 uint8_t LFULogIncr(uint8_t value);
 unsigned long LFUDecrAndReturn(robj *o);
+void tinylfuInit(void);
+void tinylfuRelease(void);
+void tinylfuRecord(sds key);
+unsigned long tinylfuEstimate(sds key);
+void tinylfuAdmit(sds key, robj *val);
 
 /* Keys hashing / comparison functions for dict.c hash tables. */
 uint64_t dictSdsHash(const void *key);
@@ -2010,6 +2169,7 @@ void spopCommand(client *c);
 void srandmemberCommand(client *c);
 void sinterCommand(client *c);
 void sinterstoreCommand(client *c);
+void sinterCardCommand(client *c);
 void sunionCommand(client *c);
 void sunionstoreCommand(client *c);
 void sdiffCommand(client *c);
@@ -2020,6 +2180,7 @@ void flushdbCommand(client *c);
 void flushallCommand(client *c);
 void sortCommand(client *c);
 void lremCommand(client *c);
+void lposCommand(client *c);
 void rpoplpushCommand(client *c);
 void infoCommand(client *c);
 void mgetCommand(client *c);
@@ -2044,6 +2205,7 @@ void zrangeCommand(client *c);
 void zrangebyscoreCommand(client *c);
 void zrevrangebyscoreCommand(client *c);
 void zrangebylexCommand(client *c);
+void zrangestoreCommand(client *c);
 void zrevrangebylexCommand(client *c);
 void zcountCommand(client *c);
 void zlexcountCommand(client *c);
@@ -2073,6 +2235,13 @@ void hgetCommand(client *c);
 void hmsetCommand(client *c);
 void hmgetCommand(client *c);
 void hdelCommand(client *c);
+void hexpireCommand(client *c);
+void hpexpireCommand(client *c);
+void hexpireatCommand(client *c);
+void hpexpireatCommand(client *c);
+void httlCommand(client *c);
+void hpttlCommand(client *c);
+void hpersistCommand(client *c);
 void hlenCommand(client *c);
 void hstrlenCommand(client *c);
 void zremrangebyrankCommand(client *c);
@@ -33,7 +33,6 @@
 #include "pqsort.h" /* Partial qsort for SORT+LIMIT */
 #include <math.h> /* isnan() */
 
-zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank);
 
 redisSortOperation *createSortOperation(int type, robj *pattern) {
     redisSortOperation *so = zmalloc(sizeof(*so));
@@ -303,7 +302,7 @@ void sortCommand(client *c) {
 
     /* Destructively convert encoded sorted sets for SORT. */
     if (sortval->type == OBJ_ZSET)
-        zsetConvert(sortval, OBJ_ENCODING_SKIPLIST);
+        zsetConvert(sortval, OBJ_ENCODING_BTREE);
 
     /* Objtain the length of the object to sort. */
     switch(sortval->type) {
@@ -397,8 +396,9 @@ void sortCommand(client *c) {
          * way, just getting the required range, as an optimization. */
 
         zset *zs = sortval->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zbtree *zbt = zs->zbt;
+        zbtreeEntry *e;
+        zbtreeIter it;
         sds sdsele;
         int rangelen = vectorlen;
 
@@ -406,23 +406,25 @@ void sortCommand(client *c) {
         if (desc) {
             long zsetlen = dictSize(((zset*)sortval->ptr)->dict);
 
-            ln = zsl->tail;
             if (start > 0)
-                ln = zslGetElementByRank(zsl,zsetlen-start);
+                e = zbtGetElementByRank(zbt,zsetlen-start,&it);
+            else
+                e = zbtLast(zbt,&it);
         } else {
-            ln = zsl->header->level[0].forward;
             if (start > 0)
-                ln = zslGetElementByRank(zsl,start+1);
+                e = zbtGetElementByRank(zbt,start+1,&it);
+            else
+                e = zbtFirst(zbt,&it);
         }
 
         while(rangelen--) {
-            serverAssertWithInfo(c,sortval,ln != NULL);
-            sdsele = ln->ele;
+            serverAssertWithInfo(c,sortval,e != NULL);
+            sdsele = e->ele;
             vector[j].obj = createStringObject(sdsele,sdslen(sdsele));
             vector[j].u.score = 0;
             vector[j].u.cmpobj = NULL;
             j++;
-            ln = desc ? ln->backward : ln->level[0].forward;
+            e = desc ? zbtPrev(&it) : zbtNext(&it);
         }
         /* Fix start/end: output code is not aware of this optimization. */
         end -= start;
@@ -35,12 +35,12 @@
  *----------------------------------------------------------------------------*/
 
 /* Check the length of a number of objects to see if we need to convert a
- * ziplist to a real hash. Note that we only check string encoded objects
+ * listpack to a real hash. Note that we only check string encoded objects
  * as their string length can be queried in constant time. */
 void hashTypeTryConversion(robj *o, robj **argv, int start, int end) {
     int i;
 
-    if (o->encoding != OBJ_ENCODING_ZIPLIST) return;
+    if (o->encoding != OBJ_ENCODING_LISTPACK) return;
 
     for (i = start; i <= end; i++) {
         if (sdsEncodedObject(argv[i]) &&
@@ -52,31 +52,31 @@ void hashTypeTryConversion(robj *o, robj **argv, int start, int end) {
     }
 }
 
-/* Get the value from a ziplist encoded hash, identified by field.
+/* Get the value from a listpack encoded hash, identified by field.
  * Returns -1 when the field cannot be found. */
-int hashTypeGetFromZiplist(robj *o, sds field,
-                           unsigned char **vstr,
-                           unsigned int *vlen,
-                           long long *vll)
+int hashTypeGetFromListpack(robj *o, sds field,
+                            unsigned char **vstr,
+                            unsigned int *vlen,
+                            long long *vll)
 {
-    unsigned char *zl, *fptr = NULL, *vptr = NULL;
+    unsigned char *lp, *fptr = NULL, *vptr = NULL;
     int ret;
 
-    serverAssert(o->encoding == OBJ_ENCODING_ZIPLIST);
+    serverAssert(o->encoding == OBJ_ENCODING_LISTPACK);
 
-    zl = o->ptr;
-    fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+    lp = o->ptr;
+    fptr = lpFirst(lp);
     if (fptr != NULL) {
-        fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+        fptr = lpFind(lp, fptr, (unsigned char*)field, sdslen(field), 1);
         if (fptr != NULL) {
             /* Grab pointer to the value (fptr points to the field) */
-            vptr = ziplistNext(zl, fptr);
+            vptr = lpNext(lp, fptr);
             serverAssert(vptr != NULL);
         }
     }
 
     if (vptr != NULL) {
-        ret = ziplistGet(vptr, vstr, vlen, vll);
+        ret = lpGetValue(vptr, vstr, vlen, vll);
         serverAssert(ret);
         return 0;
     }
@@ -107,9 +107,9 @@ sds hashTypeGetFromHashTable(robj *o, sds field) {
  * can always check the function return by checking the return value
  * for C_OK and checking if vll (or vstr) is NULL. */
 int hashTypeGetValue(robj *o, sds field, unsigned char **vstr, unsigned int *vlen, long long *vll) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         *vstr = NULL;
-        if (hashTypeGetFromZiplist(o, field, vstr, vlen, vll) == 0)
+        if (hashTypeGetFromListpack(o, field, vstr, vlen, vll) == 0)
             return C_OK;
     } else if (o->encoding == OBJ_ENCODING_HT) {
         sds value;
@@ -143,12 +143,12 @@ robj *hashTypeGetValueObject(robj *o, sds field) {
  * exist. */
 size_t hashTypeGetValueLength(robj *o, sds field) {
     size_t len = 0;
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        if (hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll) == 0)
+        if (hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll) == 0)
             len = vstr ? vlen : sdigits10(vll);
     } else if (o->encoding == OBJ_ENCODING_HT) {
         sds aux;
@@ -164,12 +164,12 @@ size_t hashTypeGetValueLength(robj *o, sds field) {
 /* Test if the specified field exists in the given hash. Returns 1 if the field
  * exists, and 0 when it doesn't. */
 int hashTypeExists(robj *o, sds field) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        if (hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll) == 0) return 1;
+        if (hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll) == 0) return 1;
     } else if (o->encoding == OBJ_ENCODING_HT) {
         if (hashTypeGetFromHashTable(o, field) != NULL) return 1;
     } else {
@@ -202,38 +202,33 @@ int hashTypeExists(robj *o, sds field) {
 int hashTypeSet(robj *o, sds field, sds value, int flags) {
     int update = 0;
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        unsigned char *zl, *fptr, *vptr;
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp, *fptr, *vptr;
 
-        zl = o->ptr;
-        fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+        lp = o->ptr;
+        fptr = lpFirst(lp);
         if (fptr != NULL) {
-            fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+            fptr = lpFind(lp, fptr, (unsigned char*)field, sdslen(field), 1);
             if (fptr != NULL) {
                 /* Grab pointer to the value (fptr points to the field) */
-                vptr = ziplistNext(zl, fptr);
+                vptr = lpNext(lp, fptr);
                 serverAssert(vptr != NULL);
                 update = 1;
 
-                /* Delete value */
-                zl = ziplistDelete(zl, &vptr);
-
-                /* Insert new value */
-                zl = ziplistInsert(zl, vptr, (unsigned char*)value,
-                        sdslen(value));
+                /* Replace value */
+                lp = lpInsert(lp, (unsigned char*)value, sdslen(value),
+                        vptr, LP_REPLACE, NULL);
             }
         }
 
         if (!update) {
-            /* Push new field/value pair onto the tail of the ziplist */
-            zl = ziplistPush(zl, (unsigned char*)field, sdslen(field),
-                    ZIPLIST_TAIL);
-            zl = ziplistPush(zl, (unsigned char*)value, sdslen(value),
-                    ZIPLIST_TAIL);
+            /* Push new field/value pair onto the tail of the listpack */
+            lp = lpAppend(lp, (unsigned char*)field, sdslen(field));
+            lp = lpAppend(lp, (unsigned char*)value, sdslen(value));
         }
-        o->ptr = zl;
+        o->ptr = lp;
 
-        /* Check if the ziplist needs to be converted to a hash table */
+        /* Check if the listpack needs to be converted to a hash table */
         if (hashTypeLength(o) > server.hash_max_ziplist_entries)
             hashTypeConvert(o, OBJ_ENCODING_HT);
     } else if (o->encoding == OBJ_ENCODING_HT) {
@@ -279,17 +274,17 @@ int hashTypeSet(robj *o, sds field, sds value, int flags) {
 int hashTypeDelete(robj *o, sds field) {
     int deleted = 0;
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        unsigned char *zl, *fptr;
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp, *fptr;
 
-        zl = o->ptr;
-        fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+        lp = o->ptr;
+        fptr = lpFirst(lp);
         if (fptr != NULL) {
-            fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+            fptr = lpFind(lp, fptr, (unsigned char*)field, sdslen(field), 1);
             if (fptr != NULL) {
-                zl = ziplistDelete(zl,&fptr); /* Delete the key. */
-                zl = ziplistDelete(zl,&fptr); /* Delete the value. */
-                o->ptr = zl;
+                lp = lpDelete(lp,fptr,&fptr); /* Delete the key. */
+                lp = lpDelete(lp,fptr,&fptr); /* Delete the value. */
+                o->ptr = lp;
                 deleted = 1;
             }
         }
@@ -311,8 +306,8 @@ int hashTypeDelete(robj *o, sds field) {
 unsigned long hashTypeLength(const robj *o) {
     unsigned long length = ULONG_MAX;
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        length = ziplistLen(o->ptr) / 2;
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        length = lpLength(o->ptr) / 2;
     } else if (o->encoding == OBJ_ENCODING_HT) {
         length = dictSize((const dict*)o->ptr);
     } else {
@@ -326,7 +321,7 @@ hashTypeIterator *hashTypeInitIterator(robj *subject) {
     hi->subject = subject;
     hi->encoding = subject->encoding;
 
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         hi->fptr = NULL;
         hi->vptr = NULL;
     } else if (hi->encoding == OBJ_ENCODING_HT) {
@@ -346,27 +341,27 @@ void hashTypeReleaseIterator(hashTypeIterator *hi) {
 /* Move to the next entry in the hash. Return C_OK when the next entry
  * could be found and C_ERR when the iterator reaches the end. */
 int hashTypeNext(hashTypeIterator *hi) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
-        unsigned char *zl;
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp;
         unsigned char *fptr, *vptr;
 
-        zl = hi->subject->ptr;
+        lp = hi->subject->ptr;
         fptr = hi->fptr;
         vptr = hi->vptr;
 
         if (fptr == NULL) {
             /* Initialize cursor */
             serverAssert(vptr == NULL);
-            fptr = ziplistIndex(zl, 0);
+            fptr = lpFirst(lp);
         } else {
             /* Advance cursor */
             serverAssert(vptr != NULL);
-            fptr = ziplistNext(zl, vptr);
+            fptr = lpNext(lp, vptr);
         }
         if (fptr == NULL) return C_ERR;
 
         /* Grab pointer to the value (fptr points to the field) */
-        vptr = ziplistNext(zl, fptr);
+        vptr = lpNext(lp, fptr);
         serverAssert(vptr != NULL);
 
         /* fptr, vptr now point to the first or next pair */
@@ -381,21 +376,21 @@ int hashTypeNext(hashTypeIterator *hi) {
 }
 
 /* Get the field or value at iterator cursor, for an iterator on a hash value
- * encoded as a ziplist. Prototype is similar to `hashTypeGetFromZiplist`. */
-void hashTypeCurrentFromZiplist(hashTypeIterator *hi, int what,
-                                unsigned char **vstr,
-                                unsigned int *vlen,
-                                long long *vll)
+ * encoded as a listpack. Prototype is similar to `hashTypeGetFromListpack`. */
+void hashTypeCurrentFromListpack(hashTypeIterator *hi, int what,
+                                 unsigned char **vstr,
+                                 unsigned int *vlen,
+                                 long long *vll)
 {
     int ret;
 
-    serverAssert(hi->encoding == OBJ_ENCODING_ZIPLIST);
+    serverAssert(hi->encoding == OBJ_ENCODING_LISTPACK);
 
     if (what & OBJ_HASH_KEY) {
-        ret = ziplistGet(hi->fptr, vstr, vlen, vll);
+        ret = lpGetValue(hi->fptr, vstr, vlen, vll);
         serverAssert(ret);
     } else {
-        ret = ziplistGet(hi->vptr, vstr, vlen, vll);
+        ret = lpGetValue(hi->vptr, vstr, vlen, vll);
         serverAssert(ret);
     }
 }
@@ -424,9 +419,9 @@ sds hashTypeCurrentFromHashTable(hashTypeIterator *hi, int what) {
  * can always check the function return by checking the return value
  * type checking if vstr == NULL. */
 void hashTypeCurrentObject(hashTypeIterator *hi, int what, unsigned char **vstr, unsigned int *vlen, long long *vll) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         *vstr = NULL;
-        hashTypeCurrentFromZiplist(hi, what, vstr, vlen, vll);
+        hashTypeCurrentFromListpack(hi, what, vstr, vlen, vll);
     } else if (hi->encoding == OBJ_ENCODING_HT) {
         sds ele = hashTypeCurrentFromHashTable(hi, what);
         *vstr = (unsigned char*) ele;
@@ -462,10 +457,10 @@ robj *hashTypeLookupWriteOrCreate(client *c, robj *key) {
     return o;
 }
 
-void hashTypeConvertZiplist(robj *o, int enc) {
-    serverAssert(o->encoding == OBJ_ENCODING_ZIPLIST);
+void hashTypeConvertListpack(robj *o, int enc) {
+    serverAssert(o->encoding == OBJ_ENCODING_LISTPACK);
 
-    if (enc == OBJ_ENCODING_ZIPLIST) {
+    if (enc == OBJ_ENCODING_LISTPACK) {
         /* Nothing to do... */
 
     } else if (enc == OBJ_ENCODING_HT) {
@@ -483,13 +478,13 @@ void hashTypeConvertZiplist(robj *o, int enc) {
             value = hashTypeCurrentObjectNewSds(hi,OBJ_HASH_VALUE);
             ret = dictAdd(dict, key, value);
             if (ret != DICT_OK) {
-                serverLogHexDump(LL_WARNING,"ziplist with dup elements dump",
-                    o->ptr,ziplistBlobLen(o->ptr));
-                serverPanic("Ziplist corruption detected");
+                serverLogHexDump(LL_WARNING,"listpack with dup elements dump",
+                    o->ptr,lpBytes(o->ptr));
+                serverPanic("Listpack corruption detected");
             }
         }
         hashTypeReleaseIterator(hi);
-        zfree(o->ptr);
+        lpFree(o->ptr);
         o->encoding = OBJ_ENCODING_HT;
         o->ptr = dict;
     } else {
@@ -498,8 +493,8 @@ void hashTypeConvertZiplist(robj *o, int enc) {
 }
 
 void hashTypeConvert(robj *o, int enc) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        hashTypeConvertZiplist(o, enc);
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        hashTypeConvertListpack(o, enc);
     } else if (o->encoding == OBJ_ENCODING_HT) {
         serverPanic("Not implemented");
     } else {
@@ -507,6 +502,265 @@ void hashTypeConvert(robj *o, int enc) {
     }
 }
 
+/*-----------------------------------------------------------------------------
+ * Hash field expires
+ *
+ * The timeouts of the fields of the hash stored at a key are kept in a
+ * hashFieldExpires structure in db->hexpires, sharing the key name with the
+ * main dictionary like db->expires does. The hash is also indexed by the
+ * time of its first timeout in db->hexpires_index, so that the expired
+ * fields can be reclaimed in order by activeExpireCycle(), in addition to
+ * being expired when the key is accessed.
+ *
+ * Like keys, fields are only expired by masters, that propagate the
+ * deletion to the AOF and the slaves as an HDEL.
+ *----------------------------------------------------------------------------*/
+
+void freeHashFieldExpires(hashFieldExpires *hfe) {
+    if (hfe == NULL) return; /* Unlinked by dbUnlinkHashFieldExpires(). */
+    dictRelease(hfe->fields);
+    zfree(hfe);
+}
+
+static hashFieldExpires *hashLookupFieldExpires(redisDb *db, sds key) {
+    dictEntry *de;
+
+    if (dictSize(db->hexpires) == 0) return NULL;
+    de = dictFind(db->hexpires,key);
+    return de ? dictGetVal(de) : NULL;
+}
+
+/* Set the timeout of 'field' of the hash stored at 'key', that must exist,
+ * to the unix time 'when' in milliseconds. */
+void hashTypeSetFieldExpire(redisDb *db, robj *key, sds field, long long when) {
+    dictEntry *kde, *de;
+    hashFieldExpires *hfe;
+
+    /* Reuse the sds from the main dict in the hexpires dict */
+    kde = dictFind(db->dict,key->ptr);
+    serverAssertWithInfo(NULL,key,kde != NULL);
+    if ((de = dictFind(db->hexpires,key->ptr)) == NULL) {
+        hfe = zmalloc(sizeof(*hfe));
+        hfe->fields = dictCreate(&setDictType,NULL);
+        hfe->min = when;
+        dictAdd(db->hexpires,dictGetKey(kde),hfe);
+        expireIndexUpdate(db->hexpires_index,dictGetKey(kde),when,1);
+    } else {
+        hfe = dictGetVal(de);
+        if (when < hfe->min) {
+            expireIndexUpdate(db->hexpires_index,dictGetKey(kde),hfe->min,0);
+            hfe->min = when;
+            expireIndexUpdate(db->hexpires_index,dictGetKey(kde),when,1);
+        }
+    }
+    if ((de = dictFind(hfe->fields,field)) == NULL)
+        de = dictAddRaw(hfe->fields,sdsdup(field),NULL);
+    dictSetSignedIntegerVal(de,when);
+}
+
+/* Return the timeout of 'field' of the hash stored at 'key' as a unix time
+ * in milliseconds, or -1 if the field has no timeout. */
+long long hashTypeGetFieldExpire(redisDb *db, robj *key, sds field) {
+    hashFieldExpires *hfe = hashLookupFieldExpires(db,key->ptr);
+    dictEntry *de;
+
+    if (hfe == NULL || (de = dictFind(hfe->fields,field)) == NULL) return -1;
+    return dictGetSignedIntegerVal(de);
+}
+
+/* Remove the timeout of 'field' of the hash stored at 'key'. Return 1 if
+ * the field had a timeout, otherwise 0.
+ *
+ * The hash stays indexed by the old first timeout, that is just computed
+ * again by hashExpireFields() when reached. */
+int hashTypeRemoveFieldExpire(redisDb *db, robj *key, sds field) {
+    hashFieldExpires *hfe = hashLookupFieldExpires(db,key->ptr);
+
+    if (hfe == NULL || dictDelete(hfe->fields,field) != DICT_OK) return 0;
+    if (dictSize(hfe->fields) == 0) dbDeleteHashFieldExpires(db,key->ptr);
+    return 1;
+}
+
+/* Remove the timeouts of all the fields of the hash stored at 'key'.
+ * Return 1 if there were any, otherwise 0. This must be called before the
+ * key name is released, since it is shared with db->hexpires. */
+int dbDeleteHashFieldExpires(redisDb *db, sds key) {
+    hashFieldExpires *hfe = dbUnlinkHashFieldExpires(db,key);
+
+    if (hfe == NULL) return 0;
+    freeHashFieldExpires(hfe);
+    return 1;
+}
+
+/* Like dbDeleteHashFieldExpires() but return the timeouts instead of
+ * releasing them, so that they can be attached to another key with
+ * dbLinkHashFieldExpires(), as RENAME and MOVE do. */
+hashFieldExpires *dbUnlinkHashFieldExpires(redisDb *db, sds key) {
+    dictEntry *de;
+    hashFieldExpires *hfe;
+
+    if (dictSize(db->hexpires) == 0) return NULL;
+    if ((de = dictUnlink(db->hexpires,key)) == NULL) return NULL;
+    hfe = dictGetVal(de);
+    expireIndexUpdate(db->hexpires_index,key,hfe->min,0);
+    dictSetVal(db->hexpires,de,NULL);
+    dictFreeUnlinkedEntry(db->hexpires,de);
+    return hfe;
+}
+
+void dbLinkHashFieldExpires(redisDb *db, robj *key, hashFieldExpires *hfe) {
+    dictEntry *kde = dictFind(db->dict,key->ptr);
+
+    serverAssertWithInfo(NULL,key,kde != NULL);
+    serverAssertWithInfo(NULL,key,dictAdd(db->hexpires,dictGetKey(kde),hfe)
+                                  == DICT_OK);
+    expireIndexUpdate(db->hexpires_index,dictGetKey(kde),hfe->min,1);
+}
+
+/* Delete the fields of the hash stored at 'key' that expired before 'now',
+ * and index the hash again by its new first timeout. The deletion is
+ * propagated as a single HDEL, and the key is deleted if no field is left.
+ * Return the number of expired fields. */
+int hashExpireFields(redisDb *db, robj *key, long long now) {
+    dictEntry *de = dictFind(db->hexpires,key->ptr);
+    hashFieldExpires *hfe;
+    dictIterator *di;
+    robj *o, **argv;
+    long long min = LLONG_MAX;
+    int argc = 0, j;
+
+    if (de == NULL) return 0;
+    hfe = dictGetVal(de);
+    o = lookupKey(db,key,LOOKUP_NOTOUCH);
+    serverAssertWithInfo(NULL,key,o != NULL && o->type == OBJ_HASH);
+
+    argv = zmalloc(sizeof(robj*)*(dictSize(hfe->fields)+2));
+    argv[argc++] = createStringObject("HDEL",4);
+    argv[argc++] = key;
+    incrRefCount(key);
+
+    di = dictGetSafeIterator(hfe->fields);
+    while((de = dictNext(di)) != NULL) {
+        sds field = dictGetKey(de);
+        long long when = dictGetSignedIntegerVal(de);
+
+        if (when >= now) {
+            if (when < min) min = when;
+            continue;
+        }
+        if (hashTypeDelete(o,field))
+            argv[argc++] = createStringObject(field,sdslen(field));
+        dictDelete(hfe->fields,field);
+    }
+    dictReleaseIterator(di);
+
+    expireIndexUpdate(db->hexpires_index,key->ptr,hfe->min,0);
+    if (dictSize(hfe->fields) == 0) {
+        dictDelete(db->hexpires,key->ptr);
+    } else {
+        hfe->min = min;
+        expireIndexUpdate(db->hexpires_index,key->ptr,min,1);
+    }
+
+    if (argc > 2) {
+        if (server.aof_state != AOF_OFF)
+            feedAppendOnlyFile(server.hdelCommand,db->id,argv,argc);
+        replicationFeedSlaves(server.slaves,db->id,argv,argc);
+        notifyKeyspaceEvent(NOTIFY_HASH,"hexpired",key,db->id);
+        if (hashTypeLength(o) == 0) {
+            dbDelete(db,key);
+            notifyKeyspaceEvent(NOTIFY_GENERIC,"del",key,db->id);
+        }
+        signalModifiedKey(db,key);
+        server.stat_expired_hash_fields += argc-2;
+    }
+    for (j = 0; j < argc; j++) decrRefCount(argv[j]);
+    zfree(argv);
+    return argc-2;
+}
+
+/* The current time for the purpose of expiring fields, with the same
+ * rules keyIsExpired() uses for keys. */
+static long long hashFieldExpireTime(void) {
+    if (server.lua_caller) return server.lua_time_start;
+    if (server.fixed_time_expire > 0) return server.mstime;
+    return mstime();
+}
+
+/* Called when the key is accessed: expire the fields of the hash stored at
+ * 'key' that reached their timeout, if we are a master. Return the number
+ * of expired fields. */
+int hashExpireFieldsIfNeeded(redisDb *db, robj *key) {
+    hashFieldExpires *hfe;
+    long long now;
+
+    if ((hfe = hashLookupFieldExpires(db,key->ptr)) == NULL) return 0;
+    if (server.loading || server.masterhost != NULL) return 0;
+    now = hashFieldExpireTime();
+    if (hfe->min >= now) return 0;
+    return hashExpireFields(db,key,now);
+}
+
+/* Set the timeouts loaded by rdbLoadHashFieldExpires() for the fields of
+ * the hash 'o' stored at 'key'. The fields that don't exist are skipped. */
+void hashTypeSetFieldExpires(redisDb *db, robj *key, robj *o,
+                             dict *field_expires)
+{
+    dictIterator *di = dictGetIterator(field_expires);
+    dictEntry *de;
+
+    while((de = dictNext(di)) != NULL) {
+        sds field = dictGetKey(de);
+        if (hashTypeExists(o,field))
+            hashTypeSetFieldExpire(db,key,field,dictGetSignedIntegerVal(de));
+    }
+    dictReleaseIterator(di);
+}
+
+/* Slaves don't expire fields, but like lookupKeyRead() does with keys, the
+ * read only commands should not see the fields that reached their timeout.
+ * If the hash 'o' stored at 'key' has such fields, return a copy of it
+ * without them, that is released once the command returns, or NULL if no
+ * field is left. Otherwise 'o' itself is returned. */
+robj *hashTypeHideExpiredFields(redisDb *db, robj *key, robj *o) {
+    hashFieldExpires *hfe;
+    hashTypeIterator *hi;
+    robj *copy;
+    long long now;
+
+    if ((hfe = hashLookupFieldExpires(db,key->ptr)) == NULL) return o;
+    now = hashFieldExpireTime();
+    if (hfe->min >= now) return o;
+
+    copy = createHashObject();
+    if (o->encoding == OBJ_ENCODING_HT) hashTypeConvert(copy,OBJ_ENCODING_HT);
+    hi = hashTypeInitIterator(o);
+    while (hashTypeNext(hi) != C_ERR) {
+        sds field = hashTypeCurrentObjectNewSds(hi,OBJ_HASH_KEY);
+        dictEntry *de = dictFind(hfe->fields,field);
+
+        if (de && dictGetSignedIntegerVal(de) < now) {
+            sdsfree(field);
+            continue;
+        }
+        hashTypeSet(copy,field,hashTypeCurrentObjectNewSds(hi,OBJ_HASH_VALUE),
+                    HASH_SET_TAKE_FIELD|HASH_SET_TAKE_VALUE);
+    }
+    hashTypeReleaseIterator(hi);
+
+    /* The hash may just be indexed by a timeout that was removed. */
+    if (hashTypeLength(copy) == hashTypeLength(o)) {
+        decrRefCount(copy);
+        return o;
+    }
+    if (hashTypeLength(copy) == 0) {
+        decrRefCount(copy);
+        return NULL;
+    }
+    listAddNodeTail(server.hash_read_copies,copy);
+    return copy;
+}
+
 /*-----------------------------------------------------------------------------
  * Hash type commands
  *----------------------------------------------------------------------------*/
@@ -539,8 +793,11 @@ void hsetCommand(client *c) {
     if ((o = hashTypeLookupWriteOrCreate(c,c->argv[1])) == NULL) return;
     hashTypeTryConversion(o,c->argv,2,c->argc-1);
 
-    for (i = 2; i < c->argc; i += 2)
+    for (i = 2; i < c->argc; i += 2) {
         created += !hashTypeSet(o,c->argv[i]->ptr,c->argv[i+1]->ptr,HASH_SET_COPY);
+        /* Setting the value of a field removes its timeout. */
+        hashTypeRemoveFieldExpire(c->db,c->argv[1],c->argv[i]->ptr);
+    }
 
     /* HMSET (deprecated) and HSET return value is different. */
     char *cmdname = c->argv[0]->ptr;
@@ -639,6 +896,25 @@ void hincrbyfloatCommand(client *c) {
     decrRefCount(aux);
     rewriteClientCommandArgument(c,3,newobj);
     decrRefCount(newobj);
+
+    /* HSET removes the timeout of the field, so restore it after the HSET
+     * if the field has one. */
+    long long when = hashTypeGetFieldExpire(c->db,c->argv[1],c->argv[2]->ptr);
+    if (when != -1) {
+        robj *propargv[6];
+
+        propargv[0] = createStringObject("HPEXPIREAT",10);
+        propargv[1] = c->argv[1];
+        propargv[2] = createStringObjectFromLongLong(when);
+        propargv[3] = createStringObject("FIELDS",6);
+        propargv[4] = shared.integers[1];
+        propargv[5] = c->argv[2];
+        alsoPropagate(server.hpexpireatCommand,c->db->id,propargv,6,
+            PROPAGATE_AOF|PROPAGATE_REPL);
+        decrRefCount(propargv[0]);
+        decrRefCount(propargv[2]);
+        decrRefCount(propargv[3]);
+    }
 }
 
 static void addHashFieldToReply(client *c, robj *o, sds field) {
@@ -649,12 +925,12 @@ static void addHashFieldToReply(client *c, robj *o, sds field) {
         return;
     }
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        ret = hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll);
+        ret = hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll);
         if (ret < 0) {
             addReply(c, shared.nullbulk);
         } else {
@@ -713,6 +989,7 @@ void hdelCommand(client *c) {
     for (j = 2; j < c->argc; j++) {
         if (hashTypeDelete(o,c->argv[j]->ptr)) {
             deleted++;
+            hashTypeRemoveFieldExpire(c->db,c->argv[1],c->argv[j]->ptr);
             if (hashTypeLength(o) == 0) {
                 dbDelete(c->db,c->argv[1]);
                 keyremoved = 1;
@@ -749,12 +1026,12 @@ void hstrlenCommand(client *c) {
 }
 
 static void addHashIteratorCursorToReply(client *c, hashTypeIterator *hi, int what) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        hashTypeCurrentFromZiplist(hi, what, &vstr, &vlen, &vll);
+        hashTypeCurrentFromListpack(hi, what, &vstr, &vlen, &vll);
         if (vstr)
             addReplyBulkCBuffer(c, vstr, vlen);
         else
@@ -827,3 +1104,233 @@ void hscanCommand(client *c) {
         checkType(c,o,OBJ_HASH)) return;
     scanGenericCommand(c,o,cursor);
 }
+
+/*-----------------------------------------------------------------------------
+ * Hash field expires commands
+ *----------------------------------------------------------------------------*/
+
+#define HFE_NX (1<<0)   /* Set only if the field has no timeout. */
+#define HFE_XX (1<<1)   /* Set only if the field has a timeout. */
+#define HFE_GT (1<<2)   /* Set only if greater than the current timeout. */
+#define HFE_LT (1<<3)   /* Set only if less than the current timeout. */
+
+/* Parse the "FIELDS numfields field [field ...]" arguments starting at
+ * c->argv[pos]. On success C_OK is returned and '*numfields' is set,
+ * otherwise an error is sent to the client and C_ERR is returned. */
+static int hashParseFieldsOrReply(client *c, int pos, long *numfields) {
+    if (pos+2 > c->argc || strcasecmp(c->argv[pos]->ptr,"fields")) {
+        addReplyError(c,"Mandatory argument FIELDS is missing or not at the right position");
+        return C_ERR;
+    }
+    if (getLongFromObjectOrReply(c,c->argv[pos+1],numfields,NULL) != C_OK)
+        return C_ERR;
+    if (*numfields <= 0 || *numfields != c->argc-pos-2) {
+        addReplyError(c,"The numfields parameter must match the number of arguments");
+        return C_ERR;
+    }
+    return C_OK;
+}
+
+/* This is the generic command implementation for HEXPIRE, HPEXPIRE,
+ * HEXPIREAT and HPEXPIREAT. See expireGenericCommand() for the meaning of
+ * 'basetime' and 'unit'.
+ *
+ * For every field the reply is -2 if the field does not exist, 0 if the
+ * NX|XX|GT|LT condition was not met, 1 if the timeout was set, or 2 if the
+ * field was deleted because the time is already in the past. */
+void hexpireGenericCommand(client *c, long long basetime, int unit) {
+    robj *o, *key = c->argv[1];
+    long long when;
+    long numfields;
+    int flags = 0, pos = 3, j, set = 0, deleted = 0, expired;
+    robj **delargv = NULL;
+
+    if (getLongLongFromObjectOrReply(c,c->argv[2],&when,NULL) != C_OK)
+        return;
+    if (unit == UNIT_SECONDS &&
+        (when > LLONG_MAX/1000 || when < LLONG_MIN/1000))
+    {
+        addReplyError(c,"invalid expire time");
+        return;
+    }
+    if (unit == UNIT_SECONDS) when *= 1000;
+    /* 'basetime' is never negative, so only an overflow is possible. */
+    if (when > LLONG_MAX-basetime) {
+        addReplyError(c,"invalid expire time");
+        return;
+    }
+    when += basetime;
+
+    if (pos < c->argc) {
+        char *opt = c->argv[pos]->ptr;
+        if (!strcasecmp(opt,"nx")) flags = HFE_NX;
+        else if (!strcasecmp(opt,"xx")) flags = HFE_XX;
+        else if (!strcasecmp(opt,"gt")) flags = HFE_GT;
+        else if (!strcasecmp(opt,"lt")) flags = HFE_LT;
+        if (flags) pos++;
+    }
+    if (hashParseFieldsOrReply(c,pos,&numfields) != C_OK) return;
+
+    if ((o = lookupKeyWrite(c->db,key)) != NULL && checkType(c,o,OBJ_HASH))
+        return;
+
+    /* Like EXPIRE, a time in the past deletes the fields, but not when
+     * loading the AOF or in the context of a slave, where we wait for an
+     * explicit HDEL from the master instead. */
+    expired = when <= mstime() && !server.loading && !server.masterhost;
+    if (o && expired) delargv = zmalloc(sizeof(robj*)*(numfields+2));
+
+    addReplyMultiBulkLen(c,numfields);
+    for (j = pos+2; j < c->argc; j++) {
+        sds field = c->argv[j]->ptr;
+        long long current;
+
+        if (o == NULL || !hashTypeExists(o,field)) {
+            addReplyLongLong(c,-2);
+            continue;
+        }
+        current = hashTypeGetFieldExpire(c->db,key,field);
+        if ((flags & HFE_NX && current != -1) ||
+            (flags & HFE_XX && current == -1) ||
+            (flags & HFE_GT && (current == -1 || when <= current)) ||
+            (flags & HFE_LT && current != -1 && when >= current))
+        {
+            addReplyLongLong(c,0);
+            continue;
+        }
+        if (expired) {
+            hashTypeDelete(o,field);
+            hashTypeRemoveFieldExpire(c->db,key,field);
+            delargv[2+deleted++] = c->argv[j];
+            incrRefCount(c->argv[j]);
+            addReplyLongLong(c,2);
+        } else {
+            hashTypeSetFieldExpire(c->db,key,field,when);
+            set++;
+            addReplyLongLong(c,1);
+        }
+    }
+
+    if (deleted) {
+        /* Replicate/AOF this as an explicit HDEL of the deleted fields. */
+        delargv[0] = createStringObject("HDEL",4);
+        delargv[1] = key;
+        incrRefCount(key);
+        notifyKeyspaceEvent(NOTIFY_HASH,"hdel",key,c->db->id);
+        if (hashTypeLength(o) == 0) {
+            dbDelete(c->db,key);
+            notifyKeyspaceEvent(NOTIFY_GENERIC,"del",key,c->db->id);
+        }
+        replaceClientCommandVector(c,deleted+2,delargv);
+        key = c->argv[1];
+        delargv = NULL;
+    } else if (set) {
+        /* Propagate the absolute time, so that the fields expire at the
+         * same time in the AOF and the slaves. */
+        robj *aux = createStringObject("HPEXPIREAT",10);
+        rewriteClientCommandArgument(c,0,aux);
+        decrRefCount(aux);
+        aux = createStringObjectFromLongLong(when);
+        rewriteClientCommandArgument(c,2,aux);
+        decrRefCount(aux);
+        notifyKeyspaceEvent(NOTIFY_HASH,"hexpire",key,c->db->id);
+    }
+    zfree(delargv);
+    if (set || deleted) {
+        signalModifiedKey(c->db,key);
+        server.dirty += set+deleted;
+    }
+}
+
+/* HEXPIRE key seconds [NX|XX|GT|LT] FIELDS numfields field [field ...] */
+void hexpireCommand(client *c) {
+    hexpireGenericCommand(c,mstime(),UNIT_SECONDS);
+}
+
+/* HEXPIREAT key unix-time-seconds [NX|XX|GT|LT] FIELDS numfields field ... */
+void hexpireatCommand(client *c) {
+    hexpireGenericCommand(c,0,UNIT_SECONDS);
+}
+
+/* HPEXPIRE key milliseconds [NX|XX|GT|LT] FIELDS numfields field ... */
+void hpexpireCommand(client *c) {
+    hexpireGenericCommand(c,mstime(),UNIT_MILLISECONDS);
+}
+
+/* HPEXPIREAT key unix-time-ms [NX|XX|GT|LT] FIELDS numfields field ... */
+void hpexpireatCommand(client *c) {
+    hexpireGenericCommand(c,0,UNIT_MILLISECONDS);
+}
+
+/* Implements HTTL and HPTTL. For every field the reply is -2 if the field
+ * does not exist, -1 if it has no timeout, or the remaining time to live. */
+void httlGenericCommand(client *c, int output_ms) {
+    robj *o;
+    long numfields;
+    long long now = mstime();
+    int j;
+
+    if (hashParseFieldsOrReply(c,2,&numfields) != C_OK) return;
+    if ((o = lookupKeyRead(c->db,c->argv[1])) != NULL &&
+        checkType(c,o,OBJ_HASH)) return;
+
+    addReplyMultiBulkLen(c,numfields);
+    for (j = 4; j < c->argc; j++) {
+        long long when, ttl;
+
+        if (o == NULL || !hashTypeExists(o,c->argv[j]->ptr)) {
+            addReplyLongLong(c,-2);
+            continue;
+        }
+        when = hashTypeGetFieldExpire(c->db,c->argv[1],c->argv[j]->ptr);
+        if (when == -1) {
+            addReplyLongLong(c,-1);
+            continue;
+        }
+        ttl = when-now;
+        if (ttl < 0) ttl = 0;
+        addReplyLongLong(c,output_ms ? ttl : ((ttl+500)/1000));
+    }
+}
+
+/* HTTL key FIELDS numfields field [field ...] */
+void httlCommand(client *c) {
+    httlGenericCommand(c,0);
+}
+
+/* HPTTL key FIELDS numfields field [field ...] */
+void hpttlCommand(client *c) {
+    httlGenericCommand(c,1);
+}
+
+/* HPERSIST key FIELDS numfields field [field ...]
+ *
+ * For every field the reply is -2 if the field does not exist, -1 if it
+ * has no timeout, or 1 if the timeout was removed. */
+void hpersistCommand(client *c) {
+    robj *o;
+    long numfields;
+    int j, removed = 0;
+
+    if (hashParseFieldsOrReply(c,2,&numfields) != C_OK) return;
+    if ((o = lookupKeyWrite(c->db,c->argv[1])) != NULL &&
+        checkType(c,o,OBJ_HASH)) return;
+
+    addReplyMultiBulkLen(c,numfields);
+    for (j = 4; j < c->argc; j++) {
+        if (o == NULL || !hashTypeExists(o,c->argv[j]->ptr)) {
+            addReplyLongLong(c,-2);
+        } else if (hashTypeRemoveFieldExpire(c->db,c->argv[1],
+                                             c->argv[j]->ptr)) {
+            addReplyLongLong(c,1);
+            removed++;
+        } else {
+            addReplyLongLong(c,-1);
+        }
+    }
+    if (removed) {
+        signalModifiedKey(c->db,c->argv[1]);
+        notifyKeyspaceEvent(NOTIFY_HASH,"hpersist",c->argv[1],c->db->id);
+        server.dirty += removed;
+    }
+}
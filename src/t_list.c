@@ -79,6 +79,16 @@ unsigned long listTypeLength(const robj *subject) {
     }
 }
 
+/* Build the node index of a long list before accessing it by position, see
+ * quicklistBuildIndex(). The index is part of the memory of the key, so the
+ * memory accounted to the key is updated when it is built, even by commands
+ * that only read the list. */
+static void listTypeBuildIndex(redisDb *db, robj *key, robj *subject) {
+    if (subject->encoding == OBJ_ENCODING_QUICKLIST &&
+        quicklistBuildIndex(subject->ptr))
+        dbAccountKey(db,key->ptr);
+}
+
 /* Initialize an iterator at the specified index. */
 listTypeIterator *listTypeInitIterator(robj *subject, long index,
                                        unsigned char direction) {
@@ -315,21 +325,19 @@ void lindexCommand(client *c) {
     robj *o = lookupKeyReadOrReply(c,c->argv[1],shared.nullbulk);
     if (o == NULL || checkType(c,o,OBJ_LIST)) return;
     long index;
-    robj *value = NULL;
 
     if ((getLongFromObjectOrReply(c, c->argv[2], &index, NULL) != C_OK))
         return;
 
     if (o->encoding == OBJ_ENCODING_QUICKLIST) {
         quicklistEntry entry;
+        listTypeBuildIndex(c->db,c->argv[1],o);
         if (quicklistIndex(o->ptr, index, &entry)) {
             if (entry.value) {
-                value = createStringObject((char*)entry.value,entry.sz);
+                addReplyBulkCBuffer(c,entry.value,entry.sz);
             } else {
-                value = createStringObjectFromLongLong(entry.longval);
+                addReplyBulkLongLong(c,entry.longval);
             }
-            addReplyBulk(c,value);
-            decrRefCount(value);
         } else {
             addReply(c,shared.nullbulk);
         }
@@ -349,6 +357,7 @@ void lsetCommand(client *c) {
 
     if (o->encoding == OBJ_ENCODING_QUICKLIST) {
         quicklist *ql = o->ptr;
+        listTypeBuildIndex(c->db,c->argv[1],o);
         int replaced = quicklistReplaceAtIndex(ql, index,
                                                value->ptr, sdslen(value->ptr));
         if (!replaced) {
@@ -423,7 +432,10 @@ void lrangeCommand(client *c) {
     /* Return the result in form of a multi-bulk reply */
     addReplyMultiBulkLen(c,rangelen);
     if (o->encoding == OBJ_ENCODING_QUICKLIST) {
-        listTypeIterator *iter = listTypeInitIterator(o, start, LIST_TAIL);
+        listTypeIterator *iter;
+
+        if (start > 0) listTypeBuildIndex(c->db,c->argv[1],o);
+        iter = listTypeInitIterator(o, start, LIST_TAIL);
 
         while(rangelen--) {
             listTypeEntry entry;
@@ -531,6 +543,109 @@ void lremCommand(client *c) {
     addReplyLongLong(c,removed);
 }
 
+/* LPOS key element [RANK rank] [COUNT num-matches] [MAXLEN len]
+ *
+ * Return the index of the first element of the list matching 'element'.
+ * RANK skips the first rank-1 matches, or with a negative rank starts
+ * searching from the tail. With COUNT the indexes of up to num-matches
+ * matches are returned (all of them if zero), and MAXLEN limits the search
+ * to the first (or last) len elements. The elements are compared inside
+ * the listpacks of the list, without creating objects. */
+void lposCommand(client *c) {
+    robj *o, *ele = c->argv[2];
+    int direction = LIST_TAIL;
+    long rank = 1, count = -1, maxlen = 0; /* Count -1: option not given. */
+    void *arraylenptr = NULL;
+    int j;
+
+    /* Parse the optional arguments. */
+    for (j = 3; j < c->argc; j++) {
+        char *opt = c->argv[j]->ptr;
+        int moreargs = (c->argc-1)-j;
+
+        if (!strcasecmp(opt,"rank") && moreargs) {
+            j++;
+            if (getLongFromObjectOrReply(c,c->argv[j],&rank,NULL) != C_OK)
+                return;
+            if (rank == 0 || rank == LONG_MIN) {
+                addReplyError(c,"RANK can't be zero or LONG_MIN: use 1 to "
+                                "start from the first match, 2 from the "
+                                "second ... or use negative to start from "
+                                "the end of the list");
+                return;
+            }
+        } else if (!strcasecmp(opt,"count") && moreargs) {
+            j++;
+            if (getLongFromObjectOrReply(c,c->argv[j],&count,NULL) != C_OK)
+                return;
+            if (count < 0) {
+                addReplyError(c,"COUNT can't be negative");
+                return;
+            }
+        } else if (!strcasecmp(opt,"maxlen") && moreargs) {
+            j++;
+            if (getLongFromObjectOrReply(c,c->argv[j],&maxlen,NULL) != C_OK)
+                return;
+            if (maxlen < 0) {
+                addReplyError(c,"MAXLEN can't be negative");
+                return;
+            }
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    }
+
+    /* A negative rank means start from the tail. */
+    if (rank < 0) {
+        rank = -rank;
+        direction = LIST_HEAD;
+    }
+
+    /* Reply with an empty array or a null, depending on COUNT, if there is
+     * no such key or no match. */
+    if ((o = lookupKeyRead(c->db,c->argv[1])) == NULL) {
+        addReply(c,count != -1 ? shared.emptymultibulk : shared.nullbulk);
+        return;
+    }
+    if (checkType(c,o,OBJ_LIST)) return;
+
+    if (count != -1) arraylenptr = addDeferredMultiBulkLength(c);
+
+    listTypeIterator *li;
+    li = listTypeInitIterator(o,direction == LIST_HEAD ? -1 : 0,direction);
+    listTypeEntry entry;
+    long llen = listTypeLength(o);
+    long index = 0, matches = 0, matchindex = -1, arraylen = 0;
+    while ((maxlen == 0 || index < maxlen) && listTypeNext(li,&entry)) {
+        if (listTypeEqual(&entry,ele)) {
+            matches++;
+            matchindex = (direction == LIST_TAIL) ? index : llen-index-1;
+            if (matches >= rank) {
+                if (arraylenptr) {
+                    arraylen++;
+                    addReplyLongLong(c,matchindex);
+                    if (count && matches-rank+1 >= count) break;
+                } else {
+                    break;
+                }
+            }
+        }
+        index++;
+        matchindex = -1; /* Remember if we exit the loop without a match. */
+    }
+    listTypeReleaseIterator(li);
+
+    if (arraylenptr) {
+        setDeferredMultiBulkLength(c,arraylenptr,arraylen);
+    } else {
+        if (matchindex != -1)
+            addReplyLongLong(c,matchindex);
+        else
+            addReply(c,shared.nullbulk);
+    }
+}
+
 /* This is the semantic of this command:
  *  RPOPLPUSH srclist dstlist:
  *    IF LLEN(srclist) > 0
@@ -37,11 +37,14 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
                               robj *dstkey, int op);
 
 /* Factory method to return a set that *can* hold "value". When the object has
- * an integer-encodable value, an intset will be returned. Otherwise a regular
- * hash table. */
+ * an integer-encodable value, an intset will be returned. Otherwise a listpack
+ * if the value is short enough, or a regular hash table. */
 robj *setTypeCreate(sds value) {
     if (isSdsRepresentableAsLongLong(value,NULL) == C_OK)
         return createIntsetObject();
+    if (server.set_max_listpack_entries &&
+        sdslen(value) <= server.set_max_listpack_value)
+        return createSetListpackObject();
     return createSetObject();
 }
 
@@ -50,33 +53,91 @@ robj *setTypeCreate(sds value) {
  * If the value was already member of the set, nothing is done and 0 is
  * returned, otherwise the new element is added and 1 is returned. */
 int setTypeAdd(robj *subject, sds value) {
-    long long llval;
-    if (subject->encoding == OBJ_ENCODING_HT) {
-        dict *ht = subject->ptr;
-        dictEntry *de = dictAddRaw(ht,value,NULL);
+    return setTypeAddAux(subject,value,sdslen(value),0,1);
+}
+
+/* Add a member. This function is optimized for the different encodings. The
+ * value can be provided as an sds string (indicated by passing str_is_sds =
+ * 1), as string and length (str_is_sds = 0) or as an integer in which case str
+ * is set to NULL and llval is provided instead.
+ *
+ * Returns 1 if the value was added and 0 if it was already a member. */
+int setTypeAddAux(robj *set, char *str, size_t len, int64_t llval, int str_is_sds) {
+    char tmpbuf[LONG_STR_SIZE];
+    if (!str) {
+        if (set->encoding == OBJ_ENCODING_INTSET) {
+            uint8_t success = 0;
+            set->ptr = intsetAdd(set->ptr,llval,&success);
+            if (success &&
+                intsetLen(set->ptr) > server.set_max_intset_entries)
+            {
+                /* Convert to regular set when the intset contains
+                 * too many entries. */
+                setTypeConvert(set,OBJ_ENCODING_HT);
+            }
+            return success;
+        }
+        /* Convert int to string. */
+        len = ll2string(tmpbuf,sizeof(tmpbuf),llval);
+        str = tmpbuf;
+        str_is_sds = 0;
+    }
+
+    serverAssert(str);
+    if (set->encoding == OBJ_ENCODING_HT) {
+        /* Avoid duping the string if it is an sds string. */
+        sds sdsval = str_is_sds ? (sds)str : sdsnewlen(str,len);
+        dict *ht = set->ptr;
+        dictEntry *de = dictAddRaw(ht,sdsval,NULL);
         if (de) {
-            dictSetKey(ht,de,sdsdup(value));
+            if (sdsval == str) dictSetKey(ht,de,sdsdup(sdsval));
             dictSetVal(ht,de,NULL);
             return 1;
         }
-    } else if (subject->encoding == OBJ_ENCODING_INTSET) {
-        if (isSdsRepresentableAsLongLong(value,&llval) == C_OK) {
+        if (sdsval != str) sdsfree(sdsval);
+    } else if (set->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = set->ptr;
+        unsigned char *p = lpFirst(lp);
+        if (lpFind(lp,p,(unsigned char*)str,len,0) != NULL) return 0;
+
+        if (lpLength(lp) < server.set_max_listpack_entries &&
+            len <= server.set_max_listpack_value)
+        {
+            set->ptr = lpAppend(lp,(unsigned char*)str,len);
+        } else {
+            /* Convert to regular set when the listpack grows too big. */
+            setTypeConvert(set,OBJ_ENCODING_HT);
+            serverAssert(dictAdd(set->ptr,sdsnewlen(str,len),NULL) ==
+                         DICT_OK);
+        }
+        return 1;
+    } else if (set->encoding == OBJ_ENCODING_INTSET) {
+        long long value;
+        if (string2ll(str,len,&value)) {
             uint8_t success = 0;
-            subject->ptr = intsetAdd(subject->ptr,llval,&success);
+            set->ptr = intsetAdd(set->ptr,value,&success);
             if (success) {
                 /* Convert to regular set when the intset contains
                  * too many entries. */
-                if (intsetLen(subject->ptr) > server.set_max_intset_entries)
-                    setTypeConvert(subject,OBJ_ENCODING_HT);
+                if (intsetLen(set->ptr) > server.set_max_intset_entries)
+                    setTypeConvert(set,OBJ_ENCODING_HT);
                 return 1;
             }
         } else {
-            /* Failed to get integer from object, convert to regular set. */
-            setTypeConvert(subject,OBJ_ENCODING_HT);
-
-            /* The set *was* an intset and this value is not integer
-             * encodable, so dictAdd should always work. */
-            serverAssert(dictAdd(subject->ptr,sdsdup(value),NULL) == DICT_OK);
+            /* The value is not integer encodable: convert to a listpack
+             * when the set stays small, otherwise to a regular set. */
+            if (intsetLen(set->ptr) < server.set_max_listpack_entries &&
+                len <= server.set_max_listpack_value)
+            {
+                setTypeConvert(set,OBJ_ENCODING_LISTPACK);
+                set->ptr = lpAppend(set->ptr,(unsigned char*)str,len);
+            } else {
+                setTypeConvert(set,OBJ_ENCODING_HT);
+                /* The set *was* an intset and this value is not integer
+                 * encodable, so dictAdd should always work. */
+                serverAssert(dictAdd(set->ptr,sdsnewlen(str,len),NULL) ==
+                             DICT_OK);
+            }
             return 1;
         }
     } else {
@@ -86,16 +147,43 @@ int setTypeAdd(robj *subject, sds value) {
 }
 
 int setTypeRemove(robj *setobj, sds value) {
-    long long llval;
+    return setTypeRemoveAux(setobj,value,sdslen(value),0,1);
+}
+
+/* Remove a member. The value is provided as in setTypeAddAux(). Returns 1 if
+ * the member was removed, 0 if it was not a member of the set. */
+int setTypeRemoveAux(robj *setobj, char *str, size_t len, int64_t llval, int str_is_sds) {
+    char tmpbuf[LONG_STR_SIZE];
+    if (!str) {
+        if (setobj->encoding == OBJ_ENCODING_INTSET) {
+            int success;
+            setobj->ptr = intsetRemove(setobj->ptr,llval,&success);
+            return success;
+        }
+        len = ll2string(tmpbuf,sizeof(tmpbuf),llval);
+        str = tmpbuf;
+        str_is_sds = 0;
+    }
+
     if (setobj->encoding == OBJ_ENCODING_HT) {
-        if (dictDelete(setobj->ptr,value) == DICT_OK) {
-            if (htNeedsResize(setobj->ptr)) dictResize(setobj->ptr);
+        sds sdsval = str_is_sds ? (sds)str : sdsnewlen(str,len);
+        int deleted = (dictDelete(setobj->ptr,sdsval) == DICT_OK);
+        if (sdsval != str) sdsfree(sdsval); /* free temp copy */
+        if (deleted && htNeedsResize(setobj->ptr)) dictResize(setobj->ptr);
+        return deleted;
+    } else if (setobj->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = setobj->ptr;
+        unsigned char *p = lpFirst(lp);
+        p = lpFind(lp,p,(unsigned char*)str,len,0);
+        if (p != NULL) {
+            setobj->ptr = lpDelete(lp,p,NULL);
             return 1;
         }
     } else if (setobj->encoding == OBJ_ENCODING_INTSET) {
-        if (isSdsRepresentableAsLongLong(value,&llval) == C_OK) {
+        long long value;
+        if (string2ll(str,len,&value)) {
             int success;
-            setobj->ptr = intsetRemove(setobj->ptr,llval,&success);
+            setobj->ptr = intsetRemove(setobj->ptr,value,&success);
             if (success) return 1;
         }
     } else {
@@ -105,17 +193,38 @@ int setTypeRemove(robj *setobj, sds value) {
 }
 
 int setTypeIsMember(robj *subject, sds value) {
-    long long llval;
-    if (subject->encoding == OBJ_ENCODING_HT) {
-        return dictFind((dict*)subject->ptr,value) != NULL;
-    } else if (subject->encoding == OBJ_ENCODING_INTSET) {
-        if (isSdsRepresentableAsLongLong(value,&llval) == C_OK) {
-            return intsetFind((intset*)subject->ptr,llval);
-        }
+    return setTypeIsMemberAux(subject,value,sdslen(value),0,1);
+}
+
+/* Membership checking optimized for the different encodings. The value can be
+ * provided as in setTypeAddAux(). */
+int setTypeIsMemberAux(robj *set, char *str, size_t len, int64_t llval, int str_is_sds) {
+    char tmpbuf[LONG_STR_SIZE];
+    if (!str) {
+        if (set->encoding == OBJ_ENCODING_INTSET)
+            return intsetFind(set->ptr,llval);
+        len = ll2string(tmpbuf,sizeof(tmpbuf),llval);
+        str = tmpbuf;
+        str_is_sds = 0;
+    }
+
+    if (set->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = set->ptr;
+        unsigned char *p = lpFirst(lp);
+        return lpFind(lp,p,(unsigned char*)str,len,0) != NULL;
+    } else if (set->encoding == OBJ_ENCODING_INTSET) {
+        long long value;
+        return string2ll(str,len,&value) && intsetFind(set->ptr,value);
+    } else if (set->encoding == OBJ_ENCODING_HT && str_is_sds) {
+        return dictFind(set->ptr,(sds)str) != NULL;
+    } else if (set->encoding == OBJ_ENCODING_HT) {
+        sds sdsval = sdsnewlen(str,len);
+        int result = dictFind(set->ptr,sdsval) != NULL;
+        sdsfree(sdsval);
+        return result;
     } else {
         serverPanic("Unknown set encoding");
     }
-    return 0;
 }
 
 setTypeIterator *setTypeInitIterator(robj *subject) {
@@ -126,6 +235,8 @@ setTypeIterator *setTypeInitIterator(robj *subject) {
         si->di = dictGetIterator(subject->ptr);
     } else if (si->encoding == OBJ_ENCODING_INTSET) {
         si->ii = 0;
+    } else if (si->encoding == OBJ_ENCODING_LISTPACK) {
+        si->lpi = NULL;
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -141,26 +252,53 @@ void setTypeReleaseIterator(setTypeIterator *si) {
 /* Move to the next entry in the set. Returns the object at the current
  * position.
  *
- * Since set elements can be internally be stored as SDS strings or
- * simple arrays of integers, setTypeNext returns the encoding of the
- * set object you are iterating, and will populate the appropriate pointer
- * (sdsele) or (llele) accordingly.
+ * Since set elements can be internally be stored as SDS strings, listpack
+ * entries or simple arrays of integers, setTypeNext returns the encoding of
+ * the set object you are iterating, and will populate the appropriate
+ * pointers (str and len) or (llele) accordingly.
+ *
+ * When the element is a string, *str is set to point to it (an SDS string
+ * for hash tables, a pointer into the listpack otherwise) and *len to its
+ * length. When the element is an integer, *str is set to NULL and the value
+ * is stored in *llele.
  *
- * Note that both the sdsele and llele pointers should be passed and cannot
+ * Note that str, len and llele pointers should all be passed and cannot
  * be NULL since the function will try to defensively populate the non
  * used field with values which are easy to trap if misused.
  *
  * When there are no longer elements -1 is returned. */
-int setTypeNext(setTypeIterator *si, sds *sdsele, int64_t *llele) {
+int setTypeNext(setTypeIterator *si, char **str, size_t *len, int64_t *llele) {
     if (si->encoding == OBJ_ENCODING_HT) {
         dictEntry *de = dictNext(si->di);
         if (de == NULL) return -1;
-        *sdsele = dictGetKey(de);
+        *str = dictGetKey(de);
+        *len = sdslen(*str);
         *llele = -123456789; /* Not needed. Defensive. */
     } else if (si->encoding == OBJ_ENCODING_INTSET) {
         if (!intsetGet(si->subject->ptr,si->ii++,llele))
             return -1;
-        *sdsele = NULL; /* Not needed. Defensive. */
+        *str = NULL; /* Not needed. Defensive. */
+    } else if (si->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = si->subject->ptr;
+        unsigned char *lpi = si->lpi;
+        if (lpi == NULL) {
+            lpi = lpFirst(lp);
+        } else {
+            lpi = lpNext(lp,lpi);
+        }
+        if (lpi == NULL) return -1;
+        si->lpi = lpi;
+        unsigned char *sstr;
+        unsigned int slen;
+        long long sval;
+        lpGetValue(lpi,&sstr,&slen,&sval);
+        if (sstr) {
+            *str = (char*)sstr;
+            *len = slen;
+        } else {
+            *str = NULL;
+            *llele = sval;
+        }
     } else {
         serverPanic("Wrong set encoding in setTypeNext");
     }
@@ -176,43 +314,51 @@ int setTypeNext(setTypeIterator *si, sds *sdsele, int64_t *llele) {
  * an issue. */
 sds setTypeNextObject(setTypeIterator *si) {
     int64_t intele;
-    sds sdsele;
-    int encoding;
+    char *str;
+    size_t len;
 
-    encoding = setTypeNext(si,&sdsele,&intele);
-    switch(encoding) {
-        case -1:    return NULL;
-        case OBJ_ENCODING_INTSET:
-            return sdsfromlonglong(intele);
-        case OBJ_ENCODING_HT:
-            return sdsdup(sdsele);
-        default:
-            serverPanic("Unsupported encoding");
-    }
-    return NULL; /* just to suppress warnings */
+    if (setTypeNext(si,&str,&len,&intele) == -1) return NULL;
+    if (str != NULL) return sdsnewlen(str,len);
+    return sdsfromlonglong(intele);
 }
 
 /* Return random element from a non empty set.
  * The returned element can be a int64_t value if the set is encoded
- * as an "intset" blob of integers, or an SDS string if the set
- * is a regular set.
+ * as an "intset" blob of integers, or a string if the set is a listpack
+ * or a regular set.
  *
- * The caller provides both pointers to be populated with the right
+ * The caller provides the pointers to be populated with the right
  * object. The return value of the function is the object->encoding
- * field of the object and is used by the caller to check if the
- * int64_t pointer or the redis object pointer was populated.
+ * field of the object and can be used by the caller to check if the
+ * int64_t pointer or the string pointers were populated: as with
+ * setTypeNext(), *str is set to NULL when the element is an integer.
  *
- * Note that both the sdsele and llele pointers should be passed and cannot
+ * Note that str, len and llele pointers should all be passed and cannot
  * be NULL since the function will try to defensively populate the non
  * used field with values which are easy to trap if misused. */
-int setTypeRandomElement(robj *setobj, sds *sdsele, int64_t *llele) {
+int setTypeRandomElement(robj *setobj, char **str, size_t *len, int64_t *llele) {
     if (setobj->encoding == OBJ_ENCODING_HT) {
         dictEntry *de = dictGetRandomKey(setobj->ptr);
-        *sdsele = dictGetKey(de);
+        *str = dictGetKey(de);
+        *len = sdslen(*str);
         *llele = -123456789; /* Not needed. Defensive. */
     } else if (setobj->encoding == OBJ_ENCODING_INTSET) {
         *llele = intsetRandom(setobj->ptr);
-        *sdsele = NULL; /* Not needed. Defensive. */
+        *str = NULL; /* Not needed. Defensive. */
+    } else if (setobj->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = setobj->ptr;
+        unsigned char *p = lpSeek(lp,random() % lpLength(lp));
+        unsigned char *sstr;
+        unsigned int slen;
+        long long sval;
+        lpGetValue(p,&sstr,&slen,&sval);
+        if (sstr) {
+            *str = (char*)sstr;
+            *len = slen;
+        } else {
+            *str = NULL;
+            *llele = sval;
+        }
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -224,6 +370,8 @@ unsigned long setTypeSize(const robj *subject) {
         return dictSize((const dict*)subject->ptr);
     } else if (subject->encoding == OBJ_ENCODING_INTSET) {
         return intsetLen((const intset*)subject->ptr);
+    } else if (subject->encoding == OBJ_ENCODING_LISTPACK) {
+        return lpLength((unsigned char *)subject->ptr);
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -231,31 +379,46 @@ unsigned long setTypeSize(const robj *subject) {
 
 /* Convert the set to specified encoding. The resulting dict (when converting
  * to a hash table) is presized to hold the number of elements in the original
- * set. */
+ * set. Intsets can be converted to listpacks or hash tables, listpacks only
+ * to hash tables. */
 void setTypeConvert(robj *setobj, int enc) {
     setTypeIterator *si;
     serverAssertWithInfo(NULL,setobj,setobj->type == OBJ_SET &&
-                             setobj->encoding == OBJ_ENCODING_INTSET);
+                             setobj->encoding != enc);
 
     if (enc == OBJ_ENCODING_HT) {
-        int64_t intele;
         dict *d = dictCreate(&setDictType,NULL);
         sds element;
 
         /* Presize the dict to avoid rehashing */
-        dictExpand(d,intsetLen(setobj->ptr));
+        dictExpand(d,setTypeSize(setobj));
 
         /* To add the elements we extract integers and create redis objects */
         si = setTypeInitIterator(setobj);
-        while (setTypeNext(si,&element,&intele) != -1) {
-            element = sdsfromlonglong(intele);
+        while ((element = setTypeNextObject(si)) != NULL) {
             serverAssert(dictAdd(d,element,NULL) == DICT_OK);
         }
         setTypeReleaseIterator(si);
 
+        freeSetObject(setobj); /* frees the intset or listpack */
         setobj->encoding = OBJ_ENCODING_HT;
-        zfree(setobj->ptr);
         setobj->ptr = d;
+    } else if (enc == OBJ_ENCODING_LISTPACK) {
+        serverAssertWithInfo(NULL,setobj,
+                             setobj->encoding == OBJ_ENCODING_INTSET);
+        unsigned char *lp = lpNew();
+        char buf[LONG_STR_SIZE];
+        int64_t intele;
+        uint32_t j = 0;
+
+        while (intsetGet(setobj->ptr,j++,&intele)) {
+            int len = ll2string(buf,sizeof(buf),intele);
+            lp = lpAppend(lp,(unsigned char*)buf,len);
+        }
+
+        zfree(setobj->ptr);
+        setobj->encoding = OBJ_ENCODING_LISTPACK;
+        setobj->ptr = lp;
     } else {
         serverPanic("Unsupported set conversion");
     }
@@ -458,6 +621,8 @@ void spopWithCountCommand(client *c) {
     addReplyMultiBulkLen(c,count);
 
     /* Common iteration vars. */
+    char *str;
+    size_t len;
     sds sdsele;
     robj *objele;
     int encoding;
@@ -474,16 +639,15 @@ void spopWithCountCommand(client *c) {
     if (remaining*SPOP_MOVE_STRATEGY_MUL > count) {
         while(count--) {
             /* Emit and remove. */
-            encoding = setTypeRandomElement(set,&sdsele,&llele);
-            if (encoding == OBJ_ENCODING_INTSET) {
+            encoding = setTypeRandomElement(set,&str,&len,&llele);
+            if (str == NULL) {
                 addReplyBulkLongLong(c,llele);
                 objele = createStringObjectFromLongLong(llele);
-                set->ptr = intsetRemove(set->ptr,llele,NULL);
             } else {
-                addReplyBulkCBuffer(c,sdsele,sdslen(sdsele));
-                objele = createStringObject(sdsele,sdslen(sdsele));
-                setTypeRemove(set,sdsele);
+                addReplyBulkCBuffer(c,str,len);
+                objele = createStringObject(str,len);
             }
+            setTypeRemoveAux(set,str,len,llele,encoding == OBJ_ENCODING_HT);
 
             /* Replicate/AOF this command as an SREM operation */
             propargv[2] = objele;
@@ -504,11 +668,11 @@ void spopWithCountCommand(client *c) {
 
         /* Create a new set with just the remaining elements. */
         while(remaining--) {
-            encoding = setTypeRandomElement(set,&sdsele,&llele);
-            if (encoding == OBJ_ENCODING_INTSET) {
+            setTypeRandomElement(set,&str,&len,&llele);
+            if (str == NULL) {
                 sdsele = sdsfromlonglong(llele);
             } else {
-                sdsele = sdsdup(sdsele);
+                sdsele = sdsnewlen(str,len);
             }
             if (!newset) newset = setTypeCreate(sdsele);
             setTypeAdd(newset,sdsele);
@@ -519,13 +683,13 @@ void spopWithCountCommand(client *c) {
         /* Transfer the old set to the client. */
         setTypeIterator *si;
         si = setTypeInitIterator(set);
-        while((encoding = setTypeNext(si,&sdsele,&llele)) != -1) {
-            if (encoding == OBJ_ENCODING_INTSET) {
+        while(setTypeNext(si,&str,&len,&llele) != -1) {
+            if (str == NULL) {
                 addReplyBulkLongLong(c,llele);
                 objele = createStringObjectFromLongLong(llele);
             } else {
-                addReplyBulkCBuffer(c,sdsele,sdslen(sdsele));
-                objele = createStringObject(sdsele,sdslen(sdsele));
+                addReplyBulkCBuffer(c,str,len);
+                objele = createStringObject(str,len);
             }
 
             /* Replicate/AOF this command as an SREM operation */
@@ -552,7 +716,8 @@ void spopWithCountCommand(client *c) {
 
 void spopCommand(client *c) {
     robj *set, *ele, *aux;
-    sds sdsele;
+    char *str;
+    size_t len;
     int64_t llele;
     int encoding;
 
@@ -570,17 +735,16 @@ void spopCommand(client *c) {
         checkType(c,set,OBJ_SET)) return;
 
     /* Get a random element from the set */
-    encoding = setTypeRandomElement(set,&sdsele,&llele);
-
-    /* Remove the element from the set */
-    if (encoding == OBJ_ENCODING_INTSET) {
+    encoding = setTypeRandomElement(set,&str,&len,&llele);
+    if (str == NULL) {
         ele = createStringObjectFromLongLong(llele);
-        set->ptr = intsetRemove(set->ptr,llele,NULL);
     } else {
-        ele = createStringObject(sdsele,sdslen(sdsele));
-        setTypeRemove(set,ele->ptr);
+        ele = createStringObject(str,len);
     }
 
+    /* Remove the element from the set */
+    setTypeRemoveAux(set,str,len,llele,encoding == OBJ_ENCODING_HT);
+
     notifyKeyspaceEvent(NOTIFY_SET,"spop",c->argv[1],c->db->id);
 
     /* Replicate/AOF this command as an SREM operation */
@@ -616,9 +780,9 @@ void srandmemberWithCountCommand(client *c) {
     unsigned long count, size;
     int uniq = 1;
     robj *set;
-    sds ele;
+    char *str;
+    size_t len;
     int64_t llele;
-    int encoding;
 
     dict *d;
 
@@ -649,11 +813,11 @@ void srandmemberWithCountCommand(client *c) {
     if (!uniq) {
         addReplyMultiBulkLen(c,count);
         while(count--) {
-            encoding = setTypeRandomElement(set,&ele,&llele);
-            if (encoding == OBJ_ENCODING_INTSET) {
+            setTypeRandomElement(set,&str,&len,&llele);
+            if (str == NULL) {
                 addReplyBulkLongLong(c,llele);
             } else {
-                addReplyBulkCBuffer(c,ele,sdslen(ele));
+                addReplyBulkCBuffer(c,str,len);
             }
         }
         return;
@@ -684,13 +848,13 @@ void srandmemberWithCountCommand(client *c) {
 
         /* Add all the elements into the temporary dictionary. */
         si = setTypeInitIterator(set);
-        while((encoding = setTypeNext(si,&ele,&llele)) != -1) {
+        while(setTypeNext(si,&str,&len,&llele) != -1) {
             int retval = DICT_ERR;
 
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (str == NULL) {
                 retval = dictAdd(d,createStringObjectFromLongLong(llele),NULL);
             } else {
-                retval = dictAdd(d,createStringObject(ele,sdslen(ele)),NULL);
+                retval = dictAdd(d,createStringObject(str,len),NULL);
             }
             serverAssert(retval == DICT_OK);
         }
@@ -716,11 +880,11 @@ void srandmemberWithCountCommand(client *c) {
         robj *objele;
 
         while(added < count) {
-            encoding = setTypeRandomElement(set,&ele,&llele);
-            if (encoding == OBJ_ENCODING_INTSET) {
+            setTypeRandomElement(set,&str,&len,&llele);
+            if (str == NULL) {
                 objele = createStringObjectFromLongLong(llele);
             } else {
-                objele = createStringObject(ele,sdslen(ele));
+                objele = createStringObject(str,len);
             }
             /* Try to add the object to the dictionary. If it already exists
              * free it, otherwise increment the number of objects we have
@@ -748,9 +912,9 @@ void srandmemberWithCountCommand(client *c) {
 
 void srandmemberCommand(client *c) {
     robj *set;
-    sds ele;
+    char *str;
+    size_t len;
     int64_t llele;
-    int encoding;
 
     if (c->argc == 3) {
         srandmemberWithCountCommand(c);
@@ -763,11 +927,11 @@ void srandmemberCommand(client *c) {
     if ((set = lookupKeyReadOrReply(c,c->argv[1],shared.nullbulk)) == NULL ||
         checkType(c,set,OBJ_SET)) return;
 
-    encoding = setTypeRandomElement(set,&ele,&llele);
-    if (encoding == OBJ_ENCODING_INTSET) {
+    setTypeRandomElement(set,&str,&len,&llele);
+    if (str == NULL) {
         addReplyBulkLongLong(c,llele);
     } else {
-        addReplyBulkCBuffer(c,ele,sdslen(ele));
+        addReplyBulkCBuffer(c,str,len);
     }
 }
 
@@ -789,12 +953,38 @@ int qsortCompareSetsByRevCardinality(const void *s1, const void *s2) {
     return 0;
 }
 
+/* Return 1 if all the sets of the array that exist are intsets. Non existing
+ * keys are represented by NULL pointers. */
+int setTypeAllIntsets(robj **sets, unsigned long setnum) {
+    unsigned long j;
+
+    for (j = 0; j < setnum; j++) {
+        if (sets[j] && sets[j]->encoding != OBJ_ENCODING_INTSET) return 0;
+    }
+    return 1;
+}
+
+/* Intersect an array of intsets, sorted by increasing cardinality, merging
+ * them in order, and return the result as a new intset. */
+intset *sinterIntsets(robj **sets, unsigned long setnum) {
+    intset *res = intsetIntersection(sets[0]->ptr,sets[1]->ptr);
+    unsigned long j;
+
+    for (j = 2; j < setnum && intsetLen(res) > 0; j++) {
+        intset *tmp = intsetIntersection(res,sets[j]->ptr);
+        zfree(res);
+        res = tmp;
+    }
+    return res;
+}
+
 void sinterGenericCommand(client *c, robj **setkeys,
                           unsigned long setnum, robj *dstkey) {
     robj **sets = zmalloc(sizeof(robj*)*setnum);
     setTypeIterator *si;
     robj *dstset = NULL;
-    sds elesds;
+    char *str;
+    size_t len;
     int64_t intobj;
     void *replylen = NULL;
     unsigned long j, cardinality = 0;
@@ -840,58 +1030,59 @@ void sinterGenericCommand(client *c, robj **setkeys,
         dstset = createIntsetObject();
     }
 
+    if (setnum > 1 && setTypeAllIntsets(sets,setnum)) {
+        /* Intsets are sorted arrays, so we can merge them instead of
+         * looking up every element of the smallest set in the others. */
+        intset *res = sinterIntsets(sets,setnum);
+
+        if (!dstkey) {
+            uint32_t pos = 0;
+
+            while (intsetGet(res,pos++,&intobj)) addReplyBulkLongLong(c,intobj);
+            cardinality = intsetLen(res);
+            zfree(res);
+        } else {
+            zfree(dstset->ptr);
+            dstset->ptr = res;
+            if (intsetLen(res) > server.set_max_intset_entries)
+                setTypeConvert(dstset,OBJ_ENCODING_HT);
+        }
+        goto done;
+    }
+
     /* Iterate all the elements of the first (smallest) set, and test
      * the element against all the other sets, if at least one set does
      * not include the element it is discarded */
     si = setTypeInitIterator(sets[0]);
-    while((encoding = setTypeNext(si,&elesds,&intobj)) != -1) {
+    while((encoding = setTypeNext(si,&str,&len,&intobj)) != -1) {
         for (j = 1; j < setnum; j++) {
             if (sets[j] == sets[0]) continue;
-            if (encoding == OBJ_ENCODING_INTSET) {
-                /* intset with intset is simple... and fast */
-                if (sets[j]->encoding == OBJ_ENCODING_INTSET &&
-                    !intsetFind((intset*)sets[j]->ptr,intobj))
-                {
-                    break;
-                /* in order to compare an integer with an object we
-                 * have to use the generic function, creating an object
-                 * for this */
-                } else if (sets[j]->encoding == OBJ_ENCODING_HT) {
-                    elesds = sdsfromlonglong(intobj);
-                    if (!setTypeIsMember(sets[j],elesds)) {
-                        sdsfree(elesds);
-                        break;
-                    }
-                    sdsfree(elesds);
-                }
-            } else if (encoding == OBJ_ENCODING_HT) {
-                if (!setTypeIsMember(sets[j],elesds)) {
-                    break;
-                }
-            }
+            /* The membership check is specialized for every pair of
+             * encodings: intset with intset is simple... and fast, while
+             * the other cases avoid creating a temporary string when
+             * possible. */
+            if (!setTypeIsMemberAux(sets[j],str,len,intobj,
+                                    encoding == OBJ_ENCODING_HT))
+                break;
         }
 
         /* Only take action when all sets contain the member */
         if (j == setnum) {
             if (!dstkey) {
-                if (encoding == OBJ_ENCODING_HT)
-                    addReplyBulkCBuffer(c,elesds,sdslen(elesds));
+                if (str != NULL)
+                    addReplyBulkCBuffer(c,str,len);
                 else
                     addReplyBulkLongLong(c,intobj);
                 cardinality++;
             } else {
-                if (encoding == OBJ_ENCODING_INTSET) {
-                    elesds = sdsfromlonglong(intobj);
-                    setTypeAdd(dstset,elesds);
-                    sdsfree(elesds);
-                } else {
-                    setTypeAdd(dstset,elesds);
-                }
+                setTypeAddAux(dstset,str,len,intobj,
+                              encoding == OBJ_ENCODING_HT);
             }
         }
     }
     setTypeReleaseIterator(si);
 
+done:
     if (dstkey) {
         /* Store the resulting set into the target, if the intersection
          * is not an empty set. */
@@ -924,6 +1115,120 @@ void sinterstoreCommand(client *c) {
     sinterGenericCommand(c,c->argv+2,c->argc-2,c->argv[1]);
 }
 
+/* Return the cardinality of the intersection of the sets, that must be sorted
+ * by increasing cardinality, stopping as soon as "limit" common elements are
+ * found when "limit" is not zero. Nothing is allocated for the result: the
+ * elements of the smallest set are just checked against the other sets. */
+unsigned long sinterCard(robj **sets, unsigned long setnum, unsigned long limit) {
+    unsigned long j, cardinality = 0;
+    int64_t intobj;
+
+    if (setnum == 1) {
+        cardinality = setTypeSize(sets[0]);
+        return (limit && cardinality > limit) ? limit : cardinality;
+    }
+
+    if (setTypeAllIntsets(sets,setnum)) {
+        /* The elements of the first intset are visited in increasing
+         * order, so every other intset is searched starting from the
+         * position of the previous lookup. Once we are past the end of
+         * one of the sets there are no more common elements. */
+        uint32_t *pos = zcalloc(sizeof(uint32_t)*setnum);
+        uint32_t i = 0;
+
+        while (intsetGet(sets[0]->ptr,i++,&intobj)) {
+            for (j = 1; j < setnum; j++) {
+                if (sets[j] == sets[0]) continue;
+                if (!intsetFindFrom(sets[j]->ptr,intobj,&pos[j])) break;
+            }
+            if (j == setnum) {
+                if (++cardinality == limit) break;
+            } else if (pos[j] == intsetLen(sets[j]->ptr)) {
+                break;
+            }
+        }
+        zfree(pos);
+    } else {
+        setTypeIterator *si = setTypeInitIterator(sets[0]);
+        char *str;
+        size_t len;
+        int encoding;
+
+        while((encoding = setTypeNext(si,&str,&len,&intobj)) != -1) {
+            for (j = 1; j < setnum; j++) {
+                if (sets[j] == sets[0]) continue;
+                if (!setTypeIsMemberAux(sets[j],str,len,intobj,
+                                        encoding == OBJ_ENCODING_HT))
+                    break;
+            }
+            if (j == setnum && ++cardinality == limit) break;
+        }
+        setTypeReleaseIterator(si);
+    }
+    return cardinality;
+}
+
+/* SINTERCARD numkeys key [key ...] [LIMIT limit] */
+void sinterCardCommand(client *c) {
+    long numkeys, limit = 0;
+    robj **sets;
+    int j;
+
+    if (getLongFromObjectOrReply(c,c->argv[1],&numkeys,NULL) != C_OK)
+        return;
+    if (numkeys < 1) {
+        addReplyError(c,"numkeys should be greater than 0");
+        return;
+    }
+    if (numkeys > c->argc-2) {
+        addReplyError(c,"Number of keys can't be greater than number of args");
+        return;
+    }
+
+    for (j = 2+numkeys; j < c->argc; j++) {
+        int moreargs = (c->argc-1) - j;
+        if (!strcasecmp(c->argv[j]->ptr,"limit") && moreargs) {
+            if (getLongFromObjectOrReply(c,c->argv[++j],&limit,NULL) != C_OK)
+                return;
+            if (limit < 0) {
+                addReplyError(c,"LIMIT can't be negative");
+                return;
+            }
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    }
+
+    sets = zmalloc(sizeof(robj*)*numkeys);
+    for (j = 0; j < numkeys; j++) {
+        robj *setobj = lookupKeyRead(c->db,c->argv[2+j]);
+        if (!setobj) {
+            /* A non existing key is an empty set: so is the intersection,
+             * but we still need to check the type of the other keys. */
+            sets[j] = NULL;
+            continue;
+        }
+        if (checkType(c,setobj,OBJ_SET)) {
+            zfree(sets);
+            return;
+        }
+        sets[j] = setobj;
+    }
+    for (j = 0; j < numkeys; j++) {
+        if (sets[j] == NULL) {
+            zfree(sets);
+            addReply(c,shared.czero);
+            return;
+        }
+    }
+
+    /* Start from the smallest set, like SINTER does. */
+    qsort(sets,numkeys,sizeof(robj*),qsortCompareSetsByCardinality);
+    addReplyLongLong(c,sinterCard(sets,numkeys,limit));
+    zfree(sets);
+}
+
 #define SET_OP_UNION 0
 #define SET_OP_DIFF 1
 #define SET_OP_INTER 2
@@ -990,7 +1295,28 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
      * this set object will be the resulting object to set into the target key*/
     dstset = createIntsetObject();
 
-    if (op == SET_OP_UNION) {
+    if (setTypeAllIntsets(sets,setnum) && (op == SET_OP_UNION || sets[0])) {
+        /* When all the sets are intsets we merge the sorted arrays,
+         * building the result directly, instead of adding or removing
+         * one element at a time. */
+        for (j = 0; j < setnum; j++) {
+            intset *res;
+
+            if (!sets[j]) continue; /* non existing keys are like empty sets */
+            if (op == SET_OP_UNION || j == 0)
+                res = intsetUnion(dstset->ptr,sets[j]->ptr);
+            else
+                res = intsetDifference(dstset->ptr,sets[j]->ptr);
+            zfree(dstset->ptr);
+            dstset->ptr = res;
+
+            /* Exit if the difference is empty, as in DIFF algorithm 2. */
+            if (op == SET_OP_DIFF && intsetLen(res) == 0) break;
+        }
+        cardinality = intsetLen(dstset->ptr);
+        if (dstkey && intsetLen(dstset->ptr) > server.set_max_intset_entries)
+            setTypeConvert(dstset,OBJ_ENCODING_HT);
+    } else if (op == SET_OP_UNION) {
         /* Union is trivial, just add every element of every set to the
          * temporary set. */
         for (j = 0; j < setnum; j++) {
@@ -37,266 +37,727 @@
  * data structure.
  *
  * The elements are added to a hash table mapping Redis objects to scores.
- * At the same time the elements are added to a skip list mapping scores
- * to Redis objects (so objects are sorted by scores in this "view").
+ * At the same time the elements are added to a B+tree ordered by score and
+ * then by element (so objects are sorted by scores in this "view"). Every
+ * inner node of the tree also tracks how many elements are below each of
+ * its children, so that ranks are computed in O(log(N)) as well.
  *
  * Note that the SDS string representing the element is the same in both
- * the hash table and skiplist in order to save memory. What we do in order
- * to manage the shared SDS string more easily is to free the SDS string
- * only in zslFreeNode(). The dictionary has no value free method set.
+ * the hash table and the B+tree in order to save memory, while the score
+ * is stored inside the dict entry itself. What we do in order to manage the
+ * shared SDS string more easily is to free the SDS string only when it is
+ * removed from the B+tree. The dictionary has no key free method set.
  * So we should always remove an element from the dictionary, and later from
- * the skiplist.
+ * the B+tree.
  *
- * This skiplist implementation is almost a C translation of the original
- * algorithm described by William Pugh in "Skip Lists: A Probabilistic
- * Alternative to Balanced Trees", modified in three ways:
- * a) this implementation allows for repeated scores.
- * b) the comparison is not just by key (our 'score') but by satellite data.
- * c) there is a back pointer, so it's a doubly linked list with the back
- * pointers being only at "level 1". This allows to traverse the list
- * from tail to head, useful for ZREVRANGE. */
+ * Compared to a skiplist, the tree stores the elements of a range in a
+ * few contiguous nodes instead of one node per element, so that range scans
+ * are cache friendly and the memory overhead per element is much smaller. */
 
 #include "server.h"
 #include <math.h>
 
 /*-----------------------------------------------------------------------------
- * Skiplist implementation of the low level API
+ * B+tree implementation of the low level API
  *----------------------------------------------------------------------------*/
 
 int zslLexValueGteMin(sds value, zlexrangespec *spec);
 int zslLexValueLteMax(sds value, zlexrangespec *spec);
 
-/* Create a skiplist node with the specified number of levels.
- * The SDS string 'ele' is referenced by the node after the call. */
-zskiplistNode *zslCreateNode(int level, double score, sds ele) {
-    zskiplistNode *zn =
-        zmalloc(sizeof(*zn)+level*sizeof(struct zskiplistLevel));
-    zn->score = score;
-    zn->ele = ele;
-    return zn;
+/* Nodes that are less than half full are merged with a sibling (or take
+ * an element from it) when something is removed from them. */
+#define ZBTREE_LEAF_MIN (ZBTREE_LEAF_ENTRIES/2)
+#define ZBTREE_INNER_MIN (ZBTREE_FANOUT/2)
+
+/* The path followed from the root to an element: node[0] is the root and
+ * node[height-1] the leaf. For inner nodes idx[] is the child we descended
+ * into, for the leaf it is the position of the element. */
+typedef struct zbtreePath {
+    void *node[ZBTREE_MAX_HEIGHT];
+    unsigned int idx[ZBTREE_MAX_HEIGHT];
+} zbtreePath;
+
+/* Compare two elements by score, and by element when the score is the same. */
+static inline int zbtCompare(double s1, sds e1, double s2, sds e2) {
+    if (s1 < s2) return -1;
+    if (s1 > s2) return 1;
+    return sdscmp(e1,e2);
 }
 
-/* Create a new skiplist. */
-zskiplist *zslCreate(void) {
-    int j;
-    zskiplist *zsl;
-
-    zsl = zmalloc(sizeof(*zsl));
-    zsl->level = 1;
-    zsl->length = 0;
-    zsl->header = zslCreateNode(ZSKIPLIST_MAXLEVEL,0,NULL);
-    for (j = 0; j < ZSKIPLIST_MAXLEVEL; j++) {
-        zsl->header->level[j].forward = NULL;
-        zsl->header->level[j].span = 0;
-    }
-    zsl->header->backward = NULL;
-    zsl->tail = NULL;
-    return zsl;
-}
-
-/* Free the specified skiplist node. The referenced SDS string representation
- * of the element is freed too, unless node->ele is set to NULL before calling
- * this function. */
-void zslFreeNode(zskiplistNode *node) {
-    sdsfree(node->ele);
-    zfree(node);
+static zbtreeLeaf *zbtCreateLeaf(void) {
+    zbtreeLeaf *leaf = zmalloc(sizeof(*leaf));
+    leaf->prev = leaf->next = NULL;
+    leaf->count = 0;
+    return leaf;
 }
 
-/* Free a whole skiplist. */
-void zslFree(zskiplist *zsl) {
-    zskiplistNode *node = zsl->header->level[0].forward, *next;
+/* Create a new B+tree. */
+zbtree *zbtCreate(void) {
+    zbtree *zbt = zmalloc(sizeof(*zbt));
 
-    zfree(zsl->header);
-    while(node) {
-        next = node->level[0].forward;
-        zslFreeNode(node);
-        node = next;
+    zbt->root = zbt->head = zbt->tail = zbtCreateLeaf();
+    zbt->length = 0;
+    zbt->height = 1;
+    return zbt;
+}
+
+/* Free the subtree rooted at 'node', that has 'height' levels, including
+ * the SDS strings of its elements. */
+static void zbtFreeNode(void *node, int height) {
+    unsigned int j;
+
+    if (height == 1) {
+        zbtreeLeaf *leaf = node;
+        for (j = 0; j < leaf->count; j++) sdsfree(leaf->entries[j].ele);
+    } else {
+        zbtreeInner *inner = node;
+        for (j = 0; j < inner->count; j++)
+            zbtFreeNode(inner->children[j],height-1);
     }
-    zfree(zsl);
+    zfree(node);
 }
 
-/* Returns a random level for the new skiplist node we are going to create.
- * The return value of this function is between 1 and ZSKIPLIST_MAXLEVEL
- * (both inclusive), with a powerlaw-alike distribution where higher
- * levels are less likely to be returned. */
-int zslRandomLevel(void) {
-    int level = 1;
-    while ((random()&0xFFFF) < (ZSKIPLIST_P * 0xFFFF))
-        level += 1;
-    return (level<ZSKIPLIST_MAXLEVEL) ? level : ZSKIPLIST_MAXLEVEL;
+/* Free a whole B+tree. */
+void zbtFree(zbtree *zbt) {
+    zbtFreeNode(zbt->root,zbt->height);
+    zfree(zbt);
 }
 
-/* Insert a new node in the skiplist. Assumes the element does not already
- * exist (up to the caller to enforce that). The skiplist takes ownership
- * of the passed SDS string 'ele'. */
-zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    unsigned int rank[ZSKIPLIST_MAXLEVEL];
-    int i, level;
+/* Copy 'n' children, with their sizes and smallest elements, from position
+ * 'spos' of 'src' to position 'dpos' of 'dst'. The two ranges may overlap,
+ * so this is also used in order to shift children inside a node. */
+static void zbtInnerCopy(zbtreeInner *dst, unsigned int dpos,
+                         zbtreeInner *src, unsigned int spos, unsigned int n)
+{
+    memmove(dst->sizes+dpos,src->sizes+spos,n*sizeof(dst->sizes[0]));
+    memmove(dst->scores+dpos,src->scores+spos,n*sizeof(dst->scores[0]));
+    memmove(dst->eles+dpos,src->eles+spos,n*sizeof(dst->eles[0]));
+    memmove(dst->children+dpos,src->children+spos,n*sizeof(dst->children[0]));
+}
 
-    serverAssert(!isnan(score));
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        /* store rank that is crossed to reach the insert position */
-        rank[i] = i == (zsl->level-1) ? 0 : rank[i+1];
-        while (x->level[i].forward &&
-                (x->level[i].forward->score < score ||
-                    (x->level[i].forward->score == score &&
-                    sdscmp(x->level[i].forward->ele,ele) < 0)))
-        {
-            rank[i] += x->level[i].span;
-            x = x->level[i].forward;
-        }
-        update[i] = x;
-    }
-    /* we assume the element is not already inside, since we allow duplicated
-     * scores, reinserting the same element should never happen since the
-     * caller of zslInsert() should test in the hash table if the element is
-     * already inside or not. */
-    level = zslRandomLevel();
-    if (level > zsl->level) {
-        for (i = zsl->level; i < level; i++) {
-            rank[i] = 0;
-            update[i] = zsl->header;
-            update[i]->level[i].span = zsl->length;
-        }
-        zsl->level = level;
-    }
-    x = zslCreateNode(level,score,ele);
-    for (i = 0; i < level; i++) {
-        x->level[i].forward = update[i]->level[i].forward;
-        update[i]->level[i].forward = x;
+/* Insert 'child' at position 'pos' of an inner node that is not full. */
+static void zbtInnerInsert(zbtreeInner *x, unsigned int pos, void *child,
+                           unsigned long size, double score, sds ele)
+{
+    zbtInnerCopy(x,pos+1,x,pos,x->count-pos);
+    x->sizes[pos] = size;
+    x->scores[pos] = score;
+    x->eles[pos] = ele;
+    x->children[pos] = child;
+    x->count++;
+}
+
+/* Remove the child at position 'pos' of an inner node. */
+static void zbtInnerRemove(zbtreeInner *x, unsigned int pos) {
+    zbtInnerCopy(x,pos,x,pos+1,x->count-pos-1);
+    x->count--;
+}
+
+/* Return the number of elements below an inner node. */
+static unsigned long zbtInnerLength(zbtreeInner *x) {
+    unsigned long length = 0;
+    unsigned int j;
+
+    for (j = 0; j < x->count; j++) length += x->sizes[j];
+    return length;
+}
 
-        /* update span covered by update[i] as x is inserted here */
-        x->level[i].span = update[i]->level[i].span - (rank[0] - rank[i]);
-        update[i]->level[i].span = (rank[0] - rank[i]) + 1;
+/* Remove a leaf from the list of leaves. */
+static void zbtUnlinkLeaf(zbtree *zbt, zbtreeLeaf *leaf) {
+    if (leaf->prev) leaf->prev->next = leaf->next;
+    else zbt->head = leaf->next;
+    if (leaf->next) leaf->next->prev = leaf->prev;
+    else zbt->tail = leaf->prev;
+}
+
+/* Return the child of 'x' the element score/ele belongs to, that is the
+ * last one whose smallest element is not greater than score/ele. */
+static unsigned int zbtRoute(zbtreeInner *x, double score, sds ele) {
+    unsigned int lo = 1, hi = x->count;
+
+    while (lo < hi) {
+        unsigned int mid = (lo+hi)/2;
+        if (zbtCompare(x->scores[mid],x->eles[mid],score,ele) <= 0)
+            lo = mid+1;
+        else
+            hi = mid;
     }
+    return lo-1;
+}
+
+/* Return the position of the first element of the leaf that is not smaller
+ * than score/ele, or leaf->count if there is no such element. */
+static unsigned int zbtLeafSearch(zbtreeLeaf *leaf, double score, sds ele) {
+    unsigned int lo = 0, hi = leaf->count;
 
-    /* increment span for untouched levels */
-    for (i = level; i < zsl->level; i++) {
-        update[i]->level[i].span++;
+    while (lo < hi) {
+        unsigned int mid = (lo+hi)/2;
+        zbtreeEntry *e = leaf->entries+mid;
+        if (zbtCompare(e->score,e->ele,score,ele) < 0)
+            lo = mid+1;
+        else
+            hi = mid;
     }
+    return lo;
+}
 
-    x->backward = (update[0] == zsl->header) ? NULL : update[0];
-    if (x->level[0].forward)
-        x->level[0].forward->backward = x;
-    else
-        zsl->tail = x;
-    zsl->length++;
-    return x;
-}
-
-/* Internal function used by zslDelete, zslDeleteByScore and zslDeleteByRank */
-void zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update) {
-    int i;
-    for (i = 0; i < zsl->level; i++) {
-        if (update[i]->level[i].forward == x) {
-            update[i]->level[i].span += x->level[i].span - 1;
-            update[i]->level[i].forward = x->level[i].forward;
-        } else {
-            update[i]->level[i].span -= 1;
-        }
+/* Set score/ele as the smallest element of the node at 'level' of the path,
+ * updating the ancestors that reference the old smallest element. */
+static void zbtUpdateMin(zbtreePath *p, int level, double score, sds ele) {
+    while (level-- > 0) {
+        zbtreeInner *x = p->node[level];
+        x->scores[p->idx[level]] = score;
+        x->eles[p->idx[level]] = ele;
+        /* Stop when the node is not the leftmost child of its parent,
+         * since the parent smallest element did not change. */
+        if (p->idx[level] != 0) break;
     }
-    if (x->level[0].forward) {
-        x->level[0].forward->backward = x->backward;
+}
+
+/* Split the full child 'i' of 'x', that must not be full itself: the
+ * elements (or the children) of the child starting at position 'at' are
+ * moved to a new node, inserted as child i+1. */
+static void zbtSplitChild(zbtree *zbt, zbtreeInner *x, unsigned int i,
+                          unsigned int at, int isleaf)
+{
+    unsigned long size;
+    double score;
+    sds ele;
+    void *new;
+
+    if (isleaf) {
+        zbtreeLeaf *leaf = x->children[i], *right = zbtCreateLeaf();
+
+        right->count = leaf->count-at;
+        memcpy(right->entries,leaf->entries+at,
+               right->count*sizeof(zbtreeEntry));
+        leaf->count = at;
+        right->prev = leaf;
+        right->next = leaf->next;
+        if (leaf->next) leaf->next->prev = right;
+        else zbt->tail = right;
+        leaf->next = right;
+
+        size = right->count;
+        score = right->entries[0].score;
+        ele = right->entries[0].ele;
+        new = right;
     } else {
-        zsl->tail = x->backward;
+        zbtreeInner *inner = x->children[i], *right = zmalloc(sizeof(*right));
+
+        right->count = inner->count-at;
+        zbtInnerCopy(right,0,inner,at,right->count);
+        inner->count = at;
+
+        size = zbtInnerLength(right);
+        score = right->scores[0];
+        ele = right->eles[0];
+        new = right;
     }
-    while(zsl->level > 1 && zsl->header->level[zsl->level-1].forward == NULL)
-        zsl->level--;
-    zsl->length--;
+    x->sizes[i] -= size;
+    zbtInnerInsert(x,i+1,new,size,score,ele);
+}
+
+/* Return where to split a full node of 'count' elements or children. Nodes
+ * are split in halves, unless the new element is going to be the first or
+ * the last of the whole tree: in that case, that is what happens when
+ * loading an RDB file or adding elements with increasing scores, we leave
+ * the old node full, since nothing else will be inserted into it. */
+static unsigned int zbtSplitPoint(unsigned int count, int append, int prepend) {
+    if (append) return count-1;
+    if (prepend) return 1;
+    return count/2;
 }
 
-/* Delete an element with matching score/element from the skiplist.
- * The function returns 1 if the node was found and deleted, otherwise
- * 0 is returned.
+/* Insert a new element in the B+tree. Assumes the element does not already
+ * exist (up to the caller to enforce that). The tree takes ownership of the
+ * passed SDS string 'ele'.
  *
- * If 'node' is NULL the deleted node is freed by zslFreeNode(), otherwise
- * it is not freed (but just unlinked) and *node is set to the node pointer,
- * so that it is possible for the caller to reuse the node (including the
- * referenced SDS string at node->ele). */
-int zslDelete(zskiplist *zsl, double score, sds ele, zskiplistNode **node) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    int i;
-
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-                (x->level[i].forward->score < score ||
-                    (x->level[i].forward->score == score &&
-                     sdscmp(x->level[i].forward->ele,ele) < 0)))
-        {
-            x = x->level[i].forward;
+ * Full nodes are split while descending the tree, so that there is always
+ * room in the parent for the new sibling. */
+void zbtInsert(zbtree *zbt, double score, sds ele) {
+    zbtreePath p;
+    zbtreeLeaf *leaf;
+    void *node;
+    unsigned int pos;
+    int level, append = 0, prepend = 0;
+
+    serverAssert(!isnan(score));
+    if (zbt->length == 0) {
+        append = 1;
+    } else {
+        zbtreeEntry *first = zbt->head->entries;
+        zbtreeEntry *last = zbt->tail->entries+zbt->tail->count-1;
+        if (zbtCompare(score,ele,last->score,last->ele) > 0)
+            append = 1;
+        else if (zbtCompare(score,ele,first->score,first->ele) < 0)
+            prepend = 1;
+    }
+
+    /* Grow the tree by one level if the root is full. */
+    if ((zbt->height == 1 &&
+         ((zbtreeLeaf*)zbt->root)->count == ZBTREE_LEAF_ENTRIES) ||
+        (zbt->height > 1 &&
+         ((zbtreeInner*)zbt->root)->count == ZBTREE_FANOUT))
+    {
+        zbtreeInner *root = zmalloc(sizeof(*root));
+        unsigned int count = zbt->height == 1 ?
+            ((zbtreeLeaf*)zbt->root)->count : ((zbtreeInner*)zbt->root)->count;
+
+        serverAssert(zbt->height < ZBTREE_MAX_HEIGHT);
+        root->count = 0;
+        zbtInnerInsert(root,0,zbt->root,zbt->length,
+                       zbt->head->entries[0].score,zbt->head->entries[0].ele);
+        zbtSplitChild(zbt,root,0,zbtSplitPoint(count,append,prepend),
+                      zbt->height == 1);
+        zbt->root = root;
+        zbt->height++;
+    }
+
+    node = zbt->root;
+    for (level = 0; level < zbt->height-1; level++) {
+        zbtreeInner *x = node;
+        int isleaf = level == zbt->height-2;
+        unsigned int i = zbtRoute(x,score,ele), count;
+
+        count = isleaf ? ((zbtreeLeaf*)x->children[i])->count :
+                         ((zbtreeInner*)x->children[i])->count;
+        if (count == (isleaf ? ZBTREE_LEAF_ENTRIES : ZBTREE_FANOUT)) {
+            zbtSplitChild(zbt,x,i,zbtSplitPoint(count,append,prepend),isleaf);
+            if (zbtCompare(score,ele,x->scores[i+1],x->eles[i+1]) > 0) i++;
+        }
+        x->sizes[i]++;
+        p.node[level] = x;
+        p.idx[level] = i;
+        node = x->children[i];
+    }
+
+    leaf = node;
+    pos = zbtLeafSearch(leaf,score,ele);
+    memmove(leaf->entries+pos+1,leaf->entries+pos,
+            (leaf->count-pos)*sizeof(zbtreeEntry));
+    leaf->entries[pos].score = score;
+    leaf->entries[pos].ele = ele;
+    leaf->count++;
+    zbt->length++;
+    if (pos == 0) zbtUpdateMin(&p,level,score,ele);
+}
+
+/* Fill an empty B+tree with the 'count' elements of 'entries', that must be
+ * sorted and unique. The tree takes ownership of their SDS strings.
+ *
+ * The tree is built bottom-up in linear time: the leaves are filled first,
+ * then every level of inner nodes is built on top of the previous one. The
+ * nodes of every level are as full as possible, with the elements spread
+ * evenly so that none of them is less than half full. */
+void zbtBulkLoad(zbtree *zbt, zbtreeEntry *entries, unsigned long count) {
+    zbtreeLeaf *prev = NULL;
+    void **nodes;
+    unsigned long numnodes, j, n;
+
+    serverAssert(zbt->length == 0);
+    if (count == 0) return;
+    zfree(zbt->root);
+
+    /* Fill the leaves. The ones left share evenly the elements left. */
+    numnodes = (count+ZBTREE_LEAF_ENTRIES-1)/ZBTREE_LEAF_ENTRIES;
+    nodes = zmalloc(sizeof(void*)*numnodes);
+    for (j = 0, n = 0; j < numnodes; j++) {
+        zbtreeLeaf *leaf = zbtCreateLeaf();
+
+        leaf->count = (count-n)/(numnodes-j);
+        memcpy(leaf->entries,entries+n,leaf->count*sizeof(zbtreeEntry));
+        n += leaf->count;
+        leaf->prev = prev;
+        if (prev) prev->next = leaf;
+        else zbt->head = leaf;
+        prev = leaf;
+        nodes[j] = leaf;
+    }
+    zbt->tail = prev;
+    zbt->height = 1;
+
+    /* Build the inner levels until a single root is left. The parents are
+     * stored in 'nodes' in place of the children, that were already
+     * consumed. */
+    while (numnodes > 1) {
+        unsigned long numparents = (numnodes+ZBTREE_FANOUT-1)/ZBTREE_FANOUT;
+
+        for (j = 0, n = 0; j < numparents; j++) {
+            zbtreeInner *x = zmalloc(sizeof(*x));
+            unsigned long children = (numnodes-n)/(numparents-j);
+
+            x->count = 0;
+            while (children--) {
+                void *child = nodes[n++];
+
+                if (zbt->height == 1) {
+                    zbtreeLeaf *leaf = child;
+                    zbtInnerInsert(x,x->count,leaf,leaf->count,
+                                   leaf->entries[0].score,
+                                   leaf->entries[0].ele);
+                } else {
+                    zbtreeInner *inner = child;
+                    zbtInnerInsert(x,x->count,inner,zbtInnerLength(inner),
+                                   inner->scores[0],inner->eles[0]);
+                }
+            }
+            nodes[j] = x;
         }
-        update[i] = x;
+        numnodes = numparents;
+        zbt->height++;
     }
-    /* We may have multiple elements with the same score, what we need
-     * is to find the element with both the right score and object. */
-    x = x->level[0].forward;
-    if (x && score == x->score && sdscmp(x->ele,ele) == 0) {
-        zslDeleteNode(zsl, x, update);
-        if (!node)
-            zslFreeNode(x);
-        else
-            *node = x;
+    serverAssert(zbt->height <= ZBTREE_MAX_HEIGHT);
+    zbt->root = nodes[0];
+    zbt->length = count;
+    zfree(nodes);
+}
+
+/* Fill the path leading to the element score/ele. If 'rank' is not NULL
+ * the number of elements preceding it is stored there. Returns 1 if the
+ * element exists, otherwise 0 is returned and the path leads to the place
+ * where the element would be inserted. */
+static int zbtFindPath(zbtree *zbt, double score, sds ele, zbtreePath *p,
+                       unsigned long *rank)
+{
+    void *node = zbt->root;
+    unsigned long traversed = 0;
+    unsigned int pos, j;
+    zbtreeLeaf *leaf;
+    int level;
+
+    for (level = 0; level < zbt->height-1; level++) {
+        zbtreeInner *x = node;
+        unsigned int i = zbtRoute(x,score,ele);
+
+        if (rank) for (j = 0; j < i; j++) traversed += x->sizes[j];
+        p->node[level] = x;
+        p->idx[level] = i;
+        node = x->children[i];
+    }
+    leaf = node;
+    pos = zbtLeafSearch(leaf,score,ele);
+    p->node[level] = leaf;
+    p->idx[level] = pos;
+    if (rank) *rank = traversed+pos;
+    return pos < leaf->count && leaf->entries[pos].score == score &&
+           sdscmp(leaf->entries[pos].ele,ele) == 0;
+}
+
+/* Fill the path leading to the element with the specified 0-based rank,
+ * that must exist. */
+static void zbtRankPath(zbtree *zbt, unsigned long rank, zbtreePath *p) {
+    void *node = zbt->root;
+    int level;
+
+    serverAssert(rank < zbt->length);
+    for (level = 0; level < zbt->height-1; level++) {
+        zbtreeInner *x = node;
+        unsigned int i = 0;
+
+        while (rank >= x->sizes[i]) rank -= x->sizes[i++];
+        p->node[level] = x;
+        p->idx[level] = i;
+        node = x->children[i];
+    }
+    p->node[level] = node;
+    p->idx[level] = rank;
+}
+
+/* Rebalance the sibling leaves 'a' and 'a+1' of 'x', one of which is less
+ * than half full. When their elements fit into a single leaf they are merged
+ * and 1 is returned, otherwise the elements are split evenly between the two
+ * leaves, so that both are at least half full, and 0 is returned. */
+static int zbtBalanceLeaves(zbtree *zbt, zbtreeInner *x, unsigned int a) {
+    zbtreeLeaf *left = x->children[a], *right = x->children[a+1];
+    unsigned int half = (left->count+right->count)/2, n;
+
+    if (left->count+right->count <= ZBTREE_LEAF_ENTRIES) {
+        memcpy(left->entries+left->count,right->entries,
+               right->count*sizeof(zbtreeEntry));
+        left->count += right->count;
+        x->sizes[a] += x->sizes[a+1];
+        zbtUnlinkLeaf(zbt,right);
+        zfree(right);
+        zbtInnerRemove(x,a+1);
+        return 1;
+    }
+
+    if (left->count < half) {
+        n = half-left->count;
+        memcpy(left->entries+left->count,right->entries,
+               n*sizeof(zbtreeEntry));
+        left->count += n;
+        right->count -= n;
+        memmove(right->entries,right->entries+n,
+                right->count*sizeof(zbtreeEntry));
+    } else {
+        n = left->count-half;
+        memmove(right->entries+n,right->entries,
+                right->count*sizeof(zbtreeEntry));
+        memcpy(right->entries,left->entries+half,n*sizeof(zbtreeEntry));
+        left->count -= n;
+        right->count += n;
+    }
+    x->sizes[a] = left->count;
+    x->sizes[a+1] = right->count;
+    x->scores[a+1] = right->entries[0].score;
+    x->eles[a+1] = right->entries[0].ele;
+    return 0;
+}
+
+/* Like zbtBalanceLeaves() but for the sibling inner nodes 'a' and 'a+1'. */
+static int zbtBalanceInner(zbtreeInner *x, unsigned int a) {
+    zbtreeInner *left = x->children[a], *right = x->children[a+1];
+    unsigned int half = (left->count+right->count)/2, n, j;
+    unsigned long moved = 0;
+
+    if (left->count+right->count <= ZBTREE_FANOUT) {
+        zbtInnerCopy(left,left->count,right,0,right->count);
+        left->count += right->count;
+        x->sizes[a] += x->sizes[a+1];
+        zfree(right);
+        zbtInnerRemove(x,a+1);
         return 1;
     }
-    return 0; /* not found */
+
+    if (left->count < half) {
+        n = half-left->count;
+        for (j = 0; j < n; j++) moved += right->sizes[j];
+        zbtInnerCopy(left,left->count,right,0,n);
+        zbtInnerCopy(right,0,right,n,right->count-n);
+        left->count += n;
+        right->count -= n;
+        x->sizes[a] += moved;
+        x->sizes[a+1] -= moved;
+    } else {
+        n = left->count-half;
+        for (j = half; j < left->count; j++) moved += left->sizes[j];
+        zbtInnerCopy(right,n,right,0,right->count);
+        zbtInnerCopy(right,0,left,half,n);
+        left->count -= n;
+        right->count += n;
+        x->sizes[a] -= moved;
+        x->sizes[a+1] += moved;
+    }
+    x->scores[a+1] = right->scores[0];
+    x->eles[a+1] = right->eles[0];
+    return 0;
+}
+
+/* Remove 'n' consecutive elements of the leaf starting at the position the
+ * path leads to. Their SDS strings are not freed: this is up to the caller.
+ * Nodes left empty are removed, and nodes left less than half full are
+ * rebalanced with a sibling, up to the root. */
+static void zbtRemovePath(zbtree *zbt, zbtreePath *p, unsigned int n) {
+    int level = zbt->height-1, l;
+    zbtreeLeaf *leaf = p->node[level];
+    unsigned int pos = p->idx[level];
+
+    leaf->count -= n;
+    memmove(leaf->entries+pos,leaf->entries+pos+n,
+            (leaf->count-pos)*sizeof(zbtreeEntry));
+    for (l = 0; l < level; l++)
+        ((zbtreeInner*)p->node[l])->sizes[p->idx[l]] -= n;
+    zbt->length -= n;
+    if (pos == 0 && leaf->count)
+        zbtUpdateMin(p,level,leaf->entries[0].score,leaf->entries[0].ele);
+
+    while (level > 0) {
+        zbtreeInner *parent = p->node[level-1];
+        unsigned int i = p->idx[level-1], count, merged;
+        int isleaf = level == zbt->height-1;
+
+        count = isleaf ? ((zbtreeLeaf*)p->node[level])->count :
+                         ((zbtreeInner*)p->node[level])->count;
+        if (count == 0) {
+            if (isleaf) zbtUnlinkLeaf(zbt,p->node[level]);
+            zfree(p->node[level]);
+            zbtInnerRemove(parent,i);
+            if (i == 0 && parent->count)
+                zbtUpdateMin(p,level-1,parent->scores[0],parent->eles[0]);
+            level--;
+            continue;
+        }
+        if (count >= (isleaf ? ZBTREE_LEAF_MIN : ZBTREE_INNER_MIN) ||
+            parent->count == 1) break;
+
+        /* Rebalance with the left sibling, or the right one if this is the
+         * first child. */
+        if (i) i--;
+        merged = isleaf ? zbtBalanceLeaves(zbt,parent,i) :
+                          zbtBalanceInner(parent,i);
+        if (!merged) break;
+        level--;
+    }
+
+    /* Shrink the tree while the root has a single child. */
+    while (zbt->height > 1) {
+        zbtreeInner *root = zbt->root;
+
+        if (root->count > 1) break;
+        if (root->count == 1) {
+            zbt->root = root->children[0];
+            zbt->height--;
+        } else {
+            zbt->root = zbt->head = zbt->tail = zbtCreateLeaf();
+            zbt->height = 1;
+        }
+        zfree(root);
+    }
 }
 
-/* Update the score of an elmenent inside the sorted set skiplist.
+/* Remove the element the path leads to, returning its SDS string that is
+ * now owned by the caller. */
+static sds zbtDeletePath(zbtree *zbt, zbtreePath *p) {
+    zbtreeLeaf *leaf = p->node[zbt->height-1];
+    sds ele = leaf->entries[p->idx[zbt->height-1]].ele;
+
+    zbtRemovePath(zbt,p,1);
+    return ele;
+}
+
+/* Delete an element with matching score/element from the B+tree, freeing
+ * its SDS string. The function returns 1 if the element was found and
+ * deleted, otherwise 0 is returned. */
+int zbtDelete(zbtree *zbt, double score, sds ele) {
+    zbtreePath p;
+
+    if (!zbtFindPath(zbt,score,ele,&p,NULL)) return 0; /* not found */
+    sdsfree(zbtDeletePath(zbt,&p));
+    return 1;
+}
+
+/* Update the score of an element inside the sorted set B+tree.
  * Note that the element must exist and must match 'score'.
  * This function does not update the score in the hash table side, the
  * caller should take care of it.
  *
- * Note that this function attempts to just update the node, in case after
- * the score update, the node would be exactly at the same position.
- * Otherwise the skiplist is modified by removing and re-adding a new
- * element, which is more costly.
- *
- * The function returns the updated element skiplist node pointer. */
-zskiplistNode *zslUpdateScore(zskiplist *zsl, double curscore, sds ele, double newscore) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    int i;
-
-    /* We need to seek to element to update to start: this is useful anyway,
-     * we'll have to update or remove it. */
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-                (x->level[i].forward->score < curscore ||
-                    (x->level[i].forward->score == curscore &&
-                     sdscmp(x->level[i].forward->ele,ele) < 0)))
-        {
-            x = x->level[i].forward;
+ * Note that this function attempts to just update the element in place, in
+ * case after the score update it would be exactly at the same position.
+ * Otherwise the element is removed and re-added, which is more costly. */
+void zbtUpdateScore(zbtree *zbt, double curscore, sds ele, double newscore) {
+    zbtreeEntry *prev, *next;
+    zbtreePath p;
+    zbtreeLeaf *leaf;
+    unsigned int pos;
+    int level = zbt->height-1;
+    int found = zbtFindPath(zbt,curscore,ele,&p,NULL);
+
+    serverAssert(found);
+    leaf = p.node[level];
+    pos = p.idx[level];
+    if (pos > 0)
+        prev = leaf->entries+pos-1;
+    else
+        prev = leaf->prev ? leaf->prev->entries+leaf->prev->count-1 : NULL;
+    if (pos+1 < leaf->count)
+        next = leaf->entries+pos+1;
+    else
+        next = leaf->next ? leaf->next->entries : NULL;
+
+    if ((prev == NULL || prev->score < newscore) &&
+        (next == NULL || next->score > newscore))
+    {
+        leaf->entries[pos].score = newscore;
+        if (pos == 0) zbtUpdateMin(&p,level,newscore,leaf->entries[pos].ele);
+        return;
+    }
+
+    /* No way to update in place: reinsert reusing the same SDS string,
+     * that is shared with the hash table. */
+    ele = zbtDeletePath(zbt,&p);
+    zbtInsert(zbt,newscore,ele);
+}
+
+/* Position the iterator at the first element and return it, or NULL if the
+ * tree is empty. */
+zbtreeEntry *zbtFirst(zbtree *zbt, zbtreeIter *it) {
+    it->leaf = zbt->head;
+    it->pos = 0;
+    return zbt->length ? it->leaf->entries : NULL;
+}
+
+/* Position the iterator at the last element and return it, or NULL if the
+ * tree is empty. */
+zbtreeEntry *zbtLast(zbtree *zbt, zbtreeIter *it) {
+    it->leaf = zbt->tail;
+    it->pos = zbt->length ? it->leaf->count-1 : 0;
+    return zbt->length ? it->leaf->entries+it->pos : NULL;
+}
+
+/* Move the iterator to the next element and return it. NULL is returned
+ * when the iterator was at the last element. */
+zbtreeEntry *zbtNext(zbtreeIter *it) {
+    if (it->pos+1 >= it->leaf->count) {
+        if (it->leaf->next == NULL) {
+            it->pos = it->leaf->count;
+            return NULL;
         }
-        update[i] = x;
+        it->leaf = it->leaf->next;
+        it->pos = 0;
+    } else {
+        it->pos++;
     }
+    return it->leaf->entries+it->pos;
+}
 
-    /* Jump to our element: note that this function assumes that the
-     * element with the matching score exists. */
-    x = x->level[0].forward;
-    serverAssert(x && curscore == x->score && sdscmp(x->ele,ele) == 0);
+/* Move the iterator to the previous element and return it. NULL is
+ * returned when the iterator was at the first element. */
+zbtreeEntry *zbtPrev(zbtreeIter *it) {
+    if (it->pos == 0) {
+        if (it->leaf->prev == NULL) return NULL;
+        it->leaf = it->leaf->prev;
+        it->pos = it->leaf->count;
+    }
+    it->pos--;
+    return it->leaf->entries+it->pos;
+}
 
-    /* If the node, after the score update, would be still exactly
-     * at the same position, we can just update the score without
-     * actually removing and re-inserting the element in the skiplist. */
-    if ((x->backward == NULL || x->backward->score < newscore) &&
-        (x->level[0].forward == NULL || x->level[0].forward->score > newscore))
-    {
-        x->score = newscore;
-        return x;
+/* Position the iterator at the first element for which 'before' returns
+ * false, or past the last element if there is no such element, and return
+ * the number of elements preceding it. The elements for which 'before' is
+ * true must be a prefix of the sorted set. */
+static unsigned long zbtSeek(zbtree *zbt,
+                             int (*before)(double score, sds ele, void *spec),
+                             void *spec, zbtreeIter *it)
+{
+    void *node = zbt->root;
+    unsigned long traversed = 0;
+    unsigned int lo, hi, j;
+    zbtreeLeaf *leaf;
+    int level;
+
+    for (level = 0; level < zbt->height-1; level++) {
+        zbtreeInner *x = node;
+
+        lo = 1, hi = x->count;
+        while (lo < hi) {
+            unsigned int mid = (lo+hi)/2;
+            if (before(x->scores[mid],x->eles[mid],spec)) lo = mid+1;
+            else hi = mid;
+        }
+        for (j = 0; j < lo-1; j++) traversed += x->sizes[j];
+        node = x->children[lo-1];
     }
 
-    /* No way to reuse the old node: we need to remove and insert a new
-     * one at a different place. */
-    zslDeleteNode(zsl, x, update);
-    zskiplistNode *newnode = zslInsert(zsl,newscore,x->ele);
-    /* We reused the old node x->ele SDS string, free the node now
-     * since zslInsert created a new one. */
-    x->ele = NULL;
-    zslFreeNode(x);
-    return newnode;
+    leaf = node;
+    lo = 0, hi = leaf->count;
+    while (lo < hi) {
+        unsigned int mid = (lo+hi)/2;
+        if (before(leaf->entries[mid].score,leaf->entries[mid].ele,spec))
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    it->leaf = leaf;
+    it->pos = lo;
+    /* The element may be the first one of the next leaf. */
+    if (lo == leaf->count && leaf->next) {
+        it->leaf = leaf->next;
+        it->pos = 0;
+    }
+    return traversed+lo;
 }
 
 int zslValueGteMin(double value, zrangespec *spec) {
@@ -307,213 +768,148 @@ int zslValueLteMax(double value, zrangespec *spec) {
     return spec->maxex ? (value < spec->max) : (value <= spec->max);
 }
 
-/* Returns if there is a part of the zset is in range. */
-int zslIsInRange(zskiplist *zsl, zrangespec *range) {
-    zskiplistNode *x;
+static int zbtBeforeMin(double score, sds ele, void *spec) {
+    UNUSED(ele);
+    return !zslValueGteMin(score,spec);
+}
+
+static int zbtBeforeMax(double score, sds ele, void *spec) {
+    UNUSED(ele);
+    return zslValueLteMax(score,spec);
+}
 
+/* Returns if there is a part of the zset is in range. */
+int zbtIsInRange(zbtree *zbt, zrangespec *range) {
     /* Test for ranges that will always be empty. */
     if (range->min > range->max ||
             (range->min == range->max && (range->minex || range->maxex)))
         return 0;
-    x = zsl->tail;
-    if (x == NULL || !zslValueGteMin(x->score,range))
-        return 0;
-    x = zsl->header->level[0].forward;
-    if (x == NULL || !zslValueLteMax(x->score,range))
+    if (zbt->length == 0 ||
+        !zslValueGteMin(zbt->tail->entries[zbt->tail->count-1].score,range) ||
+        !zslValueLteMax(zbt->head->entries[0].score,range))
         return 0;
     return 1;
 }
 
-/* Find the first node that is contained in the specified range.
- * Returns NULL when no element is contained in the range. */
-zskiplistNode *zslFirstInRange(zskiplist *zsl, zrangespec *range) {
-    zskiplistNode *x;
-    int i;
+/* Find the first element that is contained in the specified range, and
+ * position the iterator at it. Returns NULL when no element is contained
+ * in the range. */
+zbtreeEntry *zbtFirstInRange(zbtree *zbt, zrangespec *range, zbtreeIter *it) {
+    zbtreeEntry *e;
 
     /* If everything is out of range, return early. */
-    if (!zslIsInRange(zsl,range)) return NULL;
-
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        /* Go forward while *OUT* of range. */
-        while (x->level[i].forward &&
-            !zslValueGteMin(x->level[i].forward->score,range))
-                x = x->level[i].forward;
-    }
+    if (!zbtIsInRange(zbt,range)) return NULL;
 
-    /* This is an inner range, so the next node cannot be NULL. */
-    x = x->level[0].forward;
-    serverAssert(x != NULL);
+    /* This is an inner range, so the element must exist. */
+    zbtSeek(zbt,zbtBeforeMin,range,it);
+    serverAssert(it->pos < it->leaf->count);
+    e = it->leaf->entries+it->pos;
 
     /* Check if score <= max. */
-    if (!zslValueLteMax(x->score,range)) return NULL;
-    return x;
+    if (!zslValueLteMax(e->score,range)) return NULL;
+    return e;
 }
 
-/* Find the last node that is contained in the specified range.
- * Returns NULL when no element is contained in the range. */
-zskiplistNode *zslLastInRange(zskiplist *zsl, zrangespec *range) {
-    zskiplistNode *x;
-    int i;
+/* Find the last element that is contained in the specified range, and
+ * position the iterator at it. Returns NULL when no element is contained
+ * in the range. */
+zbtreeEntry *zbtLastInRange(zbtree *zbt, zrangespec *range, zbtreeIter *it) {
+    zbtreeEntry *e;
 
     /* If everything is out of range, return early. */
-    if (!zslIsInRange(zsl,range)) return NULL;
-
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        /* Go forward while *IN* range. */
-        while (x->level[i].forward &&
-            zslValueLteMax(x->level[i].forward->score,range))
-                x = x->level[i].forward;
-    }
+    if (!zbtIsInRange(zbt,range)) return NULL;
 
-    /* This is an inner range, so this node cannot be NULL. */
-    serverAssert(x != NULL);
+    /* Seek the first element past the range: this is an inner range, so
+     * the element before it must exist. */
+    zbtSeek(zbt,zbtBeforeMax,range,it);
+    e = zbtPrev(it);
+    serverAssert(e != NULL);
 
     /* Check if score >= min. */
-    if (!zslValueGteMin(x->score,range)) return NULL;
-    return x;
+    if (!zslValueGteMin(e->score,range)) return NULL;
+    return e;
 }
 
-/* Delete all the elements with score between min and max from the skiplist.
- * Min and max are inclusive, so a score >= min || score <= max is deleted.
- * Note that this function takes the reference to the hash table view of the
- * sorted set, in order to remove the elements from the hash table too. */
-unsigned long zslDeleteRangeByScore(zskiplist *zsl, zrangespec *range, dict *dict) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    unsigned long removed = 0;
-    int i;
-
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward && (range->minex ?
-            x->level[i].forward->score <= range->min :
-            x->level[i].forward->score < range->min))
-                x = x->level[i].forward;
-        update[i] = x;
-    }
-
-    /* Current node is the last with score < or <= min. */
-    x = x->level[0].forward;
+/* Return the number of elements inside the specified range. */
+unsigned long zbtCountInRange(zbtree *zbt, zrangespec *range) {
+    zbtreeIter it;
+    unsigned long first, last;
 
-    /* Delete nodes while in range. */
-    while (x &&
-           (range->maxex ? x->score < range->max : x->score <= range->max))
-    {
-        zskiplistNode *next = x->level[0].forward;
-        zslDeleteNode(zsl,x,update);
-        dictDelete(dict,x->ele);
-        zslFreeNode(x); /* Here is where x->ele is actually released. */
-        removed++;
-        x = next;
-    }
-    return removed;
+    if (!zbtIsInRange(zbt,range)) return 0;
+    first = zbtSeek(zbt,zbtBeforeMin,range,&it);
+    last = zbtSeek(zbt,zbtBeforeMax,range,&it);
+    return last > first ? last-first : 0;
 }
 
-unsigned long zslDeleteRangeByLex(zskiplist *zsl, zlexrangespec *range, dict *dict) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
+/* Delete all the elements with rank between start and end from the B+tree.
+ * Start and end are inclusive. Note that start and end need to be 1-based.
+ * Note that this function takes the reference to the hash table view of the
+ * sorted set, in order to remove the elements from the hash table too. */
+unsigned long zbtDeleteRangeByRank(zbtree *zbt, unsigned long start, unsigned long end, dict *dict) {
     unsigned long removed = 0;
-    int i;
-
-
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-            !zslLexValueGteMin(x->level[i].forward->ele,range))
-                x = x->level[i].forward;
-        update[i] = x;
-    }
-
-    /* Current node is the last with score < or <= min. */
-    x = x->level[0].forward;
-
-    /* Delete nodes while in range. */
-    while (x && zslLexValueLteMax(x->ele,range)) {
-        zskiplistNode *next = x->level[0].forward;
-        zslDeleteNode(zsl,x,update);
-        dictDelete(dict,x->ele);
-        zslFreeNode(x); /* Here is where x->ele is actually released. */
-        removed++;
-        x = next;
+    zbtreePath p;
+
+    if (start == 0) start = 1;
+    if (end > zbt->length) end = zbt->length;
+    /* Every iteration removes the run of elements of the range that are in
+     * the leaf of the last one, with a single descent and rebalance. Going
+     * from the end of the range, the leaves on the left are left untouched
+     * for the next iterations. */
+    while (end >= start) {
+        int level = zbt->height-1;
+        unsigned int pos, n, j;
+        zbtreeLeaf *leaf;
+
+        zbtRankPath(zbt,end-1,&p);
+        leaf = p.node[level];
+        pos = p.idx[level];
+        n = end-start+1 < pos+1 ? end-start+1 : pos+1;
+        for (j = pos+1-n; j <= pos; j++) {
+            dictDelete(dict,leaf->entries[j].ele);
+            sdsfree(leaf->entries[j].ele);
+        }
+        p.idx[level] = pos+1-n;
+        zbtRemovePath(zbt,&p,n);
+        removed += n;
+        end -= n;
     }
     return removed;
 }
 
-/* Delete all the elements with rank between start and end from the skiplist.
- * Start and end are inclusive. Note that start and end need to be 1-based */
-unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned int start, unsigned int end, dict *dict) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    unsigned long traversed = 0, removed = 0;
-    int i;
-
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward && (traversed + x->level[i].span) < start) {
-            traversed += x->level[i].span;
-            x = x->level[i].forward;
-        }
-        update[i] = x;
-    }
-
-    traversed++;
-    x = x->level[0].forward;
-    while (x && traversed <= end) {
-        zskiplistNode *next = x->level[0].forward;
-        zslDeleteNode(zsl,x,update);
-        dictDelete(dict,x->ele);
-        zslFreeNode(x);
-        removed++;
-        traversed++;
-        x = next;
-    }
-    return removed;
+/* Delete all the elements with score between min and max from the B+tree. */
+unsigned long zbtDeleteRangeByScore(zbtree *zbt, zrangespec *range, dict *dict) {
+    zbtreeIter it;
+    unsigned long first, last;
+
+    if (!zbtIsInRange(zbt,range)) return 0;
+    first = zbtSeek(zbt,zbtBeforeMin,range,&it);
+    last = zbtSeek(zbt,zbtBeforeMax,range,&it);
+    if (last <= first) return 0;
+    return zbtDeleteRangeByRank(zbt,first+1,last,dict);
 }
 
 /* Find the rank for an element by both score and key.
  * Returns 0 when the element cannot be found, rank otherwise.
- * Note that the rank is 1-based due to the span of zsl->header to the
- * first element. */
-unsigned long zslGetRank(zskiplist *zsl, double score, sds ele) {
-    zskiplistNode *x;
-    unsigned long rank = 0;
-    int i;
-
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-            (x->level[i].forward->score < score ||
-                (x->level[i].forward->score == score &&
-                sdscmp(x->level[i].forward->ele,ele) <= 0))) {
-            rank += x->level[i].span;
-            x = x->level[i].forward;
-        }
+ * Note that the rank is 1-based. */
+unsigned long zbtGetRank(zbtree *zbt, double score, sds ele) {
+    zbtreePath p;
+    unsigned long rank;
 
-        /* x might be equal to zsl->header, so test if obj is non-NULL */
-        if (x->ele && sdscmp(x->ele,ele) == 0) {
-            return rank;
-        }
-    }
-    return 0;
+    if (!zbtFindPath(zbt,score,ele,&p,&rank)) return 0;
+    return rank+1;
 }
 
-/* Finds an element by its rank. The rank argument needs to be 1-based. */
-zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank) {
-    zskiplistNode *x;
-    unsigned long traversed = 0;
-    int i;
+/* Finds an element by its rank, and position the iterator at it. The rank
+ * argument needs to be 1-based. */
+zbtreeEntry *zbtGetElementByRank(zbtree *zbt, unsigned long rank, zbtreeIter *it) {
+    zbtreePath p;
+    int level = zbt->height-1;
 
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward && (traversed + x->level[i].span) <= rank)
-        {
-            traversed += x->level[i].span;
-            x = x->level[i].forward;
-        }
-        if (traversed == rank) {
-            return x;
-        }
-    }
-    return NULL;
+    if (rank == 0 || rank > zbt->length) return NULL;
+    zbtRankPath(zbt,rank-1,&p);
+    it->leaf = p.node[level];
+    it->pos = p.idx[level];
+    return it->leaf->entries+it->pos;
 }
 
 /* Populate the rangespec according to the objects min and max. */
@@ -647,76 +1043,93 @@ int zslLexValueLteMax(sds value, zlexrangespec *spec) {
         (sdscmplex(value,spec->max) <= 0);
 }
 
-/* Returns if there is a part of the zset is in the lex range. */
-int zslIsInLexRange(zskiplist *zsl, zlexrangespec *range) {
-    zskiplistNode *x;
+static int zbtBeforeLexMin(double score, sds ele, void *spec) {
+    UNUSED(score);
+    return !zslLexValueGteMin(ele,spec);
+}
+
+static int zbtBeforeLexMax(double score, sds ele, void *spec) {
+    UNUSED(score);
+    return zslLexValueLteMax(ele,spec);
+}
 
+/* Returns if there is a part of the zset is in the lex range. */
+int zbtIsInLexRange(zbtree *zbt, zlexrangespec *range) {
     /* Test for ranges that will always be empty. */
     int cmp = sdscmplex(range->min,range->max);
     if (cmp > 0 || (cmp == 0 && (range->minex || range->maxex)))
         return 0;
-    x = zsl->tail;
-    if (x == NULL || !zslLexValueGteMin(x->ele,range))
-        return 0;
-    x = zsl->header->level[0].forward;
-    if (x == NULL || !zslLexValueLteMax(x->ele,range))
+    if (zbt->length == 0 ||
+        !zslLexValueGteMin(zbt->tail->entries[zbt->tail->count-1].ele,range) ||
+        !zslLexValueLteMax(zbt->head->entries[0].ele,range))
         return 0;
     return 1;
 }
 
-/* Find the first node that is contained in the specified lex range.
- * Returns NULL when no element is contained in the range. */
-zskiplistNode *zslFirstInLexRange(zskiplist *zsl, zlexrangespec *range) {
-    zskiplistNode *x;
-    int i;
+/* Find the first element that is contained in the specified lex range, and
+ * position the iterator at it. Returns NULL when no element is contained
+ * in the range. */
+zbtreeEntry *zbtFirstInLexRange(zbtree *zbt, zlexrangespec *range, zbtreeIter *it) {
+    zbtreeEntry *e;
 
     /* If everything is out of range, return early. */
-    if (!zslIsInLexRange(zsl,range)) return NULL;
-
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        /* Go forward while *OUT* of range. */
-        while (x->level[i].forward &&
-            !zslLexValueGteMin(x->level[i].forward->ele,range))
-                x = x->level[i].forward;
-    }
+    if (!zbtIsInLexRange(zbt,range)) return NULL;
 
-    /* This is an inner range, so the next node cannot be NULL. */
-    x = x->level[0].forward;
-    serverAssert(x != NULL);
+    /* This is an inner range, so the element must exist. */
+    zbtSeek(zbt,zbtBeforeLexMin,range,it);
+    serverAssert(it->pos < it->leaf->count);
+    e = it->leaf->entries+it->pos;
 
-    /* Check if score <= max. */
-    if (!zslLexValueLteMax(x->ele,range)) return NULL;
-    return x;
+    /* Check if element <= max. */
+    if (!zslLexValueLteMax(e->ele,range)) return NULL;
+    return e;
 }
 
-/* Find the last node that is contained in the specified range.
- * Returns NULL when no element is contained in the range. */
-zskiplistNode *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range) {
-    zskiplistNode *x;
-    int i;
+/* Find the last element that is contained in the specified lex range, and
+ * position the iterator at it. Returns NULL when no element is contained
+ * in the range. */
+zbtreeEntry *zbtLastInLexRange(zbtree *zbt, zlexrangespec *range, zbtreeIter *it) {
+    zbtreeEntry *e;
 
     /* If everything is out of range, return early. */
-    if (!zslIsInLexRange(zsl,range)) return NULL;
+    if (!zbtIsInLexRange(zbt,range)) return NULL;
 
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        /* Go forward while *IN* range. */
-        while (x->level[i].forward &&
-            zslLexValueLteMax(x->level[i].forward->ele,range))
-                x = x->level[i].forward;
-    }
+    /* This is an inner range, so the element before the first element
+     * past the range must exist. */
+    zbtSeek(zbt,zbtBeforeLexMax,range,it);
+    e = zbtPrev(it);
+    serverAssert(e != NULL);
+
+    /* Check if element >= min. */
+    if (!zslLexValueGteMin(e->ele,range)) return NULL;
+    return e;
+}
 
-    /* This is an inner range, so this node cannot be NULL. */
-    serverAssert(x != NULL);
+/* Return the number of elements inside the specified lex range. */
+unsigned long zbtCountInLexRange(zbtree *zbt, zlexrangespec *range) {
+    zbtreeIter it;
+    unsigned long first, last;
 
-    /* Check if score >= min. */
-    if (!zslLexValueGteMin(x->ele,range)) return NULL;
-    return x;
+    if (!zbtIsInLexRange(zbt,range)) return 0;
+    first = zbtSeek(zbt,zbtBeforeLexMin,range,&it);
+    last = zbtSeek(zbt,zbtBeforeLexMax,range,&it);
+    return last > first ? last-first : 0;
+}
+
+/* Delete all the elements inside the specified lex range from the B+tree. */
+unsigned long zbtDeleteRangeByLex(zbtree *zbt, zlexrangespec *range, dict *dict) {
+    zbtreeIter it;
+    unsigned long first, last;
+
+    if (!zbtIsInLexRange(zbt,range)) return 0;
+    first = zbtSeek(zbt,zbtBeforeLexMin,range,&it);
+    last = zbtSeek(zbt,zbtBeforeLexMax,range,&it);
+    if (last <= first) return 0;
+    return zbtDeleteRangeByRank(zbt,first+1,last,dict);
 }
 
 /*-----------------------------------------------------------------------------
- * Ziplist-backed sorted set API
+ * Listpack-backed sorted set API
  *----------------------------------------------------------------------------*/
 
 double zzlGetScore(unsigned char *sptr) {
@@ -727,7 +1140,7 @@ double zzlGetScore(unsigned char *sptr) {
     double score;
 
     serverAssert(sptr != NULL);
-    serverAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+    serverAssert(lpGetValue(sptr,&vstr,&vlen,&vlong));
 
     if (vstr) {
         memcpy(buf,vstr,vlen);
@@ -740,14 +1153,14 @@ double zzlGetScore(unsigned char *sptr) {
     return score;
 }
 
-/* Return a ziplist element as an SDS string. */
-sds ziplistGetObject(unsigned char *sptr) {
+/* Return a listpack element as an SDS string. */
+sds lpGetObject(unsigned char *sptr) {
     unsigned char *vstr;
     unsigned int vlen;
     long long vlong;
 
     serverAssert(sptr != NULL);
-    serverAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+    serverAssert(lpGetValue(sptr,&vstr,&vlen,&vlong));
 
     if (vstr) {
         return sdsnewlen((char*)vstr,vlen);
@@ -764,7 +1177,7 @@ int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int cl
     unsigned char vbuf[32];
     int minlen, cmp;
 
-    serverAssert(ziplistGet(eptr,&vstr,&vlen,&vlong));
+    serverAssert(lpGetValue(eptr,&vstr,&vlen,&vlong));
     if (vstr == NULL) {
         /* Store string representation of long long in buf. */
         vlen = ll2string((char*)vbuf,sizeof(vbuf),vlong);
@@ -778,7 +1191,7 @@ int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int cl
 }
 
 unsigned int zzlLength(unsigned char *zl) {
-    return ziplistLen(zl)/2;
+    return lpLength(zl)/2;
 }
 
 /* Move to next entry based on the values in eptr and sptr. Both are set to
@@ -787,9 +1200,9 @@ void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
     unsigned char *_eptr, *_sptr;
     serverAssert(*eptr != NULL && *sptr != NULL);
 
-    _eptr = ziplistNext(zl,*sptr);
+    _eptr = lpNext(zl,*sptr);
     if (_eptr != NULL) {
-        _sptr = ziplistNext(zl,_eptr);
+        _sptr = lpNext(zl,_eptr);
         serverAssert(_sptr != NULL);
     } else {
         /* No next entry. */
@@ -806,9 +1219,9 @@ void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
     unsigned char *_eptr, *_sptr;
     serverAssert(*eptr != NULL && *sptr != NULL);
 
-    _sptr = ziplistPrev(zl,*eptr);
+    _sptr = lpPrev(zl,*eptr);
     if (_sptr != NULL) {
-        _eptr = ziplistPrev(zl,_sptr);
+        _eptr = lpPrev(zl,_sptr);
         serverAssert(_eptr != NULL);
     } else {
         /* No previous entry. */
@@ -830,13 +1243,13 @@ int zzlIsInRange(unsigned char *zl, zrangespec *range) {
             (range->min == range->max && (range->minex || range->maxex)))
         return 0;
 
-    p = ziplistIndex(zl,-1); /* Last score. */
+    p = lpSeek(zl,-1); /* Last score. */
     if (p == NULL) return 0; /* Empty sorted set */
     score = zzlGetScore(p);
     if (!zslValueGteMin(score,range))
         return 0;
 
-    p = ziplistIndex(zl,1); /* First score. */
+    p = lpSeek(zl,1); /* First score. */
     serverAssert(p != NULL);
     score = zzlGetScore(p);
     if (!zslValueLteMax(score,range))
@@ -848,14 +1261,14 @@ int zzlIsInRange(unsigned char *zl, zrangespec *range) {
 /* Find pointer to the first element contained in the specified range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
     double score;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInRange(zl,range)) return NULL;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         score = zzlGetScore(sptr);
@@ -867,7 +1280,7 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
 
     return NULL;
@@ -876,14 +1289,14 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
 /* Find pointer to the last element contained in the specified range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+    unsigned char *eptr = lpSeek(zl,-2), *sptr;
     double score;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInRange(zl,range)) return NULL;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         score = zzlGetScore(sptr);
@@ -896,9 +1309,9 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
 
         /* Move to previous element by moving to the score of previous element.
          * When this returns NULL, we know there also is no element. */
-        sptr = ziplistPrev(zl,eptr);
+        sptr = lpPrev(zl,eptr);
         if (sptr != NULL)
-            serverAssert((eptr = ziplistPrev(zl,sptr)) != NULL);
+            serverAssert((eptr = lpPrev(zl,sptr)) != NULL);
         else
             eptr = NULL;
     }
@@ -907,14 +1320,14 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
 }
 
 int zzlLexValueGteMin(unsigned char *p, zlexrangespec *spec) {
-    sds value = ziplistGetObject(p);
+    sds value = lpGetObject(p);
     int res = zslLexValueGteMin(value,spec);
     sdsfree(value);
     return res;
 }
 
 int zzlLexValueLteMax(unsigned char *p, zlexrangespec *spec) {
-    sds value = ziplistGetObject(p);
+    sds value = lpGetObject(p);
     int res = zslLexValueLteMax(value,spec);
     sdsfree(value);
     return res;
@@ -930,12 +1343,12 @@ int zzlIsInLexRange(unsigned char *zl, zlexrangespec *range) {
     if (cmp > 0 || (cmp == 0 && (range->minex || range->maxex)))
         return 0;
 
-    p = ziplistIndex(zl,-2); /* Last element. */
+    p = lpSeek(zl,-2); /* Last element. */
     if (p == NULL) return 0;
     if (!zzlLexValueGteMin(p,range))
         return 0;
 
-    p = ziplistIndex(zl,0); /* First element. */
+    p = lpSeek(zl,0); /* First element. */
     serverAssert(p != NULL);
     if (!zzlLexValueLteMax(p,range))
         return 0;
@@ -946,7 +1359,7 @@ int zzlIsInLexRange(unsigned char *zl, zlexrangespec *range) {
 /* Find pointer to the first element contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInLexRange(zl,range)) return NULL;
@@ -960,9 +1373,9 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
         }
 
         /* Move to next element. */
-        sptr = ziplistNext(zl,eptr); /* This element score. Skip it. */
+        sptr = lpNext(zl,eptr); /* This element score. Skip it. */
         serverAssert(sptr != NULL);
-        eptr = ziplistNext(zl,sptr); /* Next element. */
+        eptr = lpNext(zl,sptr); /* Next element. */
     }
 
     return NULL;
@@ -971,7 +1384,7 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
 /* Find pointer to the last element contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+    unsigned char *eptr = lpSeek(zl,-2), *sptr;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInLexRange(zl,range)) return NULL;
@@ -986,9 +1399,9 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
 
         /* Move to previous element by moving to the score of previous element.
          * When this returns NULL, we know there also is no element. */
-        sptr = ziplistPrev(zl,eptr);
+        sptr = lpPrev(zl,eptr);
         if (sptr != NULL)
-            serverAssert((eptr = ziplistPrev(zl,sptr)) != NULL);
+            serverAssert((eptr = lpPrev(zl,sptr)) != NULL);
         else
             eptr = NULL;
     }
@@ -996,33 +1409,27 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
     return NULL;
 }
 
-unsigned char *zzlFind(unsigned char *zl, sds ele, double *score) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
-
-    while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
-        serverAssert(sptr != NULL);
+unsigned char *zzlFind(unsigned char *lp, sds ele, double *score) {
+    unsigned char *eptr, *sptr;
 
-        if (ziplistCompare(eptr,(unsigned char*)ele,sdslen(ele))) {
-            /* Matching element, pull out score. */
-            if (score != NULL) *score = zzlGetScore(sptr);
-            return eptr;
-        }
+    /* Only the elements are compared, skipping the scores. */
+    eptr = lpFind(lp,lpFirst(lp),(unsigned char*)ele,sdslen(ele),1);
+    if (eptr == NULL) return NULL;
 
-        /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
-    }
-    return NULL;
+    /* Matching element, pull out score. */
+    sptr = lpNext(lp,eptr);
+    serverAssert(sptr != NULL);
+    if (score != NULL) *score = zzlGetScore(sptr);
+    return eptr;
 }
 
-/* Delete (element,score) pair from ziplist. Use local copy of eptr because we
+/* Delete (element,score) pair from listpack. Use local copy of eptr because we
  * don't want to modify the one given as argument. */
 unsigned char *zzlDelete(unsigned char *zl, unsigned char *eptr) {
     unsigned char *p = eptr;
 
-    /* TODO: add function to ziplist API to delete N elements from offset. */
-    zl = ziplistDelete(zl,&p);
-    zl = ziplistDelete(zl,&p);
+    zl = lpDelete(zl,p,&p);
+    zl = lpDelete(zl,p,&p);
     return zl;
 }
 
@@ -1030,33 +1437,30 @@ unsigned char *zzlInsertAt(unsigned char *zl, unsigned char *eptr, sds ele, doub
     unsigned char *sptr;
     char scorebuf[128];
     int scorelen;
-    size_t offset;
 
     scorelen = d2string(scorebuf,sizeof(scorebuf),score);
     if (eptr == NULL) {
-        zl = ziplistPush(zl,(unsigned char*)ele,sdslen(ele),ZIPLIST_TAIL);
-        zl = ziplistPush(zl,(unsigned char*)scorebuf,scorelen,ZIPLIST_TAIL);
+        zl = lpAppend(zl,(unsigned char*)ele,sdslen(ele));
+        zl = lpAppend(zl,(unsigned char*)scorebuf,scorelen);
     } else {
-        /* Keep offset relative to zl, as it might be re-allocated. */
-        offset = eptr-zl;
-        zl = ziplistInsert(zl,eptr,(unsigned char*)ele,sdslen(ele));
-        eptr = zl+offset;
+        /* Insert the element before 'eptr': lpInsert() returns by reference
+         * the position of the new element in the reallocated listpack. */
+        zl = lpInsert(zl,(unsigned char*)ele,sdslen(ele),eptr,LP_BEFORE,&sptr);
 
         /* Insert score after the element. */
-        serverAssert((sptr = ziplistNext(zl,eptr)) != NULL);
-        zl = ziplistInsert(zl,sptr,(unsigned char*)scorebuf,scorelen);
+        zl = lpInsert(zl,(unsigned char*)scorebuf,scorelen,sptr,LP_AFTER,NULL);
     }
     return zl;
 }
 
-/* Insert (element,score) pair in ziplist. This function assumes the element is
+/* Insert (element,score) pair in listpack. This function assumes the element is
  * not yet present in the list. */
 unsigned char *zzlInsert(unsigned char *zl, sds ele, double score) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
     double s;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
         s = zzlGetScore(sptr);
 
@@ -1075,7 +1479,7 @@ unsigned char *zzlInsert(unsigned char *zl, sds ele, double score) {
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
 
     /* Push on tail of list when it was not yet inserted. */
@@ -1094,14 +1498,14 @@ unsigned char *zzlDeleteRangeByScore(unsigned char *zl, zrangespec *range, unsig
     eptr = zzlFirstInRange(zl,range);
     if (eptr == NULL) return zl;
 
-    /* When the tail of the ziplist is deleted, eptr will point to the sentinel
-     * byte and ziplistNext will return NULL. */
-    while ((sptr = ziplistNext(zl,eptr)) != NULL) {
+    /* When the tail of the listpack is deleted, lpDelete() sets eptr to
+     * NULL. */
+    while (eptr != NULL && (sptr = lpNext(zl,eptr)) != NULL) {
         score = zzlGetScore(sptr);
         if (zslValueLteMax(score,range)) {
             /* Delete both the element and the score. */
-            zl = ziplistDelete(zl,&eptr);
-            zl = ziplistDelete(zl,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
             num++;
         } else {
             /* No longer in range. */
@@ -1122,13 +1526,13 @@ unsigned char *zzlDeleteRangeByLex(unsigned char *zl, zlexrangespec *range, unsi
     eptr = zzlFirstInLexRange(zl,range);
     if (eptr == NULL) return zl;
 
-    /* When the tail of the ziplist is deleted, eptr will point to the sentinel
-     * byte and ziplistNext will return NULL. */
-    while ((sptr = ziplistNext(zl,eptr)) != NULL) {
+    /* When the tail of the listpack is deleted, lpDelete() sets eptr to
+     * NULL. */
+    while (eptr != NULL && (sptr = lpNext(zl,eptr)) != NULL) {
         if (zzlLexValueLteMax(eptr,range)) {
             /* Delete both the element and the score. */
-            zl = ziplistDelete(zl,&eptr);
-            zl = ziplistDelete(zl,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
             num++;
         } else {
             /* No longer in range. */
@@ -1140,12 +1544,12 @@ unsigned char *zzlDeleteRangeByLex(unsigned char *zl, zlexrangespec *range, unsi
     return zl;
 }
 
-/* Delete all the elements with rank between start and end from the skiplist.
+/* Delete all the elements with rank between start and end from the listpack.
  * Start and end are inclusive. Note that start and end need to be 1-based */
 unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsigned int end, unsigned long *deleted) {
     unsigned int num = (end-start)+1;
     if (deleted) *deleted = num;
-    zl = ziplistDeleteRange(zl,2*(start-1),2*num);
+    zl = lpDeleteRange(zl,2*(start-1),2*num);
     return zl;
 }
 
@@ -1155,97 +1559,102 @@ unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsig
 
 unsigned long zsetLength(const robj *zobj) {
     unsigned long length = 0;
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         length = zzlLength(zobj->ptr);
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
-        length = ((const zset*)zobj->ptr)->zsl->length;
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        length = ((const zset*)zobj->ptr)->zbt->length;
     } else {
         serverPanic("Unknown sorted set encoding");
     }
     return length;
 }
 
+/* Add a new element to both the hash table and the B+tree of a sorted set,
+ * that take ownership of the SDS string. The element must not already be
+ * a member of the sorted set. */
+void zsetAddNew(zset *zs, double score, sds ele) {
+    dictEntry *de = dictAddRaw(zs->dict,ele,NULL);
+
+    serverAssert(de != NULL);
+    dictSetDoubleVal(de,score);
+    zbtInsert(zs->zbt,score,ele);
+}
+
 void zsetConvert(robj *zobj, int encoding) {
     zset *zs;
-    zskiplistNode *node, *next;
     sds ele;
     double score;
 
     if (zobj->encoding == encoding) return;
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
         unsigned int vlen;
         long long vlong;
 
-        if (encoding != OBJ_ENCODING_SKIPLIST)
+        if (encoding != OBJ_ENCODING_BTREE)
             serverPanic("Unknown target encoding");
 
         zs = zmalloc(sizeof(*zs));
         zs->dict = dictCreate(&zsetDictType,NULL);
-        zs->zsl = zslCreate();
+        zs->zbt = zbtCreate();
 
-        eptr = ziplistIndex(zl,0);
-        serverAssertWithInfo(NULL,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
-        serverAssertWithInfo(NULL,zobj,sptr != NULL);
+        /* The listpack may be empty when converting a sorted set that is
+         * still being populated, like the destination of ZRANGESTORE. */
+        eptr = lpSeek(zl,0);
+        if (eptr != NULL) {
+            sptr = lpNext(zl,eptr);
+            serverAssertWithInfo(NULL,zobj,sptr != NULL);
+        }
 
         while (eptr != NULL) {
             score = zzlGetScore(sptr);
-            serverAssertWithInfo(NULL,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            serverAssertWithInfo(NULL,zobj,lpGetValue(eptr,&vstr,&vlen,&vlong));
             if (vstr == NULL)
                 ele = sdsfromlonglong(vlong);
             else
                 ele = sdsnewlen((char*)vstr,vlen);
 
-            node = zslInsert(zs->zsl,score,ele);
-            serverAssert(dictAdd(zs->dict,ele,&node->score) == DICT_OK);
+            zsetAddNew(zs,score,ele);
             zzlNext(zl,&eptr,&sptr);
         }
 
-        zfree(zobj->ptr);
+        lpFree(zobj->ptr);
         zobj->ptr = zs;
-        zobj->encoding = OBJ_ENCODING_SKIPLIST;
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
-        unsigned char *zl = ziplistNew();
+        zobj->encoding = OBJ_ENCODING_BTREE;
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        unsigned char *zl = lpNew();
+        zbtreeEntry *e;
+        zbtreeIter it;
 
-        if (encoding != OBJ_ENCODING_ZIPLIST)
+        if (encoding != OBJ_ENCODING_LISTPACK)
             serverPanic("Unknown target encoding");
 
-        /* Approach similar to zslFree(), since we want to free the skiplist at
-         * the same time as creating the ziplist. */
         zs = zobj->ptr;
-        dictRelease(zs->dict);
-        node = zs->zsl->header->level[0].forward;
-        zfree(zs->zsl->header);
-        zfree(zs->zsl);
-
-        while (node) {
-            zl = zzlInsertAt(zl,NULL,node->ele,node->score);
-            next = node->level[0].forward;
-            zslFreeNode(node);
-            node = next;
-        }
+        for (e = zbtFirst(zs->zbt,&it); e != NULL; e = zbtNext(&it))
+            zl = zzlInsertAt(zl,NULL,e->ele,e->score);
 
+        dictRelease(zs->dict);
+        zbtFree(zs->zbt);
         zfree(zs);
         zobj->ptr = zl;
-        zobj->encoding = OBJ_ENCODING_ZIPLIST;
+        zobj->encoding = OBJ_ENCODING_LISTPACK;
     } else {
         serverPanic("Unknown sorted set encoding");
     }
 }
 
-/* Convert the sorted set object into a ziplist if it is not already a ziplist
+/* Convert the sorted set object into a listpack if it is not already a listpack
  * and if the number of elements and the maximum element size is within the
  * expected ranges. */
-void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen) {
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) return;
+void zsetConvertToListpackIfNeeded(robj *zobj, size_t maxelelen) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) return;
     zset *zset = zobj->ptr;
 
-    if (zset->zsl->length <= server.zset_max_ziplist_entries &&
+    if (zset->zbt->length <= server.zset_max_ziplist_entries &&
         maxelelen <= server.zset_max_ziplist_value)
-            zsetConvert(zobj,OBJ_ENCODING_ZIPLIST);
+            zsetConvert(zobj,OBJ_ENCODING_LISTPACK);
 }
 
 /* Return (by reference) the score of the specified member of the sorted set
@@ -1255,13 +1664,13 @@ void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen) {
 int zsetScore(robj *zobj, sds member, double *score) {
     if (!zobj || !member) return C_ERR;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         if (zzlFind(zobj->ptr, member, score) == NULL) return C_ERR;
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
         dictEntry *de = dictFind(zs->dict, member);
         if (de == NULL) return C_ERR;
-        *score = *(double*)dictGetVal(de);
+        *score = dictGetDoubleVal(de);
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -1305,7 +1714,7 @@ int zsetScore(robj *zobj, sds member, double *score) {
  * start.
  *
  * The commad as a side effect of adding a new element may convert the sorted
- * set internal encoding from ziplist to hashtable+skiplist.
+ * set internal encoding from listpack to hashtable+B+tree.
  *
  * Memory managemnet of 'ele':
  *
@@ -1326,7 +1735,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
     }
 
     /* Update the sorted set according to its encoding. */
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr;
 
         if ((eptr = zzlFind(zobj->ptr,ele,&curscore)) != NULL) {
@@ -1359,7 +1768,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
             zobj->ptr = zzlInsert(zobj->ptr,ele,score);
             if (zzlLength(zobj->ptr) > server.zset_max_ziplist_entries ||
                 sdslen(ele) > server.zset_max_ziplist_value)
-                zsetConvert(zobj,OBJ_ENCODING_SKIPLIST);
+                zsetConvert(zobj,OBJ_ENCODING_BTREE);
             if (newscore) *newscore = score;
             *flags |= ZADD_ADDED;
             return 1;
@@ -1367,9 +1776,8 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
             *flags |= ZADD_NOP;
             return 1;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplistNode *znode;
         dictEntry *de;
 
         de = dictFind(zs->dict,ele);
@@ -1379,7 +1787,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
                 *flags |= ZADD_NOP;
                 return 1;
             }
-            curscore = *(double*)dictGetVal(de);
+            curscore = dictGetDoubleVal(de);
 
             /* Prepare the score for the increment if needed. */
             if (incr) {
@@ -1393,18 +1801,16 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
 
             /* Remove and re-insert when score changes. */
             if (score != curscore) {
-                znode = zslUpdateScore(zs->zsl,curscore,ele,score);
+                zbtUpdateScore(zs->zbt,curscore,ele,score);
                 /* Note that we did not removed the original element from
                  * the hash table representing the sorted set, so we just
                  * update the score. */
-                dictGetVal(de) = &znode->score; /* Update score ptr. */
+                dictSetDoubleVal(de,score);
                 *flags |= ZADD_UPDATED;
             }
             return 1;
         } else if (!xx) {
-            ele = sdsdup(ele);
-            znode = zslInsert(zs->zsl,score,ele);
-            serverAssert(dictAdd(zs->dict,ele,&znode->score) == DICT_OK);
+            zsetAddNew(zs,score,sdsdup(ele));
             *flags |= ZADD_ADDED;
             if (newscore) *newscore = score;
             return 1;
@@ -1421,32 +1827,32 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
 /* Delete the element 'ele' from the sorted set, returning 1 if the element
  * existed and was deleted, 0 otherwise (the element was not there). */
 int zsetDel(robj *zobj, sds ele) {
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr;
 
         if ((eptr = zzlFind(zobj->ptr,ele,NULL)) != NULL) {
             zobj->ptr = zzlDelete(zobj->ptr,eptr);
             return 1;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
         dictEntry *de;
         double score;
 
         de = dictUnlink(zs->dict,ele);
         if (de != NULL) {
-            /* Get the score in order to delete from the skiplist later. */
-            score = *(double*)dictGetVal(de);
+            /* Get the score in order to delete from the B+tree later. */
+            score = dictGetDoubleVal(de);
 
-            /* Delete from the hash table and later from the skiplist.
-             * Note that the order is important: deleting from the skiplist
+            /* Delete from the hash table and later from the B+tree.
+             * Note that the order is important: deleting from the B+tree
              * actually releases the SDS string representing the element,
-             * which is shared between the skiplist and the hash table, so
-             * we need to delete from the skiplist as the final step. */
+             * which is shared between the B+tree and the hash table, so
+             * we need to delete from the B+tree as the final step. */
             dictFreeUnlinkedEntry(zs->dict,de);
 
-            /* Delete from skiplist. */
-            int retval = zslDelete(zs->zsl,score,ele,NULL);
+            /* Delete from the B+tree. */
+            int retval = zbtDelete(zs->zbt,score,ele);
             serverAssert(retval);
 
             if (htNeedsResize(zs->dict)) dictResize(zs->dict);
@@ -1475,18 +1881,18 @@ long zsetRank(robj *zobj, sds ele, int reverse) {
 
     llen = zsetLength(zobj);
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpSeek(zl,0);
         serverAssert(eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         rank = 1;
         while(eptr != NULL) {
-            if (ziplistCompare(eptr,(unsigned char*)ele,sdslen(ele)))
+            if (lpCompare(eptr,(unsigned char*)ele,sdslen(ele)))
                 break;
             rank++;
             zzlNext(zl,&eptr,&sptr);
@@ -1500,16 +1906,15 @@ long zsetRank(robj *zobj, sds ele, int reverse) {
         } else {
             return -1;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
         dictEntry *de;
         double score;
 
         de = dictFind(zs->dict,ele);
         if (de != NULL) {
-            score = *(double*)dictGetVal(de);
-            rank = zslGetRank(zsl,score,ele);
+            score = dictGetDoubleVal(de);
+            rank = zbtGetRank(zs->zbt,score,ele);
             /* Existing elements always have a rank. */
             serverAssert(rank != 0);
             if (reverse)
@@ -1604,7 +2009,7 @@ void zaddGenericCommand(client *c, int flags) {
         {
             zobj = createZsetObject();
         } else {
-            zobj = createZsetZiplistObject();
+            zobj = createZsetListpackObject();
         }
         dbAdd(c->db,key,zobj);
     } else {
@@ -1737,7 +2142,7 @@ void zremrangeGenericCommand(client *c, int rangetype) {
     }
 
     /* Step 3: Perform the range deletion operation. */
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         switch(rangetype) {
         case ZRANGE_RANK:
             zobj->ptr = zzlDeleteRangeByRank(zobj->ptr,start+1,end+1,&deleted);
@@ -1753,17 +2158,17 @@ void zremrangeGenericCommand(client *c, int rangetype) {
             dbDelete(c->db,key);
             keyremoved = 1;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
         switch(rangetype) {
         case ZRANGE_RANK:
-            deleted = zslDeleteRangeByRank(zs->zsl,start+1,end+1,zs->dict);
+            deleted = zbtDeleteRangeByRank(zs->zbt,start+1,end+1,zs->dict);
             break;
         case ZRANGE_SCORE:
-            deleted = zslDeleteRangeByScore(zs->zsl,&range,zs->dict);
+            deleted = zbtDeleteRangeByScore(zs->zbt,&range,zs->dict);
             break;
         case ZRANGE_LEX:
-            deleted = zslDeleteRangeByLex(zs->zsl,&lexrange,zs->dict);
+            deleted = zbtDeleteRangeByLex(zs->zbt,&lexrange,zs->dict);
             break;
         }
         if (htNeedsResize(zs->dict)) dictResize(zs->dict);
@@ -1820,6 +2225,10 @@ typedef struct {
                 dictIterator *di;
                 dictEntry *de;
             } ht;
+            struct {
+                unsigned char *lp;
+                unsigned char *p;
+            } lp;
         } set;
 
         /* Sorted set iterators. */
@@ -1829,9 +2238,9 @@ typedef struct {
                 unsigned char *eptr, *sptr;
             } zl;
             struct {
-                zset *zs;
-                zskiplistNode *node;
-            } sl;
+                zbtreeEntry *e;
+                zbtreeIter it;
+            } bt;
         } zset;
     } iter;
 } zsetopsrc;
@@ -1874,21 +2283,24 @@ void zuiInitIterator(zsetopsrc *op) {
             it->ht.dict = op->subject->ptr;
             it->ht.di = dictGetIterator(op->subject->ptr);
             it->ht.de = dictNext(it->ht.di);
+        } else if (op->encoding == OBJ_ENCODING_LISTPACK) {
+            it->lp.lp = op->subject->ptr;
+            it->lp.p = lpFirst(it->lp.lp);
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             it->zl.zl = op->subject->ptr;
-            it->zl.eptr = ziplistIndex(it->zl.zl,0);
+            it->zl.eptr = lpSeek(it->zl.zl,0);
             if (it->zl.eptr != NULL) {
-                it->zl.sptr = ziplistNext(it->zl.zl,it->zl.eptr);
+                it->zl.sptr = lpNext(it->zl.zl,it->zl.eptr);
                 serverAssert(it->zl.sptr != NULL);
             }
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
-            it->sl.zs = op->subject->ptr;
-            it->sl.node = it->sl.zs->zsl->header->level[0].forward;
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
+            zset *zs = op->subject->ptr;
+            it->bt.e = zbtFirst(zs->zbt,&it->bt.it);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -1907,14 +2319,16 @@ void zuiClearIterator(zsetopsrc *op) {
             UNUSED(it); /* skip */
         } else if (op->encoding == OBJ_ENCODING_HT) {
             dictReleaseIterator(it->ht.di);
+        } else if (op->encoding == OBJ_ENCODING_LISTPACK) {
+            UNUSED(it); /* skip */
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             UNUSED(it); /* skip */
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
             UNUSED(it); /* skip */
         } else {
             serverPanic("Unknown sorted set encoding");
@@ -1934,15 +2348,17 @@ unsigned long zuiLength(zsetopsrc *op) {
         } else if (op->encoding == OBJ_ENCODING_HT) {
             dict *ht = op->subject->ptr;
             return dictSize(ht);
+        } else if (op->encoding == OBJ_ENCODING_LISTPACK) {
+            return lpLength(op->subject->ptr);
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (op->type == OBJ_ZSET) {
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             return zzlLength(op->subject->ptr);
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
             zset *zs = op->subject->ptr;
-            return zs->zsl->length;
+            return zs->zbt->length;
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -1983,28 +2399,36 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
 
             /* Move to next element. */
             it->ht.de = dictNext(it->ht.di);
+        } else if (op->encoding == OBJ_ENCODING_LISTPACK) {
+            if (it->lp.p == NULL)
+                return 0;
+            lpGetValue(it->lp.p,&val->estr,&val->elen,&val->ell);
+            val->score = 1.0;
+
+            /* Move to next element. */
+            it->lp.p = lpNext(it->lp.lp,it->lp.p);
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             /* No need to check both, but better be explicit. */
             if (it->zl.eptr == NULL || it->zl.sptr == NULL)
                 return 0;
-            serverAssert(ziplistGet(it->zl.eptr,&val->estr,&val->elen,&val->ell));
+            serverAssert(lpGetValue(it->zl.eptr,&val->estr,&val->elen,&val->ell));
             val->score = zzlGetScore(it->zl.sptr);
 
             /* Move to next element. */
             zzlNext(it->zl.zl,&it->zl.eptr,&it->zl.sptr);
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
-            if (it->sl.node == NULL)
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
+            if (it->bt.e == NULL)
                 return 0;
-            val->ele = it->sl.node->ele;
-            val->score = it->sl.node->score;
+            val->ele = it->bt.e->ele;
+            val->score = it->bt.e->score;
 
             /* Move to next element. */
-            it->sl.node = it->sl.node->level[0].forward;
+            it->bt.e = zbtNext(&it->bt.it);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -2100,24 +2524,35 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
             } else {
                 return 0;
             }
+        } else if (op->encoding == OBJ_ENCODING_LISTPACK) {
+            unsigned char *lp = op->subject->ptr;
+            zuiSdsFromValue(val);
+            if (lpFind(lp,lpFirst(lp),(unsigned char*)val->ele,
+                       sdslen(val->ele),0) != NULL)
+            {
+                *score = 1.0;
+                return 1;
+            } else {
+                return 0;
+            }
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (op->type == OBJ_ZSET) {
         zuiSdsFromValue(val);
 
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             if (zzlFind(op->subject->ptr,val->ele,score) != NULL) {
                 /* Score is already set by zzlFind. */
                 return 1;
             } else {
                 return 0;
             }
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
             zset *zs = op->subject->ptr;
             dictEntry *de;
             if ((de = dictFind(zs->dict,val->ele)) != NULL) {
-                *score = *(double*)dictGetVal(de);
+                *score = dictGetDoubleVal(de);
                 return 1;
             } else {
                 return 0;
@@ -2160,17 +2595,65 @@ inline static void zunionInterAggregate(double *target, double val, int aggregat
     }
 }
 
-uint64_t dictSdsHash(const void *key);
-int dictSdsKeyCompare(void *privdata, const void *key1, const void *key2);
+static int zsetEntryCompare(const void *p1, const void *p2) {
+    const zbtreeEntry *e1 = p1, *e2 = p2;
+    return zbtCompare(e1->score,e1->ele,e2->score,e2->ele);
+}
+
+/* Create the sorted set resulting from ZUNIONSTORE / ZINTERSTORE, given its
+ * 'count' elements in no particular order, and the length of the longest
+ * one. 'd' is either NULL, or a dictionary of the zset type already mapping
+ * the elements to their scores. The new sorted set takes ownership of the
+ * SDS strings and of 'd', while 'entries' is freed.
+ *
+ * Since all the elements are known in advance, they are sorted once (unless
+ * they happen to be sorted already, for instance when there is a single
+ * input) and then the listpack or the B+tree is built with a single linear
+ * pass, instead of seeking the place of every element. */
+static robj *zsetCreateFromEntries(zbtreeEntry *entries, unsigned long count,
+                                   size_t maxelelen, dict *d)
+{
+    robj *zobj;
+    unsigned long j;
+
+    for (j = 1; j < count; j++) {
+        if (zsetEntryCompare(entries+j-1,entries+j) > 0) {
+            qsort(entries,count,sizeof(zbtreeEntry),zsetEntryCompare);
+            break;
+        }
+    }
+
+    if (count <= server.zset_max_ziplist_entries &&
+        maxelelen <= server.zset_max_ziplist_value)
+    {
+        zobj = createZsetListpackObject();
+        for (j = 0; j < count; j++) {
+            zobj->ptr = zzlInsertAt(zobj->ptr,NULL,entries[j].ele,
+                                    entries[j].score);
+            sdsfree(entries[j].ele);
+        }
+        if (d) dictRelease(d);
+    } else {
+        zset *zs;
 
-dictType setAccumulatorDictType = {
-    dictSdsHash,               /* hash function */
-    NULL,                      /* key dup */
-    NULL,                      /* val dup */
-    dictSdsKeyCompare,         /* key compare */
-    NULL,                      /* key destructor */
-    NULL                       /* val destructor */
-};
+        zobj = createZsetObject();
+        zs = zobj->ptr;
+        if (d) {
+            dictRelease(zs->dict);
+            zs->dict = d;
+        } else {
+            dictExpand(zs->dict,count);
+            for (j = 0; j < count; j++) {
+                dictEntry *de = dictAddRaw(zs->dict,entries[j].ele,NULL);
+                serverAssert(de != NULL);
+                dictSetDoubleVal(de,entries[j].score);
+            }
+        }
+        zbtBulkLoad(zs->zbt,entries,count);
+    }
+    zfree(entries);
+    return zobj;
+}
 
 void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
     int i, j;
@@ -2180,9 +2663,9 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
     zsetopval zval;
     sds tmp;
     size_t maxelelen = 0;
-    robj *dstobj;
-    zset *dstzset;
-    zskiplistNode *znode;
+    robj *dstobj = NULL;
+    zbtreeEntry *entries = NULL;
+    unsigned long count = 0;
     int touched = 0;
 
     /* expect setnum input keys to be given */
@@ -2268,8 +2751,6 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
      * algorithm's performance */
     qsort(src,setnum,sizeof(zsetopsrc),zuiCompareByCardinality);
 
-    dstobj = createZsetObject();
-    dstzset = dstobj->ptr;
     memset(&zval, 0, sizeof(zval));
 
     if (op == SET_OP_INTER) {
@@ -2277,6 +2758,7 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
         if (zuiLength(&src[0]) > 0) {
             /* Precondition: as src[0] is non-empty and the inputs are ordered
              * by size, all src[i > 0] are non-empty too. */
+            entries = zmalloc(sizeof(zbtreeEntry)*zuiLength(&src[0]));
             zuiInitIterator(&src[0]);
             while (zuiNext(&src[0],&zval)) {
                 double score, value;
@@ -2301,15 +2783,22 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
                 /* Only continue when present in every input. */
                 if (j == setnum) {
                     tmp = zuiNewSdsFromValue(&zval);
-                    znode = zslInsert(dstzset->zsl,score,tmp);
-                    dictAdd(dstzset->dict,tmp,&znode->score);
+                    entries[count].ele = tmp;
+                    entries[count].score = score;
+                    count++;
                     if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
                 }
             }
             zuiClearIterator(&src[0]);
+            if (count)
+                dstobj = zsetCreateFromEntries(entries,count,maxelelen,NULL);
+            else
+                zfree(entries);
         }
     } else if (op == SET_OP_UNION) {
-        dict *accumulator = dictCreate(&setAccumulatorDictType,NULL);
+        /* The accumulator has the same type of the dictionary of a sorted
+         * set, so it becomes the dictionary of the result. */
+        dict *accumulator = dictCreate(&zsetDictType,NULL);
         dictIterator *di;
         dictEntry *de, *existing;
         double score;
@@ -2337,7 +2826,7 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
                 if (!existing) {
                     tmp = zuiNewSdsFromValue(&zval);
                     /* Remember the longest single element encountered,
-                     * to understand if it's possible to convert to ziplist
+                     * to understand if it's possible to convert to listpack
                      * at the end. */
                      if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
                     /* Update the element with its initial score. */
@@ -2357,29 +2846,27 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
         }
 
         /* Step 2: convert the dictionary into the final sorted set. */
-        di = dictGetIterator(accumulator);
-
-        /* We now are aware of the final size of the resulting sorted set,
-         * let's resize the dictionary embedded inside the sorted set to the
-         * right size, in order to save rehashing time. */
-        dictExpand(dstzset->dict,dictSize(accumulator));
-
-        while((de = dictNext(di)) != NULL) {
-            sds ele = dictGetKey(de);
-            score = dictGetDoubleVal(de);
-            znode = zslInsert(dstzset->zsl,score,ele);
-            dictAdd(dstzset->dict,ele,&znode->score);
+        if (dictSize(accumulator)) {
+            entries = zmalloc(sizeof(zbtreeEntry)*dictSize(accumulator));
+            di = dictGetIterator(accumulator);
+            while((de = dictNext(di)) != NULL) {
+                entries[count].ele = dictGetKey(de);
+                entries[count].score = dictGetDoubleVal(de);
+                count++;
+            }
+            dictReleaseIterator(di);
+            dstobj = zsetCreateFromEntries(entries,count,maxelelen,
+                                           accumulator);
+        } else {
+            dictRelease(accumulator);
         }
-        dictReleaseIterator(di);
-        dictRelease(accumulator);
     } else {
         serverPanic("Unknown operator");
     }
 
     if (dbDelete(c->db,dstkey))
         touched = 1;
-    if (dstzset->zsl->length) {
-        zsetConvertToZiplistIfNeeded(dstobj,maxelelen);
+    if (dstobj) {
         dbAdd(c->db,dstkey,dstobj);
         addReplyLongLong(c,zsetLength(dstobj));
         signalModifiedKey(c->db,dstkey);
@@ -2388,7 +2875,6 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
             dstkey,c->db->id);
         server.dirty++;
     } else {
-        decrRefCount(dstobj);
         addReply(c,shared.czero);
         if (touched) {
             signalModifiedKey(c->db,dstkey);
@@ -2407,47 +2893,173 @@ void zinterstoreCommand(client *c) {
     zunionInterGenericCommand(c,c->argv[1], SET_OP_INTER);
 }
 
-void zrangeGenericCommand(client *c, int reverse) {
-    robj *key = c->argv[1];
-    robj *zobj;
-    int withscores = 0;
-    long start;
-    long end;
-    long llen;
-    long rangelen;
+/* The elements of a range are either sent to the client, or stored into a
+ * new sorted set by ZRANGESTORE: the functions implementing the different
+ * kinds of range emit them using this handler, in the order of the reply. */
+typedef struct {
+    client *c;          /* Client that called the command. */
+    robj *dstkey;       /* Key to store the range into, or NULL to reply. */
+    robj *dstobj;       /* Sorted set being populated for 'dstkey'. */
+    int reverse;        /* True if elements are emitted in descending order. */
+    int withscores;     /* Reply with the scores as well. */
+    void *replylen;     /* Deferred reply length if the length is unknown. */
+} zrangeResultHandler;
+
+void zrangeResultInit(zrangeResultHandler *h, client *c, robj *dstkey,
+                      int reverse, int withscores)
+{
+    h->c = c;
+    h->dstkey = dstkey;
+    h->dstobj = NULL;
+    h->reverse = reverse;
+    h->withscores = withscores;
+    h->replylen = NULL;
+}
+
+/* Start emitting a range of 'length' elements, or of unknown length if
+ * 'length' is -1. */
+void zrangeResultBegin(zrangeResultHandler *h, long length) {
+    if (h->dstkey) {
+        /* Elements are emitted in order, so the destination is bulk loaded
+         * always appending them at the same end: when the length is known
+         * to be too big for a listpack we can start with a tree ASAP. */
+        if (length > (long)server.zset_max_ziplist_entries)
+            h->dstobj = createZsetObject();
+        else
+            h->dstobj = createZsetListpackObject();
+    } else if (length >= 0) {
+        addReplyMultiBulkLen(h->c,h->withscores ? length*2 : length);
+    } else {
+        h->replylen = addDeferredMultiBulkLength(h->c);
+    }
+}
 
-    if ((getLongFromObjectOrReply(c, c->argv[2], &start, NULL) != C_OK) ||
-        (getLongFromObjectOrReply(c, c->argv[3], &end, NULL) != C_OK)) return;
+/* Add 'ele' at the end of the range stored so far. The destination takes
+ * the ownership of the SDS string. */
+static void zrangeResultStore(zrangeResultHandler *h, sds ele, double score) {
+    robj *zobj = h->dstobj;
 
-    if (c->argc == 5 && !strcasecmp(c->argv[4]->ptr,"withscores")) {
-        withscores = 1;
-    } else if (c->argc >= 5) {
-        addReply(c,shared.syntaxerr);
-        return;
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK &&
+        (zzlLength(zobj->ptr)+1 > server.zset_max_ziplist_entries ||
+         sdslen(ele) > server.zset_max_ziplist_value))
+    {
+        zsetConvert(zobj,OBJ_ENCODING_BTREE);
     }
 
-    if ((zobj = lookupKeyReadOrReply(c,key,shared.emptymultibulk)) == NULL
-         || checkType(c,zobj,OBJ_ZSET)) return;
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *zl = zobj->ptr;
 
-    /* Sanitize indexes. */
-    llen = zsetLength(zobj);
-    if (start < 0) start = llen+start;
-    if (end < 0) end = llen+end;
+        /* A descending range is built prepending every element. */
+        zobj->ptr = zzlInsertAt(zl,h->reverse ? lpSeek(zl,0) : NULL,
+                                ele,score);
+        sdsfree(ele);
+    } else {
+        zsetAddNew(zobj->ptr,score,ele);
+    }
+}
+
+void zrangeResultEmitCBuffer(zrangeResultHandler *h, const void *p,
+                             size_t len, double score)
+{
+    if (h->dstkey) {
+        zrangeResultStore(h,sdsnewlen(p,len),score);
+    } else {
+        addReplyBulkCBuffer(h->c,p,len);
+        if (h->withscores) addReplyDouble(h->c,score);
+    }
+}
+
+void zrangeResultEmitLongLong(zrangeResultHandler *h, long long value,
+                              double score)
+{
+    if (h->dstkey) {
+        zrangeResultStore(h,sdsfromlonglong(value),score);
+    } else {
+        addReplyBulkLongLong(h->c,value);
+        if (h->withscores) addReplyDouble(h->c,score);
+    }
+}
+
+/* Terminate a range of 'count' elements: for ZRANGESTORE this is where the
+ * destination key is finally written (or deleted if the range is empty). */
+void zrangeResultEnd(zrangeResultHandler *h, unsigned long count) {
+    client *c = h->c;
+
+    if (h->dstkey) {
+        if (count) {
+            setKey(c->db,h->dstkey,h->dstobj);
+            notifyKeyspaceEvent(NOTIFY_ZSET,"zrangestore",h->dstkey,
+                c->db->id);
+            server.dirty++;
+        } else if (dbDelete(c->db,h->dstkey)) {
+            signalModifiedKey(c->db,h->dstkey);
+            notifyKeyspaceEvent(NOTIFY_GENERIC,"del",h->dstkey,c->db->id);
+            server.dirty++;
+        }
+        decrRefCount(h->dstobj);
+        addReplyLongLong(c,count);
+    } else if (h->replylen) {
+        setDeferredMultiBulkLength(c,h->replylen,
+            h->withscores ? count*2 : count);
+    }
+}
+
+/* Emit an empty range. */
+void zrangeResultEmpty(zrangeResultHandler *h) {
+    zrangeResultBegin(h,0);
+    zrangeResultEnd(h,0);
+}
+
+/* Lookup the source sorted set of a range. Returns NULL if the range was
+ * already terminated, because the key is missing or of the wrong type. */
+robj *zrangeLookupSource(zrangeResultHandler *h, robj *key) {
+    robj *zobj;
+
+    /* Like the other STORE commands, ZRANGESTORE looks up the source for
+     * writing, since it is executed as a write command. */
+    if (h->dstkey)
+        zobj = lookupKeyWrite(h->c->db,key);
+    else
+        zobj = lookupKeyRead(h->c->db,key);
+    if (zobj == NULL) {
+        zrangeResultEmpty(h);
+        return NULL;
+    }
+    if (checkType(h->c,zobj,OBJ_ZSET)) return NULL;
+    return zobj;
+}
+
+/* Emit the elements of the sorted set at 'key' with rank between 'start'
+ * and 'end' (both inclusive, negative values count from the end), in
+ * descending order if 'reverse' is true. */
+void genericZrangebyrank(zrangeResultHandler *h, robj *key, long start,
+                         long end, int reverse)
+{
+    client *c = h->c;
+    robj *zobj;
+    long llen;
+    long rangelen;
+
+    if ((zobj = zrangeLookupSource(h,key)) == NULL) return;
+
+    /* Sanitize indexes. */
+    llen = zsetLength(zobj);
+    if (start < 0) start = llen+start;
+    if (end < 0) end = llen+end;
     if (start < 0) start = 0;
 
     /* Invariant: start >= 0, so this test will be true when end < 0.
      * The range is empty when start > end or start >= length. */
     if (start > end || start >= llen) {
-        addReply(c,shared.emptymultibulk);
+        zrangeResultEmpty(h);
         return;
     }
     if (end >= llen) end = llen-1;
     rangelen = (end-start)+1;
 
-    /* Return the result in form of a multi-bulk reply */
-    addReplyMultiBulkLen(c, withscores ? (rangelen*2) : rangelen);
+    zrangeResultBegin(h,rangelen);
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2455,23 +3067,20 @@ void zrangeGenericCommand(client *c, int reverse) {
         long long vlong;
 
         if (reverse)
-            eptr = ziplistIndex(zl,-2-(2*start));
+            eptr = lpSeek(zl,-2-(2*start));
         else
-            eptr = ziplistIndex(zl,2*start);
+            eptr = lpSeek(zl,2*start);
 
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         while (rangelen--) {
             serverAssertWithInfo(c,zobj,eptr != NULL && sptr != NULL);
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            serverAssertWithInfo(c,zobj,lpGetValue(eptr,&vstr,&vlen,&vlong));
             if (vstr == NULL)
-                addReplyBulkLongLong(c,vlong);
+                zrangeResultEmitLongLong(h,vlong,zzlGetScore(sptr));
             else
-                addReplyBulkCBuffer(c,vstr,vlen);
-
-            if (withscores)
-                addReplyDouble(c,zzlGetScore(sptr));
+                zrangeResultEmitCBuffer(h,vstr,vlen,zzlGetScore(sptr));
 
             if (reverse)
                 zzlPrev(zl,&eptr,&sptr);
@@ -2479,34 +3088,55 @@ void zrangeGenericCommand(client *c, int reverse) {
                 zzlNext(zl,&eptr,&sptr);
         }
 
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
-        sds ele;
+        zbtree *zbt = zs->zbt;
+        zbtreeEntry *e;
+        zbtreeIter it;
 
         /* Check if starting point is trivial, before doing log(N) lookup. */
         if (reverse) {
-            ln = zsl->tail;
             if (start > 0)
-                ln = zslGetElementByRank(zsl,llen-start);
+                e = zbtGetElementByRank(zbt,llen-start,&it);
+            else
+                e = zbtLast(zbt,&it);
         } else {
-            ln = zsl->header->level[0].forward;
             if (start > 0)
-                ln = zslGetElementByRank(zsl,start+1);
+                e = zbtGetElementByRank(zbt,start+1,&it);
+            else
+                e = zbtFirst(zbt,&it);
         }
 
         while(rangelen--) {
-            serverAssertWithInfo(c,zobj,ln != NULL);
-            ele = ln->ele;
-            addReplyBulkCBuffer(c,ele,sdslen(ele));
-            if (withscores)
-                addReplyDouble(c,ln->score);
-            ln = reverse ? ln->backward : ln->level[0].forward;
+            serverAssertWithInfo(c,zobj,e != NULL);
+            zrangeResultEmitCBuffer(h,e->ele,sdslen(e->ele),e->score);
+            e = reverse ? zbtPrev(&it) : zbtNext(&it);
         }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
+
+    zrangeResultEnd(h,(end-start)+1);
+}
+
+void zrangeGenericCommand(client *c, int reverse) {
+    zrangeResultHandler h;
+    int withscores = 0;
+    long start;
+    long end;
+
+    if ((getLongFromObjectOrReply(c, c->argv[2], &start, NULL) != C_OK) ||
+        (getLongFromObjectOrReply(c, c->argv[3], &end, NULL) != C_OK)) return;
+
+    if (c->argc == 5 && !strcasecmp(c->argv[4]->ptr,"withscores")) {
+        withscores = 1;
+    } else if (c->argc >= 5) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+
+    zrangeResultInit(&h,c,NULL,reverse,withscores);
+    genericZrangebyrank(&h,c->argv[1],start,end,reverse);
 }
 
 void zrangeCommand(client *c) {
@@ -2517,62 +3147,20 @@ void zrevrangeCommand(client *c) {
     zrangeGenericCommand(c,1);
 }
 
-/* This command implements ZRANGEBYSCORE, ZREVRANGEBYSCORE. */
-void genericZrangebyscoreCommand(client *c, int reverse) {
-    zrangespec range;
-    robj *key = c->argv[1];
+/* Emit the elements of the sorted set at 'key' with score in 'range',
+ * in descending order if 'reverse' is true, skipping the first 'offset'
+ * ones and emitting at most 'limit' of them (no limit if negative). */
+void genericZrangebyscore(zrangeResultHandler *h, robj *key,
+                          zrangespec *range, long offset, long limit,
+                          int reverse)
+{
+    client *c = h->c;
     robj *zobj;
-    long offset = 0, limit = -1;
-    int withscores = 0;
     unsigned long rangelen = 0;
-    void *replylen = NULL;
-    int minidx, maxidx;
 
-    /* Parse the range arguments. */
-    if (reverse) {
-        /* Range is given as [max,min] */
-        maxidx = 2; minidx = 3;
-    } else {
-        /* Range is given as [min,max] */
-        minidx = 2; maxidx = 3;
-    }
+    if ((zobj = zrangeLookupSource(h,key)) == NULL) return;
 
-    if (zslParseRange(c->argv[minidx],c->argv[maxidx],&range) != C_OK) {
-        addReplyError(c,"min or max is not a float");
-        return;
-    }
-
-    /* Parse optional extra arguments. Note that ZCOUNT will exactly have
-     * 4 arguments, so we'll never enter the following code path. */
-    if (c->argc > 4) {
-        int remaining = c->argc - 4;
-        int pos = 4;
-
-        while (remaining) {
-            if (remaining >= 1 && !strcasecmp(c->argv[pos]->ptr,"withscores")) {
-                pos++; remaining--;
-                withscores = 1;
-            } else if (remaining >= 3 && !strcasecmp(c->argv[pos]->ptr,"limit")) {
-                if ((getLongFromObjectOrReply(c, c->argv[pos+1], &offset, NULL)
-                        != C_OK) ||
-                    (getLongFromObjectOrReply(c, c->argv[pos+2], &limit, NULL)
-                        != C_OK))
-                {
-                    return;
-                }
-                pos += 3; remaining -= 3;
-            } else {
-                addReply(c,shared.syntaxerr);
-                return;
-            }
-        }
-    }
-
-    /* Ok, lookup the key and get the range */
-    if ((zobj = lookupKeyReadOrReply(c,key,shared.emptymultibulk)) == NULL ||
-        checkType(c,zobj,OBJ_ZSET)) return;
-
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2582,25 +3170,24 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
 
         /* If reversed, get the last node in range as starting point. */
         if (reverse) {
-            eptr = zzlLastInRange(zl,&range);
+            eptr = zzlLastInRange(zl,range);
         } else {
-            eptr = zzlFirstInRange(zl,&range);
+            eptr = zzlFirstInRange(zl,range);
         }
 
         /* No "first" element in the specified interval. */
         if (eptr == NULL) {
-            addReply(c, shared.emptymultibulk);
+            zrangeResultEmpty(h);
             return;
         }
 
         /* Get score pointer for the first element. */
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         /* We don't know in advance how many matching elements there are in the
-         * list, so we push this object that will represent the multi-bulk
-         * length in the output buffer, and will "fix" it later */
-        replylen = addDeferredMultiBulkLength(c);
+         * list, so the length of the result will be "fixed" at the end. */
+        zrangeResultBegin(h,-1);
 
         /* If there is an offset, just traverse the number of elements without
          * checking the score because that is done in the next loop. */
@@ -2617,23 +3204,19 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
 
             /* Abort when the node is no longer in range. */
             if (reverse) {
-                if (!zslValueGteMin(score,&range)) break;
+                if (!zslValueGteMin(score,range)) break;
             } else {
-                if (!zslValueLteMax(score,&range)) break;
+                if (!zslValueLteMax(score,range)) break;
             }
 
-            /* We know the element exists, so ziplistGet should always succeed */
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            /* We know the element exists, so lpGetValue should always succeed */
+            serverAssertWithInfo(c,zobj,lpGetValue(eptr,&vstr,&vlen,&vlong));
 
             rangelen++;
             if (vstr == NULL) {
-                addReplyBulkLongLong(c,vlong);
+                zrangeResultEmitLongLong(h,vlong,score);
             } else {
-                addReplyBulkCBuffer(c,vstr,vlen);
-            }
-
-            if (withscores) {
-                addReplyDouble(c,score);
+                zrangeResultEmitCBuffer(h,vstr,vlen,score);
             }
 
             /* Move to next node */
@@ -2643,70 +3226,116 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
                 zzlNext(zl,&eptr,&sptr);
             }
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zbtree *zbt = zs->zbt;
+        zbtreeEntry *e;
+        zbtreeIter it;
 
-        /* If reversed, get the last node in range as starting point. */
+        /* If reversed, get the last element in range as starting point. */
         if (reverse) {
-            ln = zslLastInRange(zsl,&range);
+            e = zbtLastInRange(zbt,range,&it);
         } else {
-            ln = zslFirstInRange(zsl,&range);
+            e = zbtFirstInRange(zbt,range,&it);
         }
 
         /* No "first" element in the specified interval. */
-        if (ln == NULL) {
-            addReply(c, shared.emptymultibulk);
+        if (e == NULL) {
+            zrangeResultEmpty(h);
             return;
         }
 
         /* We don't know in advance how many matching elements there are in the
-         * list, so we push this object that will represent the multi-bulk
-         * length in the output buffer, and will "fix" it later */
-        replylen = addDeferredMultiBulkLength(c);
+         * list, so the length of the result will be "fixed" at the end. */
+        zrangeResultBegin(h,-1);
 
-        /* If there is an offset, just traverse the number of elements without
-         * checking the score because that is done in the next loop. */
-        while (ln && offset--) {
-            if (reverse) {
-                ln = ln->backward;
-            } else {
-                ln = ln->level[0].forward;
-            }
+        /* If there is an offset, seek the element by rank without checking
+         * the score because that is done in the next loop. */
+        if (offset > 0) {
+            unsigned long rank = zbtGetRank(zbt,e->score,e->ele);
+
+            if (reverse)
+                rank = (unsigned long)offset < rank ? rank-offset : 0;
+            else
+                rank += offset;
+            e = zbtGetElementByRank(zbt,rank,&it);
         }
 
-        while (ln && limit--) {
-            /* Abort when the node is no longer in range. */
+        while (e && limit--) {
+            /* Abort when the element is no longer in range. */
             if (reverse) {
-                if (!zslValueGteMin(ln->score,&range)) break;
+                if (!zslValueGteMin(e->score,range)) break;
             } else {
-                if (!zslValueLteMax(ln->score,&range)) break;
+                if (!zslValueLteMax(e->score,range)) break;
             }
 
             rangelen++;
-            addReplyBulkCBuffer(c,ln->ele,sdslen(ln->ele));
-
-            if (withscores) {
-                addReplyDouble(c,ln->score);
-            }
+            zrangeResultEmitCBuffer(h,e->ele,sdslen(e->ele),e->score);
 
-            /* Move to next node */
+            /* Move to next element */
             if (reverse) {
-                ln = ln->backward;
+                e = zbtPrev(&it);
             } else {
-                ln = ln->level[0].forward;
+                e = zbtNext(&it);
             }
         }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
 
-    if (withscores) {
-        rangelen *= 2;
+    zrangeResultEnd(h,rangelen);
+}
+
+/* This command implements ZRANGEBYSCORE, ZREVRANGEBYSCORE. */
+void genericZrangebyscoreCommand(client *c, int reverse) {
+    zrangeResultHandler h;
+    zrangespec range;
+    long offset = 0, limit = -1;
+    int withscores = 0;
+    int minidx, maxidx;
+
+    /* Parse the range arguments. */
+    if (reverse) {
+        /* Range is given as [max,min] */
+        maxidx = 2; minidx = 3;
+    } else {
+        /* Range is given as [min,max] */
+        minidx = 2; maxidx = 3;
+    }
+
+    if (zslParseRange(c->argv[minidx],c->argv[maxidx],&range) != C_OK) {
+        addReplyError(c,"min or max is not a float");
+        return;
+    }
+
+    /* Parse optional extra arguments. Note that ZCOUNT will exactly have
+     * 4 arguments, so we'll never enter the following code path. */
+    if (c->argc > 4) {
+        int remaining = c->argc - 4;
+        int pos = 4;
+
+        while (remaining) {
+            if (remaining >= 1 && !strcasecmp(c->argv[pos]->ptr,"withscores")) {
+                pos++; remaining--;
+                withscores = 1;
+            } else if (remaining >= 3 && !strcasecmp(c->argv[pos]->ptr,"limit")) {
+                if ((getLongFromObjectOrReply(c, c->argv[pos+1], &offset, NULL)
+                        != C_OK) ||
+                    (getLongFromObjectOrReply(c, c->argv[pos+2], &limit, NULL)
+                        != C_OK))
+                {
+                    return;
+                }
+                pos += 3; remaining -= 3;
+            } else {
+                addReply(c,shared.syntaxerr);
+                return;
+            }
+        }
     }
 
-    setDeferredMultiBulkLength(c, replylen, rangelen);
+    zrangeResultInit(&h,c,NULL,reverse,withscores);
+    genericZrangebyscore(&h,c->argv[1],&range,offset,limit,reverse);
 }
 
 void zrangebyscoreCommand(client *c) {
@@ -2733,7 +3362,7 @@ void zcountCommand(client *c) {
     if ((zobj = lookupKeyReadOrReply(c, key, shared.czero)) == NULL ||
         checkType(c, zobj, OBJ_ZSET)) return;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         double score;
@@ -2748,7 +3377,7 @@ void zcountCommand(client *c) {
         }
 
         /* First element is in range */
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         score = zzlGetScore(sptr);
         serverAssertWithInfo(c,zobj,zslValueLteMax(score,&range));
 
@@ -2764,29 +3393,12 @@ void zcountCommand(client *c) {
                 zzlNext(zl,&eptr,&sptr);
             }
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *zn;
-        unsigned long rank;
 
-        /* Find first element in range */
-        zn = zslFirstInRange(zsl, &range);
-
-        /* Use rank of first element, if any, to determine preliminary count */
-        if (zn != NULL) {
-            rank = zslGetRank(zsl, zn->score, zn->ele);
-            count = (zsl->length - (rank - 1));
-
-            /* Find last element in range */
-            zn = zslLastInRange(zsl, &range);
-
-            /* Use rank of last element, if any, to determine the actual count */
-            if (zn != NULL) {
-                rank = zslGetRank(zsl, zn->score, zn->ele);
-                count -= (zsl->length - rank);
-            }
-        }
+        /* The count is the difference between the ranks of the elements
+         * bounding the range, that we get seeking the tree twice. */
+        count = zbtCountInRange(zs->zbt,&range);
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -2814,7 +3426,7 @@ void zlexcountCommand(client *c) {
         return;
     }
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
 
@@ -2829,7 +3441,7 @@ void zlexcountCommand(client *c) {
         }
 
         /* First element is in range */
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssertWithInfo(c,zobj,zzlLexValueLteMax(eptr,&range));
 
         /* Iterate over elements in range */
@@ -2842,29 +3454,12 @@ void zlexcountCommand(client *c) {
                 zzlNext(zl,&eptr,&sptr);
             }
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *zn;
-        unsigned long rank;
 
-        /* Find first element in range */
-        zn = zslFirstInLexRange(zsl, &range);
-
-        /* Use rank of first element, if any, to determine preliminary count */
-        if (zn != NULL) {
-            rank = zslGetRank(zsl, zn->score, zn->ele);
-            count = (zsl->length - (rank - 1));
-
-            /* Find last element in range */
-            zn = zslLastInLexRange(zsl, &range);
-
-            /* Use rank of last element, if any, to determine the actual count */
-            if (zn != NULL) {
-                rank = zslGetRank(zsl, zn->score, zn->ele);
-                count -= (zsl->length - rank);
-            }
-        }
+        /* The count is the difference between the ranks of the elements
+         * bounding the range, that we get seeking the tree twice. */
+        count = zbtCountInLexRange(zs->zbt,&range);
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -2874,60 +3469,19 @@ void zlexcountCommand(client *c) {
 }
 
 /* This command implements ZRANGEBYLEX, ZREVRANGEBYLEX. */
-void genericZrangebylexCommand(client *c, int reverse) {
-    zlexrangespec range;
-    robj *key = c->argv[1];
+/* Emit the elements of the sorted set at 'key' in the lexicographical
+ * 'range', with the same semantics of genericZrangebyscore(). */
+void genericZrangebylex(zrangeResultHandler *h, robj *key,
+                        zlexrangespec *range, long offset, long limit,
+                        int reverse)
+{
+    client *c = h->c;
     robj *zobj;
-    long offset = 0, limit = -1;
     unsigned long rangelen = 0;
-    void *replylen = NULL;
-    int minidx, maxidx;
-
-    /* Parse the range arguments. */
-    if (reverse) {
-        /* Range is given as [max,min] */
-        maxidx = 2; minidx = 3;
-    } else {
-        /* Range is given as [min,max] */
-        minidx = 2; maxidx = 3;
-    }
 
-    if (zslParseLexRange(c->argv[minidx],c->argv[maxidx],&range) != C_OK) {
-        addReplyError(c,"min or max not valid string range item");
-        return;
-    }
-
-    /* Parse optional extra arguments. Note that ZCOUNT will exactly have
-     * 4 arguments, so we'll never enter the following code path. */
-    if (c->argc > 4) {
-        int remaining = c->argc - 4;
-        int pos = 4;
+    if ((zobj = zrangeLookupSource(h,key)) == NULL) return;
 
-        while (remaining) {
-            if (remaining >= 3 && !strcasecmp(c->argv[pos]->ptr,"limit")) {
-                if ((getLongFromObjectOrReply(c, c->argv[pos+1], &offset, NULL) != C_OK) ||
-                    (getLongFromObjectOrReply(c, c->argv[pos+2], &limit, NULL) != C_OK)) {
-                    zslFreeLexRange(&range);
-                    return;
-                }
-                pos += 3; remaining -= 3;
-            } else {
-                zslFreeLexRange(&range);
-                addReply(c,shared.syntaxerr);
-                return;
-            }
-        }
-    }
-
-    /* Ok, lookup the key and get the range */
-    if ((zobj = lookupKeyReadOrReply(c,key,shared.emptymultibulk)) == NULL ||
-        checkType(c,zobj,OBJ_ZSET))
-    {
-        zslFreeLexRange(&range);
-        return;
-    }
-
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2936,26 +3490,24 @@ void genericZrangebylexCommand(client *c, int reverse) {
 
         /* If reversed, get the last node in range as starting point. */
         if (reverse) {
-            eptr = zzlLastInLexRange(zl,&range);
+            eptr = zzlLastInLexRange(zl,range);
         } else {
-            eptr = zzlFirstInLexRange(zl,&range);
+            eptr = zzlFirstInLexRange(zl,range);
         }
 
         /* No "first" element in the specified interval. */
         if (eptr == NULL) {
-            addReply(c, shared.emptymultibulk);
-            zslFreeLexRange(&range);
+            zrangeResultEmpty(h);
             return;
         }
 
         /* Get score pointer for the first element. */
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         /* We don't know in advance how many matching elements there are in the
-         * list, so we push this object that will represent the multi-bulk
-         * length in the output buffer, and will "fix" it later */
-        replylen = addDeferredMultiBulkLength(c);
+         * list, so the length of the result will be "fixed" at the end. */
+        zrangeResultBegin(h,-1);
 
         /* If there is an offset, just traverse the number of elements without
          * checking the score because that is done in the next loop. */
@@ -2970,20 +3522,20 @@ void genericZrangebylexCommand(client *c, int reverse) {
         while (eptr && limit--) {
             /* Abort when the node is no longer in range. */
             if (reverse) {
-                if (!zzlLexValueGteMin(eptr,&range)) break;
+                if (!zzlLexValueGteMin(eptr,range)) break;
             } else {
-                if (!zzlLexValueLteMax(eptr,&range)) break;
+                if (!zzlLexValueLteMax(eptr,range)) break;
             }
 
-            /* We know the element exists, so ziplistGet should always
+            /* We know the element exists, so lpGetValue should always
              * succeed. */
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            serverAssertWithInfo(c,zobj,lpGetValue(eptr,&vstr,&vlen,&vlong));
 
             rangelen++;
             if (vstr == NULL) {
-                addReplyBulkLongLong(c,vlong);
+                zrangeResultEmitLongLong(h,vlong,zzlGetScore(sptr));
             } else {
-                addReplyBulkCBuffer(c,vstr,vlen);
+                zrangeResultEmitCBuffer(h,vstr,vlen,zzlGetScore(sptr));
             }
 
             /* Move to next node */
@@ -2993,64 +3545,111 @@ void genericZrangebylexCommand(client *c, int reverse) {
                 zzlNext(zl,&eptr,&sptr);
             }
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zbtree *zbt = zs->zbt;
+        zbtreeEntry *e;
+        zbtreeIter it;
 
-        /* If reversed, get the last node in range as starting point. */
+        /* If reversed, get the last element in range as starting point. */
         if (reverse) {
-            ln = zslLastInLexRange(zsl,&range);
+            e = zbtLastInLexRange(zbt,range,&it);
         } else {
-            ln = zslFirstInLexRange(zsl,&range);
+            e = zbtFirstInLexRange(zbt,range,&it);
         }
 
         /* No "first" element in the specified interval. */
-        if (ln == NULL) {
-            addReply(c, shared.emptymultibulk);
-            zslFreeLexRange(&range);
+        if (e == NULL) {
+            zrangeResultEmpty(h);
             return;
         }
 
         /* We don't know in advance how many matching elements there are in the
-         * list, so we push this object that will represent the multi-bulk
-         * length in the output buffer, and will "fix" it later */
-        replylen = addDeferredMultiBulkLength(c);
+         * list, so the length of the result will be "fixed" at the end. */
+        zrangeResultBegin(h,-1);
 
-        /* If there is an offset, just traverse the number of elements without
-         * checking the score because that is done in the next loop. */
-        while (ln && offset--) {
-            if (reverse) {
-                ln = ln->backward;
-            } else {
-                ln = ln->level[0].forward;
-            }
+        /* If there is an offset, seek the element by rank without checking
+         * the range because that is done in the next loop. */
+        if (offset > 0) {
+            unsigned long rank = zbtGetRank(zbt,e->score,e->ele);
+
+            if (reverse)
+                rank = (unsigned long)offset < rank ? rank-offset : 0;
+            else
+                rank += offset;
+            e = zbtGetElementByRank(zbt,rank,&it);
         }
 
-        while (ln && limit--) {
-            /* Abort when the node is no longer in range. */
+        while (e && limit--) {
+            /* Abort when the element is no longer in range. */
             if (reverse) {
-                if (!zslLexValueGteMin(ln->ele,&range)) break;
+                if (!zslLexValueGteMin(e->ele,range)) break;
             } else {
-                if (!zslLexValueLteMax(ln->ele,&range)) break;
+                if (!zslLexValueLteMax(e->ele,range)) break;
             }
 
             rangelen++;
-            addReplyBulkCBuffer(c,ln->ele,sdslen(ln->ele));
+            zrangeResultEmitCBuffer(h,e->ele,sdslen(e->ele),e->score);
 
-            /* Move to next node */
+            /* Move to next element */
             if (reverse) {
-                ln = ln->backward;
+                e = zbtPrev(&it);
             } else {
-                ln = ln->level[0].forward;
+                e = zbtNext(&it);
             }
         }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
 
+    zrangeResultEnd(h,rangelen);
+}
+
+void genericZrangebylexCommand(client *c, int reverse) {
+    zrangeResultHandler h;
+    zlexrangespec range;
+    long offset = 0, limit = -1;
+    int minidx, maxidx;
+
+    /* Parse the range arguments. */
+    if (reverse) {
+        /* Range is given as [max,min] */
+        maxidx = 2; minidx = 3;
+    } else {
+        /* Range is given as [min,max] */
+        minidx = 2; maxidx = 3;
+    }
+
+    if (zslParseLexRange(c->argv[minidx],c->argv[maxidx],&range) != C_OK) {
+        addReplyError(c,"min or max not valid string range item");
+        return;
+    }
+
+    /* Parse optional extra arguments. Note that ZCOUNT will exactly have
+     * 4 arguments, so we'll never enter the following code path. */
+    if (c->argc > 4) {
+        int remaining = c->argc - 4;
+        int pos = 4;
+
+        while (remaining) {
+            if (remaining >= 3 && !strcasecmp(c->argv[pos]->ptr,"limit")) {
+                if ((getLongFromObjectOrReply(c, c->argv[pos+1], &offset, NULL) != C_OK) ||
+                    (getLongFromObjectOrReply(c, c->argv[pos+2], &limit, NULL) != C_OK)) {
+                    zslFreeLexRange(&range);
+                    return;
+                }
+                pos += 3; remaining -= 3;
+            } else {
+                zslFreeLexRange(&range);
+                addReply(c,shared.syntaxerr);
+                return;
+            }
+        }
+    }
+
+    zrangeResultInit(&h,c,NULL,reverse,0);
+    genericZrangebylex(&h,c->argv[1],&range,offset,limit,reverse);
     zslFreeLexRange(&range);
-    setDeferredMultiBulkLength(c, replylen, rangelen);
 }
 
 void zrangebylexCommand(client *c) {
@@ -3061,6 +3660,80 @@ void zrevrangebylexCommand(client *c) {
     genericZrangebylexCommand(c,1);
 }
 
+/* ZRANGESTORE dst src min max [BYSCORE|BYLEX] [REV] [LIMIT offset count]
+ *
+ * Store the specified range of 'src' into 'dst', without the round trip of
+ * fetching the range and sending it back with ZADD. The range is by rank
+ * unless BYSCORE or BYLEX is given, and with REV 'min' and 'max' are in the
+ * same order of the respective ZREV... command. */
+void zrangestoreCommand(client *c) {
+    zrangeResultHandler h;
+    int rangetype = ZRANGE_RANK, reverse = 0, haslimit = 0, j;
+    long offset = 0, limit = -1;
+    int minidx = 3, maxidx = 4;
+
+    for (j = 5; j < c->argc; j++) {
+        char *opt = c->argv[j]->ptr;
+        int leftargs = c->argc-j-1;
+
+        if (!strcasecmp(opt,"byscore")) {
+            rangetype = ZRANGE_SCORE;
+        } else if (!strcasecmp(opt,"bylex")) {
+            rangetype = ZRANGE_LEX;
+        } else if (!strcasecmp(opt,"rev")) {
+            reverse = 1;
+        } else if (!strcasecmp(opt,"limit") && leftargs >= 2) {
+            if ((getLongFromObjectOrReply(c,c->argv[j+1],&offset,NULL)
+                    != C_OK) ||
+                (getLongFromObjectOrReply(c,c->argv[j+2],&limit,NULL)
+                    != C_OK)) return;
+            haslimit = 1;
+            j += 2;
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    }
+    if (haslimit && rangetype == ZRANGE_RANK) {
+        addReplyError(c,"syntax error, LIMIT is only supported in "
+                        "combination with either BYSCORE or BYLEX");
+        return;
+    }
+    /* Score and lex ranges are given as [max,min] when reversed. */
+    if (reverse) {
+        minidx = 4; maxidx = 3;
+    }
+
+    zrangeResultInit(&h,c,c->argv[1],reverse,0);
+    if (rangetype == ZRANGE_RANK) {
+        long start, end;
+
+        if ((getLongFromObjectOrReply(c,c->argv[3],&start,NULL) != C_OK) ||
+            (getLongFromObjectOrReply(c,c->argv[4],&end,NULL) != C_OK))
+            return;
+        genericZrangebyrank(&h,c->argv[2],start,end,reverse);
+    } else if (rangetype == ZRANGE_SCORE) {
+        zrangespec range;
+
+        if (zslParseRange(c->argv[minidx],c->argv[maxidx],&range) != C_OK) {
+            addReplyError(c,"min or max is not a float");
+            return;
+        }
+        genericZrangebyscore(&h,c->argv[2],&range,offset,limit,reverse);
+    } else {
+        zlexrangespec range;
+
+        if (zslParseLexRange(c->argv[minidx],c->argv[maxidx],&range)
+            != C_OK)
+        {
+            addReplyError(c,"min or max not valid string range item");
+            return;
+        }
+        genericZrangebylex(&h,c->argv[2],&range,offset,limit,reverse);
+        zslFreeLexRange(&range);
+    }
+}
+
 void zcardCommand(client *c) {
     robj *key = c->argv[1];
     robj *zobj;
@@ -3173,7 +3846,7 @@ void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey
 
     /* Remove the element. */
     do {
-        if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
             unsigned char *zl = zobj->ptr;
             unsigned char *eptr, *sptr;
             unsigned char *vstr;
@@ -3181,31 +3854,31 @@ void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey
             long long vlong;
 
             /* Get the first or last element in the sorted set. */
-            eptr = ziplistIndex(zl,where == ZSET_MAX ? -2 : 0);
+            eptr = lpSeek(zl,where == ZSET_MAX ? -2 : 0);
             serverAssertWithInfo(c,zobj,eptr != NULL);
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            serverAssertWithInfo(c,zobj,lpGetValue(eptr,&vstr,&vlen,&vlong));
             if (vstr == NULL)
                 ele = sdsfromlonglong(vlong);
             else
                 ele = sdsnewlen(vstr,vlen);
 
             /* Get the score. */
-            sptr = ziplistNext(zl,eptr);
+            sptr = lpNext(zl,eptr);
             serverAssertWithInfo(c,zobj,sptr != NULL);
             score = zzlGetScore(sptr);
-        } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
             zset *zs = zobj->ptr;
-            zskiplist *zsl = zs->zsl;
-            zskiplistNode *zln;
+            zbtreeEntry *e;
+            zbtreeIter it;
 
             /* Get the first or last element in the sorted set. */
-            zln = (where == ZSET_MAX ? zsl->tail :
-                                       zsl->header->level[0].forward);
+            e = (where == ZSET_MAX ? zbtLast(zs->zbt,&it) :
+                                     zbtFirst(zs->zbt,&it));
 
             /* There must be an element in the sorted set. */
-            serverAssertWithInfo(c,zobj,zln != NULL);
-            ele = sdsdup(zln->ele);
-            score = zln->score;
+            serverAssertWithInfo(c,zobj,e != NULL);
+            ele = sdsdup(e->ele);
+            score = e->score;
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -63,10 +63,19 @@ void zlibc_free(void *ptr) {
 #define realloc(ptr,size) tc_realloc(ptr,size)
 #define free(ptr) tc_free(ptr)
 #elif defined(USE_JEMALLOC)
-#define malloc(size) je_malloc(size)
-#define calloc(count,size) je_calloc(count,size)
-#define realloc(ptr,size) je_realloc(ptr,size)
-#define free(ptr) je_free(ptr)
+/* When the calling thread selected an arena other than the default one with
+ * zmalloc_set_arena(), zmalloc_arena_flags holds the mallocx() flags to use,
+ * otherwise it is zero and the plain jemalloc calls are used. */
+static __thread int zmalloc_arena_flags = 0;
+#define malloc(size) (zmalloc_arena_flags ? \
+    je_mallocx(size,zmalloc_arena_flags) : je_malloc(size))
+#define calloc(count,size) (zmalloc_arena_flags ? \
+    je_mallocx((count)*(size),zmalloc_arena_flags|MALLOCX_ZERO) : \
+    je_calloc(count,size))
+#define realloc(ptr,size) (zmalloc_arena_flags ? \
+    je_rallocx(ptr,size,zmalloc_arena_flags) : je_realloc(ptr,size))
+#define free(ptr) (zmalloc_arena_flags ? \
+    je_dallocx(ptr,zmalloc_arena_flags) : je_free(ptr))
 #define mallocx(size,flags) je_mallocx(size,flags)
 #define dallocx(ptr,flags) je_dallocx(ptr,flags)
 #endif
@@ -125,6 +134,22 @@ void zfree_no_tcache(void *ptr) {
     update_zmalloc_stat_free(zmalloc_size(ptr));
     dallocx(ptr, MALLOCX_TCACHE_NONE);
 }
+
+/* Return the index of the automatic arena jemalloc assigned to the calling
+ * thread, or -1 on error. */
+int zmalloc_get_thread_arena(void) {
+    unsigned idx;
+    size_t sz = sizeof(idx);
+    if (je_mallctl("thread.arena", &idx, &sz, NULL, 0) != 0) return -1;
+    return idx;
+}
+
+/* Make the calling thread allocate from the specified arena, as returned by
+ * zmalloc_get_thread_arena() in another thread. Returns 0 on success. */
+int zmalloc_set_thread_arena(int arena) {
+    unsigned idx = arena;
+    return je_mallctl("thread.arena", NULL, NULL, &idx, sizeof(idx)) ? -1 : 0;
+}
 #endif
 
 void *zcalloc(size_t size) {
@@ -324,6 +349,107 @@ int zmalloc_get_allocator_info(size_t *allocated,
     return 1;
 }
 
+/* Return the jemalloc index of the specified zmalloc arena, creating the
+ * arena the first time it is requested. ZMALLOC_ARENA_DATA is the set of
+ * automatic arenas jemalloc assigns to threads, so it has no index. */
+static unsigned zmalloc_arena_index[ZMALLOC_ARENA_NUM];
+
+static unsigned zmalloc_get_arena_index(int arena) {
+    if (zmalloc_arena_index[arena] == 0) {
+        unsigned idx;
+        size_t sz = sizeof(idx);
+        if (je_mallctl("arenas.create", &idx, &sz, NULL, 0) != 0) return 0;
+        zmalloc_arena_index[arena] = idx;
+    }
+    return zmalloc_arena_index[arena];
+}
+
+/* The allocations of the non default arenas can't use the automatic thread
+ * cache, otherwise freed buffers would be recycled for allocations of the
+ * data arena. Every thread uses instead an explicit thread cache of its
+ * own, created with "tcache.create" the first time it selects such an
+ * arena and destroyed when the thread exits, so that buffers are recycled
+ * without taking the arena lock at every allocation. If the thread cache
+ * can't be created the thread cache is just bypassed. */
+#define ZMALLOC_TCACHE_UNSET -1
+#define ZMALLOC_TCACHE_FAILED -2
+static __thread int zmalloc_tcache = ZMALLOC_TCACHE_UNSET;
+static pthread_key_t zmalloc_tcache_key;
+static pthread_once_t zmalloc_tcache_key_once = PTHREAD_ONCE_INIT;
+
+static void zmalloc_tcache_destroy(void *ptr) {
+    unsigned tc = (unsigned)((uintptr_t)ptr-1);
+    je_mallctl("tcache.destroy", NULL, NULL, &tc, sizeof(tc));
+}
+
+static void zmalloc_tcache_key_create(void) {
+    pthread_key_create(&zmalloc_tcache_key,zmalloc_tcache_destroy);
+}
+
+static int zmalloc_get_tcache_flags(void) {
+    if (zmalloc_tcache == ZMALLOC_TCACHE_UNSET) {
+        unsigned tc;
+        size_t sz = sizeof(tc);
+
+        pthread_once(&zmalloc_tcache_key_once,zmalloc_tcache_key_create);
+        if (je_mallctl("tcache.create", &tc, &sz, NULL, 0) == 0) {
+            zmalloc_tcache = tc;
+            /* The value is offset by one since NULL means no destructor. */
+            pthread_setspecific(zmalloc_tcache_key,(void*)((uintptr_t)tc+1));
+        } else {
+            zmalloc_tcache = ZMALLOC_TCACHE_FAILED;
+        }
+    }
+    return zmalloc_tcache >= 0 ? MALLOCX_TCACHE(zmalloc_tcache) :
+                                 MALLOCX_TCACHE_NONE;
+}
+
+/* Route the allocations performed by the calling thread to the specified
+ * arena, until the previous arena, which is returned, is restored with
+ * another call. Allocations of a given arena never share pages with the
+ * ones of other arenas, so short lived buffers (query buffers, reply
+ * blocks, the replication backlog) can't fragment the pages holding the
+ * dataset. Frees of such buffers must be performed with their arena
+ * selected as well, so that they go to the right thread cache. */
+static __thread int zmalloc_arena = ZMALLOC_ARENA_DATA;
+
+int zmalloc_set_arena(int arena) {
+    int old = zmalloc_arena;
+    unsigned idx = 0;
+
+    if (arena != ZMALLOC_ARENA_DATA) idx = zmalloc_get_arena_index(arena);
+    zmalloc_arena = idx ? arena : ZMALLOC_ARENA_DATA;
+    zmalloc_arena_flags =
+        idx ? (MALLOCX_ARENA(idx)|zmalloc_get_tcache_flags()) : 0;
+    return old;
+}
+
+/* Like zmalloc_get_allocator_info() but only for the specified arena, that
+ * must be different than ZMALLOC_ARENA_DATA. The statistics are the ones
+ * cached by the last "epoch" refresh, so this should be called just after
+ * zmalloc_get_allocator_info(). Returns 0 if the arena was never used. */
+int zmalloc_get_arena_info(int arena, size_t *allocated, size_t *active,
+                           size_t *resident) {
+    char name[64];
+    size_t sz = sizeof(size_t), small = 0, large = 0, pactive = 0, page = 0;
+    unsigned idx = zmalloc_arena_index[arena];
+
+    *allocated = *active = *resident = 0;
+    if (arena == ZMALLOC_ARENA_DATA || idx == 0) return 0;
+    snprintf(name,sizeof(name),"stats.arenas.%u.small.allocated",idx);
+    je_mallctl(name, &small, &sz, NULL, 0);
+    snprintf(name,sizeof(name),"stats.arenas.%u.large.allocated",idx);
+    je_mallctl(name, &large, &sz, NULL, 0);
+    snprintf(name,sizeof(name),"stats.arenas.%u.pactive",idx);
+    je_mallctl(name, &pactive, &sz, NULL, 0);
+    snprintf(name,sizeof(name),"stats.arenas.%u.resident",idx);
+    je_mallctl(name, resident, &sz, NULL, 0);
+    je_mallctl("arenas.page", &page, &sz, NULL, 0);
+    *allocated = small+large;
+    *active = pactive*page;
+    return 1;
+}
+
 void set_jemalloc_bg_thread(int enable) {
     /* let jemalloc do purging asynchronously, required when there's no traffic 
      * after flushdb */
@@ -337,6 +463,18 @@ int zmalloc_get_allocator_info(size_t *allocated,
     *allocated = *resident = *active = 0;
     return 1;
 }
+
+int zmalloc_set_arena(int arena) {
+    (void)arena;
+    return ZMALLOC_ARENA_DATA;
+}
+
+int zmalloc_get_arena_info(int arena, size_t *allocated, size_t *active,
+                           size_t *resident) {
+    (void)arena;
+    *allocated = *active = *resident = 0;
+    return 0;
+}
 #endif
 
 /* Get the sum of the specified field (converted form kb to bytes) in
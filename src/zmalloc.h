@@ -77,6 +77,11 @@
 #define HAVE_DEFRAG
 #endif
 
+/* Arenas that zmalloc_set_arena() can route the allocations to. */
+#define ZMALLOC_ARENA_DATA 0    /* Default arenas: the dataset and the rest. */
+#define ZMALLOC_ARENA_BUFFERS 1 /* Client and replication I/O buffers. */
+#define ZMALLOC_ARENA_NUM 2
+
 void *zmalloc(size_t size);
 void *zcalloc(size_t size);
 void *zrealloc(void *ptr, size_t size);
@@ -86,6 +91,8 @@ size_t zmalloc_used_memory(void);
 void zmalloc_set_oom_handler(void (*oom_handler)(size_t));
 size_t zmalloc_get_rss(void);
 int zmalloc_get_allocator_info(size_t *allocated, size_t *active, size_t *resident);
+int zmalloc_set_arena(int arena);
+int zmalloc_get_arena_info(int arena, size_t *allocated, size_t *active, size_t *resident);
 size_t zmalloc_get_private_dirty(long pid);
 size_t zmalloc_get_smap_bytes_by_field(char *field, long pid);
 size_t zmalloc_get_memory_size(void);
@@ -94,6 +101,8 @@ void zlibc_free(void *ptr);
 #ifdef HAVE_DEFRAG
 void zfree_no_tcache(void *ptr);
 void *zmalloc_no_tcache(size_t size);
+int zmalloc_get_thread_arena(void);
+int zmalloc_set_thread_arena(int arena);
 #endif
 
 #ifndef HAVE_MALLOC_SIZE
@@ -0,0 +1,99 @@
+# Check that compact cluster bus messages are used and interoperate
+# with nodes sending the full format.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 5 nodes cluster" {
+    create_cluster 5 5
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+test "Cluster is writable" {
+    cluster_write_test 0
+}
+
+test "Nodes exchange compact messages" {
+    foreach_redis_id id {
+        wait_for_condition 1000 50 {
+            [CI $id cluster_stats_messages_compact_received] > 0 &&
+            [CI $id cluster_stats_messages_compact_sent] > 0
+        } else {
+            fail "Instance $id is not using compact messages"
+        }
+    }
+}
+
+test "Disabling compact messages on a node is honored by peers" {
+    R 0 CONFIG SET cluster-compact-bus no
+    # Wait for all the peers to see the new flags, then make sure no
+    # compact message is received anymore.
+    after 3000
+    set before [CI 0 cluster_stats_messages_compact_received]
+    set sent [CI 0 cluster_stats_messages_compact_sent]
+    after 3000
+    assert {[CI 0 cluster_stats_messages_compact_received] == $before}
+    assert {[CI 0 cluster_stats_messages_compact_sent] == $sent}
+    assert {[CI 0 cluster_stats_messages_received] > 0}
+}
+
+test "Cluster is still up with mixed message formats" {
+    assert_cluster_state ok
+    cluster_write_test 0
+}
+
+test "Killing one master node" {
+    kill_instance redis 1
+}
+
+test "Failover works with mixed message formats" {
+    wait_for_condition 1000 50 {
+        [RI 6 role] eq {master}
+    } else {
+        fail "Instance #6 was not promoted"
+    }
+    assert_cluster_state ok
+}
+
+test "Restarting the previously killed master node" {
+    restart_instance redis 1
+}
+
+test "Instance #1 gets converted into a slave" {
+    wait_for_condition 1000 50 {
+        [RI 1 role] eq {slave}
+    } else {
+        fail "Old master was not converted into slave"
+    }
+}
+
+test "Compact messages can be enabled again" {
+    R 0 CONFIG SET cluster-compact-bus yes
+    set before [CI 0 cluster_stats_messages_compact_received]
+    wait_for_condition 1000 50 {
+        [CI 0 cluster_stats_messages_compact_received] > $before
+    } else {
+        fail "Instance #0 is not receiving compact messages"
+    }
+}
+
+test "A node joining again learns the cluster quickly with compact messages" {
+    set ids {}
+    foreach_redis_id id {lappend ids $id}
+    assert {[RI 9 role] eq {slave}}
+    R 9 cluster reset soft
+    assert {[llength [get_cluster_nodes 9]] == 1}
+    R 9 cluster meet 127.0.0.1 [get_instance_attrib redis 0 port]
+
+    # Node 9 only met node 0, so it can only learn about the others from
+    # the gossip sections it receives. Addresses must not be elided in
+    # the messages sent to a node that just joined.
+    wait_for_condition 100 50 {
+        [llength [get_cluster_nodes 9]] == [llength $ids] &&
+        [string match {*handshake*} [R 9 cluster nodes]] == 0
+    } else {
+        fail "Node 9 did not discover the whole cluster"
+    }
+}
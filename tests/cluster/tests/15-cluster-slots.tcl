@@ -0,0 +1,134 @@
+# Check that the cached CLUSTER SLOTS reply follows configuration changes.
+
+source "../tests/includes/init-tests.tcl"
+
+# Return the slots served by every master, according to CLUSTER SLOTS
+# of the specified instance, as a sorted list of "start-end id" items.
+proc slots_by_master_from_slots id {
+    set res {}
+    foreach range [R $id cluster slots] {
+        lassign $range start end master
+        lappend res "$start-$end [lindex $master 2]"
+    }
+    lsort $res
+}
+
+# The same as above, according to CLUSTER NODES.
+proc slots_by_master_from_nodes id {
+    set res {}
+    foreach n [get_cluster_nodes $id] {
+        if {![has_flag $n master]} continue
+        foreach s [dict get $n slots] {
+            if {[string index $s 0] eq {[}} continue
+            if {[string first - $s] == -1} {set s "$s-$s"}
+            lappend res "$s [dict get $n id]"
+        }
+    }
+    lsort $res
+}
+
+proc assert_slots_consistent {} {
+    foreach_redis_id id {
+        if {[instance_is_killed redis $id]} continue
+        assert_equal [slots_by_master_from_slots $id] \
+                     [slots_by_master_from_nodes $id]
+    }
+}
+
+test "Create a 5 nodes cluster" {
+    create_cluster 5 5
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+test "CLUSTER SLOTS matches CLUSTER NODES" {
+    assert_slots_consistent
+}
+
+test "CLUSTER SLOTS is the same when called again" {
+    assert_equal [R 0 cluster slots] [R 0 cluster slots]
+}
+
+test "CLUSTER SLOTS lists the replicas of each range" {
+    foreach range [R 0 cluster slots] {
+        assert {[llength $range] == 4}
+    }
+}
+
+# Return the IP listed by CLUSTER SLOTS of the specified instance for the
+# ranges it serves as a master.
+proc myself_ip_from_slots id {
+    set myid [dict get [get_myself $id] id]
+    foreach range [R $id cluster slots] {
+        set master [lindex $range 2]
+        if {[lindex $master 2] eq $myid} {return [lindex $master 0]}
+    }
+    return {}
+}
+
+test "Changing cluster-announce-ip updates CLUSTER SLOTS" {
+    assert_equal 127.0.0.1 [myself_ip_from_slots 0]
+    R 0 config set cluster-announce-ip 127.0.0.2
+    wait_for_condition 1000 50 {
+        [myself_ip_from_slots 0] eq {127.0.0.2}
+    } else {
+        fail "CLUSTER SLOTS still lists the old address"
+    }
+    R 0 config set cluster-announce-ip 127.0.0.1
+    wait_for_condition 1000 50 {
+        [myself_ip_from_slots 0] eq {127.0.0.1}
+    } else {
+        fail "CLUSTER SLOTS still lists the old address"
+    }
+}
+
+test "Moving a slot updates CLUSTER SLOTS" {
+    set target [dict get [get_myself 1] id]
+    foreach_redis_id id {
+        if {$id > 4} continue
+        R $id cluster setslot 0 node $target
+    }
+    foreach range [R 0 cluster slots] {
+        lassign $range start end master
+        if {$start <= 0 && $end >= 0} {
+            assert_equal $target [lindex $master 2]
+        }
+    }
+    assert_slots_consistent
+}
+
+test "Killing one master node" {
+    kill_instance redis 2
+}
+
+test "Failover is reflected by CLUSTER SLOTS" {
+    wait_for_condition 1000 50 {
+        [RI 7 role] eq {master}
+    } else {
+        fail "Instance #7 was not promoted"
+    }
+    assert_cluster_state ok
+    set new [dict get [get_myself 7] id]
+    wait_for_condition 1000 50 {
+        [string first $new [slots_by_master_from_slots 0]] != -1
+    } else {
+        fail "Promoted replica not listed as master in CLUSTER SLOTS"
+    }
+    assert_slots_consistent
+}
+
+test "Restarting the previously killed master node" {
+    restart_instance redis 2
+}
+
+test "The old master is listed again as a replica" {
+    set id2 [dict get [get_myself 2] id]
+    wait_for_condition 1000 50 {
+        [string first $id2 [R 0 cluster slots]] != -1
+    } else {
+        fail "Old master not listed again in CLUSTER SLOTS"
+    }
+    assert_slots_consistent
+}
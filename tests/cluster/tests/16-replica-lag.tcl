@@ -0,0 +1,111 @@
+# Check READONLY with replication lag limits.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 5 nodes cluster" {
+    create_cluster 5 5
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+test "Instance #5 is a slave" {
+    assert {[RI 5 role] eq {slave}}
+}
+
+set port0 [get_instance_attrib redis 0 port]
+
+# Set a key served by the specified instance and return its name.
+proc set_key_of_instance {id} {
+    for {set j 0} {1} {incr j} {
+        if {![catch {R $id set "key:$j" foo}]} {return "key:$j"}
+    }
+}
+
+test "Write a key on instance #0 and wait for the replica" {
+    set key [set_key_of_instance 0]
+    R 0 wait 1 5000
+    wait_for_condition 1000 50 {
+        [RI 5 slave_read_lag_offset] == 0
+    } else {
+        fail "Replica #5 lag is not zero"
+    }
+}
+
+test "READONLY validates the lag limits" {
+    catch {R 5 readonly maxlag -1} e
+    assert_match {*positive*} $e
+    catch {R 5 readonly maxlag} e
+    assert_match {*syntax*} $e
+    catch {R 5 readonly foo 10} e
+    assert_match {*syntax*} $e
+}
+
+test "Replica serves reads within the lag limits" {
+    R 5 readonly maxlag 10000 maxoffsetlag 1000
+    assert_equal foo [R 5 get $key]
+    R 5 readwrite
+}
+
+test "Replica redirects when it is lagging behind" {
+    R 5 debug replication-pause 1
+    R 0 set $key bar
+    wait_for_condition 1000 50 {
+        [RI 5 slave_read_lag_offset] > 0 &&
+        [RI 5 slave_read_lag_ms] > 500
+    } else {
+        fail "Replica #5 is not lagging"
+    }
+
+    # Bounded READONLY clients are redirected...
+    R 5 readonly maxlag 500
+    catch {R 5 get $key} e
+    assert_match "MOVED * 127.0.0.1:$port0" $e
+    R 5 readonly maxoffsetlag 1
+    catch {R 5 get $key} e
+    assert_match "MOVED * 127.0.0.1:$port0" $e
+
+    # ...while a plain READONLY client gets the stale value.
+    R 5 readonly
+    assert_equal foo [R 5 get $key]
+
+    # Once the replica catches up the bounded client is served again.
+    R 5 debug replication-pause 0
+    wait_for_condition 1000 50 {
+        [RI 5 slave_read_lag_offset] == 0
+    } else {
+        fail "Replica #5 lag is not zero"
+    }
+    R 5 readonly maxlag 10000 maxoffsetlag 1000
+    assert_equal bar [R 5 get $key]
+    R 5 readwrite
+}
+
+test "Replica redirects when the master link is down" {
+    kill_instance redis 0
+    wait_for_condition 1000 10 {
+        [RI 5 master_link_status] eq {down}
+    } else {
+        fail "Replica #5 link with master is still up"
+    }
+    assert_equal -1 [RI 5 slave_read_lag_ms]
+
+    # A bounded READONLY client is redirected...
+    R 5 readonly maxlag 10000
+    catch {R 5 get $key} e
+    assert_match "MOVED * 127.0.0.1:$port0" $e
+
+    # ...while a plain READONLY client is still served.
+    R 5 readonly
+    assert_equal bar [R 5 get $key]
+    R 5 readwrite
+}
+
+test "Restarting the killed master node" {
+    restart_instance redis 0
+}
+
+test "Cluster is up again" {
+    assert_cluster_state ok
+}
@@ -77,6 +77,24 @@ start_server {tags {"dump"}} {
         r get foo
     } {bar2}
 
+    test {RESTORE can append elements to an existing key with APPEND} {
+        r del foo
+        r rpush foo a b c
+        set encoded [r dump foo]
+        r rpush foo d
+        r restore foo 0 $encoded append
+        r lrange foo 0 -1
+    } {a b c d a b c}
+
+    test {RESTORE APPEND refuses values of a different type} {
+        r del foo bar
+        r rpush foo a b c
+        r sadd bar a b c
+        set encoded [r dump bar]
+        catch {r restore foo 0 $encoded append} e
+        set e
+    } {WRONGTYPE*}
+
     test {RESTORE can detect a syntax error for unrecongized options} {
         catch {r restore foo 0 "..." invalid-option} e
         set e
@@ -232,6 +250,24 @@ start_server {tags {"dump"}} {
         }
     }
 
+    test {MIGRATE retains the TTL of hash fields} {
+        set first [srv 0 client]
+        r del key
+        r hmset key field1 "item 1" field2 "item 2"
+        r hexpire key 100 FIELDS 1 field2
+        start_server {tags {"repl"}} {
+            set second [srv 0 client]
+            set second_host [srv 0 host]
+            set second_port [srv 0 port]
+
+            set ret [r -1 migrate $second_host $second_port key 9 10000]
+            assert {$ret eq {OK}}
+            set ttls [$second httl key FIELDS 2 field1 field2]
+            assert {[lindex $ttls 0] == -1}
+            assert {[lindex $ttls 1] >= 97 && [lindex $ttls 1] <= 100}
+        }
+    }
+
     test {MIGRATE timeout actually works} {
         set first [srv 0 client]
         r set key "Some Value"
@@ -365,4 +401,171 @@ start_server {tags {"dump"}} {
             assert_match {*invalid password*} $err
         }
     }
+
+    test {MIGRATE ASYNC is able to migrate a key between two instances} {
+        set first [srv 0 client]
+        r set key "Some Value"
+        start_server {tags {"repl"}} {
+            set second [srv 0 client]
+            set second_host [srv 0 host]
+            set second_port [srv 0 port]
+
+            assert {[$first exists key] == 1}
+            assert {[$second exists key] == 0}
+            set ret [r -1 migrate $second_host $second_port key 9 5000 async]
+            assert {$ret eq {OK}}
+            assert {[$first exists key] == 0}
+            assert {[$second exists key] == 1}
+            assert {[$second get key] eq {Some Value}}
+            assert {[$second ttl key] == -1}
+            assert_match {*migrate_async_in_progress:0*} [$first info stats]
+        }
+    }
+
+    test {MIGRATE ASYNC can migrate multiple keys at once} {
+        set first [srv 0 client]
+        r flushdb
+        r mset a 1 b 2 c 3 d 4 e 5 f 6 g 7 h 8
+        start_server {tags {"repl"}} {
+            set second [srv 0 client]
+            set second_host [srv 0 host]
+            set second_port [srv 0 port]
+
+            $second mset c _ d _; # Two busy keys and no REPLACE used
+            catch {r -1 migrate $second_host $second_port "" 9 5000 async keys a b c d e f g h missing} e
+            assert_match {*BUSYKEY*} $e
+            assert {[$first dbsize] == 2}
+            assert {[$second dbsize] == 8}
+            assert {[$second get c] eq {_}}
+
+            set ret [r -1 migrate $second_host $second_port "" 9 5000 async replace keys c d]
+            assert {$ret eq {OK}}
+            assert {[$first dbsize] == 0}
+            assert {[$second mget a c d h] eq {1 3 4 8}}
+        }
+    }
+
+    foreach type {list set zset hash} {
+        test "MIGRATE ASYNC transfers a big $type in chunks" {
+            set first [srv 0 client]
+            r del key
+            set elements {}
+            for {set j 0} {$j < 5000} {incr j} {
+                switch $type {
+                    list {lappend elements "item $j"}
+                    set {lappend elements "member:$j"}
+                    zset {lappend elements $j "member:$j"}
+                    hash {lappend elements "field:$j" "value $j"}
+                }
+            }
+            switch $type {
+                list {r rpush key {*}$elements}
+                set {r sadd key {*}$elements}
+                zset {r zadd key {*}$elements}
+                hash {r hmset key {*}$elements}
+            }
+            r expire key 100
+            if {$type eq {hash}} {
+                r hexpire key 200 FIELDS 2 field:1 field:4999
+            }
+            set digest [r debug digest-value key]
+            start_server {tags {"repl"}} {
+                set second [srv 0 client]
+                set second_host [srv 0 host]
+                set second_port [srv 0 port]
+
+                set ret [r -1 migrate $second_host $second_port key 9 5000 async]
+                assert {$ret eq {OK}}
+                assert {[$first exists key] == 0}
+                assert {[$second exists key] == 1}
+                assert {[$second debug digest-value key] eq $digest}
+                assert {[$second ttl key] >= 97 && [$second ttl key] <= 100}
+                if {$type eq {hash}} {
+                    set ttls [$second httl key FIELDS 3 field:1 field:2 field:4999]
+                    assert {[lindex $ttls 0] >= 197 && [lindex $ttls 0] <= 200}
+                    assert {[lindex $ttls 1] == -1}
+                    assert {[lindex $ttls 2] >= 197 && [lindex $ttls 2] <= 200}
+                }
+            }
+        }
+    }
+
+    test {MIGRATE ASYNC does not append chunks to an existing key without REPLACE} {
+        set first [srv 0 client]
+        r del key
+        set elements {}
+        for {set j 0} {$j < 5000} {incr j} {lappend elements $j}
+        r rpush key {*}$elements
+        start_server {tags {"repl"}} {
+            set second [srv 0 client]
+            set second_host [srv 0 host]
+            set second_port [srv 0 port]
+
+            $second rpush key a b c
+            catch {r -1 migrate $second_host $second_port key 9 5000 async} e
+            assert_match {*BUSYKEY*} $e
+            assert {[$second lrange key 0 -1] eq {a b c}}
+            assert {[$first llen key] == 5000}
+
+            set ret [r -1 migrate $second_host $second_port key 9 5000 async copy replace]
+            assert {$ret eq {OK}}
+            assert {[$first llen key] == 5000}
+            assert {[$first lrange key 0 -1] eq [$second lrange key 0 -1]}
+        }
+    }
+
+    test {MIGRATE ASYNC does not block the server} {
+        set first [srv 0 client]
+        r del key
+        start_server {tags {"repl"}} {
+            set second [srv 0 client]
+            set second_host [srv 0 host]
+            set second_port [srv 0 port]
+            set rd [redis_deferring_client -1]
+
+            # The target is paused, so the transfer can't complete, but
+            # the source keeps serving other clients.
+            r -1 set key "Some Value"
+            $second client pause 1000
+            $rd migrate $second_host $second_port key 9 5000 async
+            wait_for_condition 50 100 {
+                [string match {*migrate_async_in_progress:1*} [r -1 info stats]]
+            } else {
+                fail "MIGRATE ASYNC not in progress"
+            }
+            assert {[r -1 get key] eq {Some Value}}
+            assert {[$rd read] eq {OK}}
+            assert {[$first exists key] == 0}
+            assert {[$second get key] eq {Some Value}}
+            $rd close
+        }
+    }
+
+    test {MIGRATE ASYNC is aborted if the key expires during the transfer} {
+        set first [srv 0 client]
+        r del key
+        start_server {tags {"repl"}} {
+            set second [srv 0 client]
+            set second_host [srv 0 host]
+            set second_port [srv 0 port]
+            set rd [redis_deferring_client -1]
+
+            r -1 set key "Some Value" px 500
+            $second client pause 2000
+            $rd migrate $second_host $second_port key 9 5000 async
+            wait_for_condition 50 100 {
+                [string match {*migrate_async_in_progress:1*} [r -1 info stats]]
+            } else {
+                fail "MIGRATE ASYNC not in progress"
+            }
+            wait_for_condition 50 100 {
+                [r -1 exists key] == 0
+            } else {
+                fail "Key not expired"
+            }
+            catch {$rd read} e
+            assert_match {*modified or deleted*} $e
+            $rd close
+        }
+    }
 }
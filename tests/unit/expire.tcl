@@ -219,4 +219,39 @@ start_server {tags {"expire"}} {
         set ttl [r ttl foo]
         assert {$ttl <= 98 && $ttl > 90}
     }
+
+    test {Active expire reclaims short TTLs among many long TTLs} {
+        r flushdb
+        r debug set-active-expire 1
+        for {set j 0} {$j < 1000} {incr j} {
+            r set long:$j x EX 100000
+        }
+        for {set j 0} {$j < 100} {incr j} {
+            r psetex short:$j 100 x
+        }
+        # Overwriting the TTL of a key should move it inside the index.
+        r set moved x EX 100000
+        r pexpire moved 100
+        r set kept x PX 100
+        r persist kept
+        wait_for_condition 50 100 {
+            [r dbsize] == 1001
+        } else {
+            fail "Short TTL keys were not actively expired"
+        }
+        list [r exists kept] [r exists moved] [r exists long:0]
+    } {1 0 1}
+
+    test {Active expire works after FLUSHALL ASYNC and SWAPDB} {
+        r flushall async
+        r select 10
+        r psetex foo 100 bar
+        r swapdb 9 10
+        r select 9
+        wait_for_condition 50 100 {
+            [r dbsize] == 0
+        } else {
+            fail "Key was not actively expired after SWAPDB"
+        }
+    }
 }
@@ -37,3 +37,73 @@ start_server {tags {"lazyfree"}} {
         }
     }
 }
+
+start_server {tags {"lazyfree"} overrides {lazyfree-threads 4}} {
+    test "Multiple lazyfree threads reclaim many objects in background" {
+        assert {[lindex [r config get lazyfree-threads] 1] == 4}
+        set orig_mem [s used_memory]
+        set args {}
+        for {set i 0} {$i < 1000} {incr i} {
+            lappend args $i
+        }
+        for {set j 0} {$j < 200} {incr j} {
+            r sadd set:$j {*}$args
+        }
+        set peak_mem [s used_memory]
+        assert {$peak_mem > $orig_mem+1000000}
+        assert {[r unlink {*}[r keys set:*]] == 200}
+        wait_for_condition 50 100 {
+            [s lazyfree_pending_objects] == 0 &&
+            [s lazyfree_pending_memory] == 0 &&
+            [s used_memory] < $orig_mem*2
+        } else {
+            fail "Memory is not reclaimed by the lazyfree threads"
+        }
+    }
+}
+
+start_server {tags {"lazyfree"}} {
+    test "Overwritten big values are released in background by default" {
+        r config resetstat
+        for {set i 0} {$i < 1000} {incr i} {
+            r zadd myzset $i member:$i
+        }
+        r set foo bar
+        r set myzset foo
+        r set foo baz ;# small values are released synchronously
+        wait_for_condition 50 100 {
+            [s lazyfreed_objects] == 1
+        } else {
+            fail "The old value was not released by the lazyfree thread"
+        }
+        assert_equal foo [r get myzset]
+    }
+
+    test "Values replaced by STORE commands are released in background" {
+        r config resetstat
+        for {set i 0} {$i < 1000} {incr i} {r sadd dst $i}
+        r sadd src a b c
+        r sunionstore dst src
+        for {set i 0} {$i < 1000} {incr i} {r hset bighash f$i v$i}
+        r rename src bighash
+        wait_for_condition 50 100 {
+            [s lazyfreed_objects] == 2
+        } else {
+            fail "The replaced values were not released by the lazyfree thread"
+        }
+        assert_equal {a b c} [lsort [r smembers bighash]]
+    }
+
+    test "Big keys are expired in background by default" {
+        r config resetstat
+        for {set i 0} {$i < 1000} {incr i} {r hset myhash f$i v$i}
+        r pexpire myhash 1
+        after 10
+        assert_equal 0 [r exists myhash]
+        wait_for_condition 50 100 {
+            [s lazyfreed_objects] == 1
+        } else {
+            fail "The expired value was not released by the lazyfree thread"
+        }
+    }
+}
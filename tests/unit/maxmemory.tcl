@@ -55,6 +55,110 @@ start_server {tags {"maxmemory"}} {
         }
     }
 
+    test "maxmemory - eviction is proportional to the DBs size" {
+        r flushall
+        r config set maxmemory 0
+        r config set maxmemory-eviction-pool-size 64
+        assert_equal {maxmemory-eviction-pool-size 64} \
+            [r config get maxmemory-eviction-pool-size]
+        # Use LFU so that all the keys have the same score: with LRU the
+        # keys of the small DB, created first, may be the oldest ones when
+        # the test is slow.
+        r config set maxmemory-policy allkeys-lfu
+        r select 10
+        for {set j 0} {$j < 200} {incr j} {
+            r set small:$j [string repeat x 100]
+        }
+        r select 9
+        for {set j 0} {$j < 4000} {incr j} {
+            r set big:$j [string repeat x 100]
+        }
+        # Force the eviction of about one fourth of the keys.
+        set limit [expr {[s used_memory]-150*1024}]
+        r config set maxmemory $limit
+        r set trigger x
+        assert {[s evicted_keys] > 500}
+        r select 10
+        set small [r dbsize]
+        r select 9
+        # Sampling the same number of keys from every DB, the small DB
+        # would lose most of its keys.
+        assert {$small > 100}
+        r config set maxmemory 0
+        r config set maxmemory-eviction-pool-size 16
+        r config set maxmemory-policy noeviction
+    }
+
+    test "maxmemory - allkeys-tinylfu protects hot keys from a scan" {
+        r flushall
+        r config set maxmemory 0
+        r config set maxmemory-policy allkeys-tinylfu
+        r config resetstat
+        set used [s used_memory]
+        set limit [expr {$used+200*1024}]
+        for {set j 0} {$j < 50} {incr j} {
+            r set hot:$j [string repeat x 100]
+        }
+        for {set k 0} {$k < 10} {incr k} {
+            for {set j 0} {$j < 50} {incr j} {
+                r get hot:$j
+            }
+        }
+        r config set maxmemory $limit
+        # Backfill many keys written just once, much more than what fits.
+        for {set j 0} {$j < 10000} {incr j} {
+            r set scan:$j [string repeat x 100]
+        }
+        assert {[s used_memory] < $limit+4096}
+        assert {[s evicted_keys] > 0}
+        assert {[s tinylfu_rejected_keys] > 0}
+        set alive 0
+        for {set j 0} {$j < 50} {incr j} {
+            if {[r exists hot:$j]} {incr alive}
+        }
+        assert {$alive >= 45}
+
+        # A key requested before being written is admitted.
+        r get wanted
+        r get wanted
+        set rejected [s tinylfu_rejected_keys]
+        r set wanted [string repeat x 100]
+        assert_equal $rejected [s tinylfu_rejected_keys]
+        assert {[r object freq wanted] > 0}
+        r config set maxmemory 0
+        r config set maxmemory-policy noeviction
+    }
+
+    foreach policy {
+        allkeys-random allkeys-lru allkeys-lfu volatile-lru volatile-ttl
+    } {
+        test "maxmemory - keys are evicted in background over the low watermark (policy $policy)" {
+            r flushall
+            r config set maxmemory 0
+            r config resetstat
+            for {set j 0} {$j < 5000} {incr j} {
+                r setex key:$j 10000 [string repeat x 64]
+            }
+            # Stay under maxmemory, but over the low watermark: no command
+            # is going to trigger the eviction, only the cron.
+            set limit [expr {[s used_memory]+100*1024}]
+            set target [expr {$limit/100*50}]
+            r config set maxmemory-policy $policy
+            r config set maxmemory $limit
+            r config set maxmemory-low-watermark 50
+            wait_for_condition 100 50 {
+                [s eviction_lag_ms] == 0 && [s eviction_lag_bytes] == 0
+            } else {
+                fail "Memory not brought under the low watermark"
+            }
+            assert {[s used_memory] < $limit}
+            assert {[s evicted_keys_proactive] > 0}
+            assert {[s evicted_keys_proactive] == [s evicted_keys]}
+            r config set maxmemory-low-watermark 0
+            r config set maxmemory 0
+        }
+    }
+
     foreach policy {
         allkeys-random allkeys-lru volatile-lru volatile-random volatile-ttl
     } {
@@ -143,6 +247,180 @@ start_server {tags {"maxmemory"}} {
     }
 }
 
+proc db_used_memory {db} {
+    if {![regexp {used_memory=([0-9]+)} [s db$db] - used]} {return 0}
+    set used
+}
+
+start_server {tags {"maxmemory"}} {
+    test "db-maxmemory can be set and read back" {
+        r config set db-maxmemory "9 10mb 10 0"
+        assert_equal {db-maxmemory {9 10485760}} [r config get db-maxmemory]
+        catch {r config set db-maxmemory "9"} e
+        assert_match {*Invalid argument*} $e
+        catch {r config set db-maxmemory "100000 1mb"} e
+        assert_match {*Invalid argument*} $e
+    }
+
+    test "db-maxmemory accounting follows the keys of the DB" {
+        r flushall
+        r set foo bar
+        r rpush mylist a b c
+        for {set j 0} {$j < 1000} {incr j} {
+            r rpush mylist [string repeat x 50]
+        }
+        r hset myhash f v
+        r del foo
+        r lpop mylist
+        r rename myhash myhash2
+        set expected [expr {[r memory usage mylist]+[r memory usage myhash2]}]
+        assert_equal $expected [db_used_memory 9]
+        r del mylist
+        assert_equal [r memory usage myhash2] [db_used_memory 9]
+        r flushdb
+        r set foo bar
+        assert_equal [r memory usage foo] [db_used_memory 9]
+    }
+
+    test "db-maxmemory evicts only keys of the DB over quota" {
+        r flushall
+        r config set maxmemory-policy allkeys-lru
+        r select 10
+        for {set j 0} {$j < 1000} {incr j} {
+            r set other:$j [string repeat x 100]
+        }
+        r select 9
+        r config set db-maxmemory "9 100kb"
+        for {set j 0} {$j < 5000} {incr j} {
+            r set key:$j [string repeat x 100]
+        }
+        assert {[db_used_memory 9] < 100*1024+1024}
+        assert {[r dbsize] < 5000}
+        assert {[s evicted_keys] > 0}
+        r select 10
+        assert_equal 1000 [r dbsize]
+        r select 9
+    }
+
+    test "db-maxmemory with noeviction policy returns an error" {
+        r config set maxmemory-policy noeviction
+        catch {
+            for {set j 0} {$j < 5000} {incr j} {
+                r set key:$j [string repeat x 100]
+            }
+        } e
+        assert_match {OOM*db-maxmemory*} $e
+        # Read commands and other DBs are not affected.
+        r dbsize
+        r select 10
+        r set foo bar
+        r select 9
+        r config set db-maxmemory "9 0"
+        r set foo bar
+        assert {![string match *used_memory* [s db9]]}
+    }
+
+    test "db-maxmemory is enforced for DBs other than the selected one" {
+        r flushall
+        r config set maxmemory-policy noeviction
+        r config set db-maxmemory "9 1kb 10 50kb"
+        r select 10
+        catch {
+            for {set j 0} {$j < 1000} {incr j} {
+                r set key:$j [string repeat x 100]
+            }
+        } e
+        assert_match {OOM*db-maxmemory*} $e
+        set size10 [r dbsize]
+        r select 9
+        r set foo bar
+
+        # MOVE to a DB over quota.
+        assert_error {OOM*db-maxmemory*} {r move foo 10}
+        assert_equal 1 [r exists foo]
+
+        # Scripts and transactions selecting a DB over quota.
+        assert_error {*OOM*db-maxmemory*} {
+            r eval {redis.call('select',10); return redis.call('set','x','y')} 0
+        }
+        r multi
+        r select 10
+        r set x y
+        assert_error {OOM*db-maxmemory*} {r exec}
+        r select 10
+        assert_equal $size10 [r dbsize]
+
+        # SWAPDB moving a data set over the quota of its new index.
+        assert_error {OOM*db-maxmemory*} {r swapdb 9 10}
+        assert_equal $size10 [r dbsize]
+        r config set db-maxmemory "9 0 10 0"
+        r swapdb 9 10
+        assert_equal 1 [r dbsize]
+        r select 9
+        assert_equal $size10 [r dbsize]
+    }
+}
+
+start_server {tags {"maxmemory"} overrides {memory-accounting yes}} {
+    test "memory-accounting reports the memory of the keys by type" {
+        r set foo bar
+        r hset myhash f v
+        r select 10
+        r rpush mylist a b c
+        r set foo [string repeat x 1000]
+        assert_equal [expr {[r memory usage foo]+[r memory usage mylist]}] \
+                     [db_used_memory 10]
+        r select 9
+        assert_equal [r memory usage myhash] [s used_memory_keys_hash]
+        assert_equal 0 [s used_memory_keys_zset]
+        set foo9 [r memory usage foo]
+        r select 10
+        set strings [expr {[r memory usage foo]+$foo9}]
+        assert_equal $strings [s used_memory_keys_string]
+        assert_equal [r memory usage mylist] [s used_memory_keys_list]
+        # A key overwritten by a value of another type moves to that type.
+        r rename mylist foo
+        assert_equal [r memory usage foo] [s used_memory_keys_list]
+        assert_equal $foo9 [s used_memory_keys_string]
+        r sadd myset a
+        r set foo bar
+        assert_equal 0 [s used_memory_keys_list]
+        assert_equal [r memory usage myset] [s used_memory_keys_set]
+        assert_equal [expr {[r memory usage foo]+$foo9}] \
+                     [s used_memory_keys_string]
+        r select 9
+    }
+
+    test "memory-accounting survives SWAPDB and FLUSHALL" {
+        set used [s used_memory_keys]
+        r swapdb 9 10
+        assert_equal $used [s used_memory_keys]
+        r flushall
+        assert_equal 0 [s used_memory_keys]
+        assert_equal 0 [s used_memory_keys_set]
+    }
+
+    test "memory-accounting can be toggled at runtime" {
+        r hset myhash f v
+        r config set memory-accounting no
+        assert {![string match *used_memory_keys* [r info memory]]}
+        r config set memory-accounting yes
+        assert_equal [r memory usage myhash] [s used_memory_keys_hash]
+    }
+
+    test "memory-accounting includes the node index built by LINDEX" {
+        r flushall
+        r config set list-max-ziplist-size 4
+        for {set j 0} {$j < 1000} {incr j} {r rpush mylist $j}
+        set before [r memory usage mylist]
+        assert_equal 500 [r lindex mylist 500]
+        set after [r memory usage mylist]
+        assert {$after > $before}
+        assert_equal $after [s used_memory_keys_list]
+        r config set list-max-ziplist-size -2
+    }
+}
+
 proc test_slave_buffers {test_name cmd_count payload_len limit_memory pipeline} {
     start_server {tags {"maxmemory"}} {
         start_server {} {
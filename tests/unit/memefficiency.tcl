@@ -34,6 +34,61 @@ start_server {tags {"memefficiency"}} {
             assert {$efficiency >= $expected_min_efficiency}
         }
     }
+
+    if {[string match {*jemalloc*} [s mem_allocator]]} {
+        test "Query buffers are allocated in the buffers arena" {
+            r flushall
+            after 120 ;# serverCron only updates the info once in 100ms
+            set before [s mem_arena_buffers_allocated]
+            # Send half of a few commands with arguments that are not big
+            # enough to get a buffer of their own, so that they are held in
+            # the query buffers of the clients.
+            set clients {}
+            for {set j 0} {$j < 10} {incr j} {
+                set rd [redis_deferring_client]
+                $rd write "*3\r\n\$3\r\nSET\r\n\$4\r\nkey$j\r\n\$30000\r\n"
+                $rd write [string repeat A 15000]
+                $rd flush
+                lappend clients $rd
+            }
+            wait_for_condition 50 100 {
+                [s mem_arena_buffers_allocated] >= $before+150000
+            } else {
+                fail "Query buffers not accounted in the buffers arena"
+            }
+            foreach rd $clients {
+                $rd write "[string repeat A 15000]\r\n"
+                $rd flush
+                assert_equal {OK} [$rd read]
+                $rd close
+            }
+            assert_equal 30000 [r strlen key9]
+        }
+
+        test "Big arguments are allocated in the data arena" {
+            r flushall
+            set rd [redis_deferring_client]
+            # A big argument is read into a buffer that becomes the value
+            # of the key, so it must not be accounted in the buffers arena,
+            # neither while it is read nor once it is stored.
+            $rd write "*3\r\n\$3\r\nSET\r\n\$3\r\nkey\r\n\$2000000\r\n"
+            $rd write [string repeat A 1000000]
+            $rd flush
+            wait_for_condition 50 100 {
+                [s mem_arena_dataset_allocated] >= 2000000
+            } else {
+                fail "Big argument not accounted in the data arena"
+            }
+            assert {[s mem_arena_buffers_allocated] < 1000000}
+            $rd write "[string repeat A 1000000]\r\n"
+            $rd flush
+            assert_equal {OK} [$rd read]
+            assert_equal 2000000 [r strlen key]
+            after 120 ;# serverCron only updates the info once in 100ms
+            assert {[s mem_arena_buffers_allocated] < 1000000}
+            $rd close
+        }
+    }
 }
 
 start_server {tags {"defrag"}} {
@@ -164,6 +219,11 @@ start_server {tags {"defrag"}} {
             r latency reset
 
             set digest [r debug digest]
+            # LINDEX builds the node index of biglist, that must follow the
+            # nodes moved by the defrag.
+            set positions {1 2500 5000 9999}
+            set elements {}
+            foreach pos $positions {lappend elements [r lindex biglist $pos]}
             catch {r config set activedefrag yes} e
             if {![string match {DISABLED*} $e]} {
                 # wait for the active defrag to start working (decision once a second)
@@ -207,7 +267,76 @@ start_server {tags {"defrag"}} {
             # verify the data isn't corrupted or changed
             set newdigest [r debug digest]
             assert {$digest eq $newdigest}
+            foreach pos $positions ele $elements {
+                assert_equal $ele [r lindex biglist $pos]
+            }
             r save ;# saving an rdb iterates over all the data / pointers
         } {OK}
+
+        test "Active defrag from the defrag thread" {
+            r flushdb
+            r config resetstat
+            r latency reset
+            r config set activedefrag no
+            r config set active-defrag-threaded yes
+            r config set active-defrag-threshold-lower 5
+            # With such a low CPU effort only the defrag thread can complete
+            # the work in time.
+            r config set active-defrag-cycle-min 1
+            r config set active-defrag-cycle-max 1
+            r config set active-defrag-ignore-bytes 2mb
+            r config set maxmemory 100mb
+            r config set maxmemory-policy allkeys-lru
+            r debug populate 700000 asdf 150
+            r debug populate 170000 asdf 300
+            r ping ;# trigger eviction following the previous population
+            after 120 ;# serverCron only updates the info once in 100ms
+            assert {[s allocator_frag_ratio] >= 1.4}
+            r config set maxmemory 0 ;# no evictions while checking the digest
+            set digest [r debug digest]
+            catch {r config set activedefrag yes} e
+            if {![string match {DISABLED*} $e]} {
+                wait_for_condition 50 100 {
+                    [s active_defrag_running] ne 0
+                } else {
+                    fail "defrag not started."
+                }
+
+                # The server keeps serving commands while defragging.
+                for {set j 0} {$j < 100} {incr j} {
+                    r set foo$j bar
+                    assert_equal bar [r get foo$j]
+                    r del foo$j
+                }
+
+                wait_for_condition 150 100 {
+                    [s active_defrag_running] eq 0
+                } else {
+                    after 120 ;# serverCron only updates the info once in 100ms
+                    puts [r info memory]
+                    fail "defrag didn't stop."
+                }
+
+                after 120 ;# serverCron only updates the info once in 100ms
+                set frag [s allocator_frag_ratio]
+                set max_latency 0
+                foreach event [r latency latest] {
+                    lassign $event eventname time latency max
+                    if {$eventname == "active-defrag-cycle"} {
+                        set max_latency $max
+                    }
+                }
+                if {$::verbose} {
+                    puts "frag $frag"
+                    puts "max latency $max_latency"
+                }
+                assert {$frag < 1.1}
+                # The defrag thread works in slices of one millisecond.
+                assert {$max_latency <= 20}
+            }
+            r config set activedefrag no
+            r config set active-defrag-threaded no
+            assert_equal $digest [r debug digest]
+        }
     }
 }
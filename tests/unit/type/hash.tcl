@@ -1,3 +1,16 @@
+# Check that the TTLs of 'fields' of the hash at 'key' are 'ttls', allowing
+# for a few seconds passed since they were set. A TTL of -1 or -2 is exact.
+proc assert_field_ttls {key fields ttls} {
+    set got [r httl $key FIELDS [llength $fields] {*}$fields]
+    foreach ttl $got expected $ttls {
+        if {$expected < 0} {
+            assert_equal $expected $ttl
+        } else {
+            assert {$ttl > $expected-5 && $ttl <= $expected}
+        }
+    }
+}
+
 start_server {tags {"hash"}} {
     test {HSET/HLEN - Small hash creation} {
         array set smallhash {}
@@ -14,8 +27,8 @@ start_server {tags {"hash"}} {
         list [r hlen smallhash]
     } {8}
 
-    test {Is the small hash encoded with a ziplist?} {
-        assert_encoding ziplist smallhash
+    test {Is the small hash encoded with a listpack?} {
+        assert_encoding listpack smallhash
     }
 
     test {HSET/HLEN - Big hash creation} {
@@ -59,6 +72,28 @@ start_server {tags {"hash"}} {
         set _ $err
     } {}
 
+    test {HGET/HEXISTS on listpack fields that look like integers} {
+        r del numhash
+        set fields {0 1 01 -0 -1 127 128 -4096 4095 32767 -32768 8388607
+                    2147483647 -2147483648 9223372036854775807
+                    -9223372036854775808 9223372036854775808 1.0 { 1} a}
+        foreach f $fields {
+            r hset numhash $f "v$f"
+        }
+        assert_encoding listpack numhash
+        foreach f $fields {
+            assert_equal "v$f" [r hget numhash $f]
+        }
+        foreach f {2 001 +1 -01 1.5 b} {
+            assert_equal 0 [r hexists numhash $f]
+        }
+        r debug reload
+        assert_encoding listpack numhash
+        foreach f $fields {
+            assert_equal "v$f" [r hget numhash $f]
+        }
+    }
+
     test {HGET against non existing key} {
         set rv {}
         lappend rv [r hget smallhash __123123123__]
@@ -252,7 +287,7 @@ start_server {tags {"hash"}} {
         lappend rv [r hexists bighash nokey]
     } {1 0 1 0}
 
-    test {Is a ziplist encoded Hash promoted on big payload?} {
+    test {Is a listpack encoded Hash promoted on big payload?} {
         r hset smallhash foo [string repeat a 1024]
         r debug object smallhash
     } {*hashtable*}
@@ -438,7 +473,7 @@ start_server {tags {"hash"}} {
         }
     }
 
-    test {Hash ziplist regression test for large keys} {
+    test {Hash listpack regression test for large keys} {
         r hset hash kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk a
         r hset hash kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk b
         r hget hash kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk
@@ -505,7 +540,185 @@ start_server {tags {"hash"}} {
         }
     }
 
-    test {Stress test the hash ziplist -> hashtable encoding conversion} {
+    test {HEXPIRE/HTTL/HPTTL - Set and read the TTL of fields} {
+        foreach enc {listpack hashtable} {
+            r del myhash
+            r hset myhash f1 v1 f2 v2 f3 v3
+            if {$enc eq {hashtable}} {
+                r hset myhash big [string repeat x 100]
+            }
+            assert_encoding $enc myhash
+            assert_equal {1 1 -2} [r hexpire myhash 100 FIELDS 3 f1 f2 nofield]
+            assert_equal {-1} [r httl myhash FIELDS 1 f3]
+            assert_field_ttls myhash f1 100
+            set pttl [r hpttl myhash FIELDS 1 f2]
+            assert {$pttl > 90000 && $pttl <= 100000}
+            assert_equal {-2 -2} [r httl nokey FIELDS 2 f1 f2]
+            assert_equal {1} [r hpexpireat myhash [expr {[clock milliseconds]+50000}] FIELDS 1 f3]
+            assert_field_ttls myhash f3 50
+        }
+    }
+
+    test {HEXPIRE - NX, XX, GT and LT conditions} {
+        r del myhash
+        r hset myhash f1 v1 f2 v2
+        assert_equal {0 -2} [r hexpire myhash 100 XX FIELDS 2 f1 nofield]
+        assert_equal {1} [r hexpire myhash 100 NX FIELDS 1 f1]
+        assert_equal {0 1} [r hexpire myhash 200 NX FIELDS 2 f1 f2]
+        assert_equal {0 0} [r hexpire myhash 50 GT FIELDS 2 f1 f2]
+        assert_equal {1 0} [r hexpire myhash 150 GT FIELDS 2 f1 f2]
+        assert_equal {0 1} [r hexpire myhash 180 LT FIELDS 2 f1 f2]
+        assert_equal {1} [r hexpire myhash 10 XX FIELDS 1 f1]
+        r hpersist myhash FIELDS 1 f1
+        # A field without a timeout counts as never expiring.
+        assert_equal {0} [r hexpire myhash 100 GT FIELDS 1 f1]
+        assert_equal {1} [r hexpire myhash 100 LT FIELDS 1 f1]
+    }
+
+    test {HEXPIRE - Syntax errors and wrong type} {
+        r del myhash mystring
+        r hset myhash f1 v1
+        r set mystring foo
+        assert_error {*FIELDS*} {r hexpire myhash 100 f1 f2 f3}
+        assert_error {*numfields*} {r hexpire myhash 100 FIELDS 2 f1}
+        assert_error {*numfields*} {r httl myhash FIELDS 0 f1}
+        assert_error {*not an integer*} {r hexpire myhash foo FIELDS 1 f1}
+        assert_error {WRONGTYPE*} {r hexpire mystring 100 FIELDS 1 f1}
+        assert_error {WRONGTYPE*} {r httl mystring FIELDS 1 f1}
+    }
+
+    test {HEXPIRE - Out of range times are rejected} {
+        r del myhash
+        r hset myhash f1 v1
+        assert_error {*invalid expire*} {r hexpire myhash 9223372036854776 FIELDS 1 f1}
+        assert_error {*invalid expire*} {r hexpire myhash 9223372036854775 FIELDS 1 f1}
+        assert_error {*invalid expire*} {r hpexpire myhash 9223372036854775807 FIELDS 1 f1}
+        assert_equal {-1} [r httl myhash FIELDS 1 f1]
+        r hpexpireat myhash 9223372036854775807 FIELDS 1 f1
+    } {1}
+
+    test {HEXPIRE - A time in the past deletes the fields} {
+        r del myhash
+        r hset myhash f1 v1 f2 v2 f3 v3
+        assert_equal {2 2 -2} [r hexpire myhash -1 FIELDS 3 f1 f2 nofield]
+        assert_equal {f3 v3} [r hgetall myhash]
+        assert_equal {2} [r hexpireat myhash 1 FIELDS 1 f3]
+        r exists myhash
+    } {0}
+
+    test {HPERSIST - Remove the TTL of fields} {
+        r del myhash
+        r hset myhash f1 v1 f2 v2
+        r hexpire myhash 100 FIELDS 1 f1
+        assert_equal {1 -1 -2} [r hpersist myhash FIELDS 3 f1 f2 nofield]
+        assert_equal {-1 -1} [r httl myhash FIELDS 2 f1 f2]
+        r hpersist nokey FIELDS 1 f1
+    } {-2}
+
+    test {HSET and HDEL clear the TTL of fields, HINCRBY retains it} {
+        r del myhash
+        r hset myhash f1 v1 f2 v2 n 1
+        r hexpire myhash 100 FIELDS 3 f1 f2 n
+        r hset myhash f1 new
+        r hincrby myhash n 1
+        r hdel myhash f2
+        r hset myhash f2 v2
+        assert_field_ttls myhash {f1 f2 n} {-1 -1 100}
+        r hget myhash n
+    } {2}
+
+    test {Fields with a TTL expire when the hash is accessed} {
+        foreach enc {listpack hashtable} {
+            r del myhash
+            r debug set-active-expire 0
+            r hset myhash f1 v1 f2 v2 f3 v3
+            if {$enc eq {hashtable}} {
+                r hset myhash big [string repeat x 100]
+            }
+            r hpexpire myhash 50 FIELDS 2 f1 f2
+            after 100
+            assert_equal {} [r hget myhash f1]
+            assert_equal {-2 -2 -1} [r httl myhash FIELDS 3 f1 f2 f3]
+            assert_equal [expr {$enc eq {listpack} ? 1 : 2}] [r hlen myhash]
+            r debug set-active-expire 1
+        }
+    }
+
+    test {Fields with a TTL are reclaimed by the active expire cycle} {
+        r del myhash myhash2
+        set expired [s expired_hash_fields]
+        r hset myhash f1 v1 f2 v2 f3 v3
+        r hset myhash2 f1 v1
+        r hpexpire myhash 50 FIELDS 2 f1 f2
+        r hpexpire myhash 500 FIELDS 1 f3
+        r hpexpire myhash2 50 FIELDS 1 f1
+        wait_for_condition 50 100 {
+            [s expired_hash_fields] == $expired+3
+        } else {
+            fail "Fields with a TTL not reclaimed"
+        }
+        # The key is removed together with its last field.
+        assert_equal 0 [r exists myhash2]
+        assert_equal {f3 v3} [r hgetall myhash]
+        wait_for_condition 50 100 {
+            [r exists myhash] == 0
+        } else {
+            fail "Last field with a TTL not reclaimed"
+        }
+    }
+
+    test {The TTL of fields is removed with the key or its value} {
+        r del myhash
+        r hset myhash f1 v1
+        r hexpire myhash 100 FIELDS 1 f1
+        r set myhash foo
+        r del myhash
+        r hset myhash f1 v1
+        r httl myhash FIELDS 1 f1
+    } {-1}
+
+    test {RENAME and MOVE retain the TTL of fields} {
+        r del myhash myhash2
+        r hset myhash f1 v1 f2 v2
+        r hexpire myhash 100 FIELDS 1 f1
+        r rename myhash myhash2
+        assert_field_ttls myhash2 {f1 f2} {100 -1}
+        assert_equal 1 [r move myhash2 10]
+        r select 10
+        assert_field_ttls myhash2 {f1 f2} {100 -1}
+        r del myhash2
+        r select 9
+    } {OK}
+
+    test {DEBUG RELOAD retains the TTL of fields} {
+        r del myhash
+        r hset myhash f1 v1 f2 v2 f3 v3
+        r hexpire myhash 100 FIELDS 1 f1
+        r hexpire myhash 200 FIELDS 1 f2
+        set digest [r debug digest]
+        r debug reload
+        assert_equal $digest [r debug digest]
+        assert_field_ttls myhash {f1 f2 f3} {100 200 -1}
+    }
+
+    test {DUMP / RESTORE retain the TTL of fields} {
+        foreach enc {listpack hashtable} {
+            r del myhash
+            r hset myhash f1 v1 f2 v2 f3 v3
+            if {$enc eq {hashtable}} {
+                r hset myhash big [string repeat x 100]
+            }
+            r hexpire myhash 100 FIELDS 1 f1
+            r hexpire myhash 200 FIELDS 1 f2
+            set dump [r dump myhash]
+            r del myhash
+            r restore myhash 0 $dump
+            assert_encoding $enc myhash
+            assert_field_ttls myhash {f1 f2 f3} {100 200 -1}
+        }
+    }
+
+    test {Stress test the hash listpack -> hashtable encoding conversion} {
         r config set hash-max-ziplist-entries 32
         for {set j 0} {$j < 100} {incr j} {
             r del myhash
@@ -534,3 +747,92 @@ start_server {tags {"hash"}} {
         }
     }
 }
+
+start_server {tags {"hash"} overrides {appendonly yes aof-use-rdb-preamble no}} {
+    test {Expired fields are propagated to the AOF as HDEL} {
+        r hset myhash f1 v1 f2 v2 f3 v3 f4 v4
+        r hpexpire myhash 50 FIELDS 2 f1 f2
+        r hexpire myhash 100 FIELDS 1 f3
+        r hexpire myhash -1 FIELDS 1 f4
+        after 100
+        assert_equal {f3 v3} [r hgetall myhash]
+        r debug loadaof
+        assert_field_ttls myhash f3 100
+        r hgetall myhash
+    } {f3 v3}
+
+    test {AOF rewrite retains the TTL of fields} {
+        r hset myhash f5 v5
+        r bgrewriteaof
+        waitForBgrewriteaof r
+        r debug loadaof
+        assert_field_ttls myhash {f3 f5} {100 -1}
+        r hgetall myhash
+    } {f3 v3 f5 v5}
+
+    test {HINCRBYFLOAT retains the TTL of the field in the AOF} {
+        r del myhash
+        r hset myhash f1 1 f2 1
+        r hexpire myhash 1000 FIELDS 1 f1
+        r hincrbyfloat myhash f1 1.5
+        r hincrbyfloat myhash f2 1.5
+        r debug loadaof
+        assert_field_ttls myhash {f1 f2} {1000 -1}
+        r hgetall myhash
+    } {f1 2.5 f2 2.5}
+}
+
+start_server {tags {"hash repl"}} {
+    start_server {} {
+        set master [srv -1 client]
+        set master_host [srv -1 host]
+        set master_port [srv -1 port]
+        set slave [srv 0 client]
+
+        test {Slaves hide the fields that reached their TTL} {
+            $slave slaveof $master_host $master_port
+            wait_for_condition 50 100 {
+                [s 0 master_link_status] eq {up}
+            } else {
+                fail "Replication not started."
+            }
+
+            $master debug set-active-expire 0
+            $master hset myhash f1 v1 f2 v2
+            $master hset myhash2 f1 v1
+            $master hpexpire myhash 100 FIELDS 1 f1
+            $master hpexpire myhash2 100 FIELDS 1 f1
+            wait_for_ofs_sync $master $slave
+            after 200
+
+            # The fields are still there until the master expires them...
+            assert_equal 2 [$slave dbsize]
+            assert_equal {} [$slave hget myhash f1]
+            assert_equal {f2 v2} [$slave hgetall myhash]
+            assert_equal 1 [$slave hlen myhash]
+            assert_equal {-2 -1} [$slave httl myhash FIELDS 2 f1 f2]
+            assert_equal 0 [$slave exists myhash2]
+
+            # ...that deletes them when they are accessed.
+            $master hgetall myhash
+            $master exists myhash2
+            wait_for_ofs_sync $master $slave
+            assert_equal 1 [$slave dbsize]
+            assert_equal {f2 v2} [$slave hgetall myhash]
+            $master debug set-active-expire 1
+        }
+
+        test {HINCRBYFLOAT retains the TTL of the field on slaves} {
+            $master del myhash
+            $master hset myhash f1 1 f2 1
+            $master hexpire myhash 1000 FIELDS 1 f1
+            $master hincrbyfloat myhash f1 1.5
+            $master hincrbyfloat myhash f2 1.5
+            wait_for_ofs_sync $master $slave
+            assert_equal {f1 2.5 f2 2.5} [$slave hgetall myhash]
+            lassign [$slave httl myhash FIELDS 2 f1 f2] ttl1 ttl2
+            assert {$ttl1 > 995 && $ttl1 <= 1000}
+            assert_equal -1 $ttl2
+        }
+    }
+}
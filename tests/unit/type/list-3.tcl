@@ -57,6 +57,51 @@ start_server {
         }
     }
 
+    test {LINSERT, LSET and LREM on listpack nodes match a model} {
+        r config set list-compress-depth 1
+        r del key
+        set model {}
+        for {set j 0} {$j < 500} {incr j} {
+            if {[randomInt 2] == 0} {
+                set ele [randomInt 100000]
+            } else {
+                set ele [string repeat x [randomInt 300]]$j
+            }
+            r rpush key $ele
+            lappend model $ele
+        }
+        for {set j 0} {$j < 2000} {incr j} {
+            set idx [randomInt [llength $model]]
+            set pivot [lindex $model $idx]
+            set idx [lsearch -exact $model $pivot]
+            set ele [expr {[randomInt 2] ? [randomInt 1000] : "e[randomInt 10]$j"}]
+            switch [randomInt 4] {
+                0 {
+                    r linsert key before $pivot $ele
+                    set model [linsert $model $idx $ele]
+                }
+                1 {
+                    r linsert key after $pivot $ele
+                    set model [linsert $model [expr {$idx+1}] $ele]
+                }
+                2 {
+                    r lset key $idx $ele
+                    lset model $idx $ele
+                }
+                3 {
+                    if {[llength $model] > 100} {
+                        r lrem key 1 $pivot
+                        set model [lreplace $model $idx $idx]
+                    }
+                }
+            }
+        }
+        assert_equal $model [r lrange key 0 -1]
+        r debug reload
+        assert_equal $model [r lrange key 0 -1]
+        r config set list-compress-depth 0
+    }
+
     tags {slow} {
         test {ziplist implementation: value encoding and backlink} {
             if {$::accurate} {set iterations 100} else {set iterations 10}
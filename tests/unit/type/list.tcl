@@ -821,6 +821,90 @@ start_server {
         }
     }
 
+    foreach {type large} [array get largevalue] {
+        test "LPOS basic usage - $type" {
+            create_list mylist "a b c $large 2 3 c c"
+            assert_equal 0 [r lpos mylist a]
+            assert_equal 2 [r lpos mylist c]
+            assert_equal 3 [r lpos mylist $large]
+            assert_equal 4 [r lpos mylist 2]
+        }
+
+        test "LPOS RANK option - $type" {
+            assert_equal 6 [r lpos mylist c RANK 2]
+            assert_equal 7 [r lpos mylist c RANK -1]
+            assert_equal 2 [r lpos mylist c RANK -3]
+            assert_equal {} [r lpos mylist c RANK 4]
+        }
+
+        test "LPOS COUNT option - $type" {
+            assert_equal {2 6 7} [r lpos mylist c COUNT 0]
+            assert_equal {2 6} [r lpos mylist c COUNT 2]
+            assert_equal {6 7} [r lpos mylist c COUNT 5 RANK 2]
+            assert_equal {7 6} [r lpos mylist c COUNT 2 RANK -1]
+            assert_equal {} [r lpos mylist x COUNT 0]
+        }
+
+        test "LPOS MAXLEN option - $type" {
+            assert_equal {2} [r lpos mylist c COUNT 0 MAXLEN 6]
+            assert_equal {} [r lpos mylist c MAXLEN 2]
+            assert_equal {7 6} [r lpos mylist c COUNT 0 RANK -1 MAXLEN 2]
+        }
+    }
+
+    test {LPOS against non existing key} {
+        assert_equal {} [r lpos nosuchkey a]
+        assert_equal {} [r lpos nosuchkey a COUNT 0]
+    }
+
+    test {LPOS against non list value} {
+        r set nolist foobar
+        assert_error WRONGTYPE* {r lpos nolist a}
+    }
+
+    test {LPOS option errors} {
+        r del mylist
+        r rpush mylist a b c
+        assert_error *RANK* {r lpos mylist a RANK 0}
+        assert_error *COUNT* {r lpos mylist a COUNT -1}
+        assert_error *MAXLEN* {r lpos mylist a MAXLEN -1}
+        assert_error *syntax* {r lpos mylist a FOO 1}
+    }
+
+    test {LINDEX and LSET are consistent on long lists modified at both ends} {
+        r del mylist
+        set l {}
+        for {set i 0} {$i < 2000} {incr i} {
+            r rpush mylist $i
+            lappend l $i
+        }
+        set next 2000
+        for {set j 0} {$j < 2000} {incr j} {
+            switch [randomInt 6] {
+                0 {r lpush mylist $next; set l [linsert $l 0 $next]; incr next}
+                1 {r rpush mylist $next; lappend l $next; incr next}
+                2 {r lpop mylist; set l [lrange $l 1 end]}
+                3 {r rpop mylist; set l [lrange $l 0 end-1]}
+                4 {
+                    set pos [randomInt [llength $l]]
+                    r lset mylist $pos x$next
+                    lset l $pos x$next
+                    incr next
+                }
+                5 {
+                    set pivot [lindex $l [randomInt [llength $l]]]
+                    r linsert mylist before $pivot $next
+                    set l [linsert $l [lsearch -exact $l $pivot] $next]
+                    incr next
+                }
+            }
+            set pos [randomInt [llength $l]]
+            assert_equal [lindex $l $pos] [r lindex mylist $pos]
+            assert_equal [lindex $l end-$pos] [r lindex mylist [expr {-1-$pos}]]
+        }
+        assert_equal $l [r lrange mylist 0 -1]
+    }
+
     test "Regression for bug 593 - chaining BRPOPLPUSH with other blocking cmds" {
         set rd1 [redis_deferring_client]
         set rd2 [redis_deferring_client]
@@ -835,3 +919,28 @@ start_server {
         r ping
     } {PONG}
 }
+
+start_server {
+    tags {"list"}
+    overrides {
+        "list-max-ziplist-size" 4
+        "list-compress-depth" 1
+    }
+} {
+    test "Regression for a crash with a small node recompressed as tail" {
+        # After LTRIM the nodes may be too small to be compressed again:
+        # they must not stay flagged for recompression, otherwise a read
+        # only scan compresses the node when it has become the tail.
+        r del l
+        for {set j 10} {$j < 50} {incr j} {
+            r rpush l "[string repeat x 35]$j"
+        }
+        r ltrim l 0 20
+        r rpush l a1 a2
+        assert_equal 0 [r lrem l 0 nomatch]
+        assert_equal a2 [r rpop l]
+        assert_equal a1 [r rpop l]
+        assert_equal "[string repeat x 35]30" [r rpop l]
+        assert_equal 20 [r llen l]
+    }
+}
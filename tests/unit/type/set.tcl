@@ -9,16 +9,29 @@ start_server {
         foreach entry $entries { r sadd $key $entry }
     }
 
-    test {SADD, SCARD, SISMEMBER, SMEMBERS basics - regular set} {
-        create_set myset {foo}
-        assert_encoding hashtable myset
-        assert_equal 1 [r sadd myset bar]
-        assert_equal 0 [r sadd myset bar]
-        assert_equal 2 [r scard myset]
-        assert_equal 1 [r sismember myset foo]
-        assert_equal 1 [r sismember myset bar]
-        assert_equal 0 [r sismember myset bla]
-        assert_equal {bar foo} [lsort [r smembers myset]]
+    # Small sets of strings are encoded as listpacks: disable the listpack
+    # encoding when the test needs a regular hash table set.
+    proc set_listpack_entries {type} {
+        if {$type eq "hashtable"} {
+            r config set set-max-listpack-entries 0
+        } else {
+            r config set set-max-listpack-entries 128
+        }
+    }
+
+    foreach type {hashtable listpack} {
+        test "SADD, SCARD, SISMEMBER, SMEMBERS basics - $type" {
+            set_listpack_entries $type
+            create_set myset {foo}
+            assert_encoding $type myset
+            assert_equal 1 [r sadd myset bar]
+            assert_equal 0 [r sadd myset bar]
+            assert_equal 2 [r scard myset]
+            assert_equal 1 [r sismember myset foo]
+            assert_equal 1 [r sismember myset bar]
+            assert_equal 0 [r sismember myset bla]
+            assert_equal {bar foo} [lsort [r smembers myset]]
+        }
     }
 
     test {SADD, SCARD, SISMEMBER, SMEMBERS basics - intset} {
@@ -38,19 +51,67 @@ start_server {
         assert_error WRONGTYPE* {r sadd mylist bar}
     }
 
-    test "SADD a non-integer against an intset" {
+    test "SADD a non-integer against a small intset" {
         create_set myset {1 2 3}
         assert_encoding intset myset
         assert_equal 1 [r sadd myset a]
+        assert_encoding listpack myset
+        assert_equal {1 2 3 a} [lsort [r smembers myset]]
+    }
+
+    test "SADD a non-integer against a large intset" {
+        r del myset
+        for {set i 0} {$i < 200} {incr i} { r sadd myset $i }
+        assert_encoding intset myset
+        assert_equal 1 [r sadd myset a]
         assert_encoding hashtable myset
+        assert_equal 201 [r scard myset]
     }
 
     test "SADD an integer larger than 64 bits" {
         create_set myset {213244124402402314402033402}
-        assert_encoding hashtable myset
+        assert_encoding listpack myset
         assert_equal 1 [r sismember myset 213244124402402314402033402]
     }
 
+    test "Listpack sets are serialized with the RDB type 20" {
+        create_set myset {a b c}
+        assert_encoding listpack myset
+        set dump [r dump myset]
+        assert_equal 20 [scan [string index $dump 0] %c]
+        r del myset
+        r restore myset 0 $dump
+        assert_encoding listpack myset
+        assert_equal {a b c} [lsort [r smembers myset]]
+    }
+
+    test "SADD integers against a listpack" {
+        create_set myset {a 1 2}
+        assert_encoding listpack myset
+        assert_equal 0 [r sadd myset 1]
+        assert_equal 1 [r sadd myset 3]
+        assert_equal 1 [r sismember myset 3]
+        assert_equal 0 [r sismember myset 4]
+        assert_equal {1 2 3 a} [lsort [r smembers myset]]
+    }
+
+    test "SADD overflows the maximum allowed elements in a listpack" {
+        r del myset
+        for {set i 0} {$i < 128} {incr i} { r sadd myset "i$i" }
+        assert_encoding listpack myset
+        assert_equal 1 [r sadd myset foo]
+        assert_encoding hashtable myset
+        assert_equal 129 [r scard myset]
+    }
+
+    test "SADD overflows the maximum allowed value size in a listpack" {
+        create_set myset {a b c}
+        assert_encoding listpack myset
+        assert_equal 1 [r sadd myset [string repeat x 65]]
+        assert_encoding hashtable myset
+        assert_equal 1 [r sismember myset [string repeat x 65]]
+    }
+
     test "SADD overflows the maximum allowed integers in an intset" {
         r del myset
         for {set i 0} {$i < 512} {incr i} { r sadd myset $i }
@@ -67,26 +128,44 @@ start_server {
     }
 
     test "Set encoding after DEBUG RELOAD" {
-        r del myintset myhashset mylargeintset
+        r del myintset myhashset mylargeintset mylistpackset
         for {set i 0} {$i <  100} {incr i} { r sadd myintset $i }
         for {set i 0} {$i < 1280} {incr i} { r sadd mylargeintset $i }
         for {set i 0} {$i <  256} {incr i} { r sadd myhashset [format "i%03d" $i] }
+        for {set i 0} {$i <  100} {incr i} { r sadd mylistpackset [format "i%03d" $i] }
         assert_encoding intset myintset
         assert_encoding hashtable mylargeintset
         assert_encoding hashtable myhashset
+        assert_encoding listpack mylistpackset
+        set digest [r debug digest]
 
         r debug reload
         assert_encoding intset myintset
         assert_encoding hashtable mylargeintset
         assert_encoding hashtable myhashset
+        assert_encoding listpack mylistpackset
+        assert_equal $digest [r debug digest]
     }
 
-    test {SREM basics - regular set} {
-        create_set myset {foo bar ciao}
+    test "Listpack set converted to hashtable when loaded with lower limits" {
+        create_set myset {a b c d}
+        assert_encoding listpack myset
+        r config set set-max-listpack-entries 2
+        r debug reload
         assert_encoding hashtable myset
-        assert_equal 0 [r srem myset qux]
-        assert_equal 1 [r srem myset foo]
-        assert_equal {bar ciao} [lsort [r smembers myset]]
+        assert_equal {a b c d} [lsort [r smembers myset]]
+        r config set set-max-listpack-entries 128
+    }
+
+    foreach type {hashtable listpack} {
+        test "SREM basics - $type" {
+            set_listpack_entries $type
+            create_set myset {foo bar ciao}
+            assert_encoding $type myset
+            assert_equal 0 [r srem myset qux]
+            assert_equal 1 [r srem myset foo]
+            assert_equal {bar ciao} [lsort [r smembers myset]]
+        }
     }
 
     test {SREM basics - intset} {
@@ -111,7 +190,13 @@ start_server {
         r srem myset 1 2 3 4 5 6 7 8
     } {3}
 
-    foreach {type} {hashtable intset} {
+    foreach {type} {hashtable intset listpack} {
+        # The listpack sets of this loop are larger than the default limit.
+        if {$type eq "listpack"} {
+            r config set set-max-listpack-entries 512
+        } else {
+            set_listpack_entries $type
+        }
         for {set i 1} {$i <= 5} {incr i} {
             r del [format "set%d" $i]
         }
@@ -132,7 +217,7 @@ start_server {
         # while the tests are running -- an extra element is added to every
         # set that determines its encoding.
         set large 200
-        if {$type eq "hashtable"} {
+        if {$type ne "intset"} {
             set large foo
         }
 
@@ -163,6 +248,19 @@ start_server {
             assert_equal [list 195 196 197 198 199 $large] [lsort [r smembers setres]]
         }
 
+        test "SINTERCARD with two sets - $type" {
+            assert_equal 6 [r sintercard 2 set1 set2]
+            assert_equal 6 [r sintercard 2 set1 set2 limit 0]
+            assert_equal 6 [r sintercard 2 set1 set2 limit 10]
+            assert_equal 3 [r sintercard 2 set1 set2 limit 3]
+        }
+
+        test "SINTERCARD against three sets - $type" {
+            assert_equal 3 [r sintercard 3 set1 set2 set3]
+            assert_equal 2 [r sintercard 3 set1 set2 set3 limit 2]
+            assert_equal 1 [r sintercard 3 set1 set4 set5]
+        }
+
         test "SUNION with two sets - $type" {
             set expected [lsort -uniq "[r smembers set1] [r smembers set2]"]
             assert_equal $expected [lsort [r sunion set1 set2]]
@@ -206,6 +304,7 @@ start_server {
             assert_equal {1 2 3 4} [lsort [r smembers setres]]
         }
     }
+    r config set set-max-listpack-entries 128
 
     test "SDIFF with first set empty" {
         r del set1 set2 set3
@@ -220,6 +319,60 @@ start_server {
         r sdiff set1 set1
     } {}
 
+    test "SINTER, SUNION and SDIFF against large intsets" {
+        r config set set-max-intset-entries 50000
+        set keys {}
+        for {set i 0} {$i < 3} {incr i} {
+            r del iset$i
+            lappend keys iset$i
+            unset -nocomplain s$i
+            array set s$i {}
+            # Sets of different sizes and densities, with negative values
+            # and values only fitting 64 bit integers in some of them.
+            set num [expr {[randomInt 5000]+5000*$i}]
+            set range [lindex {10000 100000 10000000000} $i]
+            set members {}
+            for {set j 0} {$j < $num} {incr j} {
+                set v [expr {[randomInt $range]-$range/2}]
+                set s${i}($v) 1
+                lappend members $v
+            }
+            r sadd iset$i {*}$members
+            assert_encoding intset iset$i
+        }
+        set inter {}
+        set union [lsort -unique [concat [array names s0] [array names s1] \
+                                         [array names s2]]]
+        set diff {}
+        foreach v [array names s0] {
+            if {[info exists s1($v)] && [info exists s2($v)]} {
+                lappend inter $v
+            }
+            if {![info exists s1($v)] && ![info exists s2($v)]} {
+                lappend diff $v
+            }
+        }
+        assert_equal [lsort $inter] [lsort [r sinter {*}$keys]]
+        assert_equal [lsort $inter] [lsort [r sinter iset0 iset1 iset2 iset1]]
+        assert_equal $union [lsort [r sunion {*}$keys nokey]]
+        assert_equal [lsort $diff] [lsort [r sdiff {*}$keys nokey]]
+        assert_equal {} [r sdiff iset0 iset1 iset0]
+
+        assert_equal [llength $union] [r sunionstore setres {*}$keys]
+        assert_encoding intset setres
+        assert_equal [llength $diff] [r sdiffstore setres {*}$keys]
+        assert_encoding intset setres
+        assert_equal [lsort $diff] [lsort [r smembers setres]]
+        r sinterstore setres iset0 iset1
+        assert_encoding intset setres
+
+        # The results are converted to hash tables when too large.
+        r config set set-max-intset-entries 512
+        assert_equal [llength $union] [r sunionstore setres {*}$keys]
+        assert_encoding hashtable setres
+        assert_equal $union [lsort [r smembers setres]]
+    }
+
     test "SDIFF fuzzing" {
         for {set j 0} {$j < 100} {incr j} {
             unset -nocomplain s
@@ -269,10 +422,86 @@ start_server {
         r sadd set2 1 2 3 a
         r srem set2 a
         assert_encoding intset set1
+        assert_encoding listpack set2
+        assert_equal {1 2 3} [lsort [r sinter set1 set2]]
+        assert_equal {1 2 3} [lsort [r sinter set2 set1]]
+        set_listpack_entries hashtable
+        r del set2
+        r sadd set2 1 2 3 a
+        r srem set2 a
         assert_encoding hashtable set2
-        lsort [r sinter set1 set2]
+        assert_equal {1 2 3} [lsort [r sinter set1 set2]]
+        set_listpack_entries listpack
+        lsort [r sinter set2 set1]
     } {1 2 3}
 
+    test "SINTERSTORE with listpack sets" {
+        create_set set1 {a b c 1 2}
+        create_set set2 {b c d 2 3}
+        assert_encoding listpack set1
+        r sinterstore setres set1 set2
+        assert_encoding listpack setres
+        assert_equal {2 b c} [lsort [r smembers setres]]
+    }
+
+    test "SINTERCARD with illegal arguments" {
+        assert_error "ERR wrong number of arguments*" {r sintercard 1}
+        assert_error "ERR numkeys*" {r sintercard 0 myset}
+        assert_error "ERR value is not an integer*" {r sintercard a myset}
+        assert_error "ERR Number of keys*" {r sintercard 2 myset}
+        assert_error "ERR syntax*" {r sintercard 1 myset myset2}
+        assert_error "ERR syntax*" {r sintercard 1 myset limit}
+        assert_error "ERR LIMIT*" {r sintercard 1 myset limit -1}
+        assert_error "ERR value is not an integer*" {r sintercard 1 myset limit a}
+    }
+
+    test "COMMAND GETKEYS SINTERCARD" {
+        assert_equal {a b} [r command getkeys sintercard 2 a b limit 3]
+    }
+
+    test "SINTERCARD against non-set should throw error" {
+        r del set
+        r sadd set a b c
+        r set key1 x
+        assert_error "WRONGTYPE*" {r sintercard 1 key1}
+        assert_error "WRONGTYPE*" {r sintercard 2 set key1}
+        assert_error "WRONGTYPE*" {r sintercard 2 noset key1}
+    }
+
+    test "SINTERCARD against non-existing key" {
+        assert_equal 0 [r sintercard 1 non-existing-key]
+        assert_equal 0 [r sintercard 2 set non-existing-key limit 10]
+    }
+
+    test "SINTERCARD with a single set and with the same set twice" {
+        create_set myset {a b c d}
+        assert_equal 4 [r sintercard 1 myset]
+        assert_equal 2 [r sintercard 1 myset limit 2]
+        assert_equal 4 [r sintercard 2 myset myset]
+        assert_equal 3 [r sintercard 2 myset myset limit 3]
+    }
+
+    test "SINTERCARD matches SINTER with mixed encodings" {
+        r config set set-max-intset-entries 10000
+        r del iset lpset htset
+        for {set i 0} {$i < 5000} {incr i} { r sadd iset [expr {$i*3}] }
+        for {set i 0} {$i < 100} {incr i} { r sadd lpset [expr {$i*2}] }
+        r sadd lpset foo
+        for {set i 0} {$i < 1000} {incr i} { r sadd htset [expr {$i*5}] }
+        r sadd htset foo
+        assert_encoding intset iset
+        assert_encoding listpack lpset
+        assert_encoding hashtable htset
+        foreach keys {{iset lpset} {iset htset} {lpset htset}
+                      {iset lpset htset}} {
+            set card [llength [r sinter {*}$keys]]
+            assert_equal $card [r sintercard [llength $keys] {*}$keys]
+            assert_equal [expr {min($card,7)}] \
+                [r sintercard [llength $keys] {*}$keys limit 7]
+        }
+        r config set set-max-intset-entries 512
+    }
+
     test "SINTERSTORE against non existing keys should delete dstkey" {
         r set setres xxx
         assert_equal 0 [r sinterstore setres foo111 bar222]
@@ -285,8 +514,9 @@ start_server {
         assert_equal 0 [r exists setres]
     }
 
-    foreach {type contents} {hashtable {a b c} intset {1 2 3}} {
+    foreach {type contents} {hashtable {a b c} intset {1 2 3} listpack {a b c}} {
         test "SPOP basics - $type" {
+            set_listpack_entries $type
             create_set myset $contents
             assert_encoding $type myset
             assert_equal $contents [lsort [list [r spop myset] [r spop myset] [r spop myset]]]
@@ -294,6 +524,7 @@ start_server {
         }
 
         test "SPOP with <count>=1 - $type" {
+            set_listpack_entries $type
             create_set myset $contents
             assert_encoding $type myset
             assert_equal $contents [lsort [list [r spop myset 1] [r spop myset 1] [r spop myset 1]]]
@@ -301,7 +532,9 @@ start_server {
         }
 
         test "SRANDMEMBER - $type" {
+            set_listpack_entries $type
             create_set myset $contents
+            assert_encoding $type myset
             unset -nocomplain myset
             array set myset {}
             for {set i 0} {$i < 100} {incr i} {
@@ -314,8 +547,10 @@ start_server {
     foreach {type contents} {
         hashtable {a b c d e f g h i j k l m n o p q r s t u v w x y z} 
         intset {1 10 11 12 13 14 15 16 17 18 19 2 20 21 22 23 24 25 26 3 4 5 6 7 8 9}
+        listpack {a b c d e f g h i j k l m n o p q r s t u v w x y z}
     } {
-        test "SPOP with <count>" {
+        test "SPOP with <count> - $type" {
+            set_listpack_entries $type
             create_set myset $contents
             assert_encoding $type myset
             assert_equal $contents [lsort [concat [r spop myset 11] [r spop myset 9] [r spop myset 0] [r spop myset 4] [r spop myset 1] [r spop myset 0] [r spop myset 1] [r spop myset 0]]]
@@ -393,9 +628,20 @@ start_server {
             30 31 32 33 34 35 36 37 38 39
             40 41 42 43 44 45 46 47 48 49
         }
+        listpack {
+            1 5 10 50 125 50000 33959417 4775547 65434162
+            12098459 427716 483706 2726473884 72615637475
+            MARY PATRICIA LINDA BARBARA ELIZABETH JENNIFER MARIA
+            SUSAN MARGARET DOROTHY LISA NANCY KAREN BETTY HELEN
+            SANDRA DONNA CAROL RUTH SHARON MICHELLE LAURA SARAH
+            KIMBERLY DEBORAH JESSICA SHIRLEY CYNTHIA ANGELA MELISSA
+            BRENDA AMY ANNA REBECCA VIRGINIA KATHLEEN
+        }
     } {
         test "SRANDMEMBER with <count> - $type" {
+            set_listpack_entries $type
             create_set myset $contents
+            assert_encoding $type myset
             unset -nocomplain myset
             array set myset {}
             foreach ele [r smembers myset] {
@@ -489,7 +735,7 @@ start_server {
         r del myset3 myset4
         create_set myset1 {1 a b}
         create_set myset2 {2 3 4}
-        assert_encoding hashtable myset1
+        assert_encoding listpack myset1
         assert_encoding intset myset2
     }
 
@@ -499,7 +745,7 @@ start_server {
         assert_equal 1 [r smove myset1 myset2 a]
         assert_equal {1 b} [lsort [r smembers myset1]]
         assert_equal {2 3 4 a} [lsort [r smembers myset2]]
-        assert_encoding hashtable myset2
+        assert_encoding listpack myset2
 
         # move an integer element should not convert the encoding
         setup_move
@@ -535,7 +781,7 @@ start_server {
         assert_equal 1 [r smove myset1 myset3 a]
         assert_equal {1 b} [lsort [r smembers myset1]]
         assert_equal {a} [lsort [r smembers myset3]]
-        assert_encoding hashtable myset3
+        assert_encoding listpack myset3
     }
 
     test "SMOVE from intset to non existing destination set" {
@@ -7,10 +7,10 @@ start_server {tags {"zset"}} {
     }
 
     proc basics {encoding} {
-        if {$encoding == "ziplist"} {
+        if {$encoding == "listpack"} {
             r config set zset-max-ziplist-entries 128
             r config set zset-max-ziplist-value 64
-        } elseif {$encoding == "skiplist"} {
+        } elseif {$encoding == "btree"} {
             r config set zset-max-ziplist-entries 0
             r config set zset-max-ziplist-value 0
         } else {
@@ -454,6 +454,46 @@ start_server {tags {"zset"}} {
             assert_error "*not*string*" {r zrangebylex fooz -x \[bar}
         }
 
+        test "ZRANGESTORE basics - $encoding" {
+            create_zset zsrc {1 a 2 b 3 c 4 d}
+            assert_equal 3 [r zrangestore zdst zsrc 1 -1]
+            assert_equal {b 2 c 3 d 4} [r zrange zdst 0 -1 withscores]
+            assert_equal 2 [r zrangestore zdst zsrc 0 1 rev]
+            assert_equal {c 3 d 4} [r zrange zdst 0 -1 withscores]
+            assert_encoding $encoding zdst
+        }
+
+        test "ZRANGESTORE BYSCORE and BYLEX with LIMIT - $encoding" {
+            create_zset zsrc {1 a 2 b 3 c 4 d 5 e}
+            assert_equal 2 [r zrangestore zdst zsrc (1 +inf byscore limit 1 2]
+            assert_equal {c d} [r zrange zdst 0 -1]
+            assert_equal 3 [r zrangestore zdst zsrc 4 (1 byscore rev]
+            assert_equal {b c d} [r zrange zdst 0 -1]
+            create_default_lex_zset
+            assert_equal 2 [r zrangestore zdst zset \[bar + bylex limit 0 2]
+            assert_equal {bar cool} [r zrange zdst 0 -1]
+            assert_equal 2 [r zrangestore zdst zset + \[d bylex rev limit 1 2]
+            assert_equal {great hill} [r zrange zdst 0 -1]
+        }
+
+        test "ZRANGESTORE with an empty range deletes the destination - $encoding" {
+            create_zset zsrc {1 a 2 b}
+            r set zdst foo
+            assert_equal 0 [r zrangestore zdst zsrc 5 10]
+            assert_equal 0 [r exists zdst]
+            r set zdst foo
+            assert_equal 0 [r zrangestore zdst nokey 0 -1]
+            assert_equal 0 [r exists zdst]
+        }
+
+        test "ZRANGESTORE invalid syntax" {
+            create_zset zsrc {1 a 2 b}
+            assert_error "*syntax*" {r zrangestore zdst zsrc 0 -1 limit 0 1}
+            assert_error "*syntax*" {r zrangestore zdst zsrc 0 -1 withscores}
+            assert_error "*not*float*" {r zrangestore zdst zsrc a b byscore}
+            assert_error "*WRONGTYPE*" {r set foo bar; r zrangestore zdst foo 0 -1}
+        }
+
         test "ZREMRANGEBYSCORE basics" {
             proc remrangebyscore {min max} {
                 create_zset zset {1 a 2 b 3 c 4 d 5 e}
@@ -735,8 +775,8 @@ start_server {tags {"zset"}} {
         }
     }
 
-    basics ziplist
-    basics skiplist
+    basics listpack
+    basics btree
 
     test {ZINTERSTORE regression with two sets, intset+hashtable} {
         r del seta setb setc
@@ -751,7 +791,7 @@ start_server {tags {"zset"}} {
         r zrange out 0 -1 withscores
     } {neginf 0}
 
-    test {ZINTERSTORE #516 regression, mixed sets and ziplist zsets} {
+    test {ZINTERSTORE #516 regression, mixed sets and listpack zsets} {
         r sadd one 100 101 102 103
         r sadd two 100 200 201 202
         r zadd three 1 500 1 501 1 502 1 503 1 100
@@ -781,17 +821,44 @@ start_server {tags {"zset"}} {
         }
     }
 
+    test {ZUNIONSTORE / ZINTERSTORE results can be modified and reloaded} {
+        # The destination tree is built bottom-up: check that ranks are
+        # right and that it can be updated like a tree built by ZADD.
+        r del one two dest
+        for {set j 0} {$j < 3000} {incr j} {
+            r zadd one [randomInt 100] ele-[randomInt 5000]
+            r zadd two [randomInt 100] ele-[randomInt 5000]
+        }
+        foreach op {zunionstore zinterstore} {
+            r $op dest 2 one two weights 1 2
+            assert_encoding btree dest
+            for {set j 0} {$j < 500} {incr j} {
+                r zadd dest [randomInt 100] ele-[randomInt 5000]
+                r zrem dest ele-[randomInt 5000]
+            }
+            set j 0
+            foreach ele [r zrange dest 0 -1] {
+                assert_equal $j [r zrank dest $ele]
+                incr j
+            }
+            assert_equal $j [r zcard dest]
+            set digest [r debug digest]
+            r debug reload
+            assert_equal $digest [r debug digest]
+        }
+    }
+
     test "ZSET commands don't accept the empty strings as valid score" {
         assert_error "*not*float*" {r zadd myzset "" abc}
     }
 
     proc stressers {encoding} {
-        if {$encoding == "ziplist"} {
+        if {$encoding == "listpack"} {
             # Little extra to allow proper fuzzing in the sorting stresser
             r config set zset-max-ziplist-entries 256
             r config set zset-max-ziplist-value 64
             set elements 128
-        } elseif {$encoding == "skiplist"} {
+        } elseif {$encoding == "btree"} {
             r config set zset-max-ziplist-entries 0
             r config set zset-max-ziplist-value 0
             if {$::accurate} {set elements 1000} else {set elements 100}
@@ -1066,7 +1133,36 @@ start_server {tags {"zset"}} {
             }
         }
 
-        test "ZSETs skiplist implementation backlink consistency test - $encoding" {
+        test "ZRANGESTORE fuzzy test, 100 ranges in $elements element sorted set - $encoding" {
+            r del zset
+            for {set i 0} {$i < $elements} {incr i} {
+                r zadd zset [expr rand()] $i
+            }
+            for {set i 0} {$i < 100} {incr i} {
+                set min [expr rand()]
+                set max [expr rand()]
+                if {$min > $max} {
+                    set aux $min
+                    set min $max
+                    set max $aux
+                }
+                set count [r zrangestore zdst zset $min $max byscore]
+                assert_equal [r zrangebyscore zset $min $max withscores] \
+                             [r zrange zdst 0 -1 withscores]
+                assert_equal $count [r zcount zset $min $max]
+                if {$count > [lindex [r config get zset-max-ziplist-entries] 1]} {
+                    assert_encoding btree zdst
+                } elseif {$count} {
+                    assert_encoding listpack zdst
+                }
+                set start [randomInt $elements]
+                r zrangestore zdst zset $start -1 rev
+                assert_equal [r zrevrange zset $start -1 withscores] \
+                             [r zrevrange zdst 0 -1 withscores]
+            }
+        }
+
+        test "ZSETs btree implementation reverse order consistency test - $encoding" {
             set diff 0
             for {set j 0} {$j < $elements} {incr j} {
                 r zadd myzset [expr rand()] "Element-$j"
@@ -1198,11 +1294,11 @@ start_server {tags {"zset"}} {
     }
 
     tags {"slow"} {
-        stressers ziplist
-        stressers skiplist
+        stressers listpack
+        stressers btree
     }
 
-    test {ZSET skiplist order consistency when elements are moved} {
+    test {ZSET btree order consistency when elements are moved} {
         set original_max [lindex [r config get zset-max-ziplist-entries] 1]
         r config set zset-max-ziplist-entries 0
         for {set times 0} {$times < 10} {incr times} {
@@ -1227,4 +1323,73 @@ start_server {tags {"zset"}} {
         }
         r config set zset-max-ziplist-entries $original_max
     }
+
+    test {ZSET btree ranks are consistent after node splits and merges} {
+        r del zset
+        set model {}
+        # Grow the tree to a few levels, then shrink it removing random
+        # elements and ranges, so that nodes are both split and merged.
+        for {set j 0} {$j < 5000} {incr j} {
+            set ele ele-[randomInt 3000]
+            set score [randomInt 100]
+            r zadd zset $score $ele
+            dict set model $ele $score
+        }
+        for {set j 0} {$j < 3000} {incr j} {
+            set ele ele-[randomInt 3000]
+            r zrem zset $ele
+            dict unset model $ele
+        }
+        assert_encoding btree zset
+        set min [randomInt 50]
+        r zremrangebyscore zset $min [expr {$min+10}]
+        dict for {ele score} $model {
+            if {$score >= $min && $score <= $min+10} {dict unset model $ele}
+        }
+
+        set expected {}
+        dict for {ele score} $model {lappend expected [list $ele $score]}
+        set expected [lsort -index 0 $expected]
+        set expected [lsort -integer -index 1 $expected]
+        assert_equal [r zcard zset] [llength $expected]
+        for {set j 0} {$j < [llength $expected]} {incr j} {
+            set ele [lindex $expected $j 0]
+            assert_equal $j [r zrank zset $ele]
+            assert_equal $ele [lindex [r zrange zset $j $j] 0]
+        }
+        set digest [r debug digest]
+        r debug reload
+        assert_equal $digest [r debug digest]
+    }
+
+    test {ZSET btree ranks are consistent after removing rank ranges} {
+        r del zset
+        set model {}
+        for {set j 0} {$j < 20000} {incr j} {
+            r zadd zset $j ele-$j
+            lappend model ele-$j
+        }
+        # Remove ranges spanning many leaves as well as ranges inside a
+        # single leaf, adding elements back in between.
+        for {set j 0} {$j < 200} {incr j} {
+            set len [llength $model]
+            set start [randomInt $len]
+            set end [expr {$start+[randomInt [expr {$j % 2 ? 500 : 20}]]}]
+            r zremrangebyrank zset $start $end
+            set model [lreplace $model $start $end]
+            set ele ele-[expr {20000+$j}]
+            r zadd zset [expr {20000+$j}] $ele
+            lappend model $ele
+        }
+        assert_encoding btree zset
+        assert_equal [llength $model] [r zcard zset]
+        assert_equal $model [r zrange zset 0 -1]
+        for {set j 0} {$j < 1000} {incr j} {
+            set rank [randomInt [llength $model]]
+            assert_equal $rank [r zrank zset [lindex $model $rank]]
+        }
+        set digest [r debug digest]
+        r debug reload
+        assert_equal $digest [r debug digest]
+    }
 }
@@ -4,6 +4,37 @@ require 'redis'
 $runs = []; # Remember the error rate of each run for average purposes.
 $o = {};    # Options set parsing arguments
 
+# Return the DB of the key 'id'. By default all the keys are in DB 0,
+# with the exception of the first 100 keys added after the first eviction,
+# that are stored in DB 1. With --dbs <count> the keys are instead spread
+# across <count> DBs of very different sizes: DB 0 gets half the keys,
+# DB 1 a quarter, and so forth, so that we can check that the eviction
+# quality does not depend on the DB size.
+def keydb(id)
+    if $o[:dbs] > 1
+        db = 0
+        db += 1 while db < $o[:dbs]-1 && (id >> db) & 1 == 0
+        db
+    elsif id >= $otherdb_start_idx && id <= $otherdb_end_idx
+        1
+    else
+        0
+    end
+end
+
+def with_keydb(r,id)
+    db = keydb(id)
+    r.select(db) if db != 0
+    retval = yield
+    r.select(0) if db != 0
+    retval
+end
+
+# Number of keys across all the DBs.
+def total_keys(r)
+    r.info("keyspace").values.map{|v| v[/keys=(\d+)/,1].to_i}.reduce(0,:+)
+end
+
 def testit(filename)
     r = Redis.new
     r.config("SET","maxmemory","2000000")
@@ -12,9 +43,11 @@ def testit(filename)
     else
         r.config("SET","maxmemory-policy","allkeys-lru")
     end
-    r.config("SET","maxmemory-samples",5)
+    r.config("SET","maxmemory-samples",$o[:samples])
+    r.config("SET","maxmemory-eviction-pool-size",$o[:poolsize])
     r.config("RESETSTAT")
     r.flushall
+    $otherdb_start_idx = $otherdb_end_idx = -1
 
     html = ""
     html << <<EOF
@@ -48,23 +81,23 @@ def testit(filename)
 EOF
 
     # Fill the DB up to the first eviction.
-    oldsize = r.dbsize
+    oldsize = total_keys(r)
     id = 0
     while true
         id += 1
         begin
-            r.set(id,"foo")
+            with_keydb(r,id) { r.set(id,"foo") }
         rescue
             break
         end
-        newsize = r.dbsize
+        newsize = total_keys(r)
         break if newsize == oldsize # A key was evicted? Stop.
         oldsize = newsize
     end
 
-    inserted = r.dbsize
+    inserted = total_keys(r)
     first_set_max_id = id
-    html << "#{r.dbsize} keys inserted.\n"
+    html << "#{inserted} keys inserted.\n"
 
     # Access keys sequentially, so that in theory the first part will be expired
     # and the latter part will not, according to perfect LRU.
@@ -72,13 +105,13 @@ EOF
     if $o[:ttl]
         STDERR.puts "Set increasing expire value"
         (1..first_set_max_id).each{|id|
-            r.expire(id,1000+id)
+            with_keydb(r,id) { r.expire(id,1000+id) }
             STDERR.print(".") if (id % 150) == 0
         }
     else
         STDERR.puts "Access keys sequentially"
         (1..first_set_max_id).each{|id|
-            r.get(id)
+            with_keydb(r,id) { r.get(id) }
             sleep 0.001
             STDERR.print(".") if (id % 150) == 0
         }
@@ -94,23 +127,17 @@ EOF
     html << "Insert enough keys to evict half the keys we inserted.\n"
     add = 0
 
-    otherdb_start_idx = id+1
-    otherdb_end_idx = id+100
+    $otherdb_start_idx = id+1
+    $otherdb_end_idx = id+100
     while true
         add += 1
         id += 1
-        if id >= otherdb_start_idx && id <= otherdb_end_idx
-            r.select(1)
-            r.set(id,"foo")
-            r.select(0)
-        else
-            r.set(id,"foo")
-        end
+        with_keydb(r,id) { r.set(id,"foo") }
         break if r.info['evicted_keys'].to_i >= half
     end
 
     html << "#{add} additional keys added.\n"
-    html << "#{r.dbsize} keys in DB.\n"
+    html << "#{total_keys(r)} keys in DB.\n"
 
     # Check if evicted keys respect LRU
     # We consider errors from 1 to N progressively more serious as they violate
@@ -122,13 +149,7 @@ EOF
     half_set_size = first_set_max_id/2
     maxerr = 0
     (1..(first_set_max_id/2)).each{|id|
-        if id >= otherdb_start_idx && id <= otherdb_end_idx
-            r.select(1)
-            exists = r.exists(id)
-            r.select(0)
-        else
-            exists = r.exists(id)
-        end
+        exists = with_keydb(r,id) { r.exists(id) }
         if id < first_set_max_id/2
             thiserr = error_per_key * ((half_set_size-id).to_f/half_set_size)
             maxerr += thiserr
@@ -151,7 +172,7 @@ EOF
     (1..id).each{|id|
         # Mark first set and added items in a different way.
         c = "box"
-        if id >= otherdb_start_idx && id <= otherdb_end_idx
+        if keydb(id) != 0
             c << " otherdb"
         elsif id <= first_set_max_id
             c << " old"
@@ -160,13 +181,7 @@ EOF
         end
 
         # Add class if exists
-        if id >= otherdb_start_idx && id <= otherdb_end_idx
-            r.select(1)
-            exists = r.exists(id)
-            r.select(0)
-        else
-            exists = r.exists(id)
-        end
+        exists = with_keydb(r,id) { r.exists(id) }
 
         c << " ex" if exists
         html << "<div title=\"#{id}\" class=\"#{c}\"></div>"
@@ -196,11 +211,19 @@ if ARGV.length < 1
     STDERR.puts "  --ttl             Set keys with increasing TTL values"
     STDERR.puts "                    (starting from 1000 seconds) in order to"
     STDERR.puts "                    test the volatile-lru policy."
+    STDERR.puts "  --samples <count> Set maxmemory-samples (default 5)."
+    STDERR.puts "  --pool-size <count> Set maxmemory-eviction-pool-size"
+    STDERR.puts "                    (default 16)."
+    STDERR.puts "  --dbs <count>     Spread the keys across <count> DBs of"
+    STDERR.puts "                    exponentially decreasing size."
     exit 1
 end
 
 filename = ARGV[0]
 $o[:numruns] = 1
+$o[:samples] = 5
+$o[:poolsize] = 16
+$o[:dbs] = 1
 
 # Options parsing
 i = 1
@@ -210,6 +233,15 @@ while i < ARGV.length
         i+= 1
     elsif ARGV[i] == '--ttl'
         $o[:ttl] = true
+    elsif ARGV[i] == '--samples'
+        $o[:samples] = ARGV[i+1].to_i
+        i+= 1
+    elsif ARGV[i] == '--pool-size'
+        $o[:poolsize] = ARGV[i+1].to_i
+        i+= 1
+    elsif ARGV[i] == '--dbs'
+        $o[:dbs] = ARGV[i+1].to_i
+        i+= 1
     else
         STDERR.puts "Unknown option #{ARGV[i]}"
         exit 1